@@ -72,6 +72,12 @@ aarch64-none-elf-g++ \
     build/main.o build/xmusic_service.o \
     -L$DEVKITPRO/libnx/lib \
     -L$DEVKITPRO/portlibs/switch/lib \
+    -lmpg123 \
+    -lvorbisidec \
+    -logg \
+    -lpng \
+    -ljpeg \
+    -lz \
     -lnx \
     -lm \
     -lpthread \
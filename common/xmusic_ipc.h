@@ -5,6 +5,9 @@
 #define XMUSIC_SERVICE_NAME "xmusic"
 #define XMUSIC_VERSION "0.1.0-alpha"
 
+// Commands take their arguments inline, except where noted: strings go in a
+// HipcMapAlias send buffer and GetStatus fills a HipcMapAlias receive buffer,
+// since neither fits in the 0x100-byte IPC message.
 enum XMusicCmd : u32 {
     XMusicCmd_Play = 0,
     XMusicCmd_Pause = 1,
@@ -13,14 +16,141 @@ enum XMusicCmd : u32 {
     XMusicCmd_GetStatus = 4,
     XMusicCmd_Search = 5,
     XMusicCmd_SetVolume = 6,
-    XMusicCmd_PlayUrl = 7
+    XMusicCmd_PlayUrl = 7,
+    XMusicCmd_Seek = 8,
+    XMusicCmd_SubscribeAnalyzer = 9,    // Replies with a copy handle to XMusicAnalyzerShared
+    XMusicCmd_UnsubscribeAnalyzer = 10,
+    XMusicCmd_DumpTrace = 11,
+    XMusicCmd_SetSpeed = 12,
+    XMusicCmd_PlayFile = 13,
+    XMusicCmd_SetAnalyzerRate = 14
 };
 
+// XMusic's own results, in a module neither the system nor libnx uses
+#define XMUSIC_RESULT_MODULE 496
+
+enum XMusicError : u32 {
+    XMusicError_Unsupported = 1,    // Well formed, but not something this build can do
+    XMusicError_Cancelled = 2       // Stopped on request, nothing is wrong with the input
+};
+
+enum XMusicSeekMode : u32 {
+    XMusicSeek_Set = 0,     // Absolute position
+    XMusicSeek_Current = 1  // Relative to the current position
+};
+
+// Arguments for XMusicCmd_PlayUrl, plain http:// only. Sent as a buffer.
+// There is no TLS client yet, https:// fails with XMusicError_Unsupported.
+struct XMusicPlayUrlArgs {
+    char url[256];
+};
+
+// Arguments for XMusicCmd_PlayFile, a WAV, MP3 or Ogg file on the SD card. Sent as a buffer.
+struct XMusicPlayFileArgs {
+    char path[256];     // e.g. sdmc:/music/track.mp3
+};
+
+// Arguments for XMusicCmd_Seek, positions are in 48kHz output samples
+struct XMusicSeekArgs {
+    s64 samples;
+    u32 mode;
+    u32 reserved;
+};
+
+// Arguments for XMusicCmd_DumpTrace, writes sdmc:/config/xmusic/trace.bin
+struct XMusicDumpTraceArgs {
+    u32 seconds;        // How far back to dump, 0 for everything still buffered
+    u32 reserved;
+};
+
+// Arguments for XMusicCmd_SetSpeed, pitch is kept
+struct XMusicSetSpeedArgs {
+    float speed;        // 0.5 to 2.0, 1.0 for normal playback
+    u32 reserved;
+};
+
+// Arguments for XMusicCmd_SetAnalyzerRate. The rate is shared by every
+// subscriber, so a client sets the rate it actually draws at.
+struct XMusicSetAnalyzerRateArgs {
+    u32 hz;             // Updates per second, 1 to 60, 0 for the default of 30
+    u32 reserved;
+};
+
+// Reply to XMusicCmd_GetStatus, written to the client's buffer
 struct XMusicStatus {
     bool playing;
     char title[128];
     char artist[64];
-    u32 position;
-    u32 duration;
+    u32 position;       // Seconds
+    u32 duration;       // Seconds
     float volume;
+    
+    // Sample-accurate audible position, valid at positionTick (armGetSystemTick).
+    // While advancing, clients interpolate: samples + elapsed ticks * speed * sampleRate / tick frequency.
+    u64 positionSamples;
+    u64 positionUs;
+    u64 positionTick;
+    u64 lengthSamples;  // Track length at sampleRate, 0 if unknown
+    u32 sampleRate;
+    bool advancing;
+    bool looping;       // Positions wrap at lengthSamples, otherwise they stop there
+    float speed;        // Playback speed, 1.0 unless XMusicCmd_SetSpeed changed it
+    u32 pcmCacheLookups; // Tracks opened since boot
+    u32 pcmCacheHits;    // Of those, played from pre-decoded PCM
+};
+
+
+// Audible position of a status snapshot at nowTick, without another GetStatus
+static inline u64 xmusicInterpolatePosition(const XMusicStatus* status, u64 nowTick) {
+    if (!status->advancing || status->sampleRate == 0 || nowTick <= status->positionTick) {
+        return status->positionSamples;
+    }
+    u64 elapsedNs = armTicksToNs(nowTick - status->positionTick);
+    float speed = status->speed > 0.0f ? status->speed : 1.0f;
+    u64 pos = status->positionSamples + (u64)(elapsedNs * speed) * status->sampleRate / 1000000000ULL;
+    u64 length = status->lengthSamples;
+    if (length == 0) return pos;
+    if (status->looping) return pos % length;
+    return pos < length ? pos : length;
+}
+
+#define XMUSIC_ANALYZER_BANDS 16
+#define XMUSIC_ANALYZER_SLOTS 16    // Frames kept, covers the blocks queued ahead at 60Hz
+
+struct XMusicAnalyzerFrame {
+    u32 sequence;       // Odd while the sysmodule is writing this frame
+    u32 sampleRate;
+    u64 tick;           // armGetSystemTick when the end of the analyzed audio is heard
+    float peak[2];      // Per channel, 0..1
+    float rms[2];
+    float bands[XMUSIC_ANALYZER_BANDS]; // Log-spaced, 0..1 on a 60dB scale
 };
+
+// Shared memory published by the sysmodule once a client subscribes.
+// Clients map it read-only and read it with xmusicReadAnalyzer, no IPC per frame.
+// Audio is rendered ahead of the speaker, so frames arrive early and each
+// carries the tick at which it becomes current.
+struct XMusicAnalyzerShared {
+    u32 active;         // Slot of the newest complete frame
+    u32 reserved;
+    XMusicAnalyzerFrame frames[XMUSIC_ANALYZER_SLOTS];
+};
+
+// Newest frame heard by nowTick, or the oldest one while all are still ahead
+static inline bool xmusicReadAnalyzer(const XMusicAnalyzerShared* shared, u64 nowTick, XMusicAnalyzerFrame* out) {
+    u32 newest = __atomic_load_n(&shared->active, __ATOMIC_ACQUIRE);
+    bool found = false;
+    for (u32 back = 0; back < XMUSIC_ANALYZER_SLOTS; back++) {
+        const XMusicAnalyzerFrame* frame = &shared->frames[(newest + XMUSIC_ANALYZER_SLOTS - back) % XMUSIC_ANALYZER_SLOTS];
+        u32 seq = __atomic_load_n(&frame->sequence, __ATOMIC_ACQUIRE);
+        if (seq == 0 || (seq & 1)) continue; // Never written, or being written
+        XMusicAnalyzerFrame copy;
+        memcpy(&copy, frame, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&frame->sequence, __ATOMIC_RELAXED) != seq) continue;
+        *out = copy;
+        found = true;
+        if (copy.tick <= nowTick) return true;
+    }
+    return found;
+}
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <algorithm>
 #include "../common/xmusic_ipc.h"
 
 // Input handling globals
@@ -11,6 +12,8 @@ class XMusicController {
 private:
     Service m_service;
     bool m_connected = false;
+    SharedMemory m_analyzerMem = {};
+    const XMusicAnalyzerShared* m_analyzer = nullptr;
     
 public:
     XMusicController() {
@@ -28,6 +31,7 @@ public:
     }
     
     ~XMusicController() {
+        unsubscribeAnalyzer();
         if (m_connected) {
             serviceClose(&m_service);
         }
@@ -41,9 +45,72 @@ public:
         return serviceDispatchIn(&m_service, static_cast<u32>(cmd), cmd);
     }
     
+    Result seek(s64 samples, XMusicSeekMode mode) {
+        if (!m_connected) return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
+        XMusicSeekArgs args = {samples, mode, 0};
+        return serviceDispatchIn(&m_service, static_cast<u32>(XMusicCmd_Seek), args);
+    }
+    
+    Result setSpeed(float speed) {
+        if (!m_connected) return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
+        XMusicSetSpeedArgs args = {speed, 0};
+        return serviceDispatchIn(&m_service, static_cast<u32>(XMusicCmd_SetSpeed), args);
+    }
+    
+    /**
+     * Map the sysmodule's analyzer page. Reads after this need no IPC.
+     */
+    Result subscribeAnalyzer() {
+        if (!m_connected) return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
+        if (m_analyzer) return 0;
+        
+        Handle handle = INVALID_HANDLE;
+        Result rc = serviceDispatch(&m_service, static_cast<u32>(XMusicCmd_SubscribeAnalyzer),
+            .out_handle_attrs = { SfOutHandleAttr_HipcCopy },
+            .out_handles = &handle,
+        );
+        if (R_SUCCEEDED(rc) && handle == INVALID_HANDLE) {
+            rc = MAKERESULT(Module_Libnx, LibnxError_BadInput);
+        }
+        if (R_SUCCEEDED(rc)) {
+            shmemLoadRemote(&m_analyzerMem, handle, 0x1000, Perm_R);
+            rc = shmemMap(&m_analyzerMem);
+            if (R_FAILED(rc)) {
+                shmemClose(&m_analyzerMem);
+            }
+        }
+        if (R_FAILED(rc)) {
+            // The sysmodule may have subscribed us before something failed on this side
+            sendCommand(XMusicCmd_UnsubscribeAnalyzer);
+            return rc;
+        }
+        m_analyzer = (const XMusicAnalyzerShared*)shmemGetAddr(&m_analyzerMem);
+        return 0;
+    }
+    
+    Result setAnalyzerRate(u32 hz) {
+        if (!m_connected) return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
+        XMusicSetAnalyzerRateArgs args = {hz, 0};
+        return serviceDispatchIn(&m_service, static_cast<u32>(XMusicCmd_SetAnalyzerRate), args);
+    }
+    
+    void unsubscribeAnalyzer() {
+        if (!m_analyzer) return;
+        m_analyzer = nullptr;
+        shmemClose(&m_analyzerMem);
+        sendCommand(XMusicCmd_UnsubscribeAnalyzer);
+    }
+    
+    bool readAnalyzer(XMusicAnalyzerFrame* frame) const {
+        return m_analyzer && xmusicReadAnalyzer(m_analyzer, armGetSystemTick(), frame);
+    }
+    
     Result getStatus(XMusicStatus* status) {
         if (!m_connected) return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
-        return serviceDispatchOut(&m_service, static_cast<u32>(XMusicCmd_GetStatus), *status);
+        return serviceDispatch(&m_service, static_cast<u32>(XMusicCmd_GetStatus),
+            .buffer_attrs = { SfBufferAttr_HipcMapAlias | SfBufferAttr_Out },
+            .buffers = { { status, sizeof(*status) } },
+        );
     }
 };
 
@@ -55,15 +122,34 @@ void printMenu() {
     std::cout << "X - Next Track" << std::endl;
     std::cout << "Y - Previous Track" << std::endl;
     std::cout << "L/R - Volume Down/Up" << std::endl;
+    std::cout << "Left/Right - Seek (hold to scrub)" << std::endl;
+    std::cout << "Up/Down - Speed (0.5x to 2x)" << std::endl;
     std::cout << "ZL - Get Status" << std::endl;
+    std::cout << "ZR - Toggle Visualizer" << std::endl;
     std::cout << "+ - Exit" << std::endl;
     std::cout << "================================" << std::endl;
 }
 
+void drawVisualizer(const XMusicAnalyzerFrame& frame) {
+    static const char* levels = " .:-=+*#%@";
+    char bars[XMUSIC_ANALYZER_BANDS + 1];
+    for (int i = 0; i < XMUSIC_ANALYZER_BANDS; i++) {
+        bars[i] = levels[std::min(9, (int)(frame.bands[i] * 10.0f))];
+    }
+    bars[XMUSIC_ANALYZER_BANDS] = '\0';
+    
+    // Redraw in place on the last console row
+    std::cout << "\x1b[44;1H[" << bars << "] L " << (int)(frame.peak[0] * 100)
+              << "% R " << (int)(frame.peak[1] * 100) << "%   " << std::flush;
+}
+
 void printStatus(const XMusicStatus& status) {
     std::cout << "\n📊 XMusic Status:" << std::endl;
     std::cout << "   Playing: " << (status.playing ? "Yes" : "No") << std::endl;
     std::cout << "   Volume: " << (int)(status.volume * 100) << "%" << std::endl;
+    if (status.speed > 0.0f && status.speed != 1.0f) {
+        std::cout << "   Speed: " << status.speed << "x" << std::endl;
+    }
     
     if (strlen(status.title) > 0) {
         std::cout << "   Title: " << status.title << std::endl;
@@ -74,7 +160,10 @@ void printStatus(const XMusicStatus& status) {
     }
     
     if (status.duration > 0) {
-        std::cout << "   Position: " << status.position << "/" << status.duration << "s" << std::endl;
+        u64 samples = xmusicInterpolatePosition(&status, armGetSystemTick());
+        u64 ms = status.sampleRate ? samples * 1000 / status.sampleRate : 0;
+        std::cout << "   Position: " << ms / 1000 << "." << (ms % 1000) / 100
+                  << "/" << status.duration << "s" << std::endl;
     }
 }
 
@@ -107,6 +196,10 @@ int main() {
     
     XMusicStatus currentStatus = {};
     bool statusVisible = false;
+    u32 scrubFrames = 0;
+    bool visualizer = false;
+    u32 frameCount = 0;
+    float speed = 1.0f;
     
     // Main loop
     while (appletMainLoop()) {
@@ -154,6 +247,31 @@ int main() {
             commandSent = true;
         }
         
+        // Seek 5s per press; after a short hold, step 1s every 6 frames. The service
+        // applies only the latest seek per audio block, so scrubbing stays cheap.
+        u64 kHeld = padGetButtons(&pad);
+        s64 seekDir = (kHeld & HidNpadButton_Right) ? 1 : (kHeld & HidNpadButton_Left) ? -1 : 0;
+        if (seekDir == 0) {
+            scrubFrames = 0;
+        } else if (kDown & (HidNpadButton_Left | HidNpadButton_Right)) {
+            controller.seek(seekDir * 5 * 48000, XMusicSeek_Current);
+            scrubFrames = 0;
+        } else if (++scrubFrames >= 20 && scrubFrames % 6 == 0) {
+            controller.seek(seekDir * 48000, XMusicSeek_Current);
+        }
+        
+        // Speed in 0.25x steps, pitch stays the same
+        if (kDown & (HidNpadButton_Up | HidNpadButton_Down)) {
+            float next = speed + ((kDown & HidNpadButton_Up) ? 0.25f : -0.25f);
+            next = std::max(0.5f, std::min(2.0f, next));
+            if (next != speed) {
+                rc = controller.setSpeed(next);
+                if (R_SUCCEEDED(rc)) speed = next;
+                std::cout << "⏩ Speed " << speed << "x" << std::endl;
+                commandSent = true;
+            }
+        }
+        
         if (kDown & HidNpadButton_ZL) {
             rc = controller.getStatus(&currentStatus);
             if (R_SUCCEEDED(rc)) {
@@ -164,6 +282,29 @@ int main() {
             }
         }
         
+        if (kDown & HidNpadButton_ZR) {
+            if (visualizer) {
+                controller.unsubscribeAnalyzer();
+                visualizer = false;
+            } else {
+                rc = controller.subscribeAnalyzer();
+                visualizer = R_SUCCEEDED(rc);
+                if (visualizer) {
+                    // Drawn every 4th frame, faster updates would never be seen
+                    controller.setAnalyzerRate(15);
+                }
+                if (!visualizer) {
+                    std::cout << "❌ Visualizer unavailable: 0x" << std::hex << rc << std::dec << std::endl;
+                }
+            }
+        }
+        
+        // Analyzer data comes from shared memory, no IPC per frame
+        XMusicAnalyzerFrame analyzerFrame;
+        if (visualizer && (++frameCount % 4) == 0 && controller.readAnalyzer(&analyzerFrame)) {
+            drawVisualizer(analyzerFrame);
+        }
+        
         if (commandSent) {
             if (R_SUCCEEDED(rc)) {
                 std::cout << "✅ Command sent successfully" << std::endl;
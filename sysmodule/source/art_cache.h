@@ -0,0 +1,705 @@
+#pragma once
+#include <switch.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <setjmp.h>
+#include <sys/stat.h>
+#include <jpeglib.h>
+#include <png.h>
+#include "trace.h"
+
+/**
+ * Album art thumbnail cache
+ *
+ * A background job pulls the embedded cover (ID3v2 APIC) out of a track
+ * once, decodes it while streaming from the file, box-filters it down to
+ * THUMB_SIZES and stores the result as RGBA4444 (the Tesla framebuffer
+ * format) in one packed file on the SD card. Lookups are a binary search in
+ * the in-memory offset table, then one seek and one read. No image is ever
+ * decoded at play time.
+ *
+ * JPEG covers are decoded at 1/2 to 1/8 scale by libjpeg and PNG covers a
+ * row at a time, so a cover never needs a full-size RGBA buffer in our 2MB
+ * heap. Covers whose headers promise more than MAX_DIMENSION pixels a side,
+ * or progressive JPEGs whose coefficient buffer would not fit, are skipped
+ * before any pixel memory is allocated.
+ *
+ * Pack layout: header, pixel blobs, offset table. New blobs are appended,
+ * then a batch of them is committed by writing a fresh table at the end and
+ * rewriting the header last, so a torn write leaves the previous table
+ * intact and only costs the uncommitted thumbnails. Superseded tables and
+ * orphaned blobs are dead space; once it passes a quarter of the pack the
+ * live entries are copied to a new pack that replaces the old one.
+ */
+class ArtCache {
+public:
+    static constexpr u32 THUMB_COUNT = 2;
+    static constexpr u32 THUMB_SIZES[THUMB_COUNT] = {96, 48};
+    static constexpr const char* PACK_PATH = "sdmc:/config/xmusic/art.pack";
+
+    /**
+     * Pixel bytes of one thumbnail size
+     */
+    static constexpr u32 thumbBytes(u32 sizeIndex) {
+        return THUMB_SIZES[sizeIndex] * THUMB_SIZES[sizeIndex] * sizeof(u16);
+    }
+
+private:
+    static constexpr u32 PACK_MAGIC = 0x4B505841; // "AXPK"
+    static constexpr u32 PACK_VERSION = 1;
+    static constexpr u32 BLOB_BYTES = (THUMB_SIZES[0] * THUMB_SIZES[0] + THUMB_SIZES[1] * THUMB_SIZES[1]) * sizeof(u16);
+    static constexpr u32 MAX_ART_BYTES = 0x400000;
+    static constexpr u32 MAX_DIMENSION = 4096;
+    static constexpr u32 MAX_PROGRESSIVE_BYTES = 0x80000;   // Whole-image coefficients of a progressive JPEG
+    static constexpr u32 MAX_ENTRIES = 0x10000;
+    static constexpr u32 COMMIT_BATCH = 32;
+    static constexpr u64 COMPACT_MIN_DEAD = 0x100000;
+
+    struct PackHeader {
+        u32 magic;
+        u32 version;
+        u32 entryCount;
+        u32 reserved;
+        u64 tableOffset;
+    };
+
+    struct PackEntry {
+        u64 key;
+        u64 offset; // Blob with every thumbnail size, largest first
+    };
+
+    struct ArtLocation {
+        u64 offset;
+        u32 size;
+        bool png;
+    };
+
+    std::string m_packPath;
+    std::string m_compactPath;
+    FILE* m_pack = nullptr;
+    PackHeader m_header = {};
+    std::vector<PackEntry> m_entries; // Sorted by key
+    u32 m_uncommitted = 0;
+    u64 m_deadBytes = 0;    // Old tables and orphaned blobs
+    std::mutex m_packMutex;
+
+    std::thread m_worker;
+    std::mutex m_queueMutex;
+    std::condition_variable m_queueCond;
+    std::deque<std::string> m_queue;
+    bool m_stop = false;
+
+    // Stats, read from any thread
+    std::atomic<u32> m_hits{0};
+    std::atomic<u32> m_misses{0};
+    std::atomic<u32> m_extracted{0};
+    std::atomic<u32> m_compactions{0};
+
+    static u64 fnv1a(const void* data, size_t size, u64 hash = 0xcbf29ce484222325ULL) {
+        const u8* p = (const u8*)data;
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ p[i]) * 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    static u32 readBE32(const u8* p) {
+        return ((u32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    }
+
+    static u32 readSyncsafe(const u8* p) {
+        return ((u32)(p[0] & 0x7F) << 21) | ((p[1] & 0x7F) << 14) | ((p[2] & 0x7F) << 7) | (p[3] & 0x7F);
+    }
+
+    /**
+     * Walk the ID3v2 tag: hash artist/album into a key and find the front
+     * cover (or first picture). The album artist (TPE2) is preferred over
+     * the track artist, so compilations share one cover. Only frame headers
+     * and small text frames are read.
+     */
+    static bool scanId3(FILE* f, u64* key, ArtLocation* art) {
+        u8 h[10];
+        fseeko(f, 0, SEEK_SET);
+        if (fread(h, 1, 10, f) != 10 || memcmp(h, "ID3", 3) != 0) return false;
+
+        u32 version = h[3];
+        if (version < 3 || (h[5] & 0x40)) return false; // v2.2 and extended headers are not handled
+        u64 tagEnd = 10 + readSyncsafe(h + 6);
+
+        std::string artist, albumArtist, album;
+        bool haveArt = false, haveFront = false;
+        u64 pos = 10;
+
+        while (pos + 10 <= tagEnd) {
+            fseeko(f, (off_t)pos, SEEK_SET);
+            if (fread(h, 1, 10, f) != 10 || h[0] == 0) break;
+
+            u32 size = (version == 4) ? readSyncsafe(h + 4) : readBE32(h + 4);
+            u64 body = pos + 10;
+            pos = body + size;
+            if (pos > tagEnd) break;
+
+            std::string* text = memcmp(h, "TPE1", 4) == 0 ? &artist :
+                                memcmp(h, "TPE2", 4) == 0 ? &albumArtist :
+                                memcmp(h, "TALB", 4) == 0 ? &album : nullptr;
+            if (text && size > 1 && size < 512) {
+                char value[512];
+                if (fread(value, 1, size, f) != size) break;
+                text->assign(value + 1, size - 1); // Raw bytes after the encoding byte are fine for hashing
+            } else if (memcmp(h, "APIC", 4) == 0 && !haveFront && size > 16) {
+                // encoding, MIME\0, picture type, description\0, data
+                u8 head[256];
+                u32 n = (u32)fread(head, 1, std::min<u32>(size, sizeof(head)), f);
+                u32 i = 1;
+                while (i < n && head[i]) i++;
+                bool png = (i - 1 >= 9) && memcmp(head + 1, "image/png", 9) == 0;
+                i++;
+                if (i >= n) continue;
+                u8 type = head[i++];
+                bool wide = head[0] == 1 || head[0] == 2; // UTF-16 descriptions end in two zero bytes
+                while (i + (wide ? 1 : 0) < n && (wide ? (head[i] || head[i + 1]) : head[i])) i += wide ? 2 : 1;
+                i += wide ? 2 : 1;
+                if (i >= n) continue;
+
+                art->offset = body + i;
+                art->size = size - i;
+                art->png = png;
+                haveArt = true;
+                haveFront = type == 3;
+            }
+        }
+
+        if (!albumArtist.empty()) artist = albumArtist;
+        if (!artist.empty() || !album.empty()) {
+            *key = fnv1a(album.data(), album.size(), fnv1a(artist.data(), artist.size()) ^ 0xFF);
+        }
+        return haveArt;
+    }
+
+    /**
+     * Streams decoded RGB rows into a box filter for the largest thumbnail.
+     * A side shorter than the thumbnail is stretched instead, each output
+     * pixel repeating its nearest source pixel, so small covers leave no
+     * empty cells. Built between setjmp and a possible longjmp, so it owns
+     * no heap memory.
+     */
+    struct BoxFilter {
+        u32 srcW, srcH, dst;
+        u32 acc[THUMB_SIZES[0] * 4]; // r, g, b, count per output pixel of the current output row
+        u32 outRow = 0;
+        u16* out;
+
+        BoxFilter(u32 w, u32 h, u16* pixels)
+            : srcW(w), srcH(h), dst(THUMB_SIZES[0]), acc(), out(pixels) {}
+
+        void emit() {
+            for (u32 x = 0; x < dst; x++) {
+                u32* a = &acc[x * 4];
+                u32 c = std::max(1u, a[3]);
+                u32 r = a[0] / c, g = a[1] / c, b = a[2] / c;
+                out[outRow * dst + x] = (u16)((r >> 4) | ((g >> 4) << 4) | ((b >> 4) << 8) | (0xF << 12));
+            }
+            outRow++;
+        }
+
+        void flush() {
+            emit();
+            std::fill(acc, acc + dst * 4, 0);
+        }
+
+        void add(u32* a, const u8* px) {
+            a[0] += px[0];
+            a[1] += px[1];
+            a[2] += px[2];
+            a[3]++;
+        }
+
+        void row(u32 y, const u8* rgb, u32 stride) {
+            if (srcH >= dst) {
+                u32 target = (u32)((u64)y * dst / srcH);
+                while (outRow < target) flush();
+            }
+
+            if (srcW >= dst) {
+                for (u32 x = 0; x < srcW; x++) {
+                    add(&acc[((u64)x * dst / srcW) * 4], &rgb[x * stride]);
+                }
+            } else {
+                for (u32 x = 0; x < dst; x++) {
+                    add(&acc[x * 4], &rgb[((u64)x * srcW / dst) * stride]);
+                }
+            }
+
+            if (srcH < dst) {
+                // Every output row whose nearest source row this is
+                while (outRow < dst && (u64)outRow * srcH / dst == y) emit();
+                std::fill(acc, acc + dst * 4, 0);
+            }
+        }
+
+        void finish() {
+            while (outRow < dst) flush();
+        }
+    };
+
+    struct JpegError {
+        jpeg_error_mgr mgr;
+        jmp_buf jump;
+    };
+
+    static void jpegErrorExit(j_common_ptr cinfo) {
+        longjmp(((JpegError*)cinfo->err)->jump, 1);
+    }
+
+    /**
+     * Bytes libjpeg allocates up front to hold every coefficient of a
+     * progressive image, known once the header is read
+     */
+    static u64 coefficientBytes(const jpeg_decompress_struct& cinfo) {
+        u64 blocks = 0;
+        for (int c = 0; c < cinfo.num_components; c++) {
+            const jpeg_component_info& comp = cinfo.comp_info[c];
+            u64 w = (comp.width_in_blocks + comp.h_samp_factor - 1) / comp.h_samp_factor * comp.h_samp_factor;
+            u64 h = (comp.height_in_blocks + comp.v_samp_factor - 1) / comp.v_samp_factor * comp.v_samp_factor;
+            blocks += w * h;
+        }
+        return blocks * sizeof(JBLOCK);
+    }
+
+    static bool decodeJpeg(FILE* f, u16* out) {
+        jpeg_decompress_struct cinfo;
+        JpegError err;
+        cinfo.err = jpeg_std_error(&err.mgr);
+        err.mgr.error_exit = jpegErrorExit;
+        // Everything that owns memory is set up before setjmp, a longjmp skips destructors
+        std::vector<u8> row(MAX_DIMENSION * 3);
+
+        if (setjmp(err.jump)) {
+            jpeg_destroy_decompress(&cinfo);
+            return false;
+        }
+
+        jpeg_create_decompress(&cinfo);
+        jpeg_stdio_src(&cinfo, f);
+        jpeg_read_header(&cinfo, TRUE);
+
+        // Refuse what would not fit before libjpeg allocates for it
+        bool fits = cinfo.image_width > 0 && cinfo.image_height > 0 &&
+                    cinfo.image_width <= MAX_DIMENSION && cinfo.image_height <= MAX_DIMENSION &&
+                    (!jpeg_has_multiple_scans(&cinfo) || coefficientBytes(cinfo) <= MAX_PROGRESSIVE_BYTES);
+        if (!fits) {
+            jpeg_destroy_decompress(&cinfo);
+            return false;
+        }
+
+        // Let libjpeg drop resolution in the IDCT, keeping at least the thumbnail size
+        u32 target = THUMB_SIZES[0];
+        u32 shortSide = std::min(cinfo.image_width, cinfo.image_height);
+        cinfo.scale_num = 1;
+        cinfo.scale_denom = 1;
+        while (cinfo.scale_denom < 8 && shortSide / (cinfo.scale_denom * 2) >= target) {
+            cinfo.scale_denom *= 2;
+        }
+        cinfo.out_color_space = JCS_RGB;
+        jpeg_start_decompress(&cinfo);
+
+        BoxFilter filter(cinfo.output_width, cinfo.output_height, out);
+        JSAMPROW rows[1] = {row.data()};
+        while (cinfo.output_scanline < cinfo.output_height) {
+            u32 y = cinfo.output_scanline;
+            jpeg_read_scanlines(&cinfo, rows, 1);
+            filter.row(y, row.data(), 3);
+        }
+        filter.finish();
+
+        jpeg_finish_decompress(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+        return true;
+    }
+
+    static bool decodePng(FILE* f, u16* out) {
+        png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        if (!png) return false;
+        png_infop info = png_create_info_struct(png);
+        std::vector<u8> row(MAX_DIMENSION * 4);
+
+        if (!info || setjmp(png_jmpbuf(png))) {
+            png_destroy_read_struct(&png, info ? &info : nullptr, nullptr);
+            return false;
+        }
+
+        png_init_io(png, f);
+        png_set_user_limits(png, MAX_DIMENSION, MAX_DIMENSION); // Larger headers are errors
+        png_read_info(png, info);
+
+        // Normalize everything to 8-bit RGB(A)
+        png_set_strip_16(png);
+        png_set_packing(png);
+        png_set_expand(png);
+        png_set_gray_to_rgb(png);
+        int passes = png_set_interlace_handling(png);
+        png_read_update_info(png, info);
+
+        u32 w = png_get_image_width(png, info);
+        u32 h = png_get_image_height(png, info);
+        u32 stride = png_get_channels(png, info);
+        if (passes != 1 || stride < 3 || png_get_rowbytes(png, info) > row.size()) {
+            // Interlaced images need the whole frame, which does not fit our heap
+            png_destroy_read_struct(&png, &info, nullptr);
+            return false;
+        }
+
+        BoxFilter filter(w, h, out);
+        for (u32 y = 0; y < h; y++) {
+            png_read_row(png, row.data(), nullptr);
+            filter.row(y, row.data(), stride);
+        }
+        filter.finish();
+
+        png_destroy_read_struct(&png, &info, nullptr);
+        return true;
+    }
+
+    /**
+     * Derive each smaller thumbnail from the one before it with a box filter
+     */
+    static void buildSmaller(u16* blob) {
+        u16* src = blob;
+        for (u32 s = 1; s < THUMB_COUNT; s++) {
+            u16* dst = src + THUMB_SIZES[s - 1] * THUMB_SIZES[s - 1];
+            u32 from = THUMB_SIZES[s - 1], to = THUMB_SIZES[s], ratio = from / to;
+            for (u32 y = 0; y < to; y++) {
+                for (u32 x = 0; x < to; x++) {
+                    u32 sum[3] = {0, 0, 0};
+                    for (u32 dy = 0; dy < ratio; dy++) {
+                        for (u32 dx = 0; dx < ratio; dx++) {
+                            u16 p = src[(y * ratio + dy) * from + x * ratio + dx];
+                            sum[0] += p & 0xF;
+                            sum[1] += (p >> 4) & 0xF;
+                            sum[2] += (p >> 8) & 0xF;
+                        }
+                    }
+                    u32 n = ratio * ratio;
+                    dst[y * to + x] = (u16)((sum[0] / n) | ((sum[1] / n) << 4) | ((sum[2] / n) << 8) | (0xF << 12));
+                }
+            }
+            src = dst;
+        }
+    }
+
+    bool findEntry(u64 key, u64* offset) {
+        auto it = std::lower_bound(m_entries.begin(), m_entries.end(), key,
+                                   [](const PackEntry& e, u64 k) { return e.key < k; });
+        if (it == m_entries.end() || it->key != key) return false;
+        *offset = it->offset;
+        return true;
+    }
+
+    // Caller holds m_packMutex
+    Result append(u64 key, const u16* blob) {
+        fseeko(m_pack, 0, SEEK_END);
+        u64 offset = (u64)ftello(m_pack);
+        if (fwrite(blob, 1, BLOB_BYTES, m_pack) != BLOB_BYTES || fflush(m_pack) != 0) {
+            return MAKERESULT(Module_Libnx, LibnxError_IoError);
+        }
+
+        // Readable right away, persisted with the next commit
+        auto it = std::lower_bound(m_entries.begin(), m_entries.end(), key,
+                                   [](const PackEntry& e, u64 k) { return e.key < k; });
+        m_entries.insert(it, PackEntry{key, offset});
+        m_uncommitted++;
+        return 0;
+    }
+
+    // Caller holds m_packMutex
+    Result commit() {
+        if (!m_uncommitted) return 0;
+
+        fseeko(m_pack, 0, SEEK_END);
+        PackHeader header = m_header;
+        header.entryCount = (u32)m_entries.size();
+        header.tableOffset = (u64)ftello(m_pack);
+
+        bool ok = fwrite(m_entries.data(), sizeof(PackEntry), m_entries.size(), m_pack) == m_entries.size() &&
+                  fflush(m_pack) == 0;
+        if (ok) {
+            // Header last: until it lands, the previous table is still the valid one
+            fseeko(m_pack, 0, SEEK_SET);
+            ok = fwrite(&header, sizeof(header), 1, m_pack) == 1 && fflush(m_pack) == 0;
+        }
+        if (!ok) return MAKERESULT(Module_Libnx, LibnxError_IoError);
+
+        m_deadBytes += (u64)m_header.entryCount * sizeof(PackEntry);
+        m_header = header;
+        m_uncommitted = 0;
+
+        u64 live = (u64)m_entries.size() * BLOB_BYTES;
+        if (m_deadBytes >= COMPACT_MIN_DEAD && m_deadBytes >= live / 4) {
+            compact();
+        }
+        return 0;
+    }
+
+    /**
+     * Copy the committed entries into a fresh pack, written aside and
+     * swapped in. Caller holds m_packMutex.
+     */
+    Result compact() {
+        FILE* out = fopen(m_compactPath.c_str(), "wb");
+        if (!out) return MAKERESULT(Module_Libnx, LibnxError_NotFound);
+
+        std::vector<PackEntry> entries = m_entries;
+        PackHeader header = {PACK_MAGIC, PACK_VERSION, (u32)entries.size(), 0,
+                             sizeof(PackHeader) + (u64)entries.size() * BLOB_BYTES};
+        std::vector<u8> blob(BLOB_BYTES);
+        bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+        for (size_t i = 0; ok && i < entries.size(); i++) {
+            ok = fseeko(m_pack, (off_t)entries[i].offset, SEEK_SET) == 0 &&
+                 fread(blob.data(), 1, BLOB_BYTES, m_pack) == BLOB_BYTES &&
+                 fwrite(blob.data(), 1, BLOB_BYTES, out) == BLOB_BYTES;
+            entries[i].offset = sizeof(PackHeader) + (u64)i * BLOB_BYTES;
+        }
+        ok = ok && fwrite(entries.data(), sizeof(PackEntry), entries.size(), out) == entries.size() &&
+             fflush(out) == 0;
+        fclose(out);
+        if (!ok) {
+            remove(m_compactPath.c_str());
+            return MAKERESULT(Module_Libnx, LibnxError_IoError);
+        }
+
+        // rename() does not replace on the SD card; open() picks up the copy if we stop in between
+        fclose(m_pack);
+        remove(m_packPath.c_str());
+        rename(m_compactPath.c_str(), m_packPath.c_str());
+        m_pack = fopen(m_packPath.c_str(), "r+b");
+        if (!m_pack) return MAKERESULT(Module_Libnx, LibnxError_IoError);
+
+        m_header = header;
+        m_entries = std::move(entries);
+        m_deadBytes = 0;
+        m_compactions++;
+        return 0;
+    }
+
+    /**
+     * Read and check the header and table of an opened pack. Caller holds m_packMutex.
+     */
+    bool loadPack() {
+        if (fread(&m_header, sizeof(m_header), 1, m_pack) != 1 ||
+            m_header.magic != PACK_MAGIC || m_header.version != PACK_VERSION) {
+            return false;
+        }
+        fseeko(m_pack, 0, SEEK_END);
+        u64 fileSize = (u64)ftello(m_pack);
+        u64 tableBytes = (u64)m_header.entryCount * sizeof(PackEntry);
+        if (m_header.entryCount > MAX_ENTRIES || m_header.tableOffset < sizeof(PackHeader) ||
+            m_header.tableOffset + tableBytes > fileSize) {
+            return false;
+        }
+
+        m_entries.resize(m_header.entryCount);
+        fseeko(m_pack, (off_t)m_header.tableOffset, SEEK_SET);
+        if (fread(m_entries.data(), sizeof(PackEntry), m_entries.size(), m_pack) != m_entries.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < m_entries.size(); i++) {
+            if ((i > 0 && m_entries[i - 1].key >= m_entries[i].key) ||
+                m_entries[i].offset < sizeof(PackHeader) || m_entries[i].offset + BLOB_BYTES > m_header.tableOffset) {
+                return false;
+            }
+        }
+
+        m_uncommitted = 0;
+        m_deadBytes = fileSize - sizeof(PackHeader) - (u64)m_entries.size() * BLOB_BYTES - tableBytes;
+        return true;
+    }
+
+    void process(const std::string& path) {
+        FILE* f = fopen(path.c_str(), "rb");
+        if (!f) return;
+
+        u64 key = fnv1a(path.data(), path.size());
+        ArtLocation art = {};
+        bool found = scanId3(f, &key, &art) && art.size <= MAX_ART_BYTES;
+
+        {
+            std::lock_guard<std::mutex> lock(m_packMutex);
+            u64 offset;
+            if (!found || !m_pack || findEntry(key, &offset)) {
+                fclose(f);
+                return;
+            }
+        }
+
+        std::vector<u16> blob(BLOB_BYTES / sizeof(u16));
+        fseeko(f, (off_t)art.offset, SEEK_SET);
+        bool ok = art.png ? decodePng(f, blob.data()) : decodeJpeg(f, blob.data());
+        fclose(f);
+        if (!ok) return;
+
+        buildSmaller(blob.data());
+
+        std::lock_guard<std::mutex> lock(m_packMutex);
+        if (R_SUCCEEDED(append(key, blob.data()))) {
+            m_extracted++;
+        }
+    }
+
+    void workerFunc() {
+        XMUSIC_TRACE_THREAD("art");
+        while (true) {
+            std::string path;
+            bool idle;
+            {
+                std::unique_lock<std::mutex> lock(m_queueMutex);
+                m_queueCond.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+                if (m_stop) return;
+                path = m_queue.front();
+                m_queue.pop_front();
+                idle = m_queue.empty();
+            }
+            {
+                XMUSIC_TRACE_SCOPE(TraceId_ArtExtract, 0);
+                process(path);
+            }
+
+            // Each commit leaves the previous table behind as dead space, so batch them
+            std::lock_guard<std::mutex> lock(m_packMutex);
+            if (m_pack && (idle || m_uncommitted >= COMMIT_BATCH)) {
+                commit();
+            }
+        }
+    }
+
+public:
+    explicit ArtCache(const char* packPath = PACK_PATH) : m_packPath(packPath), m_compactPath(m_packPath + ".new") {}
+
+    ~ArtCache() {
+        close();
+    }
+
+    /**
+     * Open or create the pack and start the extraction job
+     */
+    Result open() {
+        std::lock_guard<std::mutex> lock(m_packMutex);
+
+        mkdir("sdmc:/config/xmusic", 0777);
+        m_pack = fopen(m_packPath.c_str(), "r+b");
+        if (!m_pack) {
+            // Stopped between removing the old pack and renaming the compacted one
+            rename(m_compactPath.c_str(), m_packPath.c_str());
+            m_pack = fopen(m_packPath.c_str(), "r+b");
+        }
+        bool valid = m_pack && loadPack();
+
+        if (!valid) {
+            // Missing or unreadable, start a fresh pack
+            if (m_pack) fclose(m_pack);
+            m_pack = fopen(m_packPath.c_str(), "w+b");
+            if (!m_pack) return MAKERESULT(Module_Libnx, LibnxError_NotFound);
+
+            m_entries.clear();
+            m_uncommitted = 0;
+            m_deadBytes = 0;
+            m_header = {PACK_MAGIC, PACK_VERSION, 0, 0, sizeof(PackHeader)};
+            if (fwrite(&m_header, sizeof(m_header), 1, m_pack) != 1 || fflush(m_pack) != 0) {
+                return MAKERESULT(Module_Libnx, LibnxError_IoError);
+            }
+        }
+
+        m_stop = false;
+        m_worker = std::thread(&ArtCache::workerFunc, this);
+        return 0;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(m_queueMutex);
+            m_stop = true;
+            m_queue.clear();
+        }
+        m_queueCond.notify_all();
+        if (m_worker.joinable()) {
+            m_worker.join();
+        }
+
+        std::lock_guard<std::mutex> lock(m_packMutex);
+        if (m_pack) {
+            commit();
+            fclose(m_pack);
+            m_pack = nullptr;
+        }
+    }
+
+    /**
+     * Queue a track for extraction, done as tracks are opened. Tracks whose
+     * cover is already packed cost one tag scan.
+     */
+    void enqueue(const char* trackPath) {
+        {
+            std::lock_guard<std::mutex> lock(m_queueMutex);
+            m_queue.emplace_back(trackPath);
+        }
+        m_queueCond.notify_one();
+    }
+
+    /**
+     * Cache key for a track: artist and album when tagged, else its path
+     */
+    static u64 trackKey(const char* trackPath) {
+        u64 key = fnv1a(trackPath, strlen(trackPath));
+        FILE* f = fopen(trackPath, "rb");
+        if (f) {
+            ArtLocation art;
+            scanId3(f, &key, &art);
+            fclose(f);
+        }
+        return key;
+    }
+
+    /**
+     * Copy one thumbnail (RGBA4444, THUMB_SIZES[sizeIndex] squared) into out
+     */
+    bool lookup(u64 key, u32 sizeIndex, u16* out) {
+        if (sizeIndex >= THUMB_COUNT) return false;
+        std::lock_guard<std::mutex> lock(m_packMutex);
+
+        u64 offset;
+        if (!m_pack || !findEntry(key, &offset)) {
+            m_misses++;
+            return false;
+        }
+        for (u32 i = 0; i < sizeIndex; i++) {
+            offset += thumbBytes(i);
+        }
+
+        bool ok = fseeko(m_pack, (off_t)offset, SEEK_SET) == 0 &&
+                  fread(out, 1, thumbBytes(sizeIndex), m_pack) == thumbBytes(sizeIndex);
+        ok ? m_hits++ : m_misses++;
+        return ok;
+    }
+
+    u32 getEntryCount() {
+        std::lock_guard<std::mutex> lock(m_packMutex);
+        return (u32)m_entries.size();
+    }
+
+    u32 getHits() const { return m_hits; }
+    u32 getMisses() const { return m_misses; }
+    u32 getExtracted() const { return m_extracted; }
+    u32 getCompactions() const { return m_compactions; }
+
+    u64 getDeadBytes() {
+        std::lock_guard<std::mutex> lock(m_packMutex);
+        return m_deadBytes;
+    }
+};
@@ -8,13 +8,27 @@
 #include <thread>
 #include <mutex>
 #include <string>
+#include "audio_mixer.h"
+#include "spectrum_analyzer.h"
+#include "playback_clock.h"
+#include "time_stretch.h"
+#include "track_player.h"
+#include "trace.h"
 
 class AudioManager {
 private:
+    // audout renders interleaved PCM16; the mixer kernels are specialized for this layout
+    using OutputConfig = RenderConfig<2, SampleFormat_S16, 4096>;
+    using Mixer = AudioMixer<OutputConfig>;
+    
     static constexpr u32 SAMPLE_RATE = 48000;
-    static constexpr u32 CHANNEL_COUNT = 2;
+    static constexpr u32 CHANNEL_COUNT = OutputConfig::CHANNELS;
     static constexpr u32 BUFFER_COUNT = 2;
-    static constexpr u32 BUFFER_SIZE = 4096 * CHANNEL_COUNT;
+    static constexpr u32 BUFFER_SIZE = OutputConfig::BLOCK_SAMPLES;
+    
+    // audout releases a buffer once the audio renderer has taken it; the
+    // renderer's 5ms frames and the final mix hold it about two frames more
+    static constexpr u32 OUTPUT_LATENCY_FRAMES = 480;
     
     AudioOutBuffer audioBuffers[BUFFER_COUNT];
     s16* bufferData[BUFFER_COUNT];
@@ -25,66 +39,189 @@ private:
     std::atomic<bool> shouldStop{false};
     std::atomic<float> volume{0.3f};
     
-    // Current audio data
+    // Voice mixer shared by music and UI sounds
+    Mixer mixer;
+    
+    // Visualizer data for overlays, idle unless a client subscribed
+    SpectrumAnalyzer analyzer{SAMPLE_RATE};
+    
+    // Audible position, advanced by audout releases
+    PlaybackClock clock{SAMPLE_RATE};
+    
+    // Speed change between the mixer and audout, bypassed at 1x
+    TimeStretch stretch;
+    
+    // Current audio data (music voice), either generated in memory
+    // or decoded from a file by the track player
     std::vector<s16> audioData;
-    size_t playbackPosition = 0;
-    std::mutex audioMutex;
+    TrackPlayer track;
+    std::atomic<s32> musicVoice{Mixer::INVALID_VOICE}; // Also read by the audio thread for the clock
+    std::vector<s16> chimeData;
+    s32 chimeVoice = Mixer::INVALID_VOICE;
+    std::mutex audioMutex; // Serializes control threads, never taken by the audio thread
     
     void audioThreadFunc() {
+        XMUSIC_TRACE_THREAD("audio");
+        u32 queued = 0;
+        
         while (!shouldStop) {
-            if (isPlaying && !audioData.empty()) {
-                std::lock_guard<std::mutex> lock(audioMutex);
-                
+            if (queued < BUFFER_COUNT && mixer.hasAudibleVoices()) {
                 // Fill current buffer
                 s16* buffer = bufferData[currentBuffer];
-                size_t samplesAvailable = audioData.size() - playbackPosition;
-                size_t samplesToWrite = std::min((size_t)BUFFER_SIZE, samplesAvailable);
+                u32 frames = BUFFER_SIZE / CHANNEL_COUNT;
+                bool stretched = stretch.update();
+                {
+                    XMUSIC_TRACE_SCOPE(TraceId_AudioMix, frames);
+                    if (stretched) {
+                        // Only the music changes speed, chimes and effects start on time
+                        s32 music = musicVoice.load(std::memory_order_relaxed);
+                        stretch.render(buffer, frames, [this, music](s16* dst, u32 n) { mixer.mixOnly(music, dst, n, volume); });
+                        mixer.mixOver(buffer, frames, volume, music);
+                    } else {
+                        mixer.mix(buffer, frames, volume);
+                    }
+                    // Heard once the blocks already queued have played
+                    u64 ahead = (u64)queued * frames + OUTPUT_LATENCY_FRAMES;
+                    u64 heardAt = armGetSystemTick() + ahead * armGetSystemTickFreq() / SAMPLE_RATE;
+                    analyzer.feed(buffer, frames, heardAt);
+                }
                 
-                if (samplesToWrite > 0) {
-                    // Copy and apply volume
-                    for (size_t i = 0; i < samplesToWrite; i++) {
-                        if (playbackPosition < audioData.size()) {
-                            buffer[i] = audioData[playbackPosition++] * volume;
+                // Tell the clock which part of the track this block carries
+                PlaybackClock::Block block = {0, frames, 0, Mixer::INVALID_VOICE, 0, false};
+                s32 voice = musicVoice.load(std::memory_order_relaxed);
+                if (mixer.getVoiceBlock(voice, &block.mediaStart, &block.mediaFrames, &block.trackLength, &block.looping)) {
+                    block.track = voice;
+                    if (stretched) {
+                        // The mixer ran ahead of this block by what the stretcher still holds
+                        u64 end = block.mediaStart + block.mediaFrames;
+                        u64 behind = stretch.getInputLatency() + stretch.sourceFrames(frames);
+                        if (block.looping && block.trackLength) {
+                            block.mediaStart = (end + block.trackLength - behind % block.trackLength) % block.trackLength;
                         } else {
-                            buffer[i] = 0;
+                            block.mediaStart = end > behind ? end - behind : 0;
                         }
+                        block.mediaFrames = block.mediaFrames ? stretch.sourceFrames(frames) : 0;
                     }
-                    
-                    // Fill rest with silence if needed
-                    for (size_t i = samplesToWrite; i < BUFFER_SIZE; i++) {
-                        buffer[i] = 0;
-                    }
-                    
-                    // Submit buffer
-                    audioBuffers[currentBuffer].data_size = BUFFER_SIZE * sizeof(s16);
-                    audoutAppendAudioOutBuffer(&audioBuffers[currentBuffer]);
-                    
-                    // Wait for playback
-                    AudioOutBuffer* released;
-                    u32 releasedCount;
+                }
+                
+                // Submit buffer
+                audioBuffers[currentBuffer].data_size = BUFFER_SIZE * sizeof(s16);
+                audoutAppendAudioOutBuffer(&audioBuffers[currentBuffer]);
+                clock.onSubmit(block, armGetSystemTick());
+                queued++;
+                XMUSIC_TRACE_INSTANT(TraceId_AudioSubmit, queued);
+                
+                // Switch buffers
+                currentBuffer = (currentBuffer + 1) % BUFFER_COUNT;
+            } else if (queued > 0) {
+                // Wait for playback, every release is a block the device consumed
+                AudioOutBuffer* released;
+                u32 releasedCount = 0;
+                {
+                    XMUSIC_TRACE_SCOPE(TraceId_AudioWait, queued);
                     audoutWaitPlayFinish(&released, &releasedCount, UINT64_MAX);
-                    
-                    // Switch buffers
-                    currentBuffer = (currentBuffer + 1) % BUFFER_COUNT;
-                    
-                    // Loop if reached end
-                    if (playbackPosition >= audioData.size()) {
-                        playbackPosition = 0;
-                    }
-                } else {
-                    svcSleepThread(10000000); // 10ms
                 }
+                releasedCount = std::min(releasedCount, queued);
+                XMUSIC_TRACE_INSTANT(TraceId_AudioRelease, releasedCount);
+                clock.onReleased(releasedCount, armGetSystemTick());
+                queued -= releasedCount;
             } else {
+                mixer.collect();
                 svcSleepThread(50000000); // 50ms when not playing
             }
         }
     }
     
+    // Caller must hold audioMutex
+    void stopMusicVoice() {
+        if (musicVoice != Mixer::INVALID_VOICE) {
+            mixer.stopVoice(musicVoice, true);
+            musicVoice = Mixer::INVALID_VOICE;
+        }
+    }
+    
+    // Caller must hold audioMutex
+    void closeTrack() {
+        stopMusicVoice();
+        track.close();
+    }
+    
+    Result playTrack(const char* path, ByteSource* source) {
+        std::lock_guard<std::mutex> lock(audioMutex);
+        closeTrack();
+        
+        // The generated tone is the largest allocation we have, the decoder needs the room
+        audioData.clear();
+        audioData.shrink_to_fit();
+        
+        Result rc = path ? track.openFile(path) : track.openSource(source);
+        if (R_FAILED(rc)) {
+            return rc;
+        }
+        musicVoice = mixer.startStreamVoice(track.getStream(), 1.0f, 0.0f, !isPlaying);
+        stretch.requestReset();
+        return 0;
+    }
+    
+    // Caller must hold audioMutex
+    void startMusicVoice() {
+        stretch.requestReset();
+        musicVoice = mixer.startVoice(audioData.data(), audioData.size() / CHANNEL_COUNT,
+                                      1.0f, 0.0f, true, !isPlaying);
+    }
+    
+    // Caller must hold audioMutex. A stream voice that already drained is
+    // started again, the track player refills it from the new position.
+    void seekMusicVoice(u64 frame) {
+        if (track.isOpen()) {
+            track.seek(frame);
+            if (!mixer.isVoiceActive(musicVoice)) {
+                musicVoice = mixer.startStreamVoice(track.getStream(), 1.0f, 0.0f, !isPlaying);
+            }
+        } else {
+            mixer.seekVoice(musicVoice, frame);
+        }
+        stretch.requestReset();
+    }
+    
+    static void generateMelody(std::vector<s16>& out) {
+        out.clear();
+        
+        // Simple melody - Mario coin sound style
+        float notes[] = {523.25f, 659.25f, 783.99f, 1046.50f}; // C5, E5, G5, C6
+        float durations[] = {0.1f, 0.1f, 0.1f, 0.3f};
+        
+        for (int note = 0; note < 4; note++) {
+            u32 noteSamples = SAMPLE_RATE * durations[note] * CHANNEL_COUNT;
+            
+            for (u32 i = 0; i < noteSamples; i += CHANNEL_COUNT) {
+                float t = (float)(i / CHANNEL_COUNT) / SAMPLE_RATE;
+                s16 sample = (s16)(32767.0f * 0.2f * sinf(2.0f * M_PI * notes[note] * t));
+                
+                // Apply envelope for smoother sound
+                float envelope = 1.0f;
+                if (i < 1000) envelope = i / 1000.0f;
+                if (i > noteSamples - 1000) envelope = (noteSamples - i) / 1000.0f;
+                sample *= envelope;
+                
+                out.push_back(sample);
+                out.push_back(sample);
+            }
+            
+            // Small gap between notes
+            for (u32 i = 0; i < 480; i++) {
+                out.push_back(0);
+                out.push_back(0);
+            }
+        }
+    }
+    
 public:
     AudioManager() {
         // Initialize audio
         audoutInitialize();
         audoutStartAudioOut();
+        clock.setOutputLatency(OUTPUT_LATENCY_FRAMES);
         
         // Allocate buffers using aligned_alloc (C11 standard)
         for (u32 i = 0; i < BUFFER_COUNT; i++) {
@@ -121,6 +258,7 @@ public:
     
     void loadTestTone(float frequency = 440.0f, float duration = 3.0f) {
         std::lock_guard<std::mutex> lock(audioMutex);
+        closeTrack();
         
         audioData.clear();
         u32 totalSamples = SAMPLE_RATE * duration * CHANNEL_COUNT;
@@ -135,57 +273,114 @@ public:
             audioData.push_back(sample);
         }
         
-        playbackPosition = 0;
+        startMusicVoice();
     }
     
     void loadMelody() {
         std::lock_guard<std::mutex> lock(audioMutex);
-        
-        audioData.clear();
-        
-        // Simple melody - Mario coin sound style
-        float notes[] = {523.25f, 659.25f, 783.99f, 1046.50f}; // C5, E5, G5, C6
-        float durations[] = {0.1f, 0.1f, 0.1f, 0.3f};
-        
-        for (int note = 0; note < 4; note++) {
-            u32 noteSamples = SAMPLE_RATE * durations[note] * CHANNEL_COUNT;
-            
-            for (u32 i = 0; i < noteSamples; i += CHANNEL_COUNT) {
-                float t = (float)(i / CHANNEL_COUNT) / SAMPLE_RATE;
-                s16 sample = (s16)(32767.0f * 0.2f * sinf(2.0f * M_PI * notes[note] * t));
-                
-                // Apply envelope for smoother sound
-                float envelope = 1.0f;
-                if (i < 1000) envelope = i / 1000.0f;
-                if (i > noteSamples - 1000) envelope = (noteSamples - i) / 1000.0f;
-                sample *= envelope;
-                
-                audioData.push_back(sample);
-                audioData.push_back(sample);
-            }
-            
-            // Small gap between notes
-            for (u32 i = 0; i < 480; i++) {
-                audioData.push_back(0);
-                audioData.push_back(0);
-            }
+        closeTrack();
+        generateMelody(audioData);
+        startMusicVoice();
+    }
+    
+    /**
+     * Stream a WAV, MP3 or Ogg file as the music voice. Decoding starts right
+     * away; the voice stays paused unless playback is running.
+     */
+    Result playFile(const char* path) {
+        return playTrack(path, nullptr);
+    }
+    
+    /**
+     * Same as playFile() for a source that is not a file, such as an HTTP
+     * stream. The source must stay open until stopTrack() or the next track.
+     */
+    Result playStream(ByteSource* source) {
+        return playTrack(nullptr, source);
+    }
+    
+    /**
+     * Cache that file playback counts plays in and plays hits from, or null
+     */
+    void setPcmCache(PcmCache* cache) {
+        std::lock_guard<std::mutex> lock(audioMutex);
+        track.setPcmCache(cache);
+    }
+    
+    /**
+     * Stop the music voice and let go of its source
+     */
+    void stopTrack() {
+        std::lock_guard<std::mutex> lock(audioMutex);
+        closeTrack();
+    }
+    
+    /**
+     * State of the file being decoded, State_Idle for generated audio
+     */
+    TrackPlayer::State getTrackState() const {
+        return track.getState();
+    }
+    
+    /**
+     * Play the melody once as a UI sound on top of whatever music is playing
+     */
+    void playChime(float gain = 1.0f, float pan = 0.0f) {
+        std::lock_guard<std::mutex> lock(audioMutex);
+        if (chimeVoice != Mixer::INVALID_VOICE) {
+            mixer.stopVoice(chimeVoice, true);
         }
-        
-        playbackPosition = 0;
+        if (chimeData.empty()) {
+            generateMelody(chimeData);
+        }
+        chimeVoice = mixer.startVoice(chimeData.data(), chimeData.size() / CHANNEL_COUNT, gain, pan);
     }
     
     void play() {
         isPlaying = true;
+        std::lock_guard<std::mutex> lock(audioMutex);
+        mixer.setVoicePaused(musicVoice, false);
     }
     
     void pause() {
         isPlaying = false;
+        std::lock_guard<std::mutex> lock(audioMutex);
+        mixer.setVoicePaused(musicVoice, true);
     }
     
     void stop() {
         isPlaying = false;
         std::lock_guard<std::mutex> lock(audioMutex);
-        playbackPosition = 0;
+        mixer.setVoicePaused(musicVoice, true);
+        seekMusicVoice(0);
+    }
+    
+    /**
+     * Move the music voice to a sample position. Takes effect at the next
+     * block, so repeated calls while scrubbing only cost the last one.
+     */
+    void seek(s64 samples, bool relative = false) {
+        std::lock_guard<std::mutex> lock(audioMutex);
+        if (musicVoice == Mixer::INVALID_VOICE && !track.isOpen()) return;
+        
+        s64 total = track.isOpen() ? (s64)track.getLength() : (s64)(audioData.size() / CHANNEL_COUNT);
+        s64 target = relative ? (s64)mixer.getVoicePosition(musicVoice) + samples : samples;
+        target = std::max<s64>(0, target);
+        if (total > 0) {
+            target = std::min<s64>(total, target); // A stream of unknown length is not clamped
+        }
+        seekMusicVoice((u64)target);
+    }
+    
+    /**
+     * Playback speed without changing pitch, 0.5x to 2x
+     */
+    void setSpeed(float speed) {
+        stretch.setSpeed(speed);
+    }
+    
+    float getSpeed() const {
+        return stretch.getSpeed();
     }
     
     void setVolume(float vol) {
@@ -201,7 +396,29 @@ public:
     }
     
     float getProgress() const {
-        if (audioData.empty()) return 0.0f;
-        return (float)playbackPosition / audioData.size();
+        PlaybackClock::Position pos = clock.read();
+        if (pos.trackLength == 0) return 0.0f;
+        return (float)pos.mediaFrames / pos.trackLength;
     }
-};
\ No newline at end of file
+    
+    /**
+     * Audible position from device consumption, in samples and microseconds
+     */
+    PlaybackClock::Position getPosition() const {
+        return clock.read();
+    }
+    
+    u32 getSampleRate() const {
+        return SAMPLE_RATE;
+    }
+    
+    SpectrumAnalyzer& getAnalyzer() {
+        return analyzer;
+    }
+    
+    /**
+     * Mixer cost of the last rendered block, for profiling
+     */
+    u64 getLastMixTicks() const { return mixer.getLastMixTicks(); }
+    u32 getLastMixVoices() const { return mixer.getLastMixVoices(); }
+};
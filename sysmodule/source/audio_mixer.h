@@ -0,0 +1,439 @@
+#pragma once
+#include <switch.h>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include "render_kernels.h"
+#include "pcm_stream.h"
+
+/**
+ * Fixed-point multi-voice mixer
+ *
+ * Sums up to MAX_VOICES interleaved sources into one output block laid out
+ * as described by Output (a RenderConfig). Every voice has its own Q15
+ * gain, pan and read position. Products are accumulated in 32-bit lanes and
+ * saturated exactly once, when the block is narrowed to the output format.
+ * Each voice binds its render kernels from KernelTable when it starts.
+ *
+ * Voices are handed between control threads and the audio thread through an
+ * atomic state per slot, so mix() never takes a lock. Sample memory passed
+ * to startVoice() must stay valid until stopVoice(id, true) has returned or
+ * the voice has finished on its own. Voice ids carry a generation count, so
+ * an id kept after its voice ended never addresses a newer voice.
+ *
+ * A stream voice reads from a PcmStream filled by a decode thread instead
+ * of a buffer. It plays silence while the stream is empty, follows the
+ * stream's seeks, and ends once the stream is drained.
+ */
+template <typename Output>
+class AudioMixer {
+public:
+    using Sample = typename Output::Sample;
+
+    static constexpr u32 MAX_VOICES = 16;
+    static constexpr u32 CHANNEL_COUNT = Output::CHANNELS;
+    static constexpr u32 MAX_BLOCK_FRAMES = Output::BLOCK_FRAMES;
+    static constexpr s32 INVALID_VOICE = -1;
+    static constexpr s32 Q15_ONE = 32767;
+
+private:
+    enum VoiceState : u32 {
+        VoiceState_Free = 0,
+        VoiceState_Claimed,   // Owned by a control thread while it is set up
+        VoiceState_Active,    // Owned by the audio thread
+        VoiceState_Stopping   // Stop requested, audio thread releases it
+    };
+
+    static constexpr u64 NO_SEEK = ~0ULL;
+
+    struct Voice {
+        std::atomic<u32> state{VoiceState_Free};
+        std::atomic<u32> gains{0};          // Q15 left gain << 16 | Q15 right gain
+        std::atomic<bool> paused{false};
+        std::atomic<u64> position{0};       // Read position in frames
+        std::atomic<u64> seekRequest{NO_SEEK};
+        std::atomic<u32> generation{0};     // Bumped on every claim so stale ids miss
+        const u8* data = nullptr;
+        PcmStream* stream = nullptr;        // Set for stream voices, data is unused then
+        u64 frames = 0;
+        u32 channels = 0;
+        u32 frameBytes = 0;
+        SampleFormat format = SampleFormat_S16;
+        VoiceKernels kernels;
+        bool loop = false;
+        u64 blockStart = 0;                 // Audio thread only: where the last block began
+        u32 blockFrames = 0;                // and how many frames it contributed,
+        u64 blockLength = 0;                // the track length and loop flag then; kept apart
+        bool blockLoop = false;             // from the settings a new claim overwrites
+    };
+
+    Voice voices[MAX_VOICES];
+    alignas(16) s32 accum[MAX_BLOCK_FRAMES * CHANNEL_COUNT];
+
+    // Profiling of the last block, mixOnly() calls add to the block that follows them
+    std::atomic<u64> lastMixTicks{0};
+    std::atomic<u32> lastMixVoices{0};
+    u64 pendingTicks = 0;
+    u32 pendingVoices = 0;
+
+    static constexpr u32 SLOT_BITS = 4;
+    static constexpr u32 SLOT_MASK = (1u << SLOT_BITS) - 1;
+    static constexpr u32 GENERATION_MASK = 0x07FFFFFF;
+    static_assert(MAX_VOICES <= (1u << SLOT_BITS), "voice slot does not fit in an id");
+
+    Voice* lookup(s32 id) {
+        if (id < 0) return nullptr;
+        Voice& v = voices[(u32)id & SLOT_MASK];
+        u32 generation = v.generation.load(std::memory_order_acquire);
+        return (generation == ((u32)id >> SLOT_BITS)) ? &v : nullptr;
+    }
+
+    const Voice* lookup(s32 id) const {
+        return const_cast<AudioMixer*>(this)->lookup(id);
+    }
+
+    static u32 packGains(float gain, float pan) {
+        gain = std::max(0.0f, std::min(1.0f, gain));
+        pan = std::max(-1.0f, std::min(1.0f, pan));
+        float left = gain * std::min(1.0f, 1.0f - pan);
+        float right = gain * std::min(1.0f, 1.0f + pan);
+        u32 l = (u32)(left * Q15_ONE + 0.5f);
+        u32 r = (u32)(right * Q15_ONE + 0.5f);
+        return (l << 16) | r;
+    }
+
+    static s32 scaleQ15(s32 a, s32 b) {
+        return (a * b) >> 15;
+    }
+
+    /**
+     * Mix as much of a stream voice as its stream holds. Returns false once
+     * the stream is drained.
+     */
+    bool mixStream(Voice& v, u32 frames, s16 gainL, s16 gainR) {
+        PcmStream* stream = v.stream;
+        stream->sync();
+        v.blockStart = stream->getTrackPosition();
+
+        u32 done = 0;
+        while (done < frames) {
+            const s16* span;
+            u32 chunk = stream->peek(&span, frames - done);
+            if (chunk == 0) break; // Underrun, the rest of the block stays silent
+            accumulateSpan<Output>(v.kernels, accum + done * CHANNEL_COUNT, (const u8*)span,
+                                   chunk, v.frameBytes, gainL, gainR);
+            stream->consume(chunk);
+            done += chunk;
+        }
+
+        v.blockFrames = done;
+        v.position.store(stream->getTrackPosition(), std::memory_order_relaxed);
+        return !stream->isDrained();
+    }
+
+    /**
+     * Mix one active voice into the accumulator. Returns false once a
+     * one-shot voice has played out.
+     */
+    bool mixVoice(Voice& v, u32 frames, s32 master) {
+        u32 packed = v.gains.load(std::memory_order_relaxed);
+        s16 gainL = (s16)scaleQ15((s32)(packed >> 16), master);
+        s16 gainR = (s16)scaleQ15((s32)(packed & 0xFFFF), master);
+        if (v.stream) {
+            return mixStream(v, frames, gainL, gainR);
+        }
+
+        u64 seek = v.seekRequest.exchange(NO_SEEK, std::memory_order_acq_rel);
+        u64 pos = (seek != NO_SEEK) ? std::min(seek, v.frames) : v.position.load(std::memory_order_relaxed);
+        v.blockStart = pos;
+
+        u32 done = 0;
+        while (done < frames) {
+            if (pos >= v.frames) {
+                if (!v.loop || v.frames == 0) break;
+                pos = 0;
+            }
+            u32 chunk = (u32)std::min<u64>(frames - done, v.frames - pos);
+            s32* acc = accum + done * CHANNEL_COUNT;
+            const u8* src = v.data + pos * v.frameBytes;
+
+            if (!v.kernels.frames) {
+                accumulateGeneric(acc, src, chunk, v.channels, v.format, CHANNEL_COUNT, gainL, gainR);
+            } else {
+                accumulateSpan<Output>(v.kernels, acc, src, chunk, v.frameBytes, gainL, gainR);
+            }
+            pos += chunk;
+            done += chunk;
+        }
+
+        v.blockFrames = done;
+        v.position.store(pos, std::memory_order_relaxed);
+        return v.loop || pos < v.frames;
+    }
+
+    s32 claimVoice(const void* data, PcmStream* stream, u64 frames, u32 channels, SampleFormat format,
+                   float gain, float pan, bool loop, bool paused) {
+        for (u32 i = 0; i < MAX_VOICES; i++) {
+            Voice& v = voices[i];
+            u32 expected = VoiceState_Free;
+            if (!v.state.compare_exchange_strong(expected, VoiceState_Claimed,
+                                                 std::memory_order_acquire)) {
+                continue;
+            }
+
+            u32 generation = (v.generation.load(std::memory_order_relaxed) + 1) & GENERATION_MASK;
+            v.generation.store(generation, std::memory_order_release);
+            v.data = (const u8*)data;
+            v.stream = stream;
+            v.frames = frames;
+            v.channels = channels;
+            v.format = format;
+            v.frameBytes = channels * sampleFormatSize(format);
+            v.kernels = KernelTable<Output>::select(channels, format);
+            v.loop = loop;
+            v.gains.store(packGains(gain, pan), std::memory_order_relaxed);
+            v.paused.store(paused, std::memory_order_relaxed);
+            v.position.store(0, std::memory_order_relaxed);
+            v.seekRequest.store(NO_SEEK, std::memory_order_relaxed);
+            v.state.store(VoiceState_Active, std::memory_order_release);
+            return (s32)((generation << SLOT_BITS) | i);
+        }
+        return INVALID_VOICE;
+    }
+
+    /**
+     * Sum the selected voices into out: only the one given, or all but
+     * skip. With over set the block already in out is part of the sum.
+     */
+    void mixBlock(Sample* out, u32 frames, float masterVolume, const Voice* only, const Voice* skip, bool over) {
+        u64 start = armGetSystemTick();
+        frames = std::min(frames, MAX_BLOCK_FRAMES);
+        u32 samples = frames * CHANNEL_COUNT;
+        s32 master = (s32)(std::max(0.0f, std::min(1.0f, masterVolume)) * Q15_ONE + 0.5f);
+
+        if (over) {
+            for (u32 i = 0; i < samples; i++) {
+                accum[i] = SampleTraits<Output::FORMAT>::toQ15(out[i]);
+            }
+        } else {
+            memset(accum, 0, samples * sizeof(s32));
+        }
+
+        u32 mixed = 0;
+        for (u32 i = 0; i < MAX_VOICES; i++) {
+            Voice& v = voices[i];
+            if ((only && &v != only) || &v == skip) {
+                continue;
+            }
+            u32 state = v.state.load(std::memory_order_acquire);
+
+            if (state == VoiceState_Stopping) {
+                v.state.store(VoiceState_Free, std::memory_order_release);
+                continue;
+            }
+            if (state != VoiceState_Active) {
+                continue;
+            }
+            v.blockLength = v.stream ? v.stream->getLength() : v.frames;
+            v.blockLoop = v.loop;
+            if (v.paused.load(std::memory_order_relaxed)) {
+                if (v.stream) {
+                    v.stream->sync();
+                    v.blockStart = v.stream->getTrackPosition();
+                    v.position.store(v.blockStart, std::memory_order_relaxed);
+                } else {
+                    u64 seek = v.seekRequest.load(std::memory_order_acquire);
+                    v.blockStart = (seek != NO_SEEK) ? std::min(seek, v.frames)
+                                                     : v.position.load(std::memory_order_relaxed);
+                }
+                v.blockFrames = 0;
+                continue;
+            }
+
+            if (!mixVoice(v, frames, master)) {
+                v.state.store(VoiceState_Free, std::memory_order_release);
+            }
+            mixed++;
+        }
+
+        storeSpan<Output>(out, accum, frames);
+
+        pendingTicks += armGetSystemTick() - start;
+        pendingVoices = only ? std::max(pendingVoices, mixed) : pendingVoices + mixed;
+        if (!only) {
+            lastMixVoices.store(pendingVoices, std::memory_order_relaxed);
+            lastMixTicks.store(pendingTicks, std::memory_order_relaxed);
+            pendingTicks = 0;
+            pendingVoices = 0;
+        }
+    }
+
+public:
+    AudioMixer() {
+        memset(accum, 0, sizeof(accum));
+    }
+
+    /**
+     * Start a voice from interleaved samples in any channel count and format.
+     * Returns the voice id, or INVALID_VOICE when every slot is busy.
+     */
+    s32 startVoice(const void* data, u64 frames, u32 channels, SampleFormat format,
+                   float gain = 1.0f, float pan = 0.0f, bool loop = false, bool paused = false) {
+        if (channels == 0) return INVALID_VOICE;
+        return claimVoice(data, nullptr, frames, channels, format, gain, pan, loop, paused);
+    }
+
+    /**
+     * Start a voice that plays a PcmStream. The stream must stay open until
+     * stopVoice(id, true) has returned or the voice has drained it.
+     */
+    s32 startStreamVoice(PcmStream* stream, float gain = 1.0f, float pan = 0.0f, bool paused = false) {
+        if (!stream || !stream->isOpen()) return INVALID_VOICE;
+        return claimVoice(nullptr, stream, 0, PcmStream::CHANNELS, SampleFormat_S16,
+                          gain, pan, false, paused);
+    }
+
+    /**
+     * Start a voice from interleaved stereo s16 samples
+     */
+    s32 startVoice(const s16* data, u64 frames, float gain = 1.0f, float pan = 0.0f,
+                   bool loop = false, bool paused = false) {
+        return startVoice(data, frames, 2, SampleFormat_S16, gain, pan, loop, paused);
+    }
+
+    /**
+     * Request a voice to stop. With wait set, blocks until the audio thread
+     * has released it and its sample memory may be freed.
+     */
+    void stopVoice(s32 id, bool wait = false) {
+        Voice* v = lookup(id);
+        if (!v) return;
+
+        u32 expected = VoiceState_Active;
+        if (!v->state.compare_exchange_strong(expected, VoiceState_Stopping,
+                                              std::memory_order_acq_rel)) {
+            return; // Already finished or released
+        }
+
+        if (wait) {
+            while (v->state.load(std::memory_order_acquire) != VoiceState_Free) {
+                svcSleepThread(1000000); // 1ms
+            }
+        }
+    }
+
+    void setVoiceGain(s32 id, float gain, float pan = 0.0f) {
+        if (Voice* v = lookup(id)) {
+            v->gains.store(packGains(gain, pan), std::memory_order_relaxed);
+        }
+    }
+
+    void setVoicePaused(s32 id, bool paused) {
+        if (Voice* v = lookup(id)) {
+            v->paused.store(paused, std::memory_order_relaxed);
+        }
+    }
+
+    void seekVoice(s32 id, u64 frame) {
+        if (Voice* v = lookup(id)) {
+            v->seekRequest.store(frame, std::memory_order_release);
+        }
+    }
+
+    bool isVoiceActive(s32 id) const {
+        const Voice* v = lookup(id);
+        return v && v->state.load(std::memory_order_acquire) == VoiceState_Active;
+    }
+
+    /**
+     * Current read position of a voice in frames
+     */
+    u64 getVoicePosition(s32 id) const {
+        const Voice* v = lookup(id);
+        if (!v) return 0;
+        u64 seek = v->seekRequest.load(std::memory_order_acquire);
+        return (seek != NO_SEEK) ? seek : v->position.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Audio thread: where a voice's part of the last mix() began, and how
+     * many frames it contributed (0 if paused). The length is the track's,
+     * 0 while a stream does not know it yet. False for a stale id.
+     */
+    bool getVoiceBlock(s32 id, u64* start, u32* frames, u64* length, bool* loop) const {
+        const Voice* v = lookup(id);
+        if (!v) return false;
+        *start = v->blockStart;
+        *frames = v->blockFrames;
+        *length = v->blockLength;
+        *loop = v->blockLoop;
+        return true;
+    }
+
+    /**
+     * True if at least one voice would contribute to the next block
+     */
+    bool hasAudibleVoices() const {
+        for (u32 i = 0; i < MAX_VOICES; i++) {
+            if (voices[i].state.load(std::memory_order_acquire) == VoiceState_Active &&
+                !voices[i].paused.load(std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Release voices whose stop was requested and let paused stream voices
+     * drop data a seek replaced. mix() does this as well; the audio thread
+     * calls it directly while idle.
+     */
+    void collect() {
+        for (u32 i = 0; i < MAX_VOICES; i++) {
+            Voice& v = voices[i];
+            u32 state = v.state.load(std::memory_order_acquire);
+            if (state == VoiceState_Stopping) {
+                v.state.store(VoiceState_Free, std::memory_order_release);
+            } else if (state == VoiceState_Active && v.stream) {
+                v.stream->sync();
+                v.position.store(v.stream->getTrackPosition(), std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Render one block of interleaved output frames. Audio thread only.
+     */
+    void mix(Sample* out, u32 frames, float masterVolume) {
+        mixBlock(out, frames, masterVolume, nullptr, nullptr, false);
+    }
+
+    /**
+     * Render one voice alone, silence if the id is stale. For a voice that
+     * goes through processing the rest of the mix must not, such as the
+     * music voice through the time stretcher. Audio thread only.
+     */
+    void mixOnly(s32 id, Sample* out, u32 frames, float masterVolume) {
+        const Voice* v = lookup(id);
+        if (!v) {
+            memset(out, 0, std::min(frames, MAX_BLOCK_FRAMES) * CHANNEL_COUNT * sizeof(Sample));
+            return;
+        }
+        mixBlock(out, frames, masterVolume, v, nullptr, false);
+    }
+
+    /**
+     * Add every voice except one onto the block already in out, saturating
+     * the sum once. Completes a block whose excluded voice was rendered
+     * with mixOnly(). Audio thread only.
+     */
+    void mixOver(Sample* out, u32 frames, float masterVolume, s32 excludeId) {
+        mixBlock(out, frames, masterVolume, nullptr, lookup(excludeId), true);
+    }
+
+    /**
+     * System ticks spent on the last block and how many voices it summed
+     */
+    u64 getLastMixTicks() const { return lastMixTicks.load(std::memory_order_relaxed); }
+    u32 getLastMixVoices() const { return lastMixVoices.load(std::memory_order_relaxed); }
+};
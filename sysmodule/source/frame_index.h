@@ -0,0 +1,522 @@
+#pragma once
+#include <switch.h>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "trace.h"
+
+/**
+ * Per-track seek index
+ *
+ * One entry per MP3 audio frame or Ogg page, mapping the first decoder
+ * sample it produces to its byte offset. A seek is a binary search plus
+ * decoding forward from one entry before the target (MP3 bit reservoir,
+ * Vorbis overlap), regardless of file length. Entries are 8 bytes, about
+ * 80KB for a four minute MP3.
+ *
+ * MP3 sample numbers count every decoded sample; getDelay() of them come
+ * before the first sample of the track (LAME encoder delay plus the 529
+ * samples of decoder delay), and the padding at the end is left out of
+ * getTotalSamples(). The Xing/Info frame carrying that tag is not audio and
+ * gets no entry. Ogg entries use the granule of the page before, which is
+ * where the page's own samples begin.
+ *
+ * Indexes are built by scanning headers only (no decode) and are cached on
+ * the SD card so a track is scanned once. FrameIndexScan runs that scan
+ * next to playback.
+ */
+class FrameIndex {
+public:
+    enum Format : u32 {
+        Format_Unknown = 0,
+        Format_Mp3 = 1,
+        Format_Ogg = 2
+    };
+
+    struct Entry {
+        u32 byteOffset;
+        u32 firstSample;
+    };
+
+    struct SeekPoint {
+        u64 byteOffset;    // Where the decoder restarts
+        u64 frameSample;   // Decoder sample the target's frame or page starts at
+        u32 skipSamples;   // Decoded samples to drop from there to land on the target
+        u32 primingFrames; // Frames or pages decoded and discarded before it
+    };
+
+    static constexpr const char* CACHE_DIR = "sdmc:/config/xmusic/index";
+
+private:
+    static constexpr u32 CACHE_MAGIC = 0x58494D58; // "XMIX"
+    static constexpr u32 CACHE_VERSION = 2;
+    static constexpr u32 MIN_ENTRY_BYTES = 24;     // Smallest MP3 frame; an Ogg page is 27+
+    static constexpr u32 MP3_DECODER_DELAY = 529;
+
+    struct CacheHeader {
+        u32 magic;
+        u32 version;
+        u32 format;
+        u32 sampleRate;
+        u64 fileSize;
+        u64 totalSamples;
+        u32 entryCount;
+        u32 delay;
+    };
+
+    Format m_format = Format_Unknown;
+    u32 m_sampleRate = 0;
+    u32 m_delay = 0;
+    u64 m_fileSize = 0;
+    u64 m_totalSamples = 0;
+    std::vector<Entry> m_entries;
+
+    static u32 readBE32(const u8* p) {
+        return ((u32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    }
+
+    static u32 readLE32(const u8* p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+    }
+
+    static u64 readLE64(const u8* p) {
+        return readLE32(p) | ((u64)readLE32(p + 4) << 32);
+    }
+
+    /**
+     * Decode an MPEG audio frame header.
+     * Returns the frame length in bytes, 0 if this is not a valid header.
+     */
+    static u32 parseMp3Header(const u8* h, u32* sampleRate, u32* samplesPerFrame) {
+        static const u16 bitratesV1L3[16] = {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0};
+        static const u16 bitratesV2L3[16] = {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0};
+        static const u16 rates[3] = {44100, 48000, 32000};
+
+        if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0) return 0;
+
+        u32 version = (h[1] >> 3) & 3;   // 3 = MPEG1, 2 = MPEG2, 0 = MPEG2.5
+        u32 layer = (h[1] >> 1) & 3;     // 1 = Layer III
+        u32 bitrateIdx = (h[2] >> 4) & 15;
+        u32 rateIdx = (h[2] >> 2) & 3;
+        u32 padding = (h[2] >> 1) & 1;
+
+        if (version == 1 || layer != 1 || rateIdx == 3) return 0;
+
+        bool mpeg1 = version == 3;
+        u32 bitrate = (mpeg1 ? bitratesV1L3 : bitratesV2L3)[bitrateIdx] * 1000;
+        if (bitrate == 0) return 0;
+
+        u32 rate = rates[rateIdx] >> (mpeg1 ? 0 : (version == 2 ? 1 : 2));
+        u32 spf = mpeg1 ? 1152 : 576;
+
+        *sampleRate = rate;
+        *samplesPerFrame = spf;
+        return (spf / 8) * bitrate / rate + padding;
+    }
+
+    /**
+     * Where a Xing/Info tag would start in a frame: after the header and
+     * the side information, whose size depends on version and channel mode
+     */
+    static u32 xingOffset(const u8* h) {
+        bool mpeg1 = ((h[1] >> 3) & 3) == 3;
+        bool mono = (h[3] >> 6) == 3;
+        return 4 + (mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17));
+    }
+
+    /**
+     * Check a frame for a Xing/Info or VBRI tag, which marks it as metadata
+     * rather than audio. A LAME extension carries the encoder delay and
+     * padding; they are set to 0 when it is missing.
+     */
+    static bool parseInfoFrame(const u8* frame, u32 length, u32* delay, u32* padding) {
+        *delay = 0;
+        *padding = 0;
+        if (length >= 4 + 32 + 26 && memcmp(frame + 4 + 32, "VBRI", 4) == 0) {
+            return true;
+        }
+
+        u32 pos = xingOffset(frame);
+        if (pos + 8 > length ||
+            (memcmp(frame + pos, "Xing", 4) != 0 && memcmp(frame + pos, "Info", 4) != 0)) {
+            return false;
+        }
+        u32 flags = readBE32(frame + pos + 4);
+        pos += 8;
+        if (flags & 1) pos += 4;    // Frame count
+        if (flags & 2) pos += 4;    // Byte count
+        if (flags & 4) pos += 100;  // Seek TOC
+        if (flags & 8) pos += 4;    // Quality
+
+        // LAME tag: 9 bytes of encoder version, 12 bytes of settings, then
+        // 12 bits of delay and 12 bits of padding
+        if (pos + 24 <= length) {
+            const u8* lame = frame + pos;
+            if (memcmp(lame, "LAME", 4) == 0 || memcmp(lame, "Lavc", 4) == 0 ||
+                memcmp(lame, "Lavf", 4) == 0) {
+                *delay = ((u32)lame[21] << 4) | (lame[22] >> 4);
+                *padding = ((u32)(lame[22] & 0x0F) << 8) | lame[23];
+            }
+        }
+        return true;
+    }
+
+    static bool cancelled(const std::atomic<bool>* cancel) {
+        return cancel && cancel->load(std::memory_order_relaxed);
+    }
+
+    Result scanMp3(FILE* f, const std::atomic<bool>* cancel) {
+        // Headers are read through a window so a scan is a few large reads
+        static constexpr u32 WINDOW_SIZE = 0x8000;
+        std::vector<u8> window(WINDOW_SIZE);
+        u64 windowStart = 0;
+        u32 windowLen = 0;
+
+        auto fetch = [&](u64 offset, u32 size) -> const u8* {
+            if (offset < windowStart || offset + size > windowStart + windowLen) {
+                fseeko(f, (off_t)offset, SEEK_SET);
+                windowStart = offset;
+                windowLen = (u32)fread(window.data(), 1, WINDOW_SIZE, f);
+                if (windowLen < size) return nullptr;
+            }
+            return window.data() + (offset - windowStart);
+        };
+
+        u64 offset = 0;
+
+        // Skip an ID3v2 tag
+        const u8* h = fetch(0, 10);
+        if (h && memcmp(h, "ID3", 3) == 0) {
+            offset = 10 + (((u32)(h[6] & 0x7F) << 21) | ((h[7] & 0x7F) << 14) |
+                           ((h[8] & 0x7F) << 7) | (h[9] & 0x7F));
+            if (h[5] & 0x10) offset += 10; // Footer
+        }
+
+        u64 sample = 0;
+        u32 padding = 0;
+        bool first = true;
+        while (offset + 4 <= m_fileSize) {
+            if (cancelled(cancel)) return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+            h = fetch(offset, 4);
+            if (!h) break;
+
+            u32 rate, spf;
+            u32 length = parseMp3Header(h, &rate, &spf);
+            if (length == 0) {
+                offset++; // Resync on garbage between frames
+                continue;
+            }
+
+            if (first) {
+                first = false;
+                const u8* frame = fetch(offset, std::min<u64>(length, m_fileSize - offset));
+                u32 encoderDelay;
+                if (frame && parseInfoFrame(frame, (u32)std::min<u64>(length, m_fileSize - offset),
+                                            &encoderDelay, &padding)) {
+                    // Decoders output the tag frame as nothing, and trim the
+                    // delay only when the tag announces it
+                    if (encoderDelay || padding) m_delay = encoderDelay + MP3_DECODER_DELAY;
+                    offset += length;
+                    continue;
+                }
+            }
+
+            if (m_sampleRate == 0) m_sampleRate = rate;
+            m_entries.push_back({(u32)offset, (u32)sample});
+            sample += spf;
+            offset += length;
+        }
+
+        // The padding is trimmed from the end, which the decoder delay shifts back
+        u64 end = sample;
+        if (m_delay) {
+            u64 shifted = sample + MP3_DECODER_DELAY;
+            end = std::min<u64>(sample, shifted > padding ? shifted - padding : 0);
+        }
+        m_totalSamples = end > m_delay ? end - m_delay : 0;
+        return m_entries.empty() ? MAKERESULT(Module_Libnx, LibnxError_BadInput) : 0;
+    }
+
+    Result scanOgg(FILE* f, const std::atomic<bool>* cancel) {
+        u8 page[27];
+        u8 segments[255];
+        u64 offset = 0;
+        u64 lastGranule = 0;
+
+        while (offset + 27 <= m_fileSize) {
+            if (cancelled(cancel)) return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+            fseeko(f, (off_t)offset, SEEK_SET);
+            if (fread(page, 1, 27, f) != 27 || memcmp(page, "OggS", 4) != 0) break;
+
+            u32 segCount = page[26];
+            if (fread(segments, 1, segCount, f) != segCount) break;
+
+            u32 bodySize = 0;
+            for (u32 i = 0; i < segCount; i++) bodySize += segments[i];
+
+            // Granule is the end sample of the page, -1 when no packet ends here
+            u64 granule = readLE64(page + 6);
+            if (granule != ~0ULL && granule > lastGranule) {
+                m_entries.push_back({(u32)offset, (u32)lastGranule});
+                lastGranule = granule;
+            }
+
+            // Vorbis identification header carries the sample rate
+            if (m_sampleRate == 0 && segCount > 0 && bodySize >= 16) {
+                u8 id[16];
+                if (fread(id, 1, 16, f) == 16 && memcmp(id + 1, "vorbis", 6) == 0 && id[0] == 1) {
+                    m_sampleRate = readLE32(id + 12);
+                }
+            }
+
+            offset += 27 + segCount + bodySize;
+        }
+
+        m_totalSamples = lastGranule;
+        return m_entries.empty() ? MAKERESULT(Module_Libnx, LibnxError_BadInput) : 0;
+    }
+
+    static void cachePath(const char* trackPath, u64 fileSize, char* out, size_t outSize) {
+        // FNV-1a over path and size, so a replaced file gets a new index
+        u64 hash = 0xcbf29ce484222325ULL;
+        for (const char* p = trackPath; *p; p++) {
+            hash = (hash ^ (u8)*p) * 0x100000001b3ULL;
+        }
+        hash = (hash ^ fileSize) * 0x100000001b3ULL;
+        snprintf(out, outSize, "%s/%016llx.idx", CACHE_DIR, (unsigned long long)hash);
+    }
+
+public:
+    void clear() {
+        m_format = Format_Unknown;
+        m_sampleRate = 0;
+        m_delay = 0;
+        m_fileSize = 0;
+        m_totalSamples = 0;
+        m_entries.clear();
+    }
+
+    /**
+     * Scan a track's headers and build its index. A scan stops early, and
+     * fails, once cancel is set.
+     */
+    Result build(const char* path, const std::atomic<bool>* cancel = nullptr) {
+        clear();
+
+        FILE* f = fopen(path, "rb");
+        if (!f) return MAKERESULT(Module_Libnx, LibnxError_NotFound);
+
+        fseeko(f, 0, SEEK_END);
+        m_fileSize = (u64)ftello(f);
+        fseeko(f, 0, SEEK_SET);
+
+        u8 magic[4] = {};
+        fread(magic, 1, 4, f);
+        fseeko(f, 0, SEEK_SET);
+
+        Result rc;
+        if (memcmp(magic, "OggS", 4) == 0) {
+            m_format = Format_Ogg;
+            rc = scanOgg(f, cancel);
+        } else {
+            m_format = Format_Mp3;
+            rc = scanMp3(f, cancel);
+        }
+
+        fclose(f);
+        if (R_FAILED(rc)) clear();
+        return rc;
+    }
+
+    /**
+     * Find where to restart decoding for a sample-accurate seek
+     */
+    bool find(u64 sample, SeekPoint* out) const {
+        if (m_entries.empty()) return false;
+
+        u64 raw = std::min(sample, m_totalSamples) + m_delay;
+        auto it = std::upper_bound(m_entries.begin(), m_entries.end(), raw,
+                                   [](u64 s, const Entry& e) { return s < e.firstSample; });
+        size_t idx = (it == m_entries.begin()) ? 0 : (size_t)(it - m_entries.begin()) - 1;
+
+        // MP3 frames may borrow bits from the previous frame, and a Vorbis
+        // packet overlaps the one before it, so prime with one entry back
+        u32 priming = (idx > 0) ? 1 : 0;
+        const Entry& start = m_entries[idx - priming];
+
+        out->byteOffset = start.byteOffset;
+        out->frameSample = m_entries[idx].firstSample;
+        out->skipSamples = (u32)(raw - m_entries[idx].firstSample);
+        out->primingFrames = priming;
+        return true;
+    }
+
+    /**
+     * Load the cached index for a track. Fails if there is none or the track
+     * changed size since it was written. One read after the header.
+     */
+    Result loadCache(const char* trackPath, u64 fileSize) {
+        clear();
+
+        char path[256];
+        cachePath(trackPath, fileSize, path, sizeof(path));
+        FILE* f = fopen(path, "rb");
+        if (!f) return MAKERESULT(Module_Libnx, LibnxError_NotFound);
+
+        fseeko(f, 0, SEEK_END);
+        u64 cacheSize = (u64)ftello(f);
+        fseeko(f, 0, SEEK_SET);
+
+        // A damaged header must not size the allocation: the entry count has
+        // to match the cache file and fit in the track
+        CacheHeader header;
+        bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+                  header.magic == CACHE_MAGIC && header.version == CACHE_VERSION &&
+                  header.fileSize == fileSize &&
+                  (header.format == Format_Mp3 || header.format == Format_Ogg) &&
+                  header.entryCount > 0 && header.entryCount <= fileSize / MIN_ENTRY_BYTES + 1 &&
+                  cacheSize == sizeof(header) + (u64)header.entryCount * sizeof(Entry);
+        if (ok) {
+            m_entries.resize(header.entryCount);
+            ok = fread(m_entries.data(), sizeof(Entry), header.entryCount, f) == header.entryCount;
+        }
+        fclose(f);
+
+        if (!ok) {
+            clear();
+            return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+        }
+
+        m_format = (Format)header.format;
+        m_sampleRate = header.sampleRate;
+        m_delay = header.delay;
+        m_fileSize = header.fileSize;
+        m_totalSamples = header.totalSamples;
+        return 0;
+    }
+
+    Result saveCache(const char* trackPath) const {
+        if (m_entries.empty()) return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+
+        mkdir(CACHE_DIR, 0777);
+
+        char path[256];
+        cachePath(trackPath, m_fileSize, path, sizeof(path));
+        FILE* f = fopen(path, "wb");
+        if (!f) return MAKERESULT(Module_Libnx, LibnxError_NotFound);
+
+        CacheHeader header = {CACHE_MAGIC, CACHE_VERSION, m_format, m_sampleRate,
+                              m_fileSize, m_totalSamples, (u32)m_entries.size(), m_delay};
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                  fwrite(m_entries.data(), sizeof(Entry), m_entries.size(), f) == m_entries.size();
+        fclose(f);
+        return ok ? 0 : MAKERESULT(Module_Libnx, LibnxError_IoError);
+    }
+
+    /**
+     * Load the cached index of a track as it is now on the card
+     */
+    Result openCached(const char* trackPath, u64* sizeOut = nullptr) {
+        FILE* f = fopen(trackPath, "rb");
+        if (!f) return MAKERESULT(Module_Libnx, LibnxError_NotFound);
+        fseeko(f, 0, SEEK_END);
+        u64 size = (u64)ftello(f);
+        fclose(f);
+        if (sizeOut) *sizeOut = size;
+        return loadCache(trackPath, size);
+    }
+
+    /**
+     * Cached index if present, otherwise scan and cache it
+     */
+    Result open(const char* trackPath, const std::atomic<bool>* cancel = nullptr) {
+        u64 size = 0;
+        Result rc = openCached(trackPath, &size);
+        if (R_SUCCEEDED(rc) || size == 0) return rc;
+
+        XMUSIC_TRACE_SCOPE(TraceId_IndexBuild, (u32)(size >> 10));
+        rc = build(trackPath, cancel);
+        if (R_SUCCEEDED(rc)) saveCache(trackPath);
+        return rc;
+    }
+
+    Format getFormat() const { return m_format; }
+    u32 getSampleRate() const { return m_sampleRate; }
+    u32 getDelay() const { return m_delay; }
+    u64 getTotalSamples() const { return m_totalSamples; }
+    size_t getEntryCount() const { return m_entries.size(); }
+    const Entry* getEntries() const { return m_entries.data(); }
+};
+
+/**
+ * Builds a track's index on its own thread
+ *
+ * A scan reads every frame header of the file, which on the SD card takes
+ * long enough to hold up the first sample of a long track. start() loads a
+ * cached index straight away; without one it scans in the background and
+ * caches the result, and the decode thread picks it up with take() while
+ * it plays. Until then decoders seek without an index.
+ */
+class FrameIndexScan {
+private:
+    std::thread m_thread;
+    std::atomic<bool> m_cancel{false};
+    std::atomic<bool> m_ready{false};
+    FrameIndex m_result;
+    char m_path[256] = {};
+
+    void scanThreadFunc() {
+        XMUSIC_TRACE_THREAD("index");
+        if (R_FAILED(m_result.open(m_path, &m_cancel))) {
+            m_result.clear();
+        }
+        m_ready.store(true, std::memory_order_release);
+    }
+
+public:
+    ~FrameIndexScan() {
+        stop();
+    }
+
+    /**
+     * True if index now holds the cached index. Otherwise a scan has
+     * started, or the track cannot be read.
+     */
+    bool start(const char* trackPath, FrameIndex* index) {
+        stop();
+        if (R_SUCCEEDED(index->openCached(trackPath))) return true;
+
+        snprintf(m_path, sizeof(m_path), "%s", trackPath);
+        m_cancel = false;
+        m_thread = std::thread(&FrameIndexScan::scanThreadFunc, this);
+        return false;
+    }
+
+    /**
+     * Move a finished scan into index. False while it runs, when it failed
+     * and when there is none.
+     */
+    bool take(FrameIndex* index) {
+        if (!m_ready.exchange(false, std::memory_order_acquire)) return false;
+        bool ok = m_result.getEntryCount() > 0;
+        if (ok) *index = std::move(m_result);
+        m_result.clear();
+        return ok;
+    }
+
+    /**
+     * Cancel a running scan and wait for its thread
+     */
+    void stop() {
+        m_cancel = true;
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+        m_ready = false;
+        m_result.clear();
+    }
+};
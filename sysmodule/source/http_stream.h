@@ -0,0 +1,732 @@
+#pragma once
+#include <switch.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "trace.h"
+#include "track_decoder.h"
+#include "xmusic_ipc.h"
+
+/**
+ * HTTP stream source with an adaptive jitter buffer
+ *
+ * A network thread downloads the URL into a ring buffer that the decoder
+ * reads from. Reading returns nothing until the low watermark is buffered,
+ * then data flows until the buffer runs dry, which counts as a rebuffer.
+ * After a rebuffer, playback resumes at the target level, which grows with
+ * the observed variance of the download throughput: a steady connection
+ * keeps latency low, a bursty one buffers more.
+ *
+ * Dropped connections resume with a Range request from the last byte
+ * received. Requests are HTTP/1.0, so bodies are never chunked. Name
+ * lookup and connect run against connectTimeoutMs and the socket is
+ * published before connecting, so close() never waits on the network.
+ * A stream has at most one name lookup in flight and keeps the address it
+ * got, so resuming after a drop does not look the name up again.
+ * Redirects may be relative; a redirect to https or another scheme we
+ * cannot follow fails the stream at once instead of being retried.
+ *
+ * There is no TLS client in the sysmodule: open() refuses https:// URLs
+ * with XMusicError_Unsupported.
+ */
+class HttpStream {
+public:
+    enum State : u32 {
+        State_Idle = 0,
+        State_Connecting,
+        State_Buffering,
+        State_Playing,
+        State_Finished,
+        State_Failed
+    };
+
+    struct Config {
+        u32 lowWatermarkBytes = 0x10000;    // Buffered before the first sample
+        u32 capacityBytes = 0x40000;        // Ring buffer size
+        u32 consumptionBps = 40000;         // Decoder input rate, 320kbps until told otherwise
+        u32 maxRetries = 5;                 // Consecutive failed reconnects before giving up
+        u32 stallTimeoutMs = 5000;          // Receive stall that triggers a reconnect
+        u32 connectTimeoutMs = 5000;        // Name lookup plus TCP connect
+    };
+
+    struct Stats {
+        u64 timeToFirstSampleNs;
+        u64 bytesReceived;
+        u32 rebufferCount;
+        u32 reconnectCount;
+        u32 lookupCount;        // Name lookups started, one per host unless a connect fails
+        u32 targetBytes;
+        float throughputMeanBps;
+        float throughputStddevBps;
+    };
+
+private:
+    static constexpr u32 RECV_SIZE = 0x1000;
+    static constexpr u32 HEADER_MAX = 0x1000;
+    static constexpr u32 MAX_REDIRECTS = 3;
+    static constexpr u64 SAMPLE_WINDOW_NS = 100000000ULL;  // Throughput sample every 100ms
+    static constexpr float EWMA_ALPHA = 0.125f;
+    static constexpr float BASE_SECONDS = 1.0f;
+    static constexpr float VARIANCE_SECONDS = 4.0f;        // Extra buffer per unit of throughput CV
+    static constexpr u64 POLL_SLICE_MS = 100;              // How often a connect checks for close()
+
+    enum RequestError : int {
+        RequestError_Retry = -1,        // Network trouble, try again
+        RequestError_Fatal = -2         // Retrying cannot help
+    };
+
+    // Name lookup handed to a helper thread, which may outlive the request
+    struct Lookup {
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::string host;
+        bool done = false;
+        bool ok = false;
+        sockaddr_in addr = {};
+    };
+
+    Config m_config;
+    std::string m_host;
+    std::string m_port;
+    std::string m_path;
+
+    // Network thread only: the lookup in flight or last finished, and the
+    // address it gave for m_addressHost
+    std::shared_ptr<Lookup> m_lookup;
+    std::string m_addressHost;
+    in_addr m_address = {};
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_spaceCond;
+    std::atomic<bool> m_stop{false};
+    std::atomic<int> m_socket{-1};
+
+    // Ring buffer, guarded by m_mutex
+    std::vector<u8> m_ring;
+    u32 m_readPos = 0;
+    u32 m_level = 0;
+    bool m_eof = false;
+
+    State m_state = State_Idle;
+    bool m_started = false;
+    u64 m_openTick = 0;
+    u64 m_received = 0;      // Body bytes received so far, the resume offset
+    u64 m_contentLength = 0; // 0 when the server did not say
+    Stats m_stats = {};
+
+    // Throughput estimate; the window is network thread only, mean/variance under m_mutex
+    u64 m_windowStart = 0;
+    u64 m_windowBytes = 0;
+    float m_meanBps = 0.0f;
+    float m_varBps = 0.0f;
+
+    static u64 nowNs() {
+        return armTicksToNs(armGetSystemTick());
+    }
+
+    bool parseUrl(const char* url) {
+        const char* p = url;
+        if (strncmp(p, "http://", 7) != 0) return false;
+        p += 7;
+
+        const char* slash = strchr(p, '/');
+        std::string hostPort = slash ? std::string(p, slash - p) : std::string(p);
+        m_path = slash ? std::string(slash) : std::string("/");
+
+        size_t colon = hostPort.find(':');
+        m_host = hostPort.substr(0, colon);
+        m_port = (colon == std::string::npos) ? std::string("80") : hostPort.substr(colon + 1);
+        return !m_host.empty();
+    }
+
+    /**
+     * Follow a Location header: absolute http URLs, scheme-relative,
+     * host-relative and path-relative references. False for any other
+     * scheme, https included.
+     */
+    bool followLocation(const std::string& location) {
+        if (location.empty()) return false;
+
+        size_t colon = location.find(':');
+        size_t slash = location.find('/');
+        if (colon != std::string::npos && (slash == std::string::npos || colon < slash)) {
+            return parseUrl(location.c_str()); // Has a scheme, only http:// parses
+        }
+        if (location.compare(0, 2, "//") == 0) {
+            return parseUrl(("http:" + location).c_str());
+        }
+        if (location[0] == '/') {
+            m_path = location;
+            return true;
+        }
+
+        // Relative to the directory of the current path, query dropped
+        std::string base = m_path.substr(0, m_path.find('?'));
+        m_path = base.substr(0, base.rfind('/') + 1) + location;
+        return true;
+    }
+
+    /**
+     * Start looking up m_host on a detached thread, so a resolver that
+     * hangs costs that thread, not this one
+     */
+    void startLookup() {
+        m_lookup = std::make_shared<Lookup>();
+        m_lookup->host = m_host;
+        std::shared_ptr<Lookup> lookup = m_lookup;
+        std::thread([lookup] {
+            addrinfo hints = {};
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo* res = nullptr;
+            bool ok = getaddrinfo(lookup->host.c_str(), nullptr, &hints, &res) == 0 && res;
+
+            std::lock_guard<std::mutex> lock(lookup->mutex);
+            if (ok) lookup->addr = *(const sockaddr_in*)res->ai_addr;
+            lookup->ok = ok;
+            lookup->done = true;
+            lookup->cond.notify_all();
+            if (res) freeaddrinfo(res);
+        }).detach();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.lookupCount++;
+    }
+
+    /**
+     * Resolve the host before the deadline. Numeric addresses skip the
+     * resolver and a host already resolved reuses its address. A lookup
+     * still running from an earlier attempt is waited on again rather
+     * than joined by a second one, so retries never pile up threads.
+     */
+    bool resolve(u64 deadlineNs, sockaddr_in* out) {
+        *out = {};
+        out->sin_family = AF_INET;
+        out->sin_port = htons((u16)atoi(m_port.c_str()));
+        if (inet_pton(AF_INET, m_host.c_str(), &out->sin_addr) == 1) {
+            return true;
+        }
+        if (m_addressHost == m_host) {
+            out->sin_addr = m_address;
+            return true;
+        }
+
+        while (!m_stop) {
+            if (!m_lookup) startLookup();
+            Lookup& lookup = *m_lookup;
+            std::unique_lock<std::mutex> lock(lookup.mutex);
+            while (!lookup.done && !m_stop && nowNs() < deadlineNs) {
+                lookup.cond.wait_for(lock, std::chrono::milliseconds(POLL_SLICE_MS));
+            }
+            if (!lookup.done) return false;     // Still running, the next attempt waits on it
+
+            bool current = lookup.host == m_host;
+            bool ok = lookup.ok;
+            sockaddr_in addr = lookup.addr;
+            lock.unlock();
+            m_lookup.reset();
+            if (!current) continue;             // Finished a lookup for the host before a redirect
+            if (!ok) return false;
+
+            m_addressHost = m_host;
+            m_address = addr.sin_addr;
+            out->sin_addr = m_address;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Non-blocking connect, polled in slices so close() can cut it short.
+     * The socket is published first, so close() can shut it down.
+     */
+    int connectTo(const sockaddr_in& addr, u64 deadlineNs) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        m_socket = fd;
+        if (m_stop) {
+            closeSocket();
+            return -1;
+        }
+
+        int flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        bool ok = connect(fd, (const sockaddr*)&addr, sizeof(addr)) == 0;
+        if (!ok && errno == EINPROGRESS) {
+            while (!m_stop) {
+                u64 now = nowNs();
+                if (now >= deadlineNs) break;
+                pollfd pfd = {fd, POLLOUT, 0};
+                int wait = (int)std::min<u64>(POLL_SLICE_MS, (deadlineNs - now) / 1000000 + 1);
+                int n = poll(&pfd, 1, wait);
+                if (n < 0) break;
+                if (n > 0) {
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    ok = getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+                    break;
+                }
+            }
+        }
+        if (!ok || m_stop) {
+            closeSocket();
+            return -1;
+        }
+        fcntl(fd, F_SETFL, flags);
+        return fd;
+    }
+
+    bool sendAll(int fd, const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = send(fd, data, size, 0);
+            if (n <= 0) return false;
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    /**
+     * Connect and send a GET from rangeStart. On success returns the socket
+     * and leaves any body bytes that arrived with the header in body.
+     */
+    int request(u64 rangeStart, std::vector<u8>& body, int* status, u64* contentLength, std::string* location) {
+        u64 deadline = nowNs() + (u64)m_config.connectTimeoutMs * 1000000;
+        sockaddr_in addr;
+        if (!resolve(deadline, &addr)) return RequestError_Retry;
+        int fd = connectTo(addr, deadline);
+        if (fd < 0) {
+            m_addressHost.clear(); // The host may have moved, look it up again next time
+            return RequestError_Retry;
+        }
+
+        timeval tv = {(time_t)(m_config.stallTimeoutMs / 1000), (suseconds_t)((m_config.stallTimeoutMs % 1000) * 1000)};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        char req[512];
+        int len = snprintf(req, sizeof(req),
+                           "GET %s HTTP/1.0\r\nHost: %s\r\nUser-Agent: XMusic\r\n"
+                           "Range: bytes=%llu-\r\nConnection: close\r\n\r\n",
+                           m_path.c_str(), m_host.c_str(), (unsigned long long)rangeStart);
+        if (len <= 0 || len >= (int)sizeof(req)) {
+            closeSocket();
+            return RequestError_Fatal; // Path too long for the request line
+        }
+        if (!sendAll(fd, req, len)) {
+            closeSocket();
+            return RequestError_Retry;
+        }
+
+        // Read until the end of the header
+        std::vector<u8> header;
+        header.reserve(HEADER_MAX);
+        u8 buf[RECV_SIZE];
+        size_t headerEnd = 0;
+        while (headerEnd == 0) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0 || header.size() + n > HEADER_MAX * 4) {
+                closeSocket();
+                return RequestError_Retry;
+            }
+            header.insert(header.end(), buf, buf + n);
+            for (size_t i = 3; i < header.size(); i++) {
+                if (memcmp(&header[i - 3], "\r\n\r\n", 4) == 0) {
+                    headerEnd = i + 1;
+                    break;
+                }
+            }
+        }
+
+        body.assign(header.begin() + headerEnd, header.end());
+        std::string text((const char*)header.data(), headerEnd);
+
+        *status = 0;
+        sscanf(text.c_str(), "HTTP/%*d.%*d %d", status);
+        *contentLength = 0;
+        location->clear();
+
+        size_t pos = 0;
+        while ((pos = text.find("\r\n", pos)) != std::string::npos) {
+            pos += 2;
+            const char* line = text.c_str() + pos;
+            if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                *contentLength = strtoull(line + 15, nullptr, 10);
+            } else if (strncasecmp(line, "Location:", 9) == 0) {
+                size_t end = text.find("\r\n", pos);
+                std::string value = text.substr(pos + 9, end - pos - 9);
+                value.erase(0, value.find_first_not_of(' '));
+                *location = value;
+            }
+        }
+        return fd;
+    }
+
+    void closeSocket() {
+        int fd = m_socket.exchange(-1);
+        if (fd >= 0) {
+            shutdown(fd, SHUT_RDWR);
+            ::close(fd);
+        }
+    }
+
+    void recordThroughput(size_t bytes, u64 now) {
+        m_windowBytes += bytes;
+        u64 elapsed = now - m_windowStart;
+        if (elapsed < SAMPLE_WINDOW_NS) return;
+
+        float sample = (float)m_windowBytes * 1e9f / (float)elapsed;
+        m_windowStart = now;
+        m_windowBytes = 0;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_meanBps == 0.0f) {
+            m_meanBps = sample;
+        } else {
+            float diff = sample - m_meanBps;
+            m_meanBps += EWMA_ALPHA * diff;
+            m_varBps = (1.0f - EWMA_ALPHA) * (m_varBps + EWMA_ALPHA * diff * diff);
+        }
+        m_stats.throughputMeanBps = m_meanBps;
+        m_stats.throughputStddevBps = sqrtf(m_varBps);
+        m_stats.targetBytes = computeTarget();
+    }
+
+    // Caller holds m_mutex
+    u32 computeTarget() const {
+        float cv = (m_meanBps > 0.0f) ? sqrtf(m_varBps) / m_meanBps : 1.0f;
+        float seconds = BASE_SECONDS + VARIANCE_SECONDS * cv;
+        u32 target = (u32)(seconds * m_config.consumptionBps);
+        return std::max(m_config.lowWatermarkBytes, std::min(target, m_config.capacityBytes));
+    }
+
+    /**
+     * Copy body bytes into the ring, waiting for space. Bytes before skip
+     * are dropped (server ignored our Range header).
+     */
+    bool push(const u8* data, size_t size, u64& skip) {
+        if (skip) {
+            size_t n = (size_t)std::min<u64>(skip, size);
+            data += n;
+            size -= n;
+            skip -= n;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (size > 0) {
+            m_spaceCond.wait(lock, [&] { return m_stop || m_level < m_ring.size(); });
+            if (m_stop) return false;
+
+            u32 cap = (u32)m_ring.size();
+            u32 writePos = (m_readPos + m_level) % cap;
+            size_t n = std::min(size, (size_t)std::min(cap - m_level, cap - writePos));
+            memcpy(&m_ring[writePos], data, n);
+            m_level += n;
+            m_received += n;
+            m_stats.bytesReceived += n;
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    void netThreadFunc() {
+        XMUSIC_TRACE_THREAD("net");
+        u32 failures = 0;
+        u32 redirects = 0;
+
+        while (!m_stop) {
+            u64 resumeAt;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                resumeAt = m_received;
+            }
+
+            std::vector<u8> body;
+            int status;
+            u64 contentLength;
+            std::string location;
+            int fd;
+            {
+                XMUSIC_TRACE_SCOPE(TraceId_HttpConnect, (u32)(resumeAt >> 10));
+                fd = request(resumeAt, body, &status, &contentLength, &location);
+            }
+
+            bool redirect = fd >= 0 && (status == 301 || status == 302 || status == 303 ||
+                                        status == 307 || status == 308);
+            if (redirect) {
+                closeSocket();
+                if (redirects < MAX_REDIRECTS && followLocation(location)) {
+                    redirects++;
+                    continue;
+                }
+                fd = RequestError_Fatal; // Loop, or a scheme we cannot follow
+            }
+
+            if (fd < 0 || (status != 200 && status != 206)) {
+                closeSocket();
+                if (m_stop) break;
+                bool fatal = fd == RequestError_Fatal || (fd >= 0 && status >= 400 && status < 500);
+                if (fatal || ++failures > m_config.maxRetries) {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_state = State_Failed;
+                    break;
+                }
+                // Back off 250ms per attempt, in slices so close() is not held up
+                for (u32 i = 0; i < failures * 5 && !m_stop; i++) {
+                    svcSleepThread(50000000);
+                }
+                continue;
+            }
+
+            // 200 on a resume means the server restarted from byte 0
+            u64 skip = (status == 200) ? resumeAt : 0;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_contentLength == 0 && contentLength) {
+                    m_contentLength = (status == 206) ? resumeAt + contentLength : contentLength;
+                }
+                if (resumeAt > 0) m_stats.reconnectCount++;
+            }
+            failures = 0;
+
+            m_windowStart = nowNs();
+            m_windowBytes = 0;
+            bool ok = push(body.data(), body.size(), skip);
+
+            u8 buf[RECV_SIZE];
+            while (ok && !m_stop) {
+                ssize_t n = recv(fd, buf, sizeof(buf), 0);
+                if (n <= 0) break;
+                XMUSIC_TRACE_INSTANT(TraceId_HttpReceive, (u32)n);
+                recordThroughput(n, nowNs());
+                ok = push(buf, n, skip);
+            }
+            closeSocket();
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_contentLength == 0 || m_received >= m_contentLength) {
+                m_eof = true; // Complete, or no length to resume against
+                break;
+            }
+            // Otherwise the connection dropped, loop around and resume
+        }
+    }
+
+public:
+    HttpStream() {}
+
+    ~HttpStream() {
+        close();
+    }
+
+    Result open(const char* url) {
+        return open(url, Config());
+    }
+
+    Result open(const char* url, const Config& config) {
+        close();
+
+        if (strncmp(url, "https://", 8) == 0) {
+            // No TLS client is linked into the sysmodule
+            return MAKERESULT(XMUSIC_RESULT_MODULE, XMusicError_Unsupported);
+        }
+        if (!parseUrl(url)) {
+            return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+        }
+
+        m_config = config;
+        m_ring.assign(config.capacityBytes, 0);
+        m_readPos = 0;
+        m_level = 0;
+        m_eof = false;
+        m_started = false;
+        m_received = 0;
+        m_contentLength = 0;
+        m_meanBps = 0.0f;
+        m_varBps = 0.0f;
+        m_stats = {};
+        m_addressHost.clear();
+        m_stats.targetBytes = config.lowWatermarkBytes;
+        m_state = State_Connecting;
+        m_openTick = armGetSystemTick();
+        m_stop = false;
+
+        m_thread = std::thread(&HttpStream::netThreadFunc, this);
+        return 0;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_spaceCond.notify_all();
+
+        // Unblock recv(), the network thread closes the socket itself
+        int fd = m_socket.load();
+        if (fd >= 0) shutdown(fd, SHUT_RDWR);
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_ring.clear();
+        m_ring.shrink_to_fit();
+        m_level = 0;
+        if (m_state != State_Failed) m_state = State_Idle;
+    }
+
+    /**
+     * Take up to size bytes for the decoder. Never blocks; returns 0 while
+     * buffering, after which the caller should output silence.
+     */
+    size_t read(void* dst, size_t size) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_state == State_Connecting || m_state == State_Buffering) {
+            u32 needed = m_started ? m_stats.targetBytes : m_config.lowWatermarkBytes;
+            if (m_level < needed && !m_eof) {
+                if (m_level > 0) m_state = State_Buffering;
+                return 0;
+            }
+            m_state = State_Playing;
+        }
+        if (m_state != State_Playing) return 0;
+
+        u8* out = (u8*)dst;
+        u32 cap = (u32)m_ring.size();
+        size_t copied = 0;
+        while (copied < size && m_level > 0) {
+            size_t n = std::min(size - copied, (size_t)std::min(m_level, cap - m_readPos));
+            memcpy(out + copied, &m_ring[m_readPos], n);
+            m_readPos = (m_readPos + n) % cap;
+            m_level -= n;
+            copied += n;
+        }
+        if (copied > 0) m_spaceCond.notify_one();
+
+        if (copied > 0 && !m_started) {
+            m_started = true;
+            m_stats.timeToFirstSampleNs = armTicksToNs(armGetSystemTick() - m_openTick);
+        }
+
+        if (m_level == 0) {
+            if (m_eof) {
+                m_state = State_Finished;
+            } else {
+                m_state = State_Buffering;
+                m_stats.rebufferCount++;
+            }
+        }
+        return copied;
+    }
+
+    /**
+     * Decoder input rate in bytes per second, once it knows the bitrate
+     */
+    void setConsumptionRate(u32 bytesPerSec) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_config.consumptionBps = bytesPerSec;
+        m_stats.targetBytes = computeTarget();
+    }
+
+    State getState() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_state;
+    }
+
+    /**
+     * Body size once the server has said, otherwise 0
+     */
+    u64 getContentLength() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_contentLength;
+    }
+
+    Stats getStats() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+};
+
+/**
+ * HttpStream as decoder input
+ *
+ * The stream never blocks, so reads poll it, sleeping while it buffers;
+ * the voice plays silence meanwhile. The end of the body, a failed stream
+ * and abort() all read as the end of the input. Bytes are counted from
+ * the start of the body, which cannot be seeked.
+ */
+class HttpSource : public ByteSource {
+private:
+    static constexpr u64 POLL_NS = 10000000ULL;    // 10ms
+
+    HttpStream* m_stream;
+    u64 m_offset = 0;
+    std::atomic<bool> m_aborted{false};
+
+protected:
+    size_t readRaw(void* dst, size_t size) override {
+        while (!m_aborted.load(std::memory_order_relaxed)) {
+            size_t n = m_stream->read(dst, size);
+            if (n > 0) {
+                m_offset += n;
+                return n;
+            }
+            HttpStream::State state = m_stream->getState();
+            if (state != HttpStream::State_Connecting && state != HttpStream::State_Buffering &&
+                state != HttpStream::State_Playing) {
+                return 0;
+            }
+            svcSleepThread(POLL_NS);
+        }
+        return 0;
+    }
+
+    bool seekRaw(u64 offset) override {
+        return false;
+    }
+
+public:
+    explicit HttpSource(HttpStream* stream) : m_stream(stream) {}
+
+    /**
+     * Start over on a stream that has just been opened
+     */
+    void reset() {
+        m_offset = 0;
+        m_aborted = false;
+        resetSniff();
+    }
+
+    u64 getRawOffset() override { return m_offset; }
+    u64 getSize() override { return m_stream->getContentLength(); }
+    bool canSeek() const override { return false; }
+
+    void setBitrate(u32 kbps) override {
+        m_stream->setConsumptionRate(kbps * 125);
+    }
+
+    void abort() override {
+        m_aborted = true;
+    }
+};
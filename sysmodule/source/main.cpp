@@ -10,7 +10,7 @@
 
 extern "C" {
     u32 __nx_applet_type = AppletType_None;
-    u32 __nx_fs_num_sessions = 1;
+    u32 __nx_fs_num_sessions = 2;  // Read-ahead I/O thread gets its own session
     
     #define INNER_HEAP_SIZE 0x200000  // 2MB heap
     size_t nx_inner_heap_size = INNER_HEAP_SIZE;
@@ -71,11 +71,8 @@ int main(int argc, char* argv[]) {
     // Initialize audio manager
     audioManager = std::make_shared<AudioManager>();
     
-    // Play startup sound
-    audioManager->loadMelody();
-    audioManager->play();
-    svcSleepThread(2000000000LL); // 2 seconds
-    audioManager->pause();
+    // Play startup sound as a one-shot voice, it finishes on its own
+    audioManager->playChime();
     
     // Load test tone for background
     audioManager->loadTestTone(440.0f, 10.0f); // 10 second loop
@@ -0,0 +1,174 @@
+#pragma once
+#include <switch.h>
+#include <sys/types.h>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <mpg123.h>
+#include "track_decoder.h"
+
+/**
+ * MPEG audio (MP3) through libmpg123
+ *
+ * mpg123 pulls its input through our reader callbacks, so the same decoder
+ * reads local files through ReadAhead and HTTP streams alike. Output is
+ * forced to signed 16-bit at the stream's own rate; gapless playback trims
+ * the encoder delay and padding a LAME/Xing header announces.
+ */
+class Mp3Decoder : public TrackDecoder {
+private:
+    mpg123_handle* m_handle = nullptr;
+    ByteSource* m_source = nullptr;
+    u32 m_channels = 0;
+    u32 m_sampleRate = 0;
+    bool m_failed = false;
+
+    // Frame offsets handed to mpg123, which copies them into its own table
+    static constexpr u32 MAX_INDEX_ENTRIES = 4096;
+
+    static ssize_t readCallback(void* handle, void* buffer, size_t size) {
+        return (ssize_t)((Mp3Decoder*)handle)->m_source->read(buffer, size);
+    }
+
+    static off_t seekCallback(void* handle, off_t offset, int whence) {
+        ByteSource* source = ((Mp3Decoder*)handle)->m_source;
+        u64 target;
+        switch (whence) {
+            case SEEK_SET: target = (u64)offset; break;
+            case SEEK_CUR: target = source->tell() + offset; break;
+            case SEEK_END:
+                if (!source->getSize()) return -1;
+                target = source->getSize() + offset;
+                break;
+            default: return -1;
+        }
+        return source->seek(target) ? (off_t)target : (off_t)-1;
+    }
+
+    static void initLibrary() {
+        static std::once_flag once;
+        std::call_once(once, [] { mpg123_init(); });
+    }
+
+public:
+    ~Mp3Decoder() {
+        if (m_handle) {
+            mpg123_close(m_handle);
+            mpg123_delete(m_handle);
+        }
+    }
+
+    /**
+     * Frame sync, or an ID3v2 tag in front of one
+     */
+    static bool probe(const u8* head, u32 size) {
+        if (size >= 3 && memcmp(head, "ID3", 3) == 0) return true;
+        return size >= 2 && head[0] == 0xFF && (head[1] & 0xE0) == 0xE0;
+    }
+
+    Result open(ByteSource* source, TrackFormat* format) override {
+        initLibrary();
+        m_source = source;
+
+        int err = MPG123_OK;
+        m_handle = mpg123_new(nullptr, &err);
+        if (!m_handle) {
+            return MAKERESULT(Module_Libnx, LibnxError_OutOfMemory);
+        }
+
+        long flags = MPG123_QUIET | MPG123_GAPLESS;
+        if (!source->canSeek()) {
+            flags |= MPG123_NO_PEEK_END; // Do not look for tags at the end of a stream
+        }
+        mpg123_param(m_handle, MPG123_FLAGS, flags, 0.0);
+
+        const long* rates;
+        size_t rateCount;
+        mpg123_rates(&rates, &rateCount);
+        mpg123_format_none(m_handle);
+        for (size_t i = 0; i < rateCount; i++) {
+            mpg123_format(m_handle, rates[i], MPG123_MONO | MPG123_STEREO, MPG123_ENC_SIGNED_16);
+        }
+
+        if (mpg123_replace_reader_handle(m_handle, readCallback,
+                                         source->canSeek() ? seekCallback : nullptr,
+                                         nullptr) != MPG123_OK ||
+            mpg123_open_handle(m_handle, this) != MPG123_OK) {
+            return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+        }
+
+        long rate;
+        int channels, encoding;
+        if (mpg123_getformat(m_handle, &rate, &channels, &encoding) != MPG123_OK ||
+            encoding != MPG123_ENC_SIGNED_16 || (channels != 1 && channels != 2)) {
+            return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+        }
+        // The format is fixed from here on, a stream that changes it is resampled wrong
+        mpg123_format_none(m_handle);
+        mpg123_format(m_handle, rate, channels, MPG123_ENC_SIGNED_16);
+        m_channels = (u32)channels;
+        m_sampleRate = (u32)rate;
+
+        mpg123_frameinfo info;
+        off_t length = mpg123_length(m_handle);
+
+        format->sampleRate = (u32)rate;
+        format->channels = m_channels;
+        format->lengthFrames = (length > 0) ? (u64)length : 0;
+        format->bitrateKbps = (mpg123_info(m_handle, &info) == MPG123_OK && info.bitrate > 0)
+                              ? (u32)info.bitrate : 0;
+        return 0;
+    }
+
+    u32 decode(s16* out, u32 maxFrames) override {
+        size_t want = (size_t)maxFrames * m_channels * sizeof(s16);
+        size_t done = 0;
+        while (done < want) {
+            size_t got = 0;
+            int err = mpg123_read(m_handle, (u8*)out + done, want - done, &got);
+            done += got;
+            if (err == MPG123_OK || err == MPG123_NEW_FORMAT) {
+                if (got == 0 && err == MPG123_OK) break;
+                continue;
+            }
+            if (err != MPG123_DONE) {
+                m_failed = true;
+            }
+            break;
+        }
+        return (u32)(done / (m_channels * sizeof(s16)));
+    }
+
+    /**
+     * Give mpg123 the frame offsets of the index. A seek then jumps to the
+     * nearest indexed frame and reads at most a step of frame headers past
+     * it, where it would otherwise scan from the furthest frame seen so far.
+     * The Xing/Info frame is not counted as audio here or by mpg123.
+     */
+    void setIndex(const FrameIndex* index) override {
+        if (!index || index->getFormat() != FrameIndex::Format_Mp3 ||
+            index->getSampleRate() != m_sampleRate || index->getEntryCount() == 0) {
+            return;
+        }
+
+        size_t count = index->getEntryCount();
+        u32 step = (u32)((count + MAX_INDEX_ENTRIES - 1) / MAX_INDEX_ENTRIES);
+        size_t fill = (count + step - 1) / step;
+        off_t* offsets = (off_t*)malloc(fill * sizeof(off_t));
+        if (!offsets) return;
+
+        const FrameIndex::Entry* entries = index->getEntries();
+        for (size_t i = 0; i < fill; i++) {
+            offsets[i] = (off_t)entries[i * step].byteOffset;
+        }
+        mpg123_set_index(m_handle, offsets, (off_t)step, fill);
+        free(offsets);
+    }
+
+    bool seek(u64 frame) override {
+        if (!m_source->canSeek()) return false;
+        return mpg123_seek(m_handle, (off_t)frame, SEEK_SET) >= 0;
+    }
+
+    bool hasFailed() const override { return m_failed; }
+};
@@ -0,0 +1,139 @@
+#pragma once
+#include <switch.h>
+#include <cstdio>
+#include <cstring>
+#include <tremor/ivorbisfile.h>
+#include "track_decoder.h"
+
+/**
+ * Ogg Vorbis through Tremor, the integer-only libvorbis
+ *
+ * With a frame index a seek restarts one page before the target and decodes
+ * forward, dropping samples up to it; vorbisfile reports where a raw seek
+ * actually landed, so the result is sample-accurate. Without one, vorbisfile
+ * bisects the file.
+ */
+class OggDecoder : public TrackDecoder {
+private:
+    OggVorbis_File m_file;
+    bool m_opened = false;
+    ByteSource* m_source = nullptr;
+    const FrameIndex* m_index = nullptr;
+    u32 m_channels = 0;
+    u64 m_skip = 0;         // Frames to drop after an indexed seek
+    bool m_failed = false;
+
+    static size_t readCallback(void* buffer, size_t size, size_t count, void* handle) {
+        if (size == 0) return 0;
+        return ((OggDecoder*)handle)->m_source->read(buffer, size * count) / size;
+    }
+
+    static int seekCallback(void* handle, ogg_int64_t offset, int whence) {
+        ByteSource* source = ((OggDecoder*)handle)->m_source;
+        u64 target;
+        switch (whence) {
+            case SEEK_SET: target = (u64)offset; break;
+            case SEEK_CUR: target = source->tell() + offset; break;
+            case SEEK_END:
+                if (!source->getSize()) return -1;
+                target = source->getSize() + offset;
+                break;
+            default: return -1;
+        }
+        return source->seek(target) ? 0 : -1;
+    }
+
+    static int closeCallback(void* handle) {
+        return 0; // The source belongs to the track player
+    }
+
+    static long tellCallback(void* handle) {
+        return (long)((OggDecoder*)handle)->m_source->tell();
+    }
+
+public:
+    ~OggDecoder() {
+        if (m_opened) {
+            ov_clear(&m_file);
+        }
+    }
+
+    static bool probe(const u8* head, u32 size) {
+        return size >= 4 && memcmp(head, "OggS", 4) == 0;
+    }
+
+    Result open(ByteSource* source, TrackFormat* format) override {
+        m_source = source;
+
+        ov_callbacks callbacks = {readCallback, source->canSeek() ? seekCallback : nullptr,
+                                  closeCallback, tellCallback};
+        if (ov_open_callbacks(this, &m_file, nullptr, 0, callbacks) < 0) {
+            return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+        }
+        m_opened = true;
+
+        vorbis_info* info = ov_info(&m_file, -1);
+        if (!info || (info->channels != 1 && info->channels != 2)) {
+            return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+        }
+        m_channels = (u32)info->channels;
+
+        ogg_int64_t length = ov_pcm_total(&m_file, -1);
+        long bitrate = ov_bitrate(&m_file, -1);
+        if (bitrate <= 0) bitrate = info->bitrate_nominal;
+
+        format->sampleRate = (u32)info->rate;
+        format->channels = m_channels;
+        format->lengthFrames = (length > 0) ? (u64)length : 0;
+        format->bitrateKbps = (bitrate > 0) ? (u32)(bitrate / 1000) : 0;
+        return 0;
+    }
+
+    u32 decode(s16* out, u32 maxFrames) override {
+        u32 frameBytes = m_channels * sizeof(s16);
+        u32 done = 0;
+        while (done < maxFrames) {
+            s16* dst = out + (size_t)done * m_channels;
+            int bitstream;
+            long got = ov_read(&m_file, (char*)dst, (int)((maxFrames - done) * frameBytes), &bitstream);
+            if (got == OV_HOLE) continue; // Damaged page, vorbisfile picked up after it
+            if (got < 0) {
+                m_failed = true;
+                break;
+            }
+            if (got == 0) break;
+
+            u32 frames = (u32)got / frameBytes;
+            if (m_skip) {
+                u32 drop = (u32)std::min<u64>(m_skip, frames);
+                memmove(dst, dst + (size_t)drop * m_channels, (size_t)(frames - drop) * frameBytes);
+                frames -= drop;
+                m_skip -= drop;
+            }
+            done += frames;
+        }
+        return done;
+    }
+
+    bool seek(u64 frame) override {
+        if (!m_source->canSeek()) return false;
+        m_skip = 0;
+
+        FrameIndex::SeekPoint point;
+        if (m_index && m_index->find(frame, &point) &&
+            ov_raw_seek(&m_file, (ogg_int64_t)point.byteOffset) == 0) {
+            ogg_int64_t landed = ov_pcm_tell(&m_file);
+            if (landed >= 0 && (u64)landed <= frame) {
+                m_skip = frame - (u64)landed;
+                return true;
+            }
+        }
+        return ov_pcm_seek(&m_file, (ogg_int64_t)frame) == 0;
+    }
+
+    void setIndex(const FrameIndex* index) override {
+        m_index = (index && index->getFormat() == FrameIndex::Format_Ogg) ? index : nullptr;
+    }
+
+    bool hasFailed() const override { return m_failed; }
+};
@@ -0,0 +1,724 @@
+#pragma once
+#include <switch.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include "read_ahead.h"
+#include "track_decoder.h"
+#include "trace.h"
+#include "xmusic_ipc.h"
+
+/**
+ * Pre-decoded PCM cache entry format
+ *
+ * Header (padded to DATA_OFFSET), then 48kHz interleaved stereo s16, then
+ * one CRC32 per BLOCK_BYTES of PCM. sourceKey is the content hash of the
+ * track the PCM came from, so an edited or replaced file never plays stale
+ * audio.
+ */
+struct PcmCacheHeader {
+    u32 magic;
+    u32 version;
+    u32 sampleRate;
+    u32 channels;
+    u64 frames;
+    u64 sourceKey;
+    u64 crcTableOffset;
+    u32 blockCount;
+    u32 headerCrc;      // Over everything before it
+};
+
+namespace pcmcache {
+    static constexpr u32 MAGIC = 0x43504D58; // "XMPC"
+    static constexpr u32 VERSION = 1;
+    static constexpr u32 SAMPLE_RATE = 48000;
+    static constexpr u32 CHANNELS = 2;
+    static constexpr u32 FRAME_BYTES = CHANNELS * sizeof(s16);
+    static constexpr u32 DATA_OFFSET = 0x1000;
+    static constexpr u32 BLOCK_BYTES = ReadAhead::CHUNK_SIZE;
+    static constexpr u32 BITRATE_KBPS = SAMPLE_RATE * FRAME_BYTES * 8 / 1000;
+
+    static inline u32 headerCrc(const PcmCacheHeader& h) {
+        return crc32Calculate(&h, offsetof(PcmCacheHeader, headerCrc));
+    }
+}
+
+/**
+ * Writes one cache entry; used by the transcode job
+ */
+class PcmCacheWriter {
+private:
+    FILE* m_file = nullptr;
+    std::string m_tempPath;
+    std::string m_path;
+    PcmCacheHeader m_header = {};
+    std::vector<u32> m_crcs;
+    u32 m_blockCrc = 0;
+    u32 m_blockFill = 0;
+    bool m_error = false;
+    const std::atomic<bool>* m_keepGoing = nullptr;
+    bool m_cancelled = false;
+
+    void addBytes(const u8* data, size_t size) {
+        while (size > 0) {
+            u32 n = (u32)std::min<size_t>(size, pcmcache::BLOCK_BYTES - m_blockFill);
+            m_blockCrc = crc32CalculateWithSeed(m_blockCrc, data, n);
+            m_blockFill += n;
+            data += n;
+            size -= n;
+            if (m_blockFill == pcmcache::BLOCK_BYTES) {
+                m_crcs.push_back(m_blockCrc);
+                m_blockCrc = 0;
+                m_blockFill = 0;
+            }
+        }
+    }
+
+public:
+    ~PcmCacheWriter() {
+        discard();
+    }
+
+    /**
+     * Start an entry. Once keepGoing reads false, append() refuses more
+     * frames with XMusicError_Cancelled so the decoder stops early.
+     */
+    Result open(const char* path, u64 sourceKey, const std::atomic<bool>* keepGoing = nullptr) {
+        discard();
+        m_keepGoing = keepGoing;
+        m_cancelled = false;
+        m_path = path;
+        m_tempPath = m_path + ".tmp";
+        m_file = fopen(m_tempPath.c_str(), "wb");
+        if (!m_file) return MAKERESULT(Module_Libnx, LibnxError_NotFound);
+
+        m_header = {pcmcache::MAGIC, pcmcache::VERSION, pcmcache::SAMPLE_RATE, pcmcache::CHANNELS,
+                    0, sourceKey, 0, 0, 0};
+        m_crcs.clear();
+        m_blockCrc = 0;
+        m_blockFill = 0;
+        m_error = fseeko(m_file, pcmcache::DATA_OFFSET, SEEK_SET) != 0;
+        return 0;
+    }
+
+    /**
+     * Append decoded 48kHz stereo frames
+     */
+    Result append(const s16* frames, u32 count) {
+        if (!m_file || m_error) return MAKERESULT(Module_Libnx, LibnxError_IoError);
+        if (m_keepGoing && !m_keepGoing->load(std::memory_order_relaxed)) {
+            m_cancelled = true;
+            return MAKERESULT(XMUSIC_RESULT_MODULE, XMusicError_Cancelled);
+        }
+        size_t bytes = (size_t)count * pcmcache::FRAME_BYTES;
+        if (fwrite(frames, 1, bytes, m_file) != bytes) {
+            m_error = true;
+            return MAKERESULT(Module_Libnx, LibnxError_IoError);
+        }
+        addBytes((const u8*)frames, bytes);
+        m_header.frames += count;
+        return 0;
+    }
+
+    /**
+     * Write the CRC table and header, then move the entry into place
+     */
+    Result commit(u64* bytesOut) {
+        if (!m_file || m_error) {
+            discard();
+            return MAKERESULT(Module_Libnx, LibnxError_IoError);
+        }
+        if (m_blockFill > 0) {
+            m_crcs.push_back(m_blockCrc);
+        }
+
+        m_header.blockCount = (u32)m_crcs.size();
+        m_header.crcTableOffset = pcmcache::DATA_OFFSET + m_header.frames * pcmcache::FRAME_BYTES;
+        m_header.headerCrc = pcmcache::headerCrc(m_header);
+
+        bool ok = fwrite(m_crcs.data(), sizeof(u32), m_crcs.size(), m_file) == m_crcs.size() &&
+                  fseeko(m_file, 0, SEEK_SET) == 0 &&
+                  fwrite(&m_header, sizeof(m_header), 1, m_file) == 1;
+        ok = fclose(m_file) == 0 && ok;
+        m_file = nullptr;
+
+        if (ok) {
+            remove(m_path.c_str());
+            ok = rename(m_tempPath.c_str(), m_path.c_str()) == 0;
+        }
+        if (!ok) {
+            remove(m_tempPath.c_str());
+            return MAKERESULT(Module_Libnx, LibnxError_IoError);
+        }
+
+        *bytesOut = m_header.crcTableOffset + m_crcs.size() * sizeof(u32);
+        return 0;
+    }
+
+    bool wasCancelled() const {
+        return m_cancelled;
+    }
+
+    /**
+     * Drop an entry that was not committed
+     */
+    void discard() {
+        if (m_file) {
+            fclose(m_file);
+            m_file = nullptr;
+            remove(m_tempPath.c_str());
+        }
+    }
+};
+
+/**
+ * Streams one cache entry. Each block is read whole into a staging buffer
+ * and checked against its CRC before any of it is handed out.
+ */
+class PcmCacheReader {
+private:
+    ReadAhead m_readAhead;
+    PcmCacheHeader m_header = {};
+    std::vector<u32> m_crcs;
+    std::vector<u8> m_block;    // The verified block read() copies from
+    u32 m_blockIndex = 0;
+    u32 m_blockBytes = 0;       // 0 when m_block holds nothing
+    u64 m_readOffset = 0;       // PCM byte the read-ahead is at
+    u64 m_offset = 0;           // PCM bytes handed out
+    bool m_failed = false;
+
+    u64 getDataBytes() const {
+        return m_header.frames * pcmcache::FRAME_BYTES;
+    }
+
+    bool loadBlock(u32 block) {
+        u64 start = (u64)block * pcmcache::BLOCK_BYTES;
+        u32 size = (u32)std::min<u64>(pcmcache::BLOCK_BYTES, getDataBytes() - start);
+        if (m_readOffset != start) {
+            m_readAhead.seek(pcmcache::DATA_OFFSET + start);
+        }
+        m_blockBytes = 0;
+
+        size_t got = 0;
+        while (got < size) {
+            size_t n = m_readAhead.read(m_block.data() + got, size - got);
+            if (n == 0) break;
+            got += n;
+        }
+        m_readOffset = start + got;
+        if (got < size || crc32Calculate(m_block.data(), size) != m_crcs[block]) {
+            m_failed = true;
+            return false;
+        }
+        m_blockIndex = block;
+        m_blockBytes = size;
+        return true;
+    }
+
+public:
+    Result open(const char* path, u64 sourceKey) {
+        close();
+
+        FILE* f = fopen(path, "rb");
+        if (!f) return MAKERESULT(Module_Libnx, LibnxError_NotFound);
+        fseeko(f, 0, SEEK_END);
+        u64 fileSize = (u64)ftello(f);
+        fseeko(f, 0, SEEK_SET);
+
+        // The table must describe exactly the PCM the file holds
+        bool ok = fread(&m_header, sizeof(m_header), 1, f) == 1 &&
+                  m_header.magic == pcmcache::MAGIC && m_header.version == pcmcache::VERSION &&
+                  m_header.headerCrc == pcmcache::headerCrc(m_header) &&
+                  m_header.sourceKey == sourceKey && m_header.sampleRate == pcmcache::SAMPLE_RATE &&
+                  m_header.channels == pcmcache::CHANNELS &&
+                  m_header.frames > 0 && m_header.frames <= fileSize / pcmcache::FRAME_BYTES &&
+                  m_header.crcTableOffset == pcmcache::DATA_OFFSET + getDataBytes() &&
+                  m_header.blockCount == (getDataBytes() + pcmcache::BLOCK_BYTES - 1) / pcmcache::BLOCK_BYTES &&
+                  fileSize == m_header.crcTableOffset + (u64)m_header.blockCount * sizeof(u32);
+        if (ok) {
+            m_crcs.resize(m_header.blockCount);
+            ok = fseeko(f, (off_t)m_header.crcTableOffset, SEEK_SET) == 0 &&
+                 fread(m_crcs.data(), sizeof(u32), m_crcs.size(), f) == m_crcs.size();
+        }
+        fclose(f);
+        if (!ok) {
+            m_crcs.clear();
+            return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+        }
+
+        Result rc = m_readAhead.open(path);
+        if (R_FAILED(rc)) return rc;
+        m_readAhead.setBitrate(pcmcache::BITRATE_KBPS);
+        m_readAhead.seek(pcmcache::DATA_OFFSET);
+        m_block.resize(pcmcache::BLOCK_BYTES);
+        m_blockBytes = 0;
+        m_readOffset = 0;
+        m_offset = 0;
+        m_failed = false;
+        return 0;
+    }
+
+    void close() {
+        m_readAhead.close();
+        m_crcs.clear();
+        m_block.clear();
+        m_block.shrink_to_fit();
+        m_blockBytes = 0;
+    }
+
+    /**
+     * Read up to count frames. Returns 0 at the end, or once a block failed
+     * its CRC (see hasFailed), in which case the caller should decode instead.
+     * Frames of a damaged block are never returned.
+     */
+    u32 read(s16* dst, u32 count) {
+        if (m_failed) return 0;
+        size_t want = (size_t)std::min<u64>(getDataBytes() - m_offset, (u64)count * pcmcache::FRAME_BYTES);
+
+        size_t got = 0;
+        while (got < want) {
+            u32 block = (u32)(m_offset / pcmcache::BLOCK_BYTES);
+            if ((m_blockBytes == 0 || block != m_blockIndex) && !loadBlock(block)) break;
+            u32 inBlock = (u32)(m_offset % pcmcache::BLOCK_BYTES);
+            size_t n = std::min<size_t>(want - got, m_blockBytes - inBlock);
+            memcpy((u8*)dst + got, m_block.data() + inBlock, n);
+            got += n;
+            m_offset += n;
+        }
+        return (u32)(got / pcmcache::FRAME_BYTES);
+    }
+
+    /**
+     * Jump to a frame. The next read() loads and checks its block first.
+     */
+    void seek(u64 frame) {
+        m_offset = std::min(frame, m_header.frames) * pcmcache::FRAME_BYTES;
+    }
+
+    bool hasFailed() const { return m_failed; }
+    u64 getFrames() const { return m_header.frames; }
+    u64 getPosition() const { return m_offset / pcmcache::FRAME_BYTES; }
+};
+
+/**
+ * A cache entry played through the decode thread like any other track.
+ * The PCM is already at the output rate, so it resamples as a copy.
+ */
+class PcmCacheDecoder : public TrackDecoder {
+private:
+    PcmCacheReader* m_reader;
+
+public:
+    explicit PcmCacheDecoder(PcmCacheReader* reader) : m_reader(reader) {}
+
+    Result open(ByteSource* source, TrackFormat* format) override {
+        format->sampleRate = pcmcache::SAMPLE_RATE;
+        format->channels = pcmcache::CHANNELS;
+        format->lengthFrames = m_reader->getFrames();
+        format->bitrateKbps = pcmcache::BITRATE_KBPS;
+        return 0;
+    }
+
+    u32 decode(s16* out, u32 maxFrames) override {
+        return m_reader->read(out, maxFrames);
+    }
+
+    bool seek(u64 frame) override {
+        if (frame > m_reader->getFrames()) return false;
+        m_reader->seek(frame);
+        return true;
+    }
+
+    bool hasFailed() const override { return m_reader->hasFailed(); }
+};
+
+/**
+ * Decoder hook for the transcode job: decode sourcePath to 48kHz stereo
+ * s16 and feed it to out. Registered by the decode pipeline.
+ */
+typedef Result (*PcmDecodeFn)(const char* sourcePath, PcmCacheWriter* out, void* user);
+
+/**
+ * Pre-decoded PCM cache for frequently played tracks
+ *
+ * Tracks are keyed by a content hash (size plus sampled regions), so
+ * renames still hit and edited files miss. Play counts are kept for up to
+ * MAX_TRACKS tracks; while playback is idle a background job transcodes
+ * the most played uncached track through the registered decoder and evicts
+ * least recently used entries to stay under the size cap. A transcode
+ * stops as soon as playback resumes and is retried at the next idle.
+ *
+ * Callers hash a track once with contentKey() and pass the key on. Play
+ * counts only change the index in memory; the background job writes it
+ * within a poll interval, and close() writes whatever is left.
+ *
+ * open() is what the playback pipeline asks first: on a hit it streams
+ * CRC-checked PCM from the SD card and skips decoding and resampling.
+ */
+class PcmCache {
+public:
+    static constexpr const char* CACHE_DIR = "sdmc:/config/xmusic/pcm";
+    static constexpr u64 DEFAULT_CAP_BYTES = 1024ULL * 1024 * 1024;
+    static constexpr u32 MAX_TRACKS = 128;
+    static constexpr u32 MIN_PLAYS = 3;
+
+    struct Stats {
+        u32 lookups;
+        u32 hits;
+        u32 transcoded;
+        u32 cancelled;      // Transcodes stopped by playback resuming
+        u32 evicted;
+        u64 cachedBytes;
+
+        float getHitRate() const {
+            return lookups ? (float)hits / lookups : 0.0f;
+        }
+    };
+
+private:
+    static constexpr u32 INDEX_MAGIC = 0x49504D58; // "XMPI"
+    static constexpr u32 HASH_SAMPLE = 0x4000;
+    static constexpr u32 POLL_SECONDS = 5;
+
+    struct Track {
+        u64 key;
+        u64 bytes;          // Size of the cache entry, 0 if not cached
+        u64 lastUsed;       // Value of m_useClock at the last play or hit
+        u32 plays;
+        u32 reserved;
+        char path[256];
+    };
+
+    std::string m_dir;
+    u64 m_capBytes;
+    std::vector<Track> m_tracks;
+    u64 m_useClock = 0;
+    Stats m_stats = {};
+    bool m_indexDirty = false;
+    std::mutex m_mutex;
+
+    PcmDecodeFn m_decoder = nullptr;
+    void* m_decoderUser = nullptr;
+    std::atomic<bool> m_idle{false};
+
+    std::thread m_worker;
+    std::mutex m_workerMutex;
+    std::condition_variable m_workerCond;
+    bool m_stop = false;
+
+    std::string entryPath(u64 key) const {
+        char name[40];
+        snprintf(name, sizeof(name), "/%016llx.pcm", (unsigned long long)key);
+        return m_dir + name;
+    }
+
+    Track* find(u64 key) {
+        for (Track& t : m_tracks) {
+            if (t.key == key) return &t;
+        }
+        return nullptr;
+    }
+
+    // Caller holds m_mutex
+    void dropEntry(Track& t) {
+        if (t.bytes) {
+            remove(entryPath(t.key).c_str());
+            m_stats.cachedBytes -= std::min(m_stats.cachedBytes, t.bytes);
+            t.bytes = 0;
+            m_stats.evicted++;
+        }
+    }
+
+    // Caller holds m_mutex
+    void loadIndex() {
+        m_tracks.clear();
+        m_stats.cachedBytes = 0;
+
+        FILE* f = fopen((m_dir + "/index.bin").c_str(), "rb");
+        if (!f) return;
+        u32 header[2] = {};
+        if (fread(header, sizeof(header), 1, f) == 1 && header[0] == INDEX_MAGIC && header[1] <= MAX_TRACKS) {
+            m_tracks.resize(header[1]);
+            if (fread(m_tracks.data(), sizeof(Track), m_tracks.size(), f) != m_tracks.size()) {
+                m_tracks.clear();
+            }
+        }
+        fclose(f);
+
+        for (Track& t : m_tracks) {
+            t.path[sizeof(t.path) - 1] = '\0';
+            m_useClock = std::max(m_useClock, t.lastUsed);
+            m_stats.cachedBytes += t.bytes;
+        }
+    }
+
+    bool writeIndex(const std::vector<Track>& tracks) {
+        std::string path = m_dir + "/index.bin";
+        std::string temp = path + ".tmp";
+        FILE* f = fopen(temp.c_str(), "wb");
+        if (!f) return false;
+        u32 header[2] = {INDEX_MAGIC, (u32)tracks.size()};
+        bool ok = fwrite(header, sizeof(header), 1, f) == 1 &&
+                  fwrite(tracks.data(), sizeof(Track), tracks.size(), f) == tracks.size();
+        ok = fclose(f) == 0 && ok;
+        if (ok) {
+            remove(path.c_str());
+            ok = rename(temp.c_str(), path.c_str()) == 0;
+        }
+        return ok;
+    }
+
+    /**
+     * Write the index if it changed, from a copy so nobody waits on the SD
+     * card for m_mutex. Only the worker thread, or close() once it has
+     * joined it, calls this.
+     */
+    void flushIndex() {
+        std::vector<Track> tracks;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_indexDirty) return;
+            tracks = m_tracks;
+            m_indexDirty = false;
+        }
+        if (!writeIndex(tracks)) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_indexDirty = true;
+        }
+    }
+
+    // Caller holds m_mutex
+    void enforceCap(u64 keep) {
+        while (m_stats.cachedBytes > m_capBytes) {
+            Track* oldest = nullptr;
+            for (Track& t : m_tracks) {
+                if (t.bytes && t.key != keep && (!oldest || t.lastUsed < oldest->lastUsed)) {
+                    oldest = &t;
+                }
+            }
+            if (!oldest) break;
+            dropEntry(*oldest);
+        }
+    }
+
+    void transcodeOne() {
+        Track candidate = {};
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            const Track* best = nullptr;
+            for (const Track& t : m_tracks) {
+                if (!t.bytes && t.plays >= MIN_PLAYS && (!best || t.plays > best->plays)) {
+                    best = &t;
+                }
+            }
+            if (!best || !m_decoder) return;
+            candidate = *best;
+        }
+
+        // The file may have changed since it was counted
+        if (contentKey(candidate.path) != candidate.key) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Track* t = find(candidate.key);
+            if (t) t->plays = 0;
+            m_indexDirty = true;
+            return;
+        }
+
+        PcmCacheWriter writer;
+        u64 bytes = 0;
+        std::string path = entryPath(candidate.key);
+        Result rc = writer.open(path.c_str(), candidate.key, &m_idle);
+        if (R_SUCCEEDED(rc)) {
+            XMUSIC_TRACE_SCOPE(TraceId_Decode, 0);
+            rc = m_decoder(candidate.path, &writer, m_decoderUser);
+        }
+        rc = R_SUCCEEDED(rc) ? writer.commit(&bytes) : rc;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (writer.wasCancelled()) {
+            // Playback resumed; the track stays a candidate for the next idle
+            writer.discard();
+            m_stats.cancelled++;
+            return;
+        }
+        Track* t = find(candidate.key);
+        if (R_FAILED(rc) || !t) {
+            writer.discard();
+            if (t) t->plays = 0; // Do not retry a track the decoder cannot handle
+            if (!t && R_SUCCEEDED(rc)) remove(path.c_str());
+            m_indexDirty = true;
+            return;
+        }
+        t->bytes = bytes;
+        m_stats.cachedBytes += bytes;
+        m_stats.transcoded++;
+        enforceCap(t->key);
+        m_indexDirty = true;
+    }
+
+    void workerFunc() {
+        XMUSIC_TRACE_THREAD("pcm");
+        std::unique_lock<std::mutex> lock(m_workerMutex);
+        while (!m_stop) {
+            m_workerCond.wait_for(lock, std::chrono::seconds(POLL_SECONDS));
+            if (m_stop) break;
+
+            lock.unlock();
+            if (m_idle.load(std::memory_order_relaxed)) {
+                transcodeOne();
+            }
+            flushIndex();
+            lock.lock();
+        }
+    }
+
+public:
+    explicit PcmCache(const char* dir = CACHE_DIR, u64 capBytes = DEFAULT_CAP_BYTES)
+        : m_dir(dir), m_capBytes(capBytes) {}
+
+    ~PcmCache() {
+        close();
+    }
+
+    Result open() {
+        mkdir("sdmc:/config/xmusic", 0777);
+        mkdir(m_dir.c_str(), 0777);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            loadIndex();
+        }
+        m_stop = false;
+        m_worker = std::thread(&PcmCache::workerFunc, this);
+        return 0;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(m_workerMutex);
+            m_stop = true;
+        }
+        m_idle.store(false, std::memory_order_relaxed); // Cuts a transcode in progress short
+        m_workerCond.notify_all();
+        if (m_worker.joinable()) {
+            m_worker.join();
+        }
+        flushIndex();
+    }
+
+    /**
+     * Content hash of a track: its size and three sampled regions
+     */
+    static u64 contentKey(const char* sourcePath) {
+        FILE* f = fopen(sourcePath, "rb");
+        if (!f) return 0;
+        fseeko(f, 0, SEEK_END);
+        u64 size = (u64)ftello(f);
+
+        u64 hash = 0xcbf29ce484222325ULL;
+        auto mix = [&hash](const u8* p, size_t n) {
+            for (size_t i = 0; i < n; i++) hash = (hash ^ p[i]) * 0x100000001b3ULL;
+        };
+        mix((const u8*)&size, sizeof(size));
+
+        std::vector<u8> buf(HASH_SAMPLE);
+        u64 offsets[3] = {0, size / 2, size > HASH_SAMPLE ? size - HASH_SAMPLE : 0};
+        for (u64 offset : offsets) {
+            fseeko(f, (off_t)offset, SEEK_SET);
+            mix(buf.data(), fread(buf.data(), 1, buf.size(), f));
+        }
+        fclose(f);
+        return hash;
+    }
+
+    /**
+     * Register the decoder the transcode job runs tracks through
+     */
+    void setDecoder(PcmDecodeFn decoder, void* user) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_decoder = decoder;
+        m_decoderUser = user;
+    }
+
+    /**
+     * Transcoding only runs while this is set, i.e. nothing is playing. The
+     * job starts as soon as playback stops rather than at its next poll,
+     * and a transcode in progress stops at its next append once cleared.
+     */
+    void setIdle(bool idle) {
+        if (!m_idle.exchange(idle, std::memory_order_relaxed) && idle) {
+            m_workerCond.notify_all();
+        }
+    }
+
+    /**
+     * Count a play of a track, making it a transcode candidate. key is
+     * contentKey(sourcePath).
+     */
+    void recordPlay(u64 key, const char* sourcePath) {
+        if (!key) return;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Track* t = find(key);
+        if (!t) {
+            if (m_tracks.size() >= MAX_TRACKS) {
+                // Forget the least recently used track, and its entry if it has one
+                auto oldest = std::min_element(m_tracks.begin(), m_tracks.end(),
+                    [](const Track& a, const Track& b) { return a.lastUsed < b.lastUsed; });
+                dropEntry(*oldest);
+                m_tracks.erase(oldest);
+            }
+            m_tracks.push_back(Track{});
+            t = &m_tracks.back();
+            t->key = key;
+        }
+        strncpy(t->path, sourcePath, sizeof(t->path) - 1);
+        t->plays++;
+        t->lastUsed = ++m_useClock;
+        m_indexDirty = true;
+    }
+
+    /**
+     * Open the cached PCM of a track. True on a hit; on a miss or a damaged
+     * entry the caller decodes as usual.
+     */
+    bool open(u64 key, PcmCacheReader* reader) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.lookups++;
+        Track* t = key ? find(key) : nullptr;
+        if (!t || !t->bytes) return false;
+
+        m_indexDirty = true;
+        if (R_FAILED(reader->open(entryPath(key).c_str(), key))) {
+            dropEntry(*t);
+            return false;
+        }
+        m_stats.hits++;
+        t->lastUsed = ++m_useClock;
+        return true;
+    }
+
+    /**
+     * Drop an entry whose reader reported a CRC failure
+     */
+    void invalidate(u64 key) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Track* t = find(key);
+        if (t) {
+            dropEntry(*t);
+            m_indexDirty = true;
+        }
+    }
+
+    Stats getStats() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+};
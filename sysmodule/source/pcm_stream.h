@@ -0,0 +1,185 @@
+#pragma once
+#include <switch.h>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+
+/**
+ * Decoded PCM handed from a decode thread to the audio thread
+ *
+ * Single producer, single consumer ring of interleaved stereo s16 frames at
+ * the output rate. Neither side locks: each side owns one counter and only
+ * reads the other's. Both sides work on contiguous spans of the ring, so the
+ * producer decodes straight into it and the mixer reads straight out of it.
+ *
+ * A seek starts a new segment. The producer records where in the ring the
+ * new data begins and which track frame that is; the consumer drops anything
+ * older the next time it syncs. Positions are reported in track frames, so
+ * they stay right across seeks and underruns.
+ */
+class PcmStream {
+public:
+    static constexpr u32 CHANNELS = 2;
+    static constexpr u32 FRAME_BYTES = CHANNELS * sizeof(s16);
+
+private:
+    s16* m_data = nullptr;
+    u32 m_capacity = 0;                     // Frames, a power of two
+    std::atomic<u64> m_written{0};          // Producer: frames committed since open
+    std::atomic<u64> m_read{0};             // Consumer: frames consumed since open
+
+    // Current segment, published by the producer under a sequence counter
+    std::atomic<u32> m_segmentSeq{0};
+    std::atomic<u64> m_segmentStart{0};     // Value of m_written when it began
+    std::atomic<u64> m_segmentTrack{0};     // Track frame at that point
+
+    std::atomic<bool> m_finished{false};    // Nothing follows what is in the ring
+    std::atomic<u64> m_length{0};           // Track length in frames, 0 if unknown
+
+    // Consumer's copy of the segment it is playing
+    u64 m_playStart = 0;
+    u64 m_playTrack = 0;
+
+    u32 mask() const { return m_capacity - 1; }
+
+public:
+    PcmStream() {}
+
+    ~PcmStream() {
+        close();
+    }
+
+    /**
+     * Allocate the ring, rounded up to a power of two frames
+     */
+    Result open(u32 frames) {
+        close();
+        u32 capacity = 1;
+        while (capacity < frames) capacity <<= 1;
+
+        m_data = (s16*)aligned_alloc(0x40, (size_t)capacity * FRAME_BYTES);
+        if (!m_data) {
+            return MAKERESULT(Module_Libnx, LibnxError_OutOfMemory);
+        }
+        m_capacity = capacity;
+        m_written.store(0, std::memory_order_relaxed);
+        m_read.store(0, std::memory_order_relaxed);
+        m_segmentStart.store(0, std::memory_order_relaxed);
+        m_segmentTrack.store(0, std::memory_order_relaxed);
+        m_finished.store(false, std::memory_order_relaxed);
+        m_length.store(0, std::memory_order_relaxed);
+        m_playStart = 0;
+        m_playTrack = 0;
+        return 0;
+    }
+
+    /**
+     * Free the ring. Neither side may be using the stream.
+     */
+    void close() {
+        free(m_data);
+        m_data = nullptr;
+        m_capacity = 0;
+    }
+
+    bool isOpen() const { return m_data != nullptr; }
+    u32 getCapacity() const { return m_capacity; }
+
+    // Producer side
+
+    /**
+     * Contiguous free space at the write position
+     */
+    u32 reserve(s16** span) {
+        u64 written = m_written.load(std::memory_order_relaxed);
+        u64 used = written - m_read.load(std::memory_order_acquire);
+        u32 offset = (u32)(written & mask());
+        *span = m_data + (size_t)offset * CHANNELS;
+        return (u32)std::min<u64>(m_capacity - used, m_capacity - offset);
+    }
+
+    void commit(u32 frames) {
+        m_written.fetch_add(frames, std::memory_order_release);
+    }
+
+    /**
+     * Frames committed but not yet consumed, including a replaced segment the
+     * consumer has not dropped yet
+     */
+    u32 getBuffered() const {
+        return (u32)(m_written.load(std::memory_order_relaxed) - m_read.load(std::memory_order_acquire));
+    }
+
+    /**
+     * Data written from now on starts at trackFrame; older data is dropped
+     */
+    void beginSegment(u64 trackFrame) {
+        u32 seq = m_segmentSeq.load(std::memory_order_relaxed);
+        m_segmentSeq.store(seq + 1, std::memory_order_relaxed);
+        // Release stores keep the odd count ahead of the fields
+        m_segmentStart.store(m_written.load(std::memory_order_relaxed), std::memory_order_release);
+        m_segmentTrack.store(trackFrame, std::memory_order_release);
+        m_segmentSeq.store(seq + 2, std::memory_order_release);
+        m_finished.store(false, std::memory_order_release);
+    }
+
+    void setFinished() { m_finished.store(true, std::memory_order_release); }
+    void setLength(u64 frames) { m_length.store(frames, std::memory_order_relaxed); }
+
+    // Consumer side
+
+    /**
+     * Pick up the latest segment and drop data it replaced
+     */
+    void sync() {
+        u32 seq;
+        u64 start, track;
+        do {
+            seq = m_segmentSeq.load(std::memory_order_acquire);
+            // Acquire loads keep the fields ahead of the second count read
+            start = m_segmentStart.load(std::memory_order_acquire);
+            track = m_segmentTrack.load(std::memory_order_acquire);
+        } while ((seq & 1) || seq != m_segmentSeq.load(std::memory_order_relaxed));
+
+        if (start != m_playStart || track != m_playTrack) {
+            m_playStart = start;
+            m_playTrack = track;
+            if (m_read.load(std::memory_order_relaxed) < start) {
+                m_read.store(start, std::memory_order_release);
+            }
+        }
+    }
+
+    /**
+     * Contiguous readable frames at the read position, up to maxFrames
+     */
+    u32 peek(const s16** span, u32 maxFrames) {
+        u64 read = m_read.load(std::memory_order_relaxed);
+        u64 available = m_written.load(std::memory_order_acquire) - read;
+        u32 offset = (u32)(read & mask());
+        *span = m_data + (size_t)offset * CHANNELS;
+        return (u32)std::min<u64>(std::min<u64>(available, m_capacity - offset), maxFrames);
+    }
+
+    void consume(u32 frames) {
+        m_read.fetch_add(frames, std::memory_order_release);
+    }
+
+    /**
+     * Track frame of the next frame the consumer reads
+     */
+    u64 getTrackPosition() const {
+        return m_playTrack + (m_read.load(std::memory_order_relaxed) - m_playStart);
+    }
+
+    /**
+     * The producer is done and everything it wrote was consumed
+     */
+    bool isDrained() const {
+        return m_finished.load(std::memory_order_acquire) &&
+               m_read.load(std::memory_order_relaxed) == m_written.load(std::memory_order_acquire);
+    }
+
+    u64 getLength() const { return m_length.load(std::memory_order_relaxed); }
+};
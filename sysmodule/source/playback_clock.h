@@ -0,0 +1,208 @@
+#pragma once
+#include <switch.h>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+
+/**
+ * Playback clock driven by audout consumption
+ *
+ * The audio thread reports every block it submits (with the track position
+ * of its first frame) and every block the device releases. A released block
+ * has been played, so the clock anchors on the next queued block at release
+ * time and advances from there with the system tick, never past that block.
+ * Queued-but-unplayed buffers therefore never count as heard, and pause,
+ * seek and track changes take effect when their first block is audible.
+ *
+ * Readers get a consistent snapshot through a sequence counter and can keep
+ * interpolating with the system tick on their own. Positions wrap at the
+ * track length only for looping tracks; others stop at their end.
+ */
+class PlaybackClock {
+public:
+    static constexpr u32 MAX_QUEUED = 8;
+
+    struct Block {
+        u64 mediaStart;    // Track position of the first frame
+        u32 frames;        // Device frames in the block
+        u32 mediaFrames;   // Frames that advance the track, 0 while paused, frames * speed when stretched
+        s32 track;         // Track token (music voice id), -1 for none
+        u64 trackLength;   // Frames, 0 if unknown
+        bool looping;      // Positions wrap at trackLength
+    };
+
+    struct Position {
+        u64 deviceFrames;  // Frames heard since start, monotonic
+        u64 mediaFrames;   // Audible track position
+        u64 mediaUs;
+        u64 anchorTick;    // System tick the media position was sampled at
+        bool advancing;    // False while paused or starved
+        s32 track;
+        u64 trackLength;
+        bool looping;
+    };
+
+private:
+    // Where playback stood when audout started a block, and how far it may go from there
+    struct Anchor {
+        u64 tick;
+        u64 device;
+        u64 media;
+        u32 limit;         // Frames the clock may advance past the anchor
+        u32 mediaLimit;    // Track frames those device frames stand for
+        s32 track;
+        u64 trackLength;
+        bool looping;
+    };
+
+    // Anchors kept to look back over the output latency, a few blocks' worth
+    static constexpr u32 HISTORY = 4;
+
+    struct Snapshot {
+        Anchor anchors[HISTORY];
+        u32 newest;
+        u32 count;
+    };
+    static_assert(sizeof(Snapshot) % sizeof(u64) == 0, "snapshot is published in whole words");
+    static constexpr u32 SNAPSHOT_WORDS = sizeof(Snapshot) / sizeof(u64);
+
+    // Audio thread only
+    Block m_queue[MAX_QUEUED];
+    u32 m_head = 0;
+    u32 m_count = 0;
+    u64 m_consumed = 0;
+
+    Snapshot m_snapshot = {};
+
+    // m_snapshot as readers see it, copied in relaxed atomic words under a sequence counter
+    std::atomic<u32> m_sequence{0};
+    std::atomic<u64> m_published[SNAPSHOT_WORDS] = {};
+
+    u32 m_sampleRate;
+    std::atomic<u32> m_latencyFrames{0};
+
+    void publish(u64 tick, u64 media, u32 limit, u32 mediaLimit, const Block& block) {
+        Snapshot& s = m_snapshot;
+        s.newest = (s.newest + 1) % HISTORY;
+        s.anchors[s.newest] = {tick, m_consumed, media, limit, mediaLimit,
+                               block.track, block.trackLength, block.looping};
+        s.count = std::min(s.count + 1, HISTORY);
+
+        u64 words[SNAPSHOT_WORDS];
+        memcpy(words, &s, sizeof(words));
+        u32 seq = m_sequence.load(std::memory_order_relaxed);
+        m_sequence.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (u32 i = 0; i < SNAPSHOT_WORDS; i++) {
+            m_published[i].store(words[i], std::memory_order_relaxed);
+        }
+        m_sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    void anchorOnFront(u64 tick) {
+        const Block& b = m_queue[m_head];
+        publish(tick, b.mediaStart, b.frames, b.mediaFrames, b);
+    }
+
+public:
+    explicit PlaybackClock(u32 sampleRate) : m_sampleRate(sampleRate) {}
+
+    /**
+     * Extra output latency after audout releases a buffer, in frames.
+     * Positions trail audout by this long, so a seek or pause is only
+     * reported once it reaches the speaker.
+     */
+    void setOutputLatency(u32 frames) {
+        m_latencyFrames.store(frames, std::memory_order_relaxed);
+    }
+
+    /**
+     * Audio thread: a block was appended to audout
+     */
+    void onSubmit(const Block& block, u64 tick) {
+        if (m_count == MAX_QUEUED) return;
+        m_queue[(m_head + m_count) % MAX_QUEUED] = block;
+        m_count++;
+        if (m_count == 1) {
+            anchorOnFront(tick); // Nothing else queued, it starts playing now
+        }
+    }
+
+    /**
+     * Audio thread: audout released the oldest count blocks
+     */
+    void onReleased(u32 count, u64 tick) {
+        Block last = {};
+        count = std::min(count, m_count);
+        for (u32 i = 0; i < count; i++) {
+            last = m_queue[m_head];
+            m_consumed += last.frames;
+            m_head = (m_head + 1) % MAX_QUEUED;
+            m_count--;
+        }
+        if (count == 0) return;
+
+        if (m_count > 0) {
+            anchorOnFront(tick);
+        } else {
+            // Starved or stopped, hold at the end of what was heard
+            publish(tick, last.mediaStart + last.mediaFrames, 0, 0, last);
+        }
+    }
+
+    /**
+     * Any thread: current audible position
+     */
+    Position read() const {
+        u64 words[SNAPSHOT_WORDS];
+        u32 seq;
+        do {
+            seq = m_sequence.load(std::memory_order_acquire);
+            for (u32 i = 0; i < SNAPSHOT_WORDS; i++) {
+                words[i] = m_published[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while ((seq & 1) || seq != m_sequence.load(std::memory_order_relaxed));
+        Snapshot snapshot;
+        memcpy(&snapshot, words, sizeof(snapshot));
+        const Anchor* anchors = snapshot.anchors;
+        u32 newest = snapshot.newest, count = snapshot.count;
+
+        Position p = {};
+        p.track = -1;
+        u64 now = armGetSystemTick();
+        p.anchorTick = now;
+        if (count == 0) return p;
+
+        // What audout played latency ago is what is being heard now: take the
+        // anchor in force then, or the oldest one if they are all more recent
+        u64 latencyTicks = armNsToTicks((u64)m_latencyFrames.load(std::memory_order_relaxed) * 1000000000ULL / m_sampleRate);
+        u64 heard = now > latencyTicks ? now - latencyTicks : 0;
+        const Anchor* a = nullptr;
+        for (u32 back = 0; back < count; back++) {
+            a = &anchors[(newest + HISTORY - back) % HISTORY];
+            if (a->tick <= heard) break;
+        }
+
+        u64 elapsedNs = heard > a->tick ? armTicksToNs(heard - a->tick) : 0;
+        u64 elapsed = std::min<u64>(elapsedNs * m_sampleRate / 1000000000ULL, a->limit);
+
+        p.deviceFrames = a->device + elapsed;
+        // Stretched playback moves the track at mediaLimit / limit of the device rate
+        u64 media = a->media + (a->limit ? elapsed * a->mediaLimit / a->limit : 0);
+        if (a->trackLength) {
+            media = a->looping ? media % a->trackLength : std::min(media, a->trackLength);
+        }
+
+        p.mediaFrames = media;
+        p.mediaUs = media * 1000000ULL / m_sampleRate;
+        p.advancing = a->mediaLimit > 0;
+        p.track = a->track;
+        p.trackLength = a->trackLength;
+        p.looping = a->looping;
+        return p;
+    }
+
+    u32 getQueuedBlocks() const { return m_count; }
+    u32 getSampleRate() const { return m_sampleRate; }
+};
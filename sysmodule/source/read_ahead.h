@@ -0,0 +1,371 @@
+#pragma once
+#include <switch.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "trace.h"
+
+/**
+ * Asynchronous read-ahead for streamed files
+ *
+ * A dedicated I/O thread keeps a window of large, aligned chunks of the file
+ * in memory so the decoder never blocks on the SD card while a game is using
+ * it. The window is sized from the track bitrate and bounded by MAX_CHUNKS;
+ * only the chunks of the current window are allocated. Each chunk is read
+ * in READ_SLICE pieces and the I/O thread checks for a seek between them,
+ * so a seek waits for at most one slice of the read in flight before the
+ * refill from the new offset starts.
+ *
+ * Works on plain stdio files, so the same code runs against sdmc:/ on the
+ * console and regular paths on a Linux host.
+ */
+class ReadAhead {
+public:
+    static constexpr u32 CHUNK_SIZE = 0x10000;   // 64KB per read
+    static constexpr u32 CHUNK_ALIGN = 0x1000;
+    static constexpr u32 READ_SLICE = 0x4000;    // 16KB, bounds how long a seek waits
+    static constexpr u32 MAX_CHUNKS = 4;         // 256KB worst case out of the 2MB heap
+    static constexpr u32 WINDOW_SECONDS = 2;
+
+    struct Stats {
+        u64 bytesRead;
+        u64 readCount;
+        u64 totalReadNs;
+        u64 worstReadNs;
+
+        float getMBps() const {
+            if (totalReadNs == 0) return 0.0f;
+            return (float)((double)bytesRead * 1000.0 / (double)totalReadNs);
+        }
+    };
+
+private:
+    struct Chunk {
+        u8* data = nullptr;
+        u32 size = 0;       // Valid bytes
+        u32 consumed = 0;   // Bytes already handed to the reader
+    };
+
+    FILE* m_file = nullptr;
+    u64 m_fileSize = 0;
+    std::thread m_thread;
+
+    std::mutex m_mutex;
+    std::condition_variable m_ioCond;     // Wakes the I/O thread
+    std::condition_variable m_readerCond; // Wakes the reader
+    Chunk m_chunks[MAX_CHUNKS];
+    u32 m_head = 0;          // Oldest filled chunk
+    u32 m_filled = 0;        // Filled chunks starting at m_head
+    u32 m_window = 0;        // Chunks allocated and kept filled
+    u64 m_nextOffset = 0;    // File offset of the next read, always aligned
+    u64 m_readOffset = 0;    // File offset of the next byte read() returns
+    u32 m_pendingSkip = 0;   // Bytes to drop from the first chunk after a seek
+    std::atomic<u32> m_epoch{0}; // Bumped under the lock to cancel the read in flight
+    bool m_reading = false;  // The I/O thread is writing into a chunk
+    bool m_eof = false;
+    bool m_error = false;
+    std::atomic<bool> m_stop{false};
+
+    Stats m_stats = {};
+    std::atomic<u64> m_injectedLatencyNs{0};
+
+    static constexpr u32 MIN_CHUNKS = 2;
+
+    static u32 windowFor(u32 kbps) {
+        u64 bytes = (u64)kbps * 1000 / 8 * WINDOW_SECONDS;
+        u32 chunks = (u32)((bytes + CHUNK_SIZE - 1) / CHUNK_SIZE);
+        return std::max(MIN_CHUNKS, std::min(MAX_CHUNKS, chunks));
+    }
+
+    bool allocateWindow(u32 count) {
+        for (u32 i = 0; i < count; i++) {
+            m_chunks[i].data = (u8*)aligned_alloc(CHUNK_ALIGN, CHUNK_SIZE);
+            if (!m_chunks[i].data) {
+                freeWindow();
+                return false;
+            }
+        }
+        m_window = count;
+        return true;
+    }
+
+    void freeWindow() {
+        for (u32 i = 0; i < MAX_CHUNKS; i++) {
+            free(m_chunks[i].data);
+            m_chunks[i].data = nullptr;
+        }
+        m_window = 0;
+        m_head = 0;
+        m_filled = 0;
+    }
+
+    // Caller holds m_mutex and has bumped m_epoch
+    void restartAt(u64 offset) {
+        offset = std::min(offset, m_fileSize);
+        m_head = 0;
+        m_filled = 0;
+        m_readOffset = offset;
+        m_nextOffset = offset & ~(u64)(CHUNK_ALIGN - 1);
+        m_pendingSkip = (u32)(offset - m_nextOffset);
+        m_eof = offset >= m_fileSize;
+        m_error = false;
+    }
+
+    void ioThreadFunc() {
+        XMUSIC_TRACE_THREAD("io");
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        while (!m_stop) {
+            if (m_eof || m_error || m_filled >= m_window) {
+                m_ioCond.wait(lock);
+                continue;
+            }
+
+            Chunk& chunk = m_chunks[(m_head + m_filled) % m_window];
+            u64 offset = m_nextOffset;
+            u32 epoch = m_epoch.load(std::memory_order_relaxed);
+            m_reading = true;
+            lock.unlock();
+
+            u64 start = armGetSystemTick();
+            size_t got = 0;
+            bool ok;
+            {
+                XMUSIC_TRACE_SCOPE(TraceId_ReadAheadFill, (u32)(offset >> 10));
+                ok = fseeko(m_file, (off_t)offset, SEEK_SET) == 0;
+                while (ok && got < CHUNK_SIZE) {
+                    // Test hook, simulates a busy SD card
+                    u64 latency = m_injectedLatencyNs.load(std::memory_order_relaxed);
+                    if (latency) {
+                        svcSleepThread(latency);
+                    }
+                    size_t n = fread(chunk.data + got, 1, READ_SLICE, m_file);
+                    got += n;
+                    if (n < READ_SLICE) {
+                        ok = !ferror(m_file);
+                        break;
+                    }
+                    if (m_epoch.load(std::memory_order_relaxed) != epoch || m_stop) {
+                        break; // Abandoned, the slices read so far are dropped below
+                    }
+                }
+            }
+            u64 elapsedNs = armTicksToNs(armGetSystemTick() - start);
+
+            lock.lock();
+            m_reading = false;
+            m_readerCond.notify_all();
+
+            m_stats.bytesRead += got;
+            m_stats.readCount++;
+            m_stats.totalReadNs += elapsedNs;
+            m_stats.worstReadNs = std::max(m_stats.worstReadNs, elapsedNs);
+
+            if (epoch != m_epoch.load(std::memory_order_relaxed)) {
+                continue; // Cancelled by seek(), drop the data
+            }
+            if (!ok) {
+                m_error = true;
+                m_readerCond.notify_all();
+                continue;
+            }
+
+            chunk.size = (u32)got;
+            chunk.consumed = 0;
+            if (m_filled == 0 && m_pendingSkip) {
+                chunk.consumed = std::min(m_pendingSkip, chunk.size);
+                m_pendingSkip = 0;
+            }
+            m_filled++;
+            m_nextOffset += got;
+            if (got < CHUNK_SIZE || m_nextOffset >= m_fileSize) {
+                m_eof = true;
+            }
+            m_readerCond.notify_all();
+        }
+    }
+
+public:
+    ReadAhead() {}
+
+    ~ReadAhead() {
+        close();
+    }
+
+    /**
+     * Open a file and start filling. kbps sizes the window like setBitrate(),
+     * 0 starts with the smallest one.
+     */
+    Result open(const char* path, u32 kbps = 0) {
+        close();
+
+        m_file = fopen(path, "rb");
+        if (!m_file) {
+            return MAKERESULT(Module_Libnx, LibnxError_NotFound);
+        }
+        // Reads go straight from the file system into our aligned chunks
+        setvbuf(m_file, nullptr, _IONBF, 0);
+
+        fseeko(m_file, 0, SEEK_END);
+        m_fileSize = (u64)ftello(m_file);
+        fseeko(m_file, 0, SEEK_SET);
+
+        if (!allocateWindow(windowFor(kbps))) {
+            close();
+            return MAKERESULT(Module_Libnx, LibnxError_OutOfMemory);
+        }
+
+        m_head = 0;
+        m_filled = 0;
+        m_nextOffset = 0;
+        m_readOffset = 0;
+        m_pendingSkip = 0;
+        m_eof = m_fileSize == 0;
+        m_error = false;
+        m_stop = false;
+        m_stats = {};
+
+        m_thread = std::thread(&ReadAhead::ioThreadFunc, this);
+        return 0;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+            m_epoch++;
+        }
+        m_ioCond.notify_all();
+        m_readerCond.notify_all();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+
+        freeWindow();
+
+        if (m_file) {
+            fclose(m_file);
+            m_file = nullptr;
+        }
+    }
+
+    /**
+     * Size the read-ahead window to cover WINDOW_SECONDS of audio. A new
+     * size reallocates the window and refills it from the read position.
+     */
+    void setBitrate(u32 kbps) {
+        u32 window = windowFor(kbps);
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (!m_file || window == m_window) return;
+
+            // Abandon the read in flight and wait for it to let go of its chunk
+            m_epoch++;
+            while (m_reading) {
+                m_readerCond.wait(lock);
+            }
+
+            freeWindow();
+            if (!allocateWindow(window) && !allocateWindow(MIN_CHUNKS)) {
+                m_error = true;
+                m_readerCond.notify_all();
+                return;
+            }
+            restartAt(m_readOffset);
+        }
+        m_ioCond.notify_all();
+    }
+
+    /**
+     * Copy up to size bytes. Blocks until data arrives, end of file or the
+     * timeout. Returns the number of bytes copied, 0 at end of file.
+     */
+    size_t read(void* dst, size_t size, u64 timeoutNs = UINT64_MAX) {
+        u8* out = (u8*)dst;
+        size_t copied = 0;
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        while (copied < size) {
+            if (m_filled == 0) {
+                if (m_eof || m_error || m_stop || copied > 0) break;
+
+                XMUSIC_TRACE_SCOPE(TraceId_ReadAheadWait, 0);
+                if (timeoutNs == UINT64_MAX) {
+                    m_readerCond.wait(lock);
+                } else if (m_readerCond.wait_for(lock, std::chrono::nanoseconds(timeoutNs)) ==
+                           std::cv_status::timeout) {
+                    break;
+                }
+                continue;
+            }
+
+            Chunk& chunk = m_chunks[m_head];
+            size_t n = std::min(size - copied, (size_t)(chunk.size - chunk.consumed));
+            memcpy(out + copied, chunk.data + chunk.consumed, n);
+            chunk.consumed += n;
+            copied += n;
+            m_readOffset += n;
+
+            if (chunk.consumed >= chunk.size) {
+                m_head = (m_head + 1) % m_window;
+                m_filled--;
+                m_ioCond.notify_one();
+            }
+        }
+
+        return copied;
+    }
+
+    /**
+     * Drop buffered data and any read in flight, then refill from offset
+     */
+    void seek(u64 offset) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_epoch++;
+            restartAt(offset);
+        }
+        m_ioCond.notify_all();
+    }
+
+    /**
+     * File offset of the next byte read() returns
+     */
+    u64 tell() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_readOffset;
+    }
+
+    u64 getFileSize() const { return m_fileSize; }
+
+    /**
+     * Chunks currently allocated for the window
+     */
+    u32 getWindowChunks() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_window;
+    }
+
+    bool hasError() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_error;
+    }
+
+    Stats getStats() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+
+    /**
+     * Add a fixed delay before every slice read, for testing against a slow card
+     */
+    void setInjectedLatency(u64 ns) {
+        m_injectedLatencyNs.store(ns, std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,287 @@
+#pragma once
+#include <switch.h>
+#include <algorithm>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ * Render kernels specialized at compile time
+ *
+ * The mixer accumulates every source into 32-bit lanes at the output
+ * channel count and narrows the result once per block. Both steps are
+ * templates over channel layout, sample format and tile size, so the common
+ * configurations get a loop with a constant trip count that the compiler
+ * unrolls and vectorizes without a remainder. Spans of any length are cut
+ * into fixed tiles plus one short tail, which keeps the specialized loop in
+ * use for partial blocks, loop points and the stretcher's smaller pulls.
+ * Kernels are picked once per voice. Layouts without a specialization go
+ * through the runtime fallback at the bottom of this file.
+ */
+
+enum SampleFormat : u32 {
+    SampleFormat_S16 = 0,
+    SampleFormat_Float = 1
+};
+
+template <SampleFormat Format> struct SampleTraits;
+
+template <> struct SampleTraits<SampleFormat_S16> {
+    using Type = s16;
+    static s32 toQ15(s16 v) { return v; }
+    static s16 fromAccum(s32 v) { return (s16)std::max(-32768, std::min(32767, v)); }
+};
+
+template <> struct SampleTraits<SampleFormat_Float> {
+    using Type = float;
+    static s32 toQ15(float v) { return (s32)(std::max(-1.0f, std::min(1.0f, v)) * 32767.0f); }
+    static float fromAccum(s32 v) { return std::max(-1.0f, std::min(1.0f, v * (1.0f / 32768.0f))); }
+};
+
+/**
+ * Output configuration of a render path
+ */
+template <u32 Channels, SampleFormat Format, u32 BlockFrames, u32 TileFrames = 256>
+struct RenderConfig {
+    static_assert(Channels == 1 || Channels == 2, "mixer renders mono or stereo");
+    static_assert(TileFrames % 8 == 0, "tile size must be a multiple of 8 frames");
+    static_assert(BlockFrames % TileFrames == 0, "block size must be a whole number of tiles");
+
+    static constexpr u32 CHANNELS = Channels;
+    static constexpr SampleFormat FORMAT = Format;
+    static constexpr u32 BLOCK_FRAMES = BlockFrames;
+    static constexpr u32 BLOCK_SAMPLES = BlockFrames * Channels;
+    static constexpr u32 TILE_FRAMES = TileFrames;     // Source and accumulator stay in L1
+    static constexpr u32 TILE_SAMPLES = TileFrames * Channels;
+    using Sample = typename SampleTraits<Format>::Type;
+};
+
+/**
+ * acc += (src * gain) >> 15, converting SrcChannels to DstChannels.
+ * Mono sources are spread to both sides, stereo sources folded for mono out.
+ */
+template <u32 SrcChannels, SampleFormat SrcFormat, u32 DstChannels>
+struct AccumulateKernel {
+    using Traits = SampleTraits<SrcFormat>;
+    using Src = typename Traits::Type;
+
+    template <u32 Frames>
+    static void block(s32* acc, const void* src, s16 gainL, s16 gainR) {
+        run(acc, (const Src*)src, Frames, gainL, gainR);
+    }
+
+    static void frames(s32* acc, const void* src, u32 count, s16 gainL, s16 gainR) {
+        run(acc, (const Src*)src, count, gainL, gainR);
+    }
+
+private:
+    static inline __attribute__((always_inline))
+    void run(s32* __restrict acc, const Src* __restrict src, u32 count, s16 gainL, s16 gainR) {
+        for (u32 f = 0; f < count; f++) {
+            s32 l = Traits::toQ15(src[f * SrcChannels]);
+            s32 r = (SrcChannels == 1) ? l : Traits::toQ15(src[f * SrcChannels + 1]);
+            if (DstChannels == 2) {
+                acc[f * 2] += (l * gainL) >> 15;
+                acc[f * 2 + 1] += (r * gainR) >> 15;
+            } else {
+                acc[f] += (((l + r) >> 1) * gainL) >> 15;
+            }
+        }
+    }
+};
+
+#if defined(__ARM_NEON)
+/**
+ * Interleaved stereo s16 into stereo, the music path. Widening multiply and
+ * shift-accumulate, eight samples per iteration.
+ */
+template <>
+struct AccumulateKernel<2, SampleFormat_S16, 2> {
+    template <u32 Frames>
+    static void block(s32* acc, const void* src, s16 gainL, s16 gainR) {
+        static_assert(Frames % 4 == 0, "NEON kernel works on 4 frame steps");
+        const s16* s = (const s16*)src;
+        const int16x4_t g = {gainL, gainR, gainL, gainR};
+        for (u32 i = 0; i < Frames * 2; i += 8) {
+            step(acc + i, s + i, g);
+        }
+    }
+
+    static void frames(s32* acc, const void* src, u32 count, s16 gainL, s16 gainR) {
+        const s16* s = (const s16*)src;
+        const int16x4_t g = {gainL, gainR, gainL, gainR};
+        u32 samples = count * 2;
+        u32 i = 0;
+        for (; i + 8 <= samples; i += 8) {
+            step(acc + i, s + i, g);
+        }
+        for (; i < samples; i += 2) {
+            acc[i] += ((s32)s[i] * gainL) >> 15;
+            acc[i + 1] += ((s32)s[i + 1] * gainR) >> 15;
+        }
+    }
+
+private:
+    static inline __attribute__((always_inline))
+    void step(s32* acc, const s16* src, int16x4_t g) {
+        int16x8_t s = vld1q_s16(src);
+        int32x4_t lo = vld1q_s32(acc);
+        int32x4_t hi = vld1q_s32(acc + 4);
+        lo = vsraq_n_s32(lo, vmull_s16(vget_low_s16(s), g), 15);
+        hi = vsraq_n_s32(hi, vmull_s16(vget_high_s16(s), g), 15);
+        vst1q_s32(acc, lo);
+        vst1q_s32(acc + 4, hi);
+    }
+};
+#endif
+
+/**
+ * Narrow the accumulator into the output format, saturating once
+ */
+template <SampleFormat DstFormat>
+struct StoreKernel {
+    using Traits = SampleTraits<DstFormat>;
+    using Dst = typename Traits::Type;
+
+    template <u32 Samples>
+    static void block(Dst* out, const s32* acc) {
+        run(out, acc, Samples);
+    }
+
+    static void samples(Dst* out, const s32* acc, u32 count) {
+        run(out, acc, count);
+    }
+
+private:
+    static inline __attribute__((always_inline))
+    void run(Dst* __restrict out, const s32* __restrict acc, u32 count) {
+        for (u32 i = 0; i < count; i++) {
+            out[i] = Traits::fromAccum(acc[i]);
+        }
+    }
+};
+
+#if defined(__ARM_NEON)
+template <>
+struct StoreKernel<SampleFormat_S16> {
+    template <u32 Samples>
+    static void block(s16* out, const s32* acc) {
+        static_assert(Samples % 8 == 0, "NEON kernel works on 8 sample steps");
+        for (u32 i = 0; i < Samples; i += 8) {
+            step(out + i, acc + i);
+        }
+    }
+
+    static void samples(s16* out, const s32* acc, u32 count) {
+        u32 i = 0;
+        for (; i + 8 <= count; i += 8) {
+            step(out + i, acc + i);
+        }
+        for (; i < count; i++) {
+            out[i] = SampleTraits<SampleFormat_S16>::fromAccum(acc[i]);
+        }
+    }
+
+private:
+    static inline __attribute__((always_inline))
+    void step(s16* out, const s32* acc) {
+        int16x4_t lo = vqmovn_s32(vld1q_s32(acc));
+        int16x4_t hi = vqmovn_s32(vld1q_s32(acc + 4));
+        vst1q_s16(out, vcombine_s16(lo, hi));
+    }
+};
+#endif
+
+/**
+ * Runtime fallback for source layouts without a specialization. Channels
+ * beyond the first two are dropped; branches are taken per sample.
+ */
+inline void accumulateGeneric(s32* acc, const void* src, u32 count,
+                              u32 srcChannels, SampleFormat srcFormat, u32 dstChannels,
+                              s16 gainL, s16 gainR) {
+    for (u32 f = 0; f < count; f++) {
+        u32 base = f * srcChannels;
+        u32 second = (srcChannels > 1) ? base + 1 : base;
+        s32 l, r;
+        if (srcFormat == SampleFormat_Float) {
+            l = SampleTraits<SampleFormat_Float>::toQ15(((const float*)src)[base]);
+            r = SampleTraits<SampleFormat_Float>::toQ15(((const float*)src)[second]);
+        } else {
+            l = ((const s16*)src)[base];
+            r = ((const s16*)src)[second];
+        }
+        if (dstChannels == 2) {
+            acc[f * 2] += (l * gainL) >> 15;
+            acc[f * 2 + 1] += (r * gainR) >> 15;
+        } else {
+            acc[f] += (((l + r) >> 1) * gainL) >> 15;
+        }
+    }
+}
+
+inline u32 sampleFormatSize(SampleFormat format) {
+    return (format == SampleFormat_Float) ? sizeof(float) : sizeof(s16);
+}
+
+/**
+ * Kernels bound to one voice. tile() renders exactly Output::TILE_FRAMES,
+ * frames() the tail shorter than a tile.
+ */
+struct VoiceKernels {
+    using TileFn = void (*)(s32* acc, const void* src, s16 gainL, s16 gainR);
+    using FramesFn = void (*)(s32* acc, const void* src, u32 count, s16 gainL, s16 gainR);
+
+    TileFn tile = nullptr;     // Null when only the runtime fallback applies
+    FramesFn frames = nullptr;
+};
+
+template <typename Output>
+struct KernelTable {
+    template <u32 SrcChannels, SampleFormat SrcFormat>
+    static VoiceKernels make() {
+        using K = AccumulateKernel<SrcChannels, SrcFormat, Output::CHANNELS>;
+        VoiceKernels k;
+        k.tile = &K::template block<Output::TILE_FRAMES>;
+        k.frames = &K::frames;
+        return k;
+    }
+
+    static VoiceKernels select(u32 srcChannels, SampleFormat srcFormat) {
+        if (srcChannels == 2 && srcFormat == SampleFormat_S16) return make<2, SampleFormat_S16>();
+        if (srcChannels == 1 && srcFormat == SampleFormat_S16) return make<1, SampleFormat_S16>();
+        if (srcChannels == 2 && srcFormat == SampleFormat_Float) return make<2, SampleFormat_Float>();
+        if (srcChannels == 1 && srcFormat == SampleFormat_Float) return make<1, SampleFormat_Float>();
+        return VoiceKernels();
+    }
+};
+
+/**
+ * acc += span of any length, as whole tiles plus the tail
+ */
+template <typename Output>
+inline void accumulateSpan(const VoiceKernels& kernels, s32* acc, const u8* src, u32 count,
+                           u32 frameBytes, s16 gainL, s16 gainR) {
+    u32 f = 0;
+    for (; f + Output::TILE_FRAMES <= count; f += Output::TILE_FRAMES) {
+        kernels.tile(acc + f * Output::CHANNELS, src + f * frameBytes, gainL, gainR);
+    }
+    if (f < count) {
+        kernels.frames(acc + f * Output::CHANNELS, src + f * frameBytes, count - f, gainL, gainR);
+    }
+}
+
+/**
+ * Narrow any number of frames of the accumulator, as whole tiles plus the tail
+ */
+template <typename Output>
+inline void storeSpan(typename Output::Sample* out, const s32* acc, u32 frames) {
+    using Store = StoreKernel<Output::FORMAT>;
+    u32 samples = frames * Output::CHANNELS;
+    u32 i = 0;
+    for (; i + Output::TILE_SAMPLES <= samples; i += Output::TILE_SAMPLES) {
+        Store::template block<Output::TILE_SAMPLES>(out + i, acc + i);
+    }
+    if (i < samples) {
+        Store::samples(out + i, acc + i, samples - i);
+    }
+}
@@ -0,0 +1,310 @@
+#pragma once
+#include <switch.h>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "../../common/xmusic_ipc.h"
+
+/**
+ * Spectrum and level analyzer for overlays
+ *
+ * Fed from the audio thread with blocks it has already rendered. Each block
+ * is folded to mono and decimated by two into a history of FFT_SIZE samples,
+ * and every update period within the block the history is windowed and run
+ * through one FFT_SIZE point FFT. A 4096-frame block spans 85ms, so one
+ * block yields several frames at 30Hz; each is stamped with the tick at
+ * which its audio is heard, so clients show them at the right moment even
+ * though the block was rendered ahead. Band energies and peak/RMS meters go
+ * into a ring of seqlocked slots in shared memory that clients read without
+ * IPC (see xmusicReadAnalyzer).
+ *
+ * The cost is one FFT per update plus one pass over each block, and nothing
+ * at all while no client is subscribed.
+ */
+class SpectrumAnalyzer {
+public:
+    static constexpr u32 FFT_SIZE = 512;
+    static constexpr u32 DECIMATION = 2;
+    static constexpr u32 DEFAULT_RATE_HZ = 30;
+    static constexpr u32 MAX_RATE_HZ = 60;
+
+private:
+    static constexpr u32 FFT_BITS = 9;
+    static_assert((1u << FFT_BITS) == FFT_SIZE, "FFT_SIZE must match FFT_BITS");
+    static constexpr float MIN_BAND_HZ = 60.0f;
+    static constexpr float MAX_BAND_HZ = 12000.0f;
+    static constexpr float FLOOR_DB = -60.0f;
+    static_assert(sizeof(XMusicAnalyzerShared) <= 0x1000, "analyzer page is one shared memory page");
+
+    u32 m_sampleRate;
+    std::atomic<u32> m_subscribers{0};
+    std::atomic<u32> m_rateHz{DEFAULT_RATE_HZ};
+
+    // Audio thread state between updates
+    u32 m_framesSinceUpdate = 0;
+    s32 m_peak[2] = {0, 0};
+    u64 m_sumSq[2] = {0, 0};
+    float m_history[FFT_SIZE] = {};     // Decimated mono, m_historyPos is the oldest
+    u32 m_historyPos = 0;
+    float m_carry = 0.0f;               // First frame of a decimation pair split across blocks
+    bool m_hasCarry = false;
+
+#ifdef __SWITCH__
+    SharedMemory m_shmem;
+#endif
+    XMusicAnalyzerShared* m_shared = nullptr;
+    u32 m_sequence = 0;
+
+    // Precomputed tables
+    alignas(16) float m_window[FFT_SIZE];
+    alignas(16) float m_twRe[FFT_SIZE];   // Per-stage twiddles, stage with half h starts at h - 1
+    alignas(16) float m_twIm[FFT_SIZE];
+    u16 m_bitrev[FFT_SIZE];
+    u16 m_bandStart[XMUSIC_ANALYZER_BANDS + 1];
+
+    // Work buffers in split real/imaginary layout
+    alignas(16) float m_re[FFT_SIZE];
+    alignas(16) float m_im[FFT_SIZE];
+
+    void buildTables() {
+        for (u32 i = 0; i < FFT_SIZE; i++) {
+            m_window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / (FFT_SIZE - 1));
+
+            u32 r = 0;
+            for (u32 b = 0; b < FFT_BITS; b++) {
+                r |= ((i >> b) & 1) << (FFT_BITS - 1 - b);
+            }
+            m_bitrev[i] = (u16)r;
+        }
+
+        // Twiddles laid out contiguously per stage so butterflies load them linearly
+        for (u32 half = 1; half < FFT_SIZE; half <<= 1) {
+            for (u32 k = 0; k < half; k++) {
+                float angle = -(float)M_PI * k / half;
+                m_twRe[half - 1 + k] = cosf(angle);
+                m_twIm[half - 1 + k] = sinf(angle);
+            }
+        }
+
+        // Log-spaced band edges in FFT bins of the decimated signal
+        float binHz = (float)m_sampleRate / DECIMATION / FFT_SIZE;
+        for (u32 b = 0; b <= XMUSIC_ANALYZER_BANDS; b++) {
+            float hz = MIN_BAND_HZ * powf(MAX_BAND_HZ / MIN_BAND_HZ, (float)b / XMUSIC_ANALYZER_BANDS);
+            u32 bin = (u32)(hz / binHz + 0.5f);
+            m_bandStart[b] = (u16)std::max(1u, std::min(FFT_SIZE / 2, bin));
+        }
+        for (u32 b = 1; b <= XMUSIC_ANALYZER_BANDS; b++) {
+            m_bandStart[b] = std::max<u16>(m_bandStart[b], m_bandStart[b - 1] + 1);
+        }
+    }
+
+    /**
+     * In-place radix-2 FFT on m_re/m_im, input already in bit-reversed order
+     */
+    void fft() {
+        for (u32 half = 1; half < FFT_SIZE; half <<= 1) {
+            const float* twRe = m_twRe + half - 1;
+            const float* twIm = m_twIm + half - 1;
+
+            for (u32 base = 0; base < FFT_SIZE; base += half * 2) {
+                float* aRe = m_re + base;
+                float* aIm = m_im + base;
+                float* bRe = aRe + half;
+                float* bIm = aIm + half;
+
+                u32 k = 0;
+#if defined(__ARM_NEON)
+                for (; k + 4 <= half; k += 4) {
+                    float32x4_t wr = vld1q_f32(twRe + k);
+                    float32x4_t wi = vld1q_f32(twIm + k);
+                    float32x4_t xr = vld1q_f32(bRe + k);
+                    float32x4_t xi = vld1q_f32(bIm + k);
+                    float32x4_t tr = vmlsq_f32(vmulq_f32(xr, wr), xi, wi);
+                    float32x4_t ti = vmlaq_f32(vmulq_f32(xr, wi), xi, wr);
+                    float32x4_t ur = vld1q_f32(aRe + k);
+                    float32x4_t ui = vld1q_f32(aIm + k);
+                    vst1q_f32(aRe + k, vaddq_f32(ur, tr));
+                    vst1q_f32(aIm + k, vaddq_f32(ui, ti));
+                    vst1q_f32(bRe + k, vsubq_f32(ur, tr));
+                    vst1q_f32(bIm + k, vsubq_f32(ui, ti));
+                }
+#endif
+                for (; k < half; k++) {
+                    float tr = bRe[k] * twRe[k] - bIm[k] * twIm[k];
+                    float ti = bRe[k] * twIm[k] + bIm[k] * twRe[k];
+                    bRe[k] = aRe[k] - tr;
+                    bIm[k] = aIm[k] - ti;
+                    aRe[k] += tr;
+                    aIm[k] += ti;
+                }
+            }
+        }
+    }
+
+    void resetMeters() {
+        m_framesSinceUpdate = 0;
+        m_peak[0] = m_peak[1] = 0;
+        m_sumSq[0] = m_sumSq[1] = 0;
+    }
+
+    /**
+     * Meters and history for a run of frames inside one update period
+     */
+    void accumulate(const s16* block, u32 frames) {
+        for (u32 i = 0; i < frames; i++) {
+            s32 l = block[i * 2];
+            s32 r = block[i * 2 + 1];
+            m_peak[0] = std::max(m_peak[0], std::abs(l));
+            m_peak[1] = std::max(m_peak[1], std::abs(r));
+            m_sumSq[0] += (u64)(l * l);
+            m_sumSq[1] += (u64)(r * r);
+
+            float mono = (float)(l + r);
+            if (m_hasCarry) {
+                m_history[m_historyPos] = (m_carry + mono) * (0.25f / 32768.0f);
+                m_historyPos = (m_historyPos + 1) % FFT_SIZE;
+            } else {
+                m_carry = mono;
+            }
+            m_hasCarry = !m_hasCarry;
+        }
+        m_framesSinceUpdate += frames;
+    }
+
+    void analyze(u64 tick) {
+        XMusicAnalyzerFrame frame = {};
+        frame.sampleRate = m_sampleRate;
+        frame.tick = tick;
+
+        u32 frames = std::max(1u, m_framesSinceUpdate);
+        for (u32 c = 0; c < 2; c++) {
+            frame.peak[c] = std::min(1.0f, m_peak[c] / 32768.0f);
+            frame.rms[c] = sqrtf((float)m_sumSq[c] / frames) / 32768.0f;
+        }
+
+        // Window the history, oldest first, into bit-reversed slots
+        for (u32 i = 0; i < FFT_SIZE; i++) {
+            u32 j = m_bitrev[i];
+            m_re[j] = m_history[(m_historyPos + i) % FFT_SIZE] * m_window[i];
+            m_im[j] = 0.0f;
+        }
+
+        fft();
+
+        for (u32 b = 0; b < XMUSIC_ANALYZER_BANDS; b++) {
+            float energy = 0.0f;
+            for (u32 k = m_bandStart[b]; k < m_bandStart[b + 1]; k++) {
+                energy += m_re[k] * m_re[k] + m_im[k] * m_im[k];
+            }
+            // A full-scale sine through the Hann window peaks at (FFT_SIZE / 4)^2
+            float db = 10.0f * log10f(energy * (16.0f / (FFT_SIZE * FFT_SIZE)) + 1e-12f);
+            frame.bands[b] = std::max(0.0f, std::min(1.0f, (db - FLOOR_DB) / -FLOOR_DB));
+        }
+
+        publish(frame);
+        resetMeters();
+    }
+
+    void publish(const XMusicAnalyzerFrame& frame) {
+        u32 next = (__atomic_load_n(&m_shared->active, __ATOMIC_RELAXED) + 1) % XMUSIC_ANALYZER_SLOTS;
+        XMusicAnalyzerFrame* slot = &m_shared->frames[next];
+
+        u32 seq = m_sequence + 1; // Odd, readers retry while they see it
+        __atomic_store_n(&slot->sequence, seq, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy((u8*)slot + sizeof(u32), (const u8*)&frame + sizeof(u32), sizeof(frame) - sizeof(u32));
+        m_sequence = seq + 1;
+        __atomic_store_n(&slot->sequence, m_sequence, __ATOMIC_RELEASE);
+        __atomic_store_n(&m_shared->active, next, __ATOMIC_RELEASE);
+    }
+
+public:
+    explicit SpectrumAnalyzer(u32 sampleRate) : m_sampleRate(sampleRate) {
+        buildTables();
+
+#ifdef __SWITCH__
+        if (R_SUCCEEDED(shmemCreate(&m_shmem, 0x1000, Perm_Rw, Perm_R))) {
+            if (R_SUCCEEDED(shmemMap(&m_shmem))) {
+                m_shared = (XMusicAnalyzerShared*)shmemGetAddr(&m_shmem);
+            } else {
+                shmemClose(&m_shmem);
+            }
+        }
+#else
+        m_shared = (XMusicAnalyzerShared*)aligned_alloc(0x1000, 0x1000);
+#endif
+        if (m_shared) {
+            memset(m_shared, 0, sizeof(*m_shared));
+        }
+    }
+
+    ~SpectrumAnalyzer() {
+#ifdef __SWITCH__
+        if (m_shared) {
+            shmemClose(&m_shmem);
+        }
+#else
+        free(m_shared);
+#endif
+    }
+
+    /**
+     * Shared memory handle handed to subscribing clients
+     */
+    Handle getSharedHandle() const {
+#ifdef __SWITCH__
+        return m_shared ? shmemGetHandle(&m_shmem) : INVALID_HANDLE;
+#else
+        return INVALID_HANDLE;
+#endif
+    }
+
+    const XMusicAnalyzerShared* getShared() const { return m_shared; }
+
+    void subscribe() {
+        m_subscribers.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void unsubscribe() {
+        u32 count = m_subscribers.load(std::memory_order_relaxed);
+        while (count > 0 && !m_subscribers.compare_exchange_weak(count, count - 1, std::memory_order_relaxed)) {
+        }
+    }
+
+    bool isActive() const {
+        return m_shared && m_subscribers.load(std::memory_order_relaxed) > 0;
+    }
+
+    void setRate(u32 hz) {
+        m_rateHz.store(std::max(1u, std::min(MAX_RATE_HZ, hz)), std::memory_order_relaxed);
+    }
+
+    /**
+     * Called by the audio thread with each rendered interleaved stereo block
+     * and the tick at which its first frame will be heard
+     */
+    void feed(const s16* block, u32 frames, u64 startTick) {
+        if (!isActive()) {
+            resetMeters();
+            m_hasCarry = false;
+            return;
+        }
+
+        u32 period = m_sampleRate / m_rateHz.load(std::memory_order_relaxed);
+        u64 tickFreq = armGetSystemTickFreq();
+        u32 done = 0;
+        while (done < frames) {
+            u32 n = std::min(frames - done, period - std::min(period, m_framesSinceUpdate));
+            accumulate(block + (size_t)done * 2, n);
+            done += n;
+            if (m_framesSinceUpdate >= period) {
+                analyze(startTick + (u64)done * tickFreq / m_sampleRate);
+            }
+        }
+    }
+};
@@ -0,0 +1,287 @@
+#pragma once
+#include <switch.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "trace.h"
+
+/**
+ * What the sysmodule was playing, restored after a restart
+ */
+enum PlaybackSource : u32 {
+    PlaybackSource_TestTone = 0,
+    PlaybackSource_Melody = 1,
+    PlaybackSource_Url = 2,
+    PlaybackSource_File = 3
+};
+
+struct PlaybackState {
+    u32 source;             // PlaybackSource
+    char url[256];          // PlaybackSource_Url, or the path for PlaybackSource_File
+    char title[128];
+    char artist[64];
+    u64 positionSamples;
+    float volume;
+    bool playing;
+};
+
+/**
+ * Crash-safe playback state journal on the SD card
+ *
+ * Each write appends one record with its own CRC: a small update with
+ * position, play state and volume, or a full snapshot when the track
+ * changed. A write torn by power loss therefore only drops that one record,
+ * never leaves half of a change applied. Restore reads the whole journal in
+ * one go and replays records up to the first bad one.
+ *
+ * update() is cheap and may be called as often as the state changes; the
+ * journal only touches the SD card once per WRITE_INTERVAL_NS, with whatever
+ * changed since the last write. Once the file passes COMPACT_SIZE it is
+ * rewritten as a single snapshot next to the journal and swapped in, the
+ * loader falls back to that copy if the swap was interrupted.
+ */
+class StateJournal {
+public:
+    static constexpr const char* JOURNAL_PATH = "sdmc:/config/xmusic/state.journal";
+    static constexpr u64 WRITE_INTERVAL_NS = 15000000000ULL; // At most 4 writes a minute
+    static constexpr u32 COMPACT_SIZE = 4096;
+
+private:
+    static constexpr u32 RECORD_MAGIC = 0x4A534D58; // "XMSJ"
+    static constexpr u32 MAX_JOURNAL_SIZE = COMPACT_SIZE * 4;
+
+    enum RecordType : u16 {
+        Record_Snapshot = 1,
+        Record_Update = 2
+    };
+
+    struct RecordHeader {
+        u32 magic;
+        u16 type;
+        u16 size;   // Payload bytes
+        u32 crc;    // Over type, size and payload
+    };
+
+    struct UpdateRecord {
+        u64 positionSamples;
+        float volume;
+        u32 playing;
+    };
+
+    std::string m_path;
+    std::string m_compactPath;
+
+    PlaybackState m_pending = {};   // Latest state handed to update()
+    PlaybackState m_written = {};   // State the journal on disk replays to
+    bool m_dirty = false;
+    bool m_haveWritten = false;
+    bool m_needsCompact = false;    // File has a torn tail that appends would hide behind
+    u64 m_lastWriteTick = 0;
+    u32 m_fileSize = 0;
+
+    // Stats
+    u32 m_writes = 0;
+    u32 m_compactions = 0;
+
+    static u32 recordCrc(u16 type, u16 size, const void* payload) {
+        u8 buf[sizeof(u16) * 2 + sizeof(PlaybackState)];
+        memcpy(buf, &type, sizeof(type));
+        memcpy(buf + sizeof(type), &size, sizeof(size));
+        memcpy(buf + sizeof(type) + sizeof(size), payload, size);
+        return crc32Calculate(buf, sizeof(type) + sizeof(size) + size);
+    }
+
+    static void appendRecord(std::vector<u8>& out, u16 type, const void* payload, u16 size) {
+        RecordHeader header = {RECORD_MAGIC, type, size, recordCrc(type, size, payload)};
+        const u8* h = (const u8*)&header;
+        out.insert(out.end(), h, h + sizeof(header));
+        out.insert(out.end(), (const u8*)payload, (const u8*)payload + size);
+    }
+
+    /**
+     * Replay a journal image, returns false if it holds no snapshot.
+     * validSize receives the length of the intact prefix.
+     */
+    static bool replay(const u8* data, u32 size, PlaybackState* out, u32* validSize) {
+        PlaybackState state = {};
+        bool haveSnapshot = false;
+        u32 pos = 0;
+
+        while (pos + sizeof(RecordHeader) <= size) {
+            RecordHeader header;
+            memcpy(&header, data + pos, sizeof(header));
+            const u8* payload = data + pos + sizeof(header);
+            if (header.magic != RECORD_MAGIC || pos + sizeof(header) + header.size > size ||
+                header.size > sizeof(PlaybackState) ||
+                recordCrc(header.type, header.size, payload) != header.crc) {
+                break; // Torn or garbage tail, everything before it stands
+            }
+
+            if (header.type == Record_Snapshot && header.size == sizeof(PlaybackState)) {
+                memcpy(&state, payload, sizeof(state));
+                haveSnapshot = true;
+            } else if (haveSnapshot && header.type == Record_Update && header.size == sizeof(UpdateRecord)) {
+                UpdateRecord r;
+                memcpy(&r, payload, sizeof(r));
+                state.positionSamples = r.positionSamples;
+                state.volume = r.volume;
+                state.playing = r.playing != 0;
+            }
+            pos += sizeof(header) + header.size;
+        }
+        *validSize = pos;
+
+        if (haveSnapshot) {
+            state.url[sizeof(state.url) - 1] = '\0';
+            state.title[sizeof(state.title) - 1] = '\0';
+            state.artist[sizeof(state.artist) - 1] = '\0';
+            *out = state;
+        }
+        return haveSnapshot;
+    }
+
+    static bool loadFile(const char* path, PlaybackState* out, u32* fileSize, u32* validSize) {
+        FILE* f = fopen(path, "rb");
+        if (!f) return false;
+
+        std::vector<u8> data(MAX_JOURNAL_SIZE);
+        u32 size = (u32)fread(data.data(), 1, data.size(), f);
+        fclose(f);
+
+        *fileSize = size;
+        return replay(data.data(), size, out, validSize);
+    }
+
+    /**
+     * Rewrite the journal as one snapshot, written aside and swapped in
+     */
+    Result compact(const PlaybackState& state) {
+        std::vector<u8> data;
+        appendRecord(data, Record_Snapshot, &state, sizeof(state));
+
+        mkdir("sdmc:/config/xmusic", 0777);
+        FILE* f = fopen(m_compactPath.c_str(), "wb");
+        if (!f) return MAKERESULT(Module_Libnx, LibnxError_NotFound);
+        bool ok = fwrite(data.data(), 1, data.size(), f) == data.size() && fflush(f) == 0;
+        fclose(f);
+        if (!ok) return MAKERESULT(Module_Libnx, LibnxError_IoError);
+
+        // rename() does not replace on the SD card; load() picks up the copy if we stop in between
+        remove(m_path.c_str());
+        if (rename(m_compactPath.c_str(), m_path.c_str()) != 0) {
+            return MAKERESULT(Module_Libnx, LibnxError_IoError);
+        }
+
+        m_fileSize = (u32)data.size();
+        m_needsCompact = false;
+        m_compactions++;
+        return 0;
+    }
+
+    Result append(const std::vector<u8>& records) {
+        FILE* f = fopen(m_path.c_str(), "ab");
+        if (!f) return MAKERESULT(Module_Libnx, LibnxError_NotFound);
+        bool ok = fwrite(records.data(), 1, records.size(), f) == records.size() && fflush(f) == 0;
+        fclose(f);
+        if (!ok) {
+            m_needsCompact = true; // Part of it may have landed
+            return MAKERESULT(Module_Libnx, LibnxError_IoError);
+        }
+
+        m_fileSize += (u32)records.size();
+        return 0;
+    }
+
+public:
+    explicit StateJournal(const char* path = JOURNAL_PATH) : m_path(path), m_compactPath(m_path + ".new") {}
+
+    /**
+     * Restore the last saved state with a single read of the journal
+     */
+    bool load(PlaybackState* out) {
+        u32 size = 0, valid = 0;
+        bool ok = loadFile(m_path.c_str(), out, &size, &valid);
+        if (!ok) {
+            // Interrupted compaction: the journal is gone but its replacement is complete
+            ok = loadFile(m_compactPath.c_str(), out, &size, &valid);
+            if (ok) {
+                rename(m_compactPath.c_str(), m_path.c_str());
+            }
+        }
+
+        if (ok) {
+            m_written = *out;
+            m_pending = *out;
+            m_haveWritten = true;
+            m_fileSize = size;
+            m_needsCompact = valid != size;
+        }
+        m_dirty = false;
+        return ok;
+    }
+
+    /**
+     * Record the current state, written out once the interval has passed
+     */
+    void update(const PlaybackState& state, u64 nowTick) {
+        m_pending = state;
+        m_dirty = true;
+
+        if (m_lastWriteTick && armTicksToNs(nowTick - m_lastWriteTick) < WRITE_INTERVAL_NS) {
+            return;
+        }
+        if (R_SUCCEEDED(flush())) {
+            m_lastWriteTick = nowTick;
+        }
+    }
+
+    /**
+     * Whether update() would write now, lets callers skip building a state
+     */
+    bool isDue(u64 nowTick) const {
+        return !m_lastWriteTick || armTicksToNs(nowTick - m_lastWriteTick) >= WRITE_INTERVAL_NS;
+    }
+
+    /**
+     * Write pending changes now, e.g. on shutdown
+     */
+    Result flush() {
+        if (!m_dirty) return 0;
+        const PlaybackState& s = m_pending;
+
+        // One record per write, so a torn write never applies half a change
+        std::vector<u8> records;
+        bool sameTrack = m_haveWritten && s.source == m_written.source && strcmp(s.url, m_written.url) == 0 &&
+                         strcmp(s.title, m_written.title) == 0 && strcmp(s.artist, m_written.artist) == 0;
+        if (!sameTrack) {
+            appendRecord(records, Record_Snapshot, &s, sizeof(s));
+        } else if (s.positionSamples != m_written.positionSamples || s.volume != m_written.volume ||
+                   s.playing != m_written.playing) {
+            UpdateRecord r = {s.positionSamples, s.volume, s.playing};
+            appendRecord(records, Record_Update, &r, sizeof(r));
+        }
+
+        // Nothing usable on disk yet, a torn tail, or time to fold the records
+        XMUSIC_TRACE_SCOPE(TraceId_JournalWrite, (u32)records.size());
+        Result rc = 0;
+        bool rewrite = !m_haveWritten || m_needsCompact || m_fileSize + records.size() > COMPACT_SIZE;
+        if (rewrite) {
+            rc = compact(s);
+        } else if (!records.empty()) {
+            rc = append(records);
+        }
+        if (R_FAILED(rc)) return rc;
+
+        if (rewrite || !records.empty()) m_writes++;
+        m_written = s;
+        m_haveWritten = true;
+        m_dirty = false;
+        return 0;
+    }
+
+    u32 getWrites() const { return m_writes; }
+    u32 getCompactions() const { return m_compactions; }
+    u32 getFileSize() const { return m_fileSize; }
+};
@@ -0,0 +1,272 @@
+#pragma once
+#include <switch.h>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ * Pitch-preserving speed change (WSOLA)
+ *
+ * Stretches the music voice on its way to audout; the other voices are
+ * mixed in after it, at normal speed and without its latency. Output is
+ * built from SEQUENCE-frame segments of the input; each one starts near
+ * where the speed says it should (the nominal position) but is moved by up
+ * to SEEK frames to the offset whose start best matches the tail of the
+ * previous segment, then cross-faded over OVERLAP frames. Skipping or repeating whole waveform
+ * periods this way changes duration without touching pitch.
+ *
+ * The search correlates a mono float copy of the input, first every
+ * COARSE_STEP frames over the whole window and then frame by frame around
+ * the best hit. Input and output live in fixed buffers sized for the
+ * fastest speed, nothing is allocated while playing.
+ *
+ * Audio thread only, except setSpeed() and requestReset().
+ */
+class TimeStretch {
+public:
+    static constexpr float MIN_SPEED = 0.5f;
+    static constexpr float MAX_SPEED = 2.0f;
+    static constexpr u32 MAX_BLOCK_FRAMES = 4096;
+
+private:
+    static constexpr u32 CHANNELS = 2;
+    static constexpr u32 SEQUENCE = 1920;   // 40ms segments
+    static constexpr u32 OVERLAP = 384;     // 8ms cross-fade
+    static constexpr u32 SEEK = 720;        // 15ms search window
+    static constexpr u32 COARSE_STEP = 8;
+    static constexpr u32 HOP = SEQUENCE - OVERLAP; // Output frames per segment
+    static constexpr u32 PULL_FRAMES = 1024;
+
+    // Enough input for one segment at MAX_SPEED plus one pull
+    static constexpr u32 MAX_REQUIRED = (u32)(HOP * MAX_SPEED) + OVERLAP + SEEK + 1;
+    static constexpr u32 INPUT_FRAMES = MAX_REQUIRED + PULL_FRAMES;
+    static constexpr u32 OUTPUT_FRAMES = MAX_BLOCK_FRAMES + HOP;
+
+    std::atomic<float> m_speed{1.0f};
+    std::atomic<bool> m_resetRequested{false};
+    float m_activeSpeed = 1.0f;
+    bool m_active = false;
+
+    // Input not yet consumed, index 0 is the nominal position of the next segment
+    alignas(16) s16 m_in[INPUT_FRAMES * CHANNELS];
+    alignas(16) float m_mono[INPUT_FRAMES];
+    u32 m_inFrames = 0;
+
+    // Tail of the last segment, faded into the next one
+    alignas(16) s16 m_mid[OVERLAP * CHANNELS];
+    alignas(16) float m_ref[OVERLAP];     // Weighted mono copy of m_mid
+    alignas(16) float m_weight[OVERLAP];
+    bool m_haveMid = false;
+
+    alignas(16) s16 m_out[OUTPUT_FRAMES * CHANNELS];
+    u32 m_outFrames = 0;
+
+    float m_skipFraction = 0.0f;
+    u64 m_pulled = 0;       // Input frames taken from the source
+    u64 m_discarded = 0;    // Input frames the nominal position has moved past
+
+    void clear() {
+        m_inFrames = 0;
+        m_outFrames = 0;
+        m_haveMid = false;
+        m_skipFraction = 0.0f;
+        m_pulled = 0;
+        m_discarded = 0;
+    }
+
+    static float dot(const float* a, const float* b, u32 n, float* energy) {
+        u32 i = 0;
+        float c = 0.0f, e = 0.0f;
+#if defined(__ARM_NEON)
+        float32x4_t c0 = vdupq_n_f32(0.0f), c1 = c0, e0 = c0, e1 = c0;
+        for (; i + 8 <= n; i += 8) {
+            float32x4_t x0 = vld1q_f32(b + i);
+            float32x4_t x1 = vld1q_f32(b + i + 4);
+            c0 = vmlaq_f32(c0, vld1q_f32(a + i), x0);
+            c1 = vmlaq_f32(c1, vld1q_f32(a + i + 4), x1);
+            e0 = vmlaq_f32(e0, x0, x0);
+            e1 = vmlaq_f32(e1, x1, x1);
+        }
+        c = vaddvq_f32(vaddq_f32(c0, c1));
+        e = vaddvq_f32(vaddq_f32(e0, e1));
+#endif
+        for (; i < n; i++) {
+            c += a[i] * b[i];
+            e += b[i] * b[i];
+        }
+        *energy = e;
+        return c;
+    }
+
+    float score(u32 offset) const {
+        float energy;
+        float c = dot(m_ref, m_mono + offset, OVERLAP, &energy);
+        return c / sqrtf(energy + 1.0f);
+    }
+
+    u32 bestOffset() const {
+        u32 best = 0;
+        float bestScore = -INFINITY;
+        for (u32 o = 0; o < SEEK; o += COARSE_STEP) {
+            float s = score(o);
+            if (s > bestScore) {
+                bestScore = s;
+                best = o;
+            }
+        }
+
+        u32 from = best > COARSE_STEP ? best - COARSE_STEP + 1 : 0;
+        u32 to = std::min(SEEK - 1, best + COARSE_STEP - 1);
+        u32 coarse = best;
+        for (u32 o = from; o <= to; o++) {
+            if (o == coarse) continue;
+            float s = score(o);
+            if (s > bestScore) {
+                bestScore = s;
+                best = o;
+            }
+        }
+        return best;
+    }
+
+    void setMid(const s16* src) {
+        memcpy(m_mid, src, sizeof(m_mid));
+        for (u32 i = 0; i < OVERLAP; i++) {
+            m_ref[i] = ((s32)src[i * 2] + src[i * 2 + 1]) * m_weight[i];
+        }
+        m_haveMid = true;
+    }
+
+    u32 required(float speed) const {
+        u32 skip = (u32)(HOP * speed + m_skipFraction) + 1;
+        return std::max(skip + OVERLAP, SEQUENCE) + SEEK;
+    }
+
+    /**
+     * Build one segment into the output buffer and advance the input
+     */
+    void processSegment(float speed) {
+        u32 offset = m_haveMid ? bestOffset() : 0;
+        const s16* seg = m_in + offset * CHANNELS;
+        s16* out = m_out + m_outFrames * CHANNELS;
+
+        if (m_haveMid) {
+            for (u32 i = 0; i < OVERLAP; i++) {
+                s32 fadeIn = (s32)i;
+                s32 fadeOut = (s32)(OVERLAP - i);
+                for (u32 c = 0; c < CHANNELS; c++) {
+                    out[i * CHANNELS + c] = (s16)((m_mid[i * CHANNELS + c] * fadeOut + seg[i * CHANNELS + c] * fadeIn) / (s32)OVERLAP);
+                }
+            }
+        } else {
+            memcpy(out, seg, OVERLAP * CHANNELS * sizeof(s16));
+        }
+        memcpy(out + OVERLAP * CHANNELS, seg + OVERLAP * CHANNELS, (HOP - OVERLAP) * CHANNELS * sizeof(s16));
+        m_outFrames += HOP;
+        setMid(seg + HOP * CHANNELS);
+
+        // Move the nominal position on by the speed-scaled hop
+        float skip = HOP * speed + m_skipFraction;
+        u32 whole = (u32)skip;
+        m_skipFraction = skip - whole;
+        whole = std::min(whole, m_inFrames);
+
+        m_inFrames -= whole;
+        m_discarded += whole;
+        memmove(m_in, m_in + whole * CHANNELS, m_inFrames * CHANNELS * sizeof(s16));
+        memmove(m_mono, m_mono + whole, m_inFrames * sizeof(float));
+    }
+
+public:
+    TimeStretch() {
+        // Weight the middle of the reference, its edges are the least reliable match
+        for (u32 i = 0; i < OVERLAP; i++) {
+            m_weight[i] = (float)(i * (OVERLAP - i)) / (OVERLAP * OVERLAP / 4);
+        }
+    }
+
+    /**
+     * Any thread: new playback speed, applied at the next block
+     */
+    void setSpeed(float speed) {
+        m_speed.store(std::max(MIN_SPEED, std::min(MAX_SPEED, speed)), std::memory_order_relaxed);
+    }
+
+    float getSpeed() const {
+        return m_speed.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Any thread: drop buffered audio, e.g. after a seek or track change
+     */
+    void requestReset() {
+        m_resetRequested.store(true, std::memory_order_release);
+    }
+
+    /**
+     * Audio thread: apply pending changes, true if blocks must go through
+     * render(). At 1x the stage keeps running until the next reset so the
+     * audio it already buffered is not skipped.
+     */
+    bool update() {
+        m_activeSpeed = m_speed.load(std::memory_order_relaxed);
+        if (m_resetRequested.exchange(false, std::memory_order_acquire)) {
+            clear();
+            m_active = false;
+        }
+        if (m_activeSpeed != 1.0f) {
+            m_active = true;
+        }
+        return m_active;
+    }
+
+    /**
+     * Audio thread: fill out with frames of stretched audio, calling
+     * pull(dst, frames) for more source audio as needed
+     */
+    template <typename Pull>
+    void render(s16* out, u32 frames, Pull&& pull) {
+        float speed = m_activeSpeed;
+        frames = std::min(frames, MAX_BLOCK_FRAMES);
+
+        while (m_outFrames < frames) {
+            u32 need = required(speed);
+            while (m_inFrames < need) {
+                u32 n = std::min(PULL_FRAMES, INPUT_FRAMES - m_inFrames);
+                s16* dst = m_in + m_inFrames * CHANNELS;
+                pull(dst, n);
+                for (u32 i = 0; i < n; i++) {
+                    m_mono[m_inFrames + i] = (s32)dst[i * 2] + dst[i * 2 + 1];
+                }
+                m_inFrames += n;
+                m_pulled += n;
+            }
+            processSegment(speed);
+        }
+
+        memcpy(out, m_out, frames * CHANNELS * sizeof(s16));
+        m_outFrames -= frames;
+        memmove(m_out, m_out + frames * CHANNELS, m_outFrames * CHANNELS * sizeof(s16));
+    }
+
+    /**
+     * Audio thread: source frames pulled but not yet heard through the output
+     * of render(), i.e. how far the source runs ahead of the next output frame
+     */
+    u64 getInputLatency() const {
+        u64 behind = m_pulled - m_discarded;
+        u64 queued = (u64)(m_outFrames * m_activeSpeed);
+        return behind + queued;
+    }
+
+    /**
+     * Audio thread: source frames that frames of output stand for
+     */
+    u32 sourceFrames(u32 frames) const {
+        return (u32)(frames * m_activeSpeed + 0.5f);
+    }
+};
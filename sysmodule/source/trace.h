@@ -0,0 +1,294 @@
+#pragma once
+#include <switch.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <sys/stat.h>
+
+/**
+ * In-process binary trace
+ *
+ * Every thread writes {tick, id, phase, payload} events into its own fixed
+ * ring, claimed on first use from a static pool. Writing an event is a
+ * handful of stores with no locks and no allocation, so trace points can
+ * stay in the audio thread permanently.
+ *
+ * A ring is released when its thread exits but keeps its events for dumps.
+ * The next thread with the same name continues it, so a decode thread per
+ * track uses one ring. Other new threads take a free ring, then the retired
+ * ring that has been idle longest. Only MAX_THREADS threads alive at once
+ * can trace. A dump copies the last few seconds
+ * of every ring to the SD card; tools/xmusic_trace.py turns that file into
+ * Chrome trace JSON (chrome://tracing, Perfetto).
+ *
+ * Build with XMUSIC_NO_TRACE to compile the trace points out entirely.
+ */
+enum TraceId : u16 {
+    TraceId_AudioMix = 0,       // Scope, payload: frames
+    TraceId_AudioSubmit,        // Instant, payload: blocks queued
+    TraceId_AudioWait,          // Scope around audoutWaitPlayFinish
+    TraceId_AudioRelease,       // Instant, payload: blocks released
+    TraceId_IpcCommand,         // Scope, payload: command id
+    TraceId_ReadAheadFill,      // Scope, payload: file offset in KB
+    TraceId_ReadAheadWait,      // Scope, reader blocked on the I/O thread
+    TraceId_HttpConnect,        // Scope, payload: resume offset in KB
+    TraceId_HttpReceive,        // Instant, payload: bytes
+    TraceId_Decode,             // Scope, payload: frames decoded
+    TraceId_IndexBuild,         // Scope, payload: track size in KB
+    TraceId_ArtExtract,         // Scope
+    TraceId_JournalWrite,       // Scope, payload: journal bytes
+    TraceId_Count
+};
+
+static const char* const TRACE_NAMES[TraceId_Count] = {
+    "AudioMix", "AudioSubmit", "AudioWait", "AudioRelease", "IpcCommand",
+    "ReadAheadFill", "ReadAheadWait", "HttpConnect", "HttpReceive", "Decode",
+    "IndexBuild", "ArtExtract", "JournalWrite"
+};
+
+enum TracePhase : u8 {
+    TracePhase_Begin = 'B',
+    TracePhase_End = 'E',
+    TracePhase_Instant = 'i'
+};
+
+struct TraceEvent {
+    u64 tick;       // armGetSystemTick
+    u16 id;         // TraceId
+    u8 phase;       // TracePhase
+    u8 reserved;
+    u32 payload;
+};
+
+class Trace {
+public:
+    static constexpr u32 MAX_THREADS = 8;
+    static constexpr u32 RING_EVENTS = 1024; // 16KB per thread
+    static constexpr const char* DUMP_PATH = "sdmc:/config/xmusic/trace.bin";
+
+private:
+    static_assert((RING_EVENTS & (RING_EVENTS - 1)) == 0, "RING_EVENTS must be a power of two");
+    static constexpr u32 FILE_MAGIC = 0x52544D58; // "XMTR"
+    static constexpr u32 FILE_VERSION = 1;
+
+    enum RingState : u32 {
+        RingState_Free = 0,
+        RingState_Owned,        // A live thread writes it
+        RingState_Retired       // Its thread exited, events kept until another name takes it
+    };
+
+    struct Ring {
+        std::atomic<u32> head;  // Events ever written, only the owning thread stores
+        std::atomic<u32> state;
+        u32 base;               // Head when the current name took it, under s_dumpMutex
+        char name[16];          // Under s_dumpMutex
+        TraceEvent events[RING_EVENTS];
+    };
+
+    // Gives the ring back when its thread exits
+    struct RingHolder {
+        Ring* ring;
+
+        constexpr RingHolder() : ring(nullptr) {}
+        ~RingHolder() {
+            if (ring) ring->state.store(RingState_Retired, std::memory_order_release);
+        }
+    };
+
+    struct FileHeader {
+        u32 magic;
+        u32 version;
+        u64 tickFrequency;
+        u32 threadCount;
+        u32 idCount;        // Followed by idCount names of 24 bytes
+    };
+
+    struct FileThread {
+        char name[16];
+        u32 eventCount;     // Followed by eventCount TraceEvents
+        u32 reserved;
+    };
+
+    static inline Ring s_rings[MAX_THREADS];
+    static inline std::atomic<bool> s_enabled{true};
+    static inline thread_local RingHolder t_ring;
+
+    // Claims and dumps
+    static inline std::mutex s_dumpMutex;
+    static inline TraceEvent s_dumpEvents[RING_EVENTS];
+
+    static u64 lastTick(const Ring& ring) {
+        u32 head = ring.head.load(std::memory_order_acquire);
+        return head > ring.base ? ring.events[(head - 1) & (RING_EVENTS - 1)].tick : 0;
+    }
+
+    static Ring* claim(const char* name) {
+        std::lock_guard<std::mutex> lock(s_dumpMutex);
+
+        // Same name first, then a ring never used, then the one retired longest ago
+        Ring* sameName = nullptr;
+        Ring* unused = nullptr;
+        Ring* oldest = nullptr;
+        for (Ring& ring : s_rings) {
+            u32 state = ring.state.load(std::memory_order_acquire);
+            if (state == RingState_Retired && strncmp(ring.name, name, sizeof(ring.name) - 1) == 0) {
+                sameName = &ring;
+                break;
+            }
+            if (state == RingState_Free && !unused) {
+                unused = &ring;
+            } else if (state == RingState_Retired && (!oldest || lastTick(ring) < lastTick(*oldest))) {
+                oldest = &ring;
+            }
+        }
+
+        Ring* ring = sameName ? sameName : unused ? unused : oldest;
+        if (!ring) return nullptr;
+        if (ring != sameName) {
+            // Events of the previous name are not ours to dump
+            ring->base = ring->head.load(std::memory_order_relaxed);
+            memset(ring->name, 0, sizeof(ring->name));
+            strncpy(ring->name, name, sizeof(ring->name) - 1);
+        }
+        ring->state.store(RingState_Owned, std::memory_order_release);
+        return ring;
+    }
+
+    /**
+     * Copy the events of one ring newer than minTick, dropping any the
+     * owner may have overwritten while we copied
+     */
+    static u32 snapshot(Ring& ring, u64 minTick) {
+        u32 head = ring.head.load(std::memory_order_acquire);
+        u32 first = std::max(head > RING_EVENTS ? head - RING_EVENTS : 0, ring.base);
+        for (u32 i = first; i < head; i++) {
+            s_dumpEvents[i - first] = ring.events[i & (RING_EVENTS - 1)];
+        }
+
+        // The slot after head may be mid-write, so the oldest copy is never trusted
+        u32 after = ring.head.load(std::memory_order_acquire);
+        u32 safe = after + 1 > RING_EVENTS ? after + 1 - RING_EVENTS : 0;
+        u32 skip = safe > first ? safe - first : 0;
+        if (skip >= head - first) return 0;
+
+        u32 count = head - first - skip;
+        memmove(s_dumpEvents, s_dumpEvents + skip, count * sizeof(TraceEvent));
+
+        u32 start = 0;
+        while (start < count && s_dumpEvents[start].tick < minTick) start++;
+        memmove(s_dumpEvents, s_dumpEvents + start, (count - start) * sizeof(TraceEvent));
+        return count - start;
+    }
+
+public:
+    /**
+     * Name the calling thread's ring, call first thing in a thread
+     */
+    static void registerThread(const char* name) {
+        if (!t_ring.ring) {
+            t_ring.ring = claim(name);
+        }
+    }
+
+    static void setEnabled(bool enabled) {
+        s_enabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    static bool isEnabled() {
+        return s_enabled.load(std::memory_order_relaxed);
+    }
+
+    static void emit(TraceId id, TracePhase phase, u32 payload = 0) {
+        if (!s_enabled.load(std::memory_order_relaxed)) return;
+
+        Ring* ring = t_ring.ring;
+        if (!ring) {
+            ring = t_ring.ring = claim("thread");
+            if (!ring) return;
+        }
+
+        u32 head = ring->head.load(std::memory_order_relaxed);
+        TraceEvent& e = ring->events[head & (RING_EVENTS - 1)];
+        e.tick = armGetSystemTick();
+        e.id = id;
+        e.phase = phase;
+        e.payload = payload;
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+
+    static void instant(TraceId id, u32 payload = 0) {
+        emit(id, TracePhase_Instant, payload);
+    }
+
+    /**
+     * Write the last seconds of every ring to path
+     */
+    static Result dump(u32 seconds, const char* path = DUMP_PATH) {
+        std::lock_guard<std::mutex> lock(s_dumpMutex);
+
+        u64 now = armGetSystemTick();
+        u64 span = armNsToTicks((u64)seconds * 1000000000ULL);
+        u64 minTick = (seconds && now > span) ? now - span : 0;
+
+        mkdir("sdmc:/config/xmusic", 0777);
+        FILE* f = fopen(path, "wb");
+        if (!f) return MAKERESULT(Module_Libnx, LibnxError_NotFound);
+
+        // Rings only leave Free under s_dumpMutex, so this set holds while we write
+        u32 threads = 0;
+        for (const Ring& ring : s_rings) {
+            if (ring.state.load(std::memory_order_acquire) != RingState_Free) threads++;
+        }
+        FileHeader header = {FILE_MAGIC, FILE_VERSION, armGetSystemTickFreq(), threads, TraceId_Count};
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+        for (u32 i = 0; ok && i < TraceId_Count; i++) {
+            char name[24] = {};
+            strncpy(name, TRACE_NAMES[i], sizeof(name) - 1);
+            ok = fwrite(name, sizeof(name), 1, f) == 1;
+        }
+
+        for (u32 t = 0; ok && t < MAX_THREADS; t++) {
+            if (s_rings[t].state.load(std::memory_order_acquire) == RingState_Free) continue;
+            FileThread thread = {};
+            memcpy(thread.name, s_rings[t].name, sizeof(thread.name));
+            thread.eventCount = snapshot(s_rings[t], minTick);
+            ok = fwrite(&thread, sizeof(thread), 1, f) == 1 &&
+                 fwrite(s_dumpEvents, sizeof(TraceEvent), thread.eventCount, f) == thread.eventCount;
+        }
+
+        ok = fclose(f) == 0 && ok;
+        return ok ? 0 : MAKERESULT(Module_Libnx, LibnxError_IoError);
+    }
+};
+
+/**
+ * Begin/end pair around a scope
+ */
+class TraceScope {
+    TraceId m_id;
+    u32 m_payload;
+
+public:
+    TraceScope(TraceId id, u32 payload = 0) : m_id(id), m_payload(payload) {
+        Trace::emit(id, TracePhase_Begin, payload);
+    }
+
+    ~TraceScope() {
+        Trace::emit(m_id, TracePhase_End, m_payload);
+    }
+};
+
+#ifdef XMUSIC_NO_TRACE
+#define XMUSIC_TRACE_SCOPE(id, payload) do {} while (0)
+#define XMUSIC_TRACE_INSTANT(id, payload) do {} while (0)
+#define XMUSIC_TRACE_THREAD(name) do {} while (0)
+#else
+#define XMUSIC_TRACE_CONCAT_(a, b) a##b
+#define XMUSIC_TRACE_CONCAT(a, b) XMUSIC_TRACE_CONCAT_(a, b)
+#define XMUSIC_TRACE_SCOPE(id, payload) TraceScope XMUSIC_TRACE_CONCAT(traceScope_, __LINE__)(id, payload)
+#define XMUSIC_TRACE_INSTANT(id, payload) Trace::instant(id, payload)
+#define XMUSIC_TRACE_THREAD(name) Trace::registerThread(name)
+#endif
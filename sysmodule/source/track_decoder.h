@@ -0,0 +1,423 @@
+#pragma once
+#include <switch.h>
+#include <cstring>
+#include <algorithm>
+#include "read_ahead.h"
+#include "frame_index.h"
+
+/**
+ * Decoder building blocks: compressed input, the decoder interface, a WAV
+ * decoder and the resampler to the output rate
+ *
+ * Decoders pull bytes from a ByteSource and produce interleaved s16 frames
+ * at the source's own rate and channel count (mono or stereo). The caller
+ * turns those into 48kHz stereo with a Resampler.
+ */
+
+/**
+ * Compressed input of a decoder
+ *
+ * read() blocks until data arrives and returns 0 only at the end of the
+ * input or after abort(). The first bytes can be looked at with sniff()
+ * before a decoder is picked; read() returns them again afterwards, so
+ * sources that cannot seek still work.
+ */
+class ByteSource {
+public:
+    static constexpr u32 SNIFF_BYTES = 16;
+
+private:
+    u8 m_sniffed[SNIFF_BYTES];
+    u32 m_sniffedSize = 0;
+    u32 m_sniffedPos = 0;
+
+protected:
+    virtual size_t readRaw(void* dst, size_t size) = 0;
+    virtual bool seekRaw(u64 offset) = 0;
+
+    /**
+     * Forget sniffed bytes when the source is reopened on new input
+     */
+    void resetSniff() {
+        m_sniffedSize = 0;
+        m_sniffedPos = 0;
+    }
+
+public:
+    virtual ~ByteSource() {}
+
+    /**
+     * Peek at up to SNIFF_BYTES from the start. Only valid before any read.
+     */
+    u32 sniff(u8* dst, u32 size) {
+        size = std::min(size, SNIFF_BYTES);
+        while (m_sniffedSize < size) {
+            size_t n = readRaw(m_sniffed + m_sniffedSize, size - m_sniffedSize);
+            if (n == 0) break;
+            m_sniffedSize += (u32)n;
+        }
+        u32 n = std::min(size, m_sniffedSize);
+        memcpy(dst, m_sniffed, n);
+        return n;
+    }
+
+    size_t read(void* dst, size_t size) {
+        size_t copied = 0;
+        if (m_sniffedPos < m_sniffedSize) {
+            copied = std::min(size, (size_t)(m_sniffedSize - m_sniffedPos));
+            memcpy(dst, m_sniffed + m_sniffedPos, copied);
+            m_sniffedPos += (u32)copied;
+            if (copied == size) return copied;
+        }
+        return copied + readRaw((u8*)dst + copied, size - copied);
+    }
+
+    /**
+     * read() until size bytes or the end of the input
+     */
+    size_t readFull(void* dst, size_t size) {
+        size_t got = 0;
+        while (got < size) {
+            size_t n = read((u8*)dst + got, size - got);
+            if (n == 0) break;
+            got += n;
+        }
+        return got;
+    }
+
+    /**
+     * Move to a byte offset. False for sources that cannot seek.
+     */
+    bool seek(u64 offset) {
+        if (!seekRaw(offset)) return false;
+        m_sniffedSize = 0;
+        m_sniffedPos = 0;
+        return true;
+    }
+
+    /**
+     * Byte offset of the next read()
+     */
+    u64 tell() {
+        return getRawOffset() - (m_sniffedSize - m_sniffedPos);
+    }
+
+    virtual u64 getRawOffset() = 0;
+    virtual u64 getSize() = 0;              // 0 if unknown
+    virtual bool canSeek() const = 0;
+    virtual void setBitrate(u32 kbps) {}   // Hint for how much to buffer ahead
+
+    /**
+     * Make a blocked read() return, from any thread
+     */
+    virtual void abort() = 0;
+};
+
+/**
+ * Local file through the read-ahead thread
+ */
+class FileSource : public ByteSource {
+private:
+    ReadAhead m_reader;
+    std::atomic<bool> m_aborted{false};
+
+protected:
+    size_t readRaw(void* dst, size_t size) override {
+        if (m_aborted.load(std::memory_order_relaxed)) return 0;
+        return m_reader.read(dst, size);
+    }
+
+    bool seekRaw(u64 offset) override {
+        m_reader.seek(offset);
+        return true;
+    }
+
+public:
+    Result open(const char* path) {
+        m_aborted = false;
+        resetSniff();
+        return m_reader.open(path);
+    }
+
+    void close() {
+        m_reader.close();
+    }
+
+    u64 getRawOffset() override { return m_reader.tell(); }
+    u64 getSize() override { return m_reader.getFileSize(); }
+    bool canSeek() const override { return true; }
+    void setBitrate(u32 kbps) override { m_reader.setBitrate(kbps); }
+
+    void abort() override {
+        m_aborted = true; // Reads from the card finish on their own within a slice
+    }
+
+    ReadAhead::Stats getStats() { return m_reader.getStats(); }
+};
+
+struct TrackFormat {
+    u32 sampleRate;
+    u32 channels;       // 1 or 2
+    u64 lengthFrames;   // At sampleRate, 0 if unknown
+    u32 bitrateKbps;    // 0 if unknown
+};
+
+/**
+ * One compressed track. Not thread safe, the decode thread owns it.
+ */
+class TrackDecoder {
+public:
+    virtual ~TrackDecoder() {}
+
+    /**
+     * Parse headers and report the output format
+     */
+    virtual Result open(ByteSource* source, TrackFormat* format) = 0;
+
+    /**
+     * Decode up to maxFrames interleaved frames. Returns 0 at the end of the
+     * track or on an error; hasFailed() tells the two apart.
+     */
+    virtual u32 decode(s16* out, u32 maxFrames) = 0;
+
+    /**
+     * Continue decoding at a frame of the source rate. False if the input
+     * cannot seek or the position is out of range.
+     */
+    virtual bool seek(u64 frame) = 0;
+
+    /**
+     * Seek through a frame index built for this track instead of scanning
+     * or bisecting the file. The index must outlive the decoder; decoders
+     * that do not need one ignore it.
+     */
+    virtual void setIndex(const FrameIndex* index) {}
+
+    virtual bool hasFailed() const = 0;
+};
+
+/**
+ * Uncompressed RIFF WAVE, 16-bit PCM, mono or stereo
+ */
+class WavDecoder : public TrackDecoder {
+private:
+    ByteSource* m_source = nullptr;
+    u32 m_channels = 0;
+    u32 m_frameBytes = 0;
+    u64 m_dataOffset = 0;
+    u64 m_dataFrames = 0;
+    u64 m_frame = 0;
+    bool m_failed = false;
+
+    static u32 le32(const u8* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24); }
+    static u16 le16(const u8* p) { return (u16)(p[0] | (p[1] << 8)); }
+
+    bool readExact(void* dst, size_t size) {
+        return m_source->readFull(dst, size) == size;
+    }
+
+    bool skip(u64 bytes) {
+        u8 scratch[256];
+        while (bytes) {
+            size_t n = (size_t)std::min<u64>(bytes, sizeof(scratch));
+            if (!readExact(scratch, n)) return false;
+            bytes -= n;
+        }
+        return true;
+    }
+
+public:
+    static bool probe(const u8* head, u32 size) {
+        return size >= 12 && memcmp(head, "RIFF", 4) == 0 && memcmp(head + 8, "WAVE", 4) == 0;
+    }
+
+    Result open(ByteSource* source, TrackFormat* format) override {
+        m_source = source;
+        m_failed = false;
+        m_frame = 0;
+
+        u8 riff[12];
+        if (!readExact(riff, sizeof(riff)) || !probe(riff, sizeof(riff))) {
+            return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+        }
+        u64 offset = sizeof(riff);
+
+        u32 rate = 0;
+        bool haveFormat = false;
+        while (true) {
+            u8 chunk[8];
+            if (!readExact(chunk, sizeof(chunk))) {
+                return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+            }
+            offset += sizeof(chunk);
+            u32 size = le32(chunk + 4);
+
+            if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16 && size <= 64) {
+                u8 fmt[64];
+                if (!readExact(fmt, size)) {
+                    return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+                }
+                u16 tag = le16(fmt);
+                m_channels = le16(fmt + 2);
+                rate = le32(fmt + 4);
+                u16 bits = le16(fmt + 14);
+                // WAVE_FORMAT_PCM, or EXTENSIBLE whose sub-format the 16-bit check covers
+                if ((tag != 1 && tag != 0xFFFE) || bits != 16 ||
+                    (m_channels != 1 && m_channels != 2) || rate < 8000 || rate > 192000) {
+                    return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+                }
+                haveFormat = true;
+            } else if (memcmp(chunk, "data", 4) == 0 && haveFormat) {
+                m_frameBytes = m_channels * sizeof(s16);
+                m_dataOffset = offset;
+                // Streams written on the fly leave the size at 0 or all ones
+                m_dataFrames = (size == 0 || size == 0xFFFFFFFF) ? ~0ULL : size / m_frameBytes;
+                if (source->getSize() > offset) {
+                    m_dataFrames = std::min<u64>(m_dataFrames, (source->getSize() - offset) / m_frameBytes);
+                }
+                break;
+            } else if (!skip(size + (size & 1))) {
+                return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+            }
+            offset += size + (size & 1);
+        }
+
+        format->sampleRate = rate;
+        format->channels = m_channels;
+        format->lengthFrames = (m_dataFrames == ~0ULL) ? 0 : m_dataFrames;
+        format->bitrateKbps = rate * m_frameBytes * 8 / 1000;
+        return 0;
+    }
+
+    u32 decode(s16* out, u32 maxFrames) override {
+        u64 left = m_dataFrames - m_frame;
+        u32 frames = (u32)std::min<u64>(maxFrames, left);
+        if (frames == 0) return 0;
+
+        size_t got = m_source->readFull(out, (size_t)frames * m_frameBytes);
+        u32 whole = (u32)(got / m_frameBytes);
+        if (got % m_frameBytes) {
+            m_failed = true; // Truncated mid-frame
+        }
+        m_frame += whole;
+        if (whole < frames) {
+            m_dataFrames = m_frame; // Input ended early
+        }
+        return whole;
+    }
+
+    bool seek(u64 frame) override {
+        if (frame > m_dataFrames || !m_source->canSeek()) return false;
+        if (!m_source->seek(m_dataOffset + frame * m_frameBytes)) return false;
+        m_frame = frame;
+        return true;
+    }
+
+    bool hasFailed() const override { return m_failed; }
+};
+
+/**
+ * Streaming rate conversion to stereo at the output rate
+ *
+ * Four-point Hermite interpolation on a 32.32 fixed-point phase, so long
+ * tracks do not drift. Output frame n is input position n * inRate / outRate;
+ * the two frames of look-ahead it needs are flushed with silence at the end.
+ * Rates go down to 8kHz, so FLUSH_FRAMES covers two input frames.
+ * Same-rate stereo input is copied through.
+ */
+class Resampler {
+private:
+    static constexpr u64 ONE = 1ULL << 32;
+
+    u32 m_inRate = 0;
+    u32 m_outRate = 0;
+    u32 m_channels = 0;
+    u64 m_step = ONE;       // Input frames per output frame
+    u64 m_phase = 0;        // Between m_hist[1] and m_hist[2]
+    float m_hist[4][2];
+
+    void push(const s16* frame) {
+        memmove(m_hist[0], m_hist[1], sizeof(m_hist[0]) * 3);
+        m_hist[3][0] = frame[0];
+        m_hist[3][1] = (m_channels == 2) ? frame[1] : frame[0];
+    }
+
+    static s16 hermite(float xm1, float x0, float x1, float x2, float t) {
+        float c1 = 0.5f * (x1 - xm1);
+        float c2 = xm1 - 2.5f * x0 + 2.0f * x1 - 0.5f * x2;
+        float c3 = 0.5f * (x2 - xm1) + 1.5f * (x0 - x1);
+        float v = ((c3 * t + c2) * t + c1) * t + x0;
+        return (s16)std::max(-32768.0f, std::min(32767.0f, v));
+    }
+
+public:
+    void reset(u32 inRate, u32 outRate, u32 channels) {
+        m_inRate = inRate;
+        m_outRate = outRate;
+        m_channels = channels;
+        m_step = ((u64)inRate << 32) / outRate;
+        memset(m_hist, 0, sizeof(m_hist));
+        m_phase = 3 * ONE; // Load x[-1] = 0, x[0], x[1], x[2] before the first output
+    }
+
+    bool isPassthrough() const {
+        return m_inRate == m_outRate && m_channels == 2;
+    }
+
+    /**
+     * Convert from in until either side runs out. Returns output frames
+     * written and sets consumed to the input frames used.
+     */
+    u32 process(const s16* in, u32 inFrames, u32* consumed, s16* out, u32 outFrames) {
+        if (isPassthrough()) {
+            u32 n = std::min(inFrames, outFrames);
+            memcpy(out, in, (size_t)n * 2 * sizeof(s16));
+            *consumed = n;
+            return n;
+        }
+
+        u32 used = 0;
+        u32 made = 0;
+        while (made < outFrames) {
+            while (m_phase >= ONE) {
+                if (used == inFrames) {
+                    *consumed = used;
+                    return made;
+                }
+                push(in + (size_t)used * m_channels);
+                used++;
+                m_phase -= ONE;
+            }
+            float t = (float)(m_phase >> 8) * (1.0f / (float)(1 << 24));
+            for (u32 c = 0; c < 2; c++) {
+                out[made * 2 + c] = hermite(m_hist[0][c], m_hist[1][c], m_hist[2][c], m_hist[3][c], t);
+            }
+            made++;
+            m_phase += m_step;
+        }
+        *consumed = used;
+        return made;
+    }
+
+    /**
+     * Output still owed for input already consumed, at the end of a track.
+     * out must hold FLUSH_FRAMES.
+     */
+    static constexpr u32 FLUSH_FRAMES = 64;
+
+    u32 flush(s16* out) {
+        if (isPassthrough()) return 0;
+        static const s16 silence[2 * 2] = {};
+        u32 used;
+        u32 made = process(silence, 2, &used, out, FLUSH_FRAMES);
+        m_phase = 3 * ONE;
+        memset(m_hist, 0, sizeof(m_hist));
+        return made;
+    }
+
+    /**
+     * Input position of output frame n, and the output frame of an input position
+     */
+    u64 toInput(u64 outFrame) const { return outFrame * m_inRate / m_outRate; }
+    u64 toOutput(u64 inFrame) const { return inFrame * m_outRate / m_inRate; }
+};
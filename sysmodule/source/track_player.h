@@ -0,0 +1,411 @@
+#pragma once
+#include <switch.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "pcm_stream.h"
+#include "pcm_cache.h"
+#include "track_decoder.h"
+#include "trace.h"
+#if __has_include(<mpg123.h>)
+#include "mp3_decoder.h"
+#endif
+#if __has_include(<tremor/ivorbisfile.h>)
+#include "ogg_decoder.h"
+#endif
+
+/**
+ * Decode thread for one compressed track
+ *
+ * Picks a decoder from the first bytes of the source, decodes on its own
+ * thread and resamples into a PcmStream that a mixer stream voice plays.
+ * The stream holds RING_FRAMES of output, so the thread runs at most that
+ * far ahead of the speaker and sleeps while the ring is full.
+ *
+ * seek() is handed to the thread and applied before its next decode; the
+ * stream starts a new segment there, so the voice drops what was buffered
+ * from the old position. Sources that cannot seek ignore it.
+ *
+ * MP3 and Ogg files seek through a FrameIndex. It is loaded from the SD
+ * cache when the track opens. The first time a track is played it is
+ * built by a header scan on its own thread while decoding starts, and
+ * installed when the scan is done; seeks before that use the decoder's own.
+ *
+ * With a PcmCache set, every file opened counts as a play, and a file the
+ * cache holds plays from its pre-decoded PCM. If a block of that PCM turns
+ * out damaged, the entry is dropped and the thread carries on decoding the
+ * file from the same frame.
+ */
+class TrackPlayer {
+public:
+    static constexpr u32 OUTPUT_RATE = 48000;
+    static constexpr u32 RING_FRAMES = 16384;   // 340ms, 64KB
+    static constexpr u32 DECODE_FRAMES = 2048;
+    static constexpr u32 START_FRAMES = 4096;   // Buffered before the state turns to Playing
+
+    enum State : u32 {
+        State_Idle = 0,
+        State_Buffering,    // Opening the source or refilling after a seek
+        State_Playing,
+        State_Finished,     // Everything decoded, the stream drains on its own
+        State_Failed
+    };
+
+private:
+    PcmStream m_stream;
+    FileSource m_file;
+    char m_path[256] = {};                  // Set for files, which get a frame index
+    PcmCache* m_pcmCache = nullptr;
+    PcmCacheReader m_cacheReader;
+    bool m_cached = false;                  // Playing m_cacheReader, m_file is not open
+    u64 m_cacheKey = 0;                     // PcmCache::contentKey of m_path
+    FrameIndex m_index;
+    FrameIndexScan m_indexScan;
+    ByteSource* m_source = nullptr;
+    TrackDecoder* m_decoder = nullptr;
+    TrackFormat m_format = {};
+    Resampler m_resampler;
+    s16* m_decodeBuffer = nullptr;
+
+    std::thread m_thread;
+    std::atomic<bool> m_stop{false};
+    std::atomic<s64> m_seekRequest{-1};     // Output frame, -1 when none
+    std::atomic<u32> m_state{State_Idle};
+
+    static TrackDecoder* createDecoder(ByteSource* source, bool* indexed) {
+        u8 head[ByteSource::SNIFF_BYTES];
+        u32 size = source->sniff(head, sizeof(head));
+
+        *indexed = false;
+        if (WavDecoder::probe(head, size)) {
+            return new WavDecoder(); // Seeks are arithmetic
+        }
+        *indexed = true;
+#if __has_include(<tremor/ivorbisfile.h>)
+        if (OggDecoder::probe(head, size)) {
+            return new OggDecoder();
+        }
+#endif
+#if __has_include(<mpg123.h>)
+        if (Mp3Decoder::probe(head, size)) {
+            return new Mp3Decoder();
+        }
+#endif
+        return nullptr;
+    }
+
+    /**
+     * Copy frames into the ring, waiting for room. False if stopped or a
+     * seek arrived first.
+     */
+    bool writeAll(const s16* src, u32 frames) {
+        while (frames) {
+            if (m_stop || m_seekRequest.load(std::memory_order_relaxed) >= 0) return false;
+            s16* span;
+            u32 n = std::min(m_stream.reserve(&span), frames);
+            if (n == 0) {
+                svcSleepThread(5000000); // 5ms
+                continue;
+            }
+            memcpy(span, src, (size_t)n * PcmStream::FRAME_BYTES);
+            m_stream.commit(n);
+            src += (size_t)n * PcmStream::CHANNELS;
+            frames -= n;
+        }
+        return true;
+    }
+
+    void applySeek(s64 target) {
+        u64 frame = (u64)target;
+        u64 length = m_stream.getLength();
+        if (length) frame = std::min(frame, length);
+
+        if (!m_decoder->seek(m_resampler.toInput(frame))) return;
+        m_resampler.reset(m_format.sampleRate, OUTPUT_RATE, m_format.channels);
+        m_stream.beginSegment(frame);
+        m_state = State_Buffering;
+    }
+
+    /**
+     * Hand m_index to the decoder, if it describes the track being decoded
+     */
+    void installIndex() {
+        if (m_index.getSampleRate() != m_format.sampleRate) return;
+        m_decoder->setIndex(&m_index);
+        m_format.lengthFrames = m_index.getTotalSamples(); // Exact, also for VBR without a tag
+    }
+
+    /**
+     * Pick and open the decoder for m_source, with its frame index if it
+     * is cached
+     */
+    bool openDecoder() {
+        bool indexed;
+        m_decoder = createDecoder(m_source, &indexed);
+        if (!m_decoder || R_FAILED(m_decoder->open(m_source, &m_format))) {
+            return false;
+        }
+        if (indexed && m_path[0] && m_indexScan.start(m_path, &m_index)) {
+            installIndex();
+        }
+        if (m_format.bitrateKbps) {
+            m_source->setBitrate(m_format.bitrateKbps);
+        }
+        m_resampler.reset(m_format.sampleRate, OUTPUT_RATE, m_format.channels);
+        return true;
+    }
+
+    /**
+     * The cached PCM failed its CRC: drop the entry and decode the file
+     * from the frame the cache stopped at. False if the file cannot take over.
+     */
+    bool leaveCache() {
+        u64 frame = m_cacheReader.getPosition();
+        m_cached = false;
+        delete m_decoder;
+        m_decoder = nullptr;
+        m_cacheReader.close();
+        m_pcmCache->invalidate(m_cacheKey);
+
+        if (R_FAILED(m_file.open(m_path)) || !openDecoder()) return false;
+        return frame == 0 || m_decoder->seek(m_resampler.toInput(frame));
+    }
+
+    void decodeThreadFunc() {
+        XMUSIC_TRACE_THREAD("decode");
+
+        if (m_cached) {
+            m_decoder = new PcmCacheDecoder(&m_cacheReader);
+            m_decoder->open(nullptr, &m_format);
+            m_resampler.reset(m_format.sampleRate, OUTPUT_RATE, m_format.channels);
+        } else if (!openDecoder()) {
+            m_state = State_Failed;
+            m_stream.setFinished();
+            return;
+        }
+        m_stream.setLength(m_resampler.toOutput(m_format.lengthFrames));
+
+        u32 pending = 0;    // Decoded frames not yet resampled
+        u32 pendingPos = 0;
+        bool ended = false;
+
+        while (!m_stop) {
+            if (m_indexScan.take(&m_index)) {
+                installIndex();
+                m_stream.setLength(m_resampler.toOutput(m_format.lengthFrames));
+            }
+            s64 seek = m_seekRequest.exchange(-1, std::memory_order_acquire);
+            if (seek >= 0) {
+                applySeek(seek);
+                pending = 0;
+                ended = false;
+            }
+            if (ended) {
+                svcSleepThread(10000000); // 10ms, only a seek brings more work
+                continue;
+            }
+
+            if (pending == 0) {
+                {
+                    XMUSIC_TRACE_SCOPE(TraceId_Decode, DECODE_FRAMES);
+                    pending = m_decoder->decode(m_decodeBuffer, DECODE_FRAMES);
+                }
+                pendingPos = 0;
+                if (pending == 0 && m_cached && m_decoder->hasFailed()) {
+                    if (leaveCache()) continue;
+                    m_state = State_Failed;
+                    m_stream.setFinished();
+                    return;
+                }
+                if (pending == 0) {
+                    s16 tail[Resampler::FLUSH_FRAMES * PcmStream::CHANNELS];
+                    if (!writeAll(tail, m_resampler.flush(tail))) continue;
+                    m_stream.setFinished();
+                    m_state = m_decoder->hasFailed() ? State_Failed : State_Finished;
+                    ended = true;
+                    continue;
+                }
+            }
+
+            s16* span;
+            u32 space = m_stream.reserve(&span);
+            if (space == 0) {
+                svcSleepThread(5000000); // 5ms, the ring holds 340ms
+                continue;
+            }
+            u32 consumed;
+            u32 made = m_resampler.process(m_decodeBuffer + (size_t)pendingPos * m_format.channels,
+                                           pending, &consumed, span, space);
+            m_stream.commit(made);
+            pending -= consumed;
+            pendingPos += consumed;
+
+            if (m_state == State_Buffering && m_stream.getBuffered() >= START_FRAMES) {
+                m_state = State_Playing;
+            }
+        }
+    }
+
+public:
+    TrackPlayer() {}
+
+    ~TrackPlayer() {
+        close();
+    }
+
+    /**
+     * Count plays in and play hits from this cache. Set before opening a
+     * track; the cache must outlive the player.
+     */
+    void setPcmCache(PcmCache* cache) {
+        m_pcmCache = cache;
+    }
+
+    /**
+     * Start decoding a local file. The format is detected on the decode
+     * thread; getState() reports Failed if it is not supported.
+     */
+    Result openFile(const char* path) {
+        close();
+        if (m_pcmCache) {
+            // One hash of the file serves the play count and the lookup
+            m_cacheKey = PcmCache::contentKey(path);
+            m_pcmCache->recordPlay(m_cacheKey, path);
+            m_cached = m_pcmCache->open(m_cacheKey, &m_cacheReader);
+        }
+        Result rc = m_cached ? 0 : m_file.open(path);
+        if (R_FAILED(rc)) return rc;
+        snprintf(m_path, sizeof(m_path), "%s", path);
+        rc = openSource(&m_file);
+        if (R_FAILED(rc)) {
+            m_file.close();
+            m_cacheReader.close();
+            m_cached = false;
+            m_path[0] = '\0';
+        }
+        return rc;
+    }
+
+    /**
+     * Start decoding from any source, which must outlive close()
+     */
+    Result openSource(ByteSource* source) {
+        if (source != &m_file) {
+            close(); // openFile() has already closed and reopened m_file
+        }
+        m_decodeBuffer = (s16*)malloc((size_t)DECODE_FRAMES * 2 * sizeof(s16));
+        if (!m_decodeBuffer) {
+            return MAKERESULT(Module_Libnx, LibnxError_OutOfMemory);
+        }
+        Result rc = m_stream.open(RING_FRAMES);
+        if (R_FAILED(rc)) {
+            free(m_decodeBuffer);
+            m_decodeBuffer = nullptr;
+            return rc;
+        }
+
+        m_source = source;
+        m_format = {};
+        m_stop = false;
+        m_seekRequest = -1;
+        m_state = State_Buffering;
+        m_thread = std::thread(&TrackPlayer::decodeThreadFunc, this);
+        return 0;
+    }
+
+    /**
+     * Stop decoding and free everything. A voice playing getStream() must
+     * have been stopped first.
+     */
+    void close() {
+        m_stop = true;
+        if (m_source) {
+            m_source->abort();
+        }
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+        m_indexScan.stop();
+
+        delete m_decoder;
+        m_decoder = nullptr;
+        if (m_source == &m_file) {
+            m_file.close();
+        }
+        m_cacheReader.close();
+        m_cached = false;
+        m_source = nullptr;
+        m_path[0] = '\0';
+        m_index.clear();
+
+        m_stream.close();
+        free(m_decodeBuffer);
+        m_decodeBuffer = nullptr;
+        m_state = State_Idle;
+    }
+
+    /**
+     * Continue from an output frame. The newest request wins.
+     */
+    void seek(u64 frame) {
+        m_seekRequest.store((s64)frame, std::memory_order_release);
+    }
+
+    bool isOpen() const { return m_stream.isOpen(); }
+    State getState() const { return (State)m_state.load(); }
+    PcmStream* getStream() { return &m_stream; }
+
+    /**
+     * Track length in output frames, 0 while unknown
+     */
+    u64 getLength() const { return m_stream.getLength(); }
+
+    ReadAhead::Stats getReadStats() { return m_file.getStats(); }
+
+    /**
+     * Decode a whole file to 48kHz stereo for the PCM cache. A PcmDecodeFn,
+     * run on the cache's transcode thread while nothing plays.
+     */
+    static Result transcode(const char* sourcePath, PcmCacheWriter* out, void* user) {
+        FileSource file;
+        Result rc = file.open(sourcePath);
+        if (R_FAILED(rc)) return rc;
+
+        bool indexed;
+        TrackFormat format = {};
+        TrackDecoder* decoder = createDecoder(&file, &indexed);
+        if (!decoder || R_FAILED(decoder->open(&file, &format))) {
+            delete decoder;
+            return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+        }
+        Resampler resampler;
+        resampler.reset(format.sampleRate, OUTPUT_RATE, format.channels);
+
+        std::vector<s16> in((size_t)DECODE_FRAMES * 2);
+        std::vector<s16> resampled((size_t)DECODE_FRAMES * 2);
+        u32 decoded;
+        while (R_SUCCEEDED(rc) && (decoded = decoder->decode(in.data(), DECODE_FRAMES)) > 0) {
+            u32 pos = 0;
+            while (decoded > 0 && R_SUCCEEDED(rc)) {
+                u32 consumed;
+                u32 made = resampler.process(in.data() + (size_t)pos * format.channels, decoded,
+                                             &consumed, resampled.data(), DECODE_FRAMES);
+                rc = out->append(resampled.data(), made);
+                decoded -= consumed;
+                pos += consumed;
+            }
+        }
+        if (R_SUCCEEDED(rc)) {
+            s16 tail[Resampler::FLUSH_FRAMES * PcmStream::CHANNELS];
+            rc = out->append(tail, resampler.flush(tail));
+        }
+        if (R_SUCCEEDED(rc) && decoder->hasFailed()) {
+            rc = MAKERESULT(Module_Libnx, LibnxError_BadInput);
+        }
+        delete decoder;
+        return rc;
+    }
+};
@@ -4,8 +4,11 @@
 XMusicService* XMusicService::s_instance = nullptr;
 
 XMusicService::XMusicService() 
-    : m_initialized(false), m_running(false), m_handle(INVALID_HANDLE) {
+    : m_initialized(false), m_running(false), m_handle(INVALID_HANDLE), m_sessionCount(0),
+      m_httpSource(&m_stream), m_socketsInitialized(false), m_source(PlaybackSource_TestTone),
+      m_urlPending(false), m_positionRestored(false), m_restoredSamples(0) {
     memset(&m_currentStatus, 0, sizeof(m_currentStatus));
+    memset(m_sourceUrl, 0, sizeof(m_sourceUrl));
     strcpy(m_currentStatus.title, "XMusic Ready");
     strcpy(m_currentStatus.artist, "System");
     m_currentStatus.volume = 0.3f;
@@ -25,12 +28,20 @@ Result XMusicService::initialize(std::shared_ptr<AudioManager> audioManager) {
     
     // Register service using modern API
     SmServiceName serviceName = smEncodeName(XMUSIC_SERVICE_NAME);
-    Result rc = smRegisterService(&m_handle, serviceName, false, 2);
+    Result rc = smRegisterService(&m_handle, serviceName, false, MAX_SESSIONS);
     
     if (R_FAILED(rc)) {
         return rc;
     }
     
+    // A missing SD card only costs us cover art
+    m_artCache.open();
+    m_pcmCache.setDecoder(&TrackPlayer::transcode, nullptr);
+    m_pcmCache.open();
+    m_audioManager->setPcmCache(&m_pcmCache);
+    
+    restoreState();
+    
     m_initialized = true;
     return 0;
 }
@@ -57,6 +68,27 @@ void XMusicService::stop() {
         }
     }
     
+    while (m_sessionCount > 0) {
+        closeSession(m_sessionCount - 1);
+    }
+    
+    if (m_initialized) {
+        persistState(true);
+    }
+    
+    // The decoder reads the stream, it lets go first
+    if (m_audioManager) {
+        m_audioManager->stopTrack();
+        m_audioManager->setPcmCache(nullptr);
+    }
+    m_stream.close();
+    m_artCache.close();
+    m_pcmCache.close();
+    if (m_socketsInitialized) {
+        socketExit();
+        m_socketsInitialized = false;
+    }
+    
     if (m_initialized && m_handle != INVALID_HANDLE) {
         SmServiceName serviceName = smEncodeName(XMUSIC_SERVICE_NAME);
         smUnregisterService(serviceName);
@@ -67,60 +99,203 @@ void XMusicService::stop() {
 }
 
 void XMusicService::serviceThreadFunc() {
+    XMUSIC_TRACE_THREAD("ipc");
+    Handle replyTarget = INVALID_HANDLE;
+    
     while (m_running) {
-        Handle session;
-        Result rc = svcAcceptSession(&session, m_handle);
+        // Wait on the port and every open session, replying to the last request on the way
+        Handle handles[MAX_SESSIONS + 1];
+        handles[0] = m_handle;
+        for (u32 i = 0; i < m_sessionCount; i++) {
+            handles[i + 1] = m_sessions[i].handle;
+        }
         
-        if (R_SUCCEEDED(rc)) {
-            // Handle the request in a separate scope
-            handleRequest(session);
-            svcCloseHandle(session);
-        } else {
-            // Sleep briefly on failure to avoid busy loop
-            svcSleepThread(1000000); // 1ms
+        s32 idx = -1;
+        Result rc = svcReplyAndReceive(&idx, handles, m_sessionCount + 1, replyTarget, RECEIVE_TIMEOUT_NS);
+        replyTarget = INVALID_HANDLE;
+        
+        if (R_SUCCEEDED(rc) && idx == 0) {
+            acceptSession();
+        } else if (idx > 0 && idx <= (s32)m_sessionCount) {
+            Session& session = m_sessions[idx - 1];
+            if (R_SUCCEEDED(rc) && handleRequest(session)) {
+                replyTarget = session.handle;
+            } else {
+                closeSession(idx - 1); // Closed by the client, or a request we cannot parse
+            }
+        } else if (R_FAILED(rc) && rc != KERNELRESULT(TimedOut)) {
+            svcSleepThread(1000000); // 1ms, a failed reply to a client that went away
         }
+        
+        persistState(false);
+        m_pcmCache.setIdle(!m_audioManager->getIsPlaying());
     }
 }
 
-Result XMusicService::handleRequest(Handle session) {
-    if (!m_audioManager) {
-        return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
+void XMusicService::acceptSession() {
+    Handle handle;
+    if (R_FAILED(svcAcceptSession(&handle, m_handle))) {
+        return;
+    }
+    if (m_sessionCount == MAX_SESSIONS) {
+        svcCloseHandle(handle); // sm also caps us at MAX_SESSIONS
+        return;
+    }
+    m_sessions[m_sessionCount++] = {handle, false};
+}
+
+void XMusicService::closeSession(u32 index) {
+    Session& session = m_sessions[index];
+    if (session.analyzer && m_audioManager) {
+        m_audioManager->getAnalyzer().unsubscribe();
+    }
+    svcCloseHandle(session.handle);
+    m_sessions[index] = m_sessions[--m_sessionCount];
+}
+
+void XMusicService::writeReply(Result result, const void* data, u32 size, Handle copyHandle) {
+    // 16 bytes of slack for the alignment of the CMIF header
+    u32 words = (16 + sizeof(CmifOutHeader) + size + 3) / 4;
+    void* base = armGetTls();
+    HipcRequest reply = hipcMakeRequestInline(base,
+        .type = CmifCommandType_Invalid,
+        .num_data_words = words,
+        .num_copy_handles = (copyHandle != INVALID_HANDLE) ? 1u : 0u,
+    );
+    if (copyHandle != INVALID_HANDLE) {
+        reply.copy_handles[0] = copyHandle;
     }
     
-    // For now, implement a simple protocol
-    // We'll use svcReplyAndReceive for basic communication
+    CmifOutHeader* header = (CmifOutHeader*)cmifGetAlignedDataStart(reply.data_words, base);
+    header->magic = CMIF_OUT_HEADER_MAGIC;
+    header->version = 0;
+    header->result = result;
+    header->token = 0;
+    if (size) {
+        memcpy(header + 1, data, size);
+    }
+}
+
+bool XMusicService::handleRequest(Session& session) {
+    void* base = armGetTls();
+    HipcParsedRequest request = hipcParseRequest(base);
+    if (request.meta.type == CmifCommandType_Close) {
+        return false;
+    }
     
-    s32 idx;
-    Result rc = svcReplyAndReceive(&idx, &session, 1, 0, 1000000000LL); // 1 second timeout
+    CmifInHeader* header = (CmifInHeader*)cmifGetAlignedDataStart(request.data.data_words, base);
+    size_t headerOffset = (u8*)header - (u8*)request.data.data_words;
+    size_t wordBytes = (size_t)request.meta.num_data_words * 4;
+    if (request.meta.type != CmifCommandType_Request || wordBytes < headerOffset + sizeof(CmifInHeader) ||
+        header->magic != CMIF_IN_HEADER_MAGIC) {
+        writeReply(MAKERESULT(Module_Libnx, LibnxError_BadInput));
+        return true;
+    }
     
-    if (R_FAILED(rc)) {
-        return rc;
+    // Arguments follow the header inline; strings and the status go through mapped buffers
+    RequestArgs args;
+    args.data = (const u8*)(header + 1);
+    args.dataSize = wordBytes - headerOffset - sizeof(CmifInHeader);
+    args.in = nullptr;
+    args.inSize = 0;
+    args.out = nullptr;
+    args.outSize = 0;
+    if (request.meta.num_send_buffers > 0) {
+        args.in = (const char*)hipcGetBufferAddress(&request.data.send_buffers[0]);
+        args.inSize = hipcGetBufferSize(&request.data.send_buffers[0]);
+    }
+    if (request.meta.num_recv_buffers > 0) {
+        args.out = hipcGetBufferAddress(&request.data.recv_buffers[0]);
+        args.outSize = hipcGetBufferSize(&request.data.recv_buffers[0]);
     }
     
-    // Read the command from TLS (Thread Local Storage)
-    // This is a simplified approach - we'll read the command ID directly
-    u8* tls = (u8*)armGetTls();
-    u32* cmdPtr = (u32*)(tls + 8); // Command typically at offset 8
-    u32 cmd = *cmdPtr;
+    Handle copyHandle = INVALID_HANDLE;
+    Result rc = dispatch(session, header->command_id, args, &copyHandle);
+    writeReply(rc, nullptr, 0, R_SUCCEEDED(rc) ? copyHandle : INVALID_HANDLE);
+    return true;
+}
+
+Result XMusicService::dispatch(Session& session, u32 cmd, const RequestArgs& args, Handle* copyHandle) {
+    if (!m_audioManager) {
+        return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
+    }
+    XMUSIC_TRACE_SCOPE(TraceId_IpcCommand, cmd);
     
     // Process the command
     switch (cmd) {
         case XMusicCmd_Play:
-            return cmdPlay(session);
+            return cmdPlay(session.handle);
             
         case XMusicCmd_Pause:
-            return cmdPause(session);
+            return cmdPause(session.handle);
             
         case XMusicCmd_GetStatus:
-            return cmdGetStatus(session);
+            if (!args.out || args.outSize < sizeof(XMusicStatus)) {
+                return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+            }
+            return cmdGetStatus(session.handle, (XMusicStatus*)args.out);
             
         case XMusicCmd_SetVolume:
             // For now, use a default volume
-            return cmdSetVolume(session, 0.5f);
+            return cmdSetVolume(session.handle, 0.5f);
             
         case XMusicCmd_Next:
         case XMusicCmd_Previous:
-            return cmdLoadMelody(session);
+            return cmdLoadMelody(session.handle);
+            
+        case XMusicCmd_PlayUrl: {
+            XMusicPlayUrlArgs url = {};
+            if (!args.readString(url.url, sizeof(url.url))) {
+                return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+            }
+            return cmdPlayUrl(session.handle, url);
+        }
+            
+        case XMusicCmd_PlayFile: {
+            XMusicPlayFileArgs file = {};
+            if (!args.readString(file.path, sizeof(file.path))) {
+                return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+            }
+            return cmdPlayFile(session.handle, file);
+        }
+            
+        case XMusicCmd_SubscribeAnalyzer:
+            return cmdSubscribeAnalyzer(session, true, copyHandle);
+            
+        case XMusicCmd_UnsubscribeAnalyzer:
+            return cmdSubscribeAnalyzer(session, false, copyHandle);
+            
+        case XMusicCmd_Seek: {
+            XMusicSeekArgs seek;
+            if (!args.read(&seek, sizeof(seek))) {
+                return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+            }
+            return cmdSeek(session.handle, seek);
+        }
+            
+        case XMusicCmd_DumpTrace: {
+            XMusicDumpTraceArgs dump;
+            if (!args.read(&dump, sizeof(dump))) {
+                return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+            }
+            return cmdDumpTrace(session.handle, dump);
+        }
+            
+        case XMusicCmd_SetSpeed: {
+            XMusicSetSpeedArgs speed;
+            if (!args.read(&speed, sizeof(speed))) {
+                return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+            }
+            return cmdSetSpeed(session.handle, speed);
+        }
+            
+        case XMusicCmd_SetAnalyzerRate: {
+            XMusicSetAnalyzerRateArgs rate;
+            if (!args.read(&rate, sizeof(rate))) {
+                return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+            }
+            return cmdSetAnalyzerRate(session.handle, rate);
+        }
             
         default:
             // Unknown command, just return success
@@ -129,8 +304,17 @@ Result XMusicService::handleRequest(Handle session) {
 }
 
 Result XMusicService::cmdPlay(Handle session) {
+    if (m_audioManager && m_urlPending) {
+        XMusicPlayUrlArgs args;
+        memcpy(args.url, m_sourceUrl, sizeof(args.url));
+        Result rc = cmdPlayUrl(session, args);
+        if (R_FAILED(rc)) {
+            return rc;
+        }
+    }
     if (m_audioManager) {
         m_audioManager->play();
+        m_positionRestored = false;
         m_currentStatus.playing = true;
         updateStatus();
     }
@@ -155,13 +339,9 @@ Result XMusicService::cmdSetVolume(Handle session, float volume) {
     return 0;
 }
 
-Result XMusicService::cmdGetStatus(Handle session) {
+Result XMusicService::cmdGetStatus(Handle session, XMusicStatus* out) {
     updateStatus();
-    
-    // For now, we can't easily send back the status
-    // This would require proper IPC response handling
-    // We'll implement this in the next iteration
-    
+    memcpy(out, &m_currentStatus, sizeof(*out));
     return 0;
 }
 
@@ -169,18 +349,254 @@ Result XMusicService::cmdLoadMelody(Handle session) {
     if (m_audioManager) {
         m_audioManager->loadMelody();
         m_audioManager->play();
+        m_stream.close();
         m_currentStatus.playing = true;
+        m_source = PlaybackSource_Melody;
+        m_urlPending = false;
+        m_positionRestored = false;
+        updateStatus();
+    }
+    return 0;
+}
+
+Result XMusicService::cmdSeek(Handle session, const XMusicSeekArgs& args) {
+    if (args.mode != XMusicSeek_Set && args.mode != XMusicSeek_Current) {
+        return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+    }
+    
+    if (m_audioManager) {
+        m_audioManager->seek(args.samples, args.mode == XMusicSeek_Current);
+        m_positionRestored = false;
+        updateStatus();
+    }
+    return 0;
+}
+
+Result XMusicService::cmdPlayUrl(Handle session, const XMusicPlayUrlArgs& args) {
+    if (!m_audioManager) {
+        return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
+    }
+    
+    // Sockets are brought up on first use, their transfer memory comes out of our small heap
+    if (!m_socketsInitialized) {
+        SocketInitConfig config = *socketGetDefaultInitConfig();
+        config.tcp_tx_buf_size = 0x1000;
+        config.tcp_rx_buf_size = 0x8000;
+        config.tcp_tx_buf_max_size = 0;
+        config.tcp_rx_buf_max_size = 0;
+        config.udp_tx_buf_size = 0;
+        config.udp_rx_buf_size = 0;
+        config.num_bsd_sessions = 1;
+        
+        Result rc = socketInitialize(&config);
+        if (R_FAILED(rc)) {
+            return rc;
+        }
+        m_socketsInitialized = true;
+    }
+    
+    // Stop what is playing; a decoder still reading the old stream must let go first
+    m_audioManager->stopTrack();
+    Result rc = m_stream.open(args.url);
+    if (R_FAILED(rc)) {
+        return rc;
+    }
+    
+    m_httpSource.reset();
+    rc = m_audioManager->playStream(&m_httpSource);
+    if (R_FAILED(rc)) {
+        m_stream.close();
+        return rc;
+    }
+    
+    strncpy(m_currentStatus.title, args.url, sizeof(m_currentStatus.title) - 1);
+    m_currentStatus.title[sizeof(m_currentStatus.title) - 1] = '\0';
+    strcpy(m_currentStatus.artist, "Stream");
+    m_source = PlaybackSource_Url;
+    m_urlPending = false;
+    m_positionRestored = false;
+    memcpy(m_sourceUrl, args.url, sizeof(m_sourceUrl));
+    m_sourceUrl[sizeof(m_sourceUrl) - 1] = '\0';
+    updateStatus();
+    return 0;
+}
+
+Result XMusicService::cmdPlayFile(Handle session, const XMusicPlayFileArgs& args) {
+    if (!m_audioManager) {
+        return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
+    }
+    
+    Result rc = m_audioManager->playFile(args.path);
+    m_stream.close(); // Whatever played before is gone either way
+    if (R_FAILED(rc)) {
+        return rc;
+    }
+    
+    // Title from the file name until tags are read
+    const char* name = strrchr(args.path, '/');
+    name = name ? name + 1 : args.path;
+    strncpy(m_currentStatus.title, name, sizeof(m_currentStatus.title) - 1);
+    m_currentStatus.title[sizeof(m_currentStatus.title) - 1] = '\0';
+    strcpy(m_currentStatus.artist, "File");
+    m_source = PlaybackSource_File;
+    m_urlPending = false;
+    m_positionRestored = false;
+    m_artCache.enqueue(args.path); // Thumbnail ready for the next time the overlay asks
+    memcpy(m_sourceUrl, args.path, sizeof(m_sourceUrl));
+    m_sourceUrl[sizeof(m_sourceUrl) - 1] = '\0';
+    updateStatus();
+    return 0;
+}
+
+Result XMusicService::cmdSubscribeAnalyzer(Session& session, bool subscribe, Handle* copyHandle) {
+    if (!m_audioManager) {
+        return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
+    }
+    
+    // One subscription per session, released when the session closes
+    SpectrumAnalyzer& analyzer = m_audioManager->getAnalyzer();
+    if (!subscribe) {
+        if (session.analyzer) {
+            analyzer.unsubscribe();
+            session.analyzer = false;
+        }
+        return 0;
+    }
+    
+    Handle handle = analyzer.getSharedHandle();
+    if (handle == INVALID_HANDLE) {
+        return MAKERESULT(Module_Libnx, LibnxError_OutOfMemory);
+    }
+    
+    // The client gets its own copy of the handle in the reply
+    if (!session.analyzer) {
+        analyzer.subscribe();
+        session.analyzer = true;
+    }
+    *copyHandle = handle;
+    return 0;
+}
+
+Result XMusicService::cmdDumpTrace(Handle session, const XMusicDumpTraceArgs& args) {
+    return Trace::dump(args.seconds);
+}
+
+Result XMusicService::cmdSetSpeed(Handle session, const XMusicSetSpeedArgs& args) {
+    if (!(args.speed >= TimeStretch::MIN_SPEED && args.speed <= TimeStretch::MAX_SPEED)) {
+        return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+    }
+    
+    if (m_audioManager) {
+        m_audioManager->setSpeed(args.speed);
         updateStatus();
     }
     return 0;
 }
 
+Result XMusicService::cmdSetAnalyzerRate(Handle session, const XMusicSetAnalyzerRateArgs& args) {
+    if (!m_audioManager) {
+        return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
+    }
+    if (args.hz > SpectrumAnalyzer::MAX_RATE_HZ) {
+        return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+    }
+    
+    m_audioManager->getAnalyzer().setRate(args.hz ? args.hz : SpectrumAnalyzer::DEFAULT_RATE_HZ);
+    return 0;
+}
+
 void XMusicService::updateStatus() {
     if (m_audioManager) {
         m_currentStatus.playing = m_audioManager->getIsPlaying();
         m_currentStatus.volume = m_audioManager->getVolume();
-        m_currentStatus.position = (u32)(m_audioManager->getProgress() * 100);
+        
+        PlaybackClock::Position pos = m_audioManager->getPosition();
+        u32 rate = m_audioManager->getSampleRate();
+        m_currentStatus.positionSamples = pos.mediaFrames;
+        m_currentStatus.positionUs = pos.mediaUs;
+        m_currentStatus.positionTick = pos.anchorTick;
+        m_currentStatus.sampleRate = rate;
+        m_currentStatus.advancing = pos.advancing;
+        m_currentStatus.lengthSamples = pos.trackLength;
+        m_currentStatus.looping = pos.looping;
+        m_currentStatus.speed = m_audioManager->getSpeed();
+        m_currentStatus.position = (u32)(pos.mediaUs / 1000000);
+        m_currentStatus.duration = (u32)(pos.trackLength / rate);
+        
+        // The clock only knows what was heard, and nothing has been since the restore
+        if (m_positionRestored) {
+            m_currentStatus.positionSamples = m_restoredSamples;
+            m_currentStatus.positionUs = m_restoredSamples * 1000000ULL / rate;
+            m_currentStatus.position = (u32)(m_restoredSamples / rate);
+            m_currentStatus.advancing = false;
+        }
+    }
+    
+    PcmCache::Stats cache = m_pcmCache.getStats();
+    m_currentStatus.pcmCacheLookups = cache.lookups;
+    m_currentStatus.pcmCacheHits = cache.hits;
+}
+
+void XMusicService::persistState(bool force) {
+    u64 now = armGetSystemTick();
+    if (!force && !m_journal.isDue(now)) {
+        return;
+    }
+    
+    updateStatus();
+    
+    PlaybackState state = {};
+    state.source = m_source;
+    memcpy(state.url, m_sourceUrl, sizeof(state.url));
+    memcpy(state.title, m_currentStatus.title, sizeof(state.title));
+    memcpy(state.artist, m_currentStatus.artist, sizeof(state.artist));
+    state.positionSamples = m_currentStatus.positionSamples;
+    state.volume = m_currentStatus.volume;
+    state.playing = m_currentStatus.playing;
+    
+    m_journal.update(state, now);
+    if (force) {
+        m_journal.flush();
+    }
+}
+
+void XMusicService::restoreState() {
+    PlaybackState state;
+    if (!m_audioManager || !m_journal.load(&state)) {
+        return;
     }
+    
+    m_audioManager->setVolume(state.volume);
+    m_currentStatus.volume = state.volume;
+    
+    // Nothing plays until a client asks; voices started below come up paused
+    m_audioManager->pause();
+    m_currentStatus.playing = false;
+    
+    if (state.source == PlaybackSource_Melody) {
+        m_audioManager->loadMelody();
+        m_source = PlaybackSource_Melody;
+    } else if (state.source == PlaybackSource_Url) {
+        // Streams have no position to return to; the next Play connects
+        memcpy(m_sourceUrl, state.url, sizeof(m_sourceUrl));
+        m_sourceUrl[sizeof(m_sourceUrl) - 1] = '\0';
+        m_source = PlaybackSource_Url;
+        m_urlPending = true;
+    } else if (state.source == PlaybackSource_File) {
+        XMusicPlayFileArgs args;
+        memcpy(args.path, state.url, sizeof(args.path));
+        args.path[sizeof(args.path) - 1] = '\0';
+        cmdPlayFile(INVALID_HANDLE, args);
+    }
+    strcpy(m_currentStatus.title, state.title);
+    strcpy(m_currentStatus.artist, state.artist);
+    
+    if (state.source != PlaybackSource_Url) {
+        m_audioManager->seek((s64)state.positionSamples);
+        m_restoredSamples = state.positionSamples;
+        m_positionRestored = true;
+    }
+    updateStatus();
 }
 
 XMusicService* XMusicService::getInstance() {
@@ -1,20 +1,60 @@
 #pragma once
 #include <switch.h>
 #include <cstring>
+#include <algorithm>
 #include <atomic>
 #include <thread>
 #include <memory>
 #include "../../common/xmusic_ipc.h"
 #include "audio_manager.h"
+#include "http_stream.h"
+#include "art_cache.h"
+#include "state_journal.h"
+#include "pcm_cache.h"
 
 /**
  * XMusic IPC Service Handler
  * 
- * Modern libnx service implementation using the Service framework
- * instead of the old IPC API that no longer exists.
+ * Serves CMIF requests, the format libnx's serviceDispatch sends, on up to
+ * MAX_SESSIONS client sessions from one thread. Sessions stay open between
+ * requests; state a client acquires, such as an analyzer subscription, is
+ * tied to its session and released when the session closes.
  */
 class XMusicService {
 private:
+    static constexpr u32 MAX_SESSIONS = 4;
+    static constexpr s64 RECEIVE_TIMEOUT_NS = 100000000LL; // Housekeeping runs at least every 100ms
+    
+    struct Session {
+        Handle handle;
+        bool analyzer;      // Holds an analyzer subscription, dropped with the session
+    };
+    
+    // Arguments of one request, pointers into TLS or buffers mapped by the kernel
+    struct RequestArgs {
+        const u8* data;     // Inline, after the CMIF header
+        size_t dataSize;
+        const char* in;     // First HipcMapAlias send buffer
+        size_t inSize;
+        void* out;          // First HipcMapAlias receive buffer
+        size_t outSize;
+        
+        bool read(void* dst, size_t size) const {
+            if (dataSize < size) return false;
+            memcpy(dst, data, size);
+            return true;
+        }
+        
+        // Copies a string sent as a buffer, always terminated
+        bool readString(char* dst, size_t size) const {
+            if (!in || inSize == 0) return false;
+            size_t n = strnlen(in, std::min(inSize, size - 1));
+            memcpy(dst, in, n);
+            dst[n] = '\0';
+            return true;
+        }
+    };
+    
     static XMusicService* s_instance;
     
     Service m_service;
@@ -23,21 +63,50 @@ private:
     Handle m_handle;
     std::thread m_serviceThread;
     
+    // Open client sessions, service thread only
+    Session m_sessions[MAX_SESSIONS];
+    u32 m_sessionCount;
+    
     // Audio manager reference
     std::shared_ptr<AudioManager> m_audioManager;
     
+    // Network stream source for XMusicCmd_PlayUrl, read by the track decoder
+    HttpStream m_stream;
+    HttpSource m_httpSource;
+    bool m_socketsInitialized;
+    
+    // Cover thumbnails, filled in the background as tracks are queued
+    ArtCache m_artCache;
+    
+    // Decoded PCM of the most played tracks, transcoded while idle
+    PcmCache m_pcmCache;
+    
     // Current status
     XMusicStatus m_currentStatus;
     
+    // What is loaded, and the journal that brings it back after a restart
+    u32 m_source;
+    char m_sourceUrl[256];
+    bool m_urlPending;      // Restored URL, opened on the next Play instead of at boot
+    bool m_positionRestored; // Restored paused, nothing heard since: report the saved position
+    u64 m_restoredSamples;
+    StateJournal m_journal;
+    
     /**
      * Service thread function - handles incoming IPC requests
      */
     void serviceThreadFunc();
     
+    void acceptSession();
+    void closeSession(u32 index);
+    
     /**
-     * Handle a single IPC request
+     * Handle the request in TLS and leave the reply there. False when the
+     * client asked to close the session.
      */
-    Result handleRequest(Handle session);
+    bool handleRequest(Session& session);
+    Result dispatch(Session& session, u32 cmd, const RequestArgs& args, Handle* copyHandle);
+    void writeReply(Result result, const void* data = nullptr, u32 size = 0, Handle copyHandle = INVALID_HANDLE);
     
     /**
      * Process specific commands
@@ -45,13 +114,32 @@ private:
     Result cmdPlay(Handle session);
     Result cmdPause(Handle session);
     Result cmdSetVolume(Handle session, float volume);
-    Result cmdGetStatus(Handle session);
+    Result cmdGetStatus(Handle session, XMusicStatus* out);
     Result cmdLoadMelody(Handle session);
+    Result cmdSeek(Handle session, const XMusicSeekArgs& args);
+    Result cmdPlayUrl(Handle session, const XMusicPlayUrlArgs& args);
+    Result cmdPlayFile(Handle session, const XMusicPlayFileArgs& args);
+    Result cmdSubscribeAnalyzer(Session& session, bool subscribe, Handle* copyHandle);
+    Result cmdDumpTrace(Handle session, const XMusicDumpTraceArgs& args);
+    Result cmdSetSpeed(Handle session, const XMusicSetSpeedArgs& args);
+    Result cmdSetAnalyzerRate(Handle session, const XMusicSetAnalyzerRateArgs& args);
     
     /**
      * Update internal status from audio manager
      */
     void updateStatus();
+    
+    /**
+     * Hand the current state to the journal, which coalesces SD writes
+     */
+    void persistState(bool force);
+    
+    /**
+     * Reload whatever was playing before the last restart, paused. Files
+     * and the melody are loaded at their saved position; a URL is only
+     * remembered, so boot never touches the network.
+     */
+    void restoreState();
 
 public:
     XMusicService();
@@ -77,6 +165,16 @@ public:
      */
     bool isRunning() const { return m_running; }
     
+    /**
+     * Album art cache, tracks are queued for extraction as they are discovered
+     */
+    ArtCache& getArtCache() { return m_artCache; }
+    
+    /**
+     * PCM cache, the file pipeline asks it before decoding a track
+     */
+    PcmCache& getPcmCache() { return m_pcmCache; }
+    
     /**
      * Get singleton instance
      */
@@ -49,7 +49,10 @@ public:
             return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
         }
 
-        Result rc = serviceDispatchOut(&m_service, static_cast<u32>(XMusicCmd_GetStatus), *status);
+        Result rc = serviceDispatch(&m_service, static_cast<u32>(XMusicCmd_GetStatus),
+            .buffer_attrs = { SfBufferAttr_HipcMapAlias | SfBufferAttr_Out },
+            .buffers = { { status, sizeof(*status) } },
+        );
         if (R_SUCCEEDED(rc)) {
             std::cout << "✅ Status retrieved successfully" << std::endl;
             std::cout << "   Is Playing: " << (status->playing ? "Yes" : "No") << std::endl;
@@ -0,0 +1,141 @@
+#include "test_util.h"
+#include "spectrum_analyzer.h"
+#include <cmath>
+#include <vector>
+
+/**
+ * SpectrumAnalyzer: update rates above the block rate, ticks of the frames
+ * within a block, reading the frame that is being heard, band placement of
+ * a tone, and the cost of an update.
+ */
+static constexpr u32 RATE = 48000;
+static constexpr u32 BLOCK_FRAMES = 4096;   // What the audio thread renders at once
+
+static std::vector<s16> toneBlock(float hz, u32 startFrame) {
+    std::vector<s16> block(BLOCK_FRAMES * 2);
+    for (u32 i = 0; i < BLOCK_FRAMES; i++) {
+        s16 s = (s16)lrintf(16000.0f * sinf(2.0f * (float)M_PI * hz * (float)(startFrame + i) / RATE));
+        block[i * 2] = s;
+        block[i * 2 + 1] = s;
+    }
+    return block;
+}
+
+static u64 blockTick(u32 index) {
+    return 1000000 + (u64)index * BLOCK_FRAMES * armGetSystemTickFreq() / RATE;
+}
+
+static u32 published(const XMusicAnalyzerShared* shared) {
+    return shared->frames[shared->active].sequence / 2;
+}
+
+/**
+ * Feed count blocks, returning the number of frames they published
+ */
+static u32 feedBlocks(SpectrumAnalyzer& analyzer, u32 first, u32 count, float hz = 1000.0f) {
+    u32 before = published(analyzer.getShared());
+    for (u32 b = first; b < first + count; b++) {
+        std::vector<s16> block = toneBlock(hz, b * BLOCK_FRAMES);
+        analyzer.feed(block.data(), BLOCK_FRAMES, blockTick(b));
+    }
+    return published(analyzer.getShared()) - before;
+}
+
+static void testRates() {
+    SpectrumAnalyzer analyzer(RATE);
+    const XMusicAnalyzerShared* shared = analyzer.getShared();
+    CHECK(shared != nullptr);
+
+    // Nobody subscribed, nothing published
+    CHECK(feedBlocks(analyzer, 0, 4) == 0);
+
+    // 30Hz is 2.56 frames per 85ms block
+    analyzer.subscribe();
+    CHECK(feedBlocks(analyzer, 0, 30) == 30 * BLOCK_FRAMES / (RATE / 30));
+
+    // Frames carry the tick at which the end of their window is heard
+    u32 newest = shared->active;
+    const XMusicAnalyzerFrame& last = shared->frames[newest];
+    const XMusicAnalyzerFrame& before = shared->frames[(newest + XMUSIC_ANALYZER_SLOTS - 1) % XMUSIC_ANALYZER_SLOTS];
+    u64 period = (u64)(RATE / 30) * armGetSystemTickFreq() / RATE;
+    CHECK(last.tick - before.tick >= period - 1 && last.tick - before.tick <= period + 1);
+    CHECK(last.tick <= blockTick(30) && last.tick > blockTick(29));
+
+    // 60Hz, and requests above it are held there; frames left over from
+    // the previous period can make one more
+    const u32 at60 = 10 * BLOCK_FRAMES / (RATE / 60);
+    analyzer.setRate(60);
+    u32 fast = feedBlocks(analyzer, 30, 10);
+    CHECK(fast >= at60 && fast <= at60 + 1);
+    analyzer.setRate(1000);
+    u32 clamped = feedBlocks(analyzer, 40, 10);
+    CHECK(clamped >= at60 && clamped <= at60 + 1);
+
+    // The last subscriber leaving stops the work
+    analyzer.unsubscribe();
+    CHECK(feedBlocks(analyzer, 50, 4) == 0);
+    analyzer.unsubscribe();     // Extra calls do not wrap the count
+    CHECK(!analyzer.isActive());
+    printf("  30Hz and 60Hz from %u-frame blocks\n", BLOCK_FRAMES);
+}
+
+static void testReader() {
+    SpectrumAnalyzer analyzer(RATE);
+    const XMusicAnalyzerShared* shared = analyzer.getShared();
+    XMusicAnalyzerFrame frame;
+    CHECK(!xmusicReadAnalyzer(shared, ~0ULL, &frame));   // Nothing yet
+
+    analyzer.subscribe();
+    analyzer.setRate(30);
+    feedBlocks(analyzer, 0, 4);
+
+    // Between two frames the older one is what is being heard
+    u32 newest = shared->active;
+    u64 t1 = shared->frames[newest].tick;
+    u64 t0 = shared->frames[(newest + XMUSIC_ANALYZER_SLOTS - 1) % XMUSIC_ANALYZER_SLOTS].tick;
+    CHECK(xmusicReadAnalyzer(shared, t1 - 1, &frame) && frame.tick == t0);
+    CHECK(xmusicReadAnalyzer(shared, t1, &frame) && frame.tick == t1);
+
+    // Before the first frame is heard, the oldest is the best there is
+    u64 oldest = ~0ULL;
+    for (const XMusicAnalyzerFrame& f : shared->frames) {
+        if (f.sequence) oldest = std::min(oldest, f.tick);
+    }
+    CHECK(xmusicReadAnalyzer(shared, 0, &frame) && frame.tick == oldest);
+}
+
+static void testBands() {
+    SpectrumAnalyzer analyzer(RATE);
+    analyzer.subscribe();
+    feedBlocks(analyzer, 0, 2);
+
+    XMusicAnalyzerFrame frame;
+    CHECK(xmusicReadAnalyzer(analyzer.getShared(), ~0ULL, &frame));
+    u32 loudest = 0;
+    for (u32 b = 1; b < XMUSIC_ANALYZER_BANDS; b++) {
+        if (frame.bands[b] > frame.bands[loudest]) loudest = b;
+    }
+    CHECK(loudest == 8);                                // 848 to 1182Hz
+    CHECK(frame.bands[loudest] > 0.8f && frame.bands[0] < 0.3f);
+    CHECK(fabsf(frame.peak[0] - 16000.0f / 32768.0f) < 0.01f);
+    CHECK(fabsf(frame.rms[1] - 16000.0f / 32768.0f / sqrtf(2.0f)) < 0.01f);
+
+    // Cost of one block at 60Hz, five FFTs
+    analyzer.setRate(60);
+    std::vector<s16> block = toneBlock(1000.0f, 0);
+    u64 start = armGetSystemTick();
+    const u32 runs = 200;
+    for (u32 i = 0; i < runs; i++) {
+        analyzer.feed(block.data(), BLOCK_FRAMES, blockTick(i));
+    }
+    double us = msSince(start) * 1000.0 / runs;
+    CHECK(!TIMING_CHECKS || us < 2000.0);
+    printf("  %.1fus per block at 60Hz\n", us);
+}
+
+int main() {
+    testRates();
+    testReader();
+    testBands();
+    return testExit("analyzer_test");
+}
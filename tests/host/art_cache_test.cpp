@@ -0,0 +1,353 @@
+#include "test_util.h"
+#include "art_cache.h"
+#include <vector>
+
+/**
+ * ArtCache: thumbnails from JPEG and PNG covers, the album artist key,
+ * covers smaller than the thumbnail, covers refused by their headers,
+ * packs with bad tables, compaction of dead space including a swap
+ * interrupted halfway, and the size and hit latency of a 1000 album pack.
+ */
+static const char* PACK = "sdmc:/config/xmusic/art_test.pack";
+static const char* PACK_NEW = "sdmc:/config/xmusic/art_test.pack.new";
+
+static std::vector<u8> makeJpeg(u32 w, u32 h, const u8 rgb[3], bool progressive) {
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr err;
+    cinfo.err = jpeg_std_error(&err);
+    jpeg_create_compress(&cinfo);
+    unsigned char* data = nullptr;
+    unsigned long size = 0;
+    jpeg_mem_dest(&cinfo, &data, &size);
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    if (progressive) jpeg_simple_progression(&cinfo);
+    jpeg_start_compress(&cinfo, TRUE);
+    std::vector<u8> row(w * 3);
+    for (u32 x = 0; x < w; x++) memcpy(&row[x * 3], rgb, 3);
+    JSAMPROW rows[1] = {row.data()};
+    while (cinfo.next_scanline < h) jpeg_write_scanlines(&cinfo, rows, 1);
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    std::vector<u8> out(data, data + size);
+    free(data);
+    return out;
+}
+
+static void pngWrite(png_structp png, png_bytep data, png_size_t size) {
+    std::vector<u8>* out = (std::vector<u8>*)png_get_io_ptr(png);
+    out->insert(out->end(), data, data + size);
+}
+
+static std::vector<u8> makePng(u32 w, u32 h, const u8 rgb[3]) {
+    std::vector<u8> out;
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png_create_info_struct(png);
+    png_set_write_fn(png, &out, pngWrite, nullptr);
+    png_set_IHDR(png, info, w, h, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    std::vector<u8> row(w * 3);
+    for (u32 x = 0; x < w; x++) memcpy(&row[x * 3], rgb, 3);
+    for (u32 y = 0; y < h; y++) png_write_row(png, row.data());
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+    return out;
+}
+
+static void frame(std::vector<u8>& tag, const char* id, const std::vector<u8>& body) {
+    tag.insert(tag.end(), id, id + 4);
+    u32 n = (u32)body.size();
+    u8 size[6] = {(u8)(n >> 24), (u8)(n >> 16), (u8)(n >> 8), (u8)n, 0, 0};
+    tag.insert(tag.end(), size, size + 6);
+    tag.insert(tag.end(), body.begin(), body.end());
+}
+
+static void textFrame(std::vector<u8>& tag, const char* id, const char* text) {
+    if (!text) return;
+    std::vector<u8> body(1, 0);
+    body.insert(body.end(), text, text + strlen(text));
+    frame(tag, id, body);
+}
+
+/**
+ * An MP3-looking file: ID3v2.3 tag with the given text frames and cover
+ */
+static void writeTrack(const char* path, const char* artist, const char* albumArtist, const char* album,
+                       const std::vector<u8>& cover, bool png) {
+    std::vector<u8> frames;
+    textFrame(frames, "TPE1", artist);
+    textFrame(frames, "TPE2", albumArtist);
+    textFrame(frames, "TALB", album);
+    if (!cover.empty()) {
+        const char* mime = png ? "image/png" : "image/jpeg";
+        std::vector<u8> body(1, 0);
+        body.insert(body.end(), mime, mime + strlen(mime) + 1);
+        body.push_back(3);  // Front cover
+        body.push_back(0);  // Empty description
+        body.insert(body.end(), cover.begin(), cover.end());
+        frame(frames, "APIC", body);
+    }
+
+    u32 n = (u32)frames.size();
+    u8 header[10] = {'I', 'D', '3', 3, 0, 0,
+                     (u8)((n >> 21) & 0x7F), (u8)((n >> 14) & 0x7F), (u8)((n >> 7) & 0x7F), (u8)(n & 0x7F)};
+    FILE* f = fopen(path, "wb");
+    fwrite(header, 1, sizeof(header), f);
+    fwrite(frames.data(), 1, frames.size(), f);
+    static const u8 audio[64] = {0xFF, 0xFB};
+    fwrite(audio, 1, sizeof(audio), f);
+    fclose(f);
+}
+
+static bool waitFor(ArtCache& cache, u32 (ArtCache::*get)() const, u32 count) {
+    u64 start = armGetSystemTick();
+    while ((cache.*get)() < count && msSince(start) < 5000) svcSleepThread(1000000);
+    return (cache.*get)() >= count;
+}
+
+static bool waitExtracted(ArtCache& cache, u32 count) {
+    return waitFor(cache, &ArtCache::getExtracted, count);
+}
+
+static long fileSize(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return -1;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+static bool isColor(u16 pixel, u32 r, u32 g, u32 b) {
+    auto near = [](u32 a, u32 e) { return a + 1 >= e && a <= e + 1; };
+    return near(pixel & 0xF, r) && near((pixel >> 4) & 0xF, g) && near((pixel >> 8) & 0xF, b) && (pixel >> 12) == 0xF;
+}
+
+static const u8 RED[3] = {255, 0, 0};
+static const u8 BLUE[3] = {0, 0, 255};
+static const u8 GREEN[3] = {0, 255, 0};
+
+static void testExtract() {
+    remove(PACK);
+    writeTrack("sdmc:/art_jpeg.mp3", "Artist", nullptr, "Red", makeJpeg(800, 600, RED, false), false);
+    writeTrack("sdmc:/art_png.mp3", "Artist", nullptr, "Blue", makePng(200, 200, BLUE), true);
+
+    std::vector<u16> big(ArtCache::thumbBytes(0) / 2), small(ArtCache::thumbBytes(1) / 2);
+    {
+        ArtCache cache(PACK);
+        CHECK(R_SUCCEEDED(cache.open()));
+        cache.enqueue("sdmc:/art_jpeg.mp3");
+        cache.enqueue("sdmc:/art_png.mp3");
+        CHECK(waitExtracted(cache, 2));
+
+        u64 red = ArtCache::trackKey("sdmc:/art_jpeg.mp3");
+        CHECK(cache.lookup(red, 0, big.data()) && isColor(big[0], 0xF, 0, 0) && isColor(big.back(), 0xF, 0, 0));
+        CHECK(cache.lookup(red, 1, small.data()) && isColor(small[small.size() / 2], 0xF, 0, 0));
+        u64 blue = ArtCache::trackKey("sdmc:/art_png.mp3");
+        CHECK(cache.lookup(blue, 0, big.data()) && isColor(big[big.size() / 2], 0, 0, 0xF));
+
+        // Already packed: no second extraction
+        cache.enqueue("sdmc:/art_jpeg.mp3");
+        cache.enqueue("sdmc:/art_png.mp3");
+        svcSleepThread(50000000);
+        CHECK(cache.getExtracted() == 2 && cache.getEntryCount() == 2);
+    }
+
+    // Committed on close, back after a restart
+    ArtCache cache(PACK);
+    CHECK(R_SUCCEEDED(cache.open()));
+    CHECK(cache.getEntryCount() == 2);
+    CHECK(cache.lookup(ArtCache::trackKey("sdmc:/art_png.mp3"), 1, small.data()) && isColor(small[0], 0, 0, 0xF));
+    CHECK(!cache.lookup(12345, 0, big.data()));
+}
+
+static void testAlbumArtist() {
+    std::vector<u8> cover = makeJpeg(64, 64, GREEN, false);
+    writeTrack("sdmc:/art_comp1.mp3", "Singer A", "Various", "Hits", cover, false);
+    writeTrack("sdmc:/art_comp2.mp3", "Singer B", "Various", "Hits", cover, false);
+    writeTrack("sdmc:/art_solo1.mp3", "Singer A", nullptr, "Hits", cover, false);
+    writeTrack("sdmc:/art_solo2.mp3", "Singer B", nullptr, "Hits", cover, false);
+
+    // A compilation shares one cover whoever sings each track
+    CHECK(ArtCache::trackKey("sdmc:/art_comp1.mp3") == ArtCache::trackKey("sdmc:/art_comp2.mp3"));
+    CHECK(ArtCache::trackKey("sdmc:/art_solo1.mp3") != ArtCache::trackKey("sdmc:/art_solo2.mp3"));
+    CHECK(ArtCache::trackKey("sdmc:/art_comp1.mp3") != ArtCache::trackKey("sdmc:/art_solo1.mp3"));
+}
+
+static bool allColor(const std::vector<u16>& pixels, u32 r, u32 g, u32 b) {
+    for (u16 p : pixels) {
+        if (!isColor(p, r, g, b)) return false;
+    }
+    return true;
+}
+
+static void testSmallCovers() {
+    // Sides under the thumbnail size are stretched, every cell gets a colour
+    remove(PACK);
+    writeTrack("sdmc:/art_small.mp3", "Small", nullptr, "64x64", makeJpeg(64, 64, RED, false), false);
+    writeTrack("sdmc:/art_narrow.mp3", "Small", nullptr, "40x200", makePng(40, 200, BLUE), true);
+    writeTrack("sdmc:/art_short.mp3", "Small", nullptr, "200x40", makeJpeg(200, 40, GREEN, false), false);
+
+    ArtCache cache(PACK);
+    CHECK(R_SUCCEEDED(cache.open()));
+    cache.enqueue("sdmc:/art_small.mp3");
+    cache.enqueue("sdmc:/art_narrow.mp3");
+    cache.enqueue("sdmc:/art_short.mp3");
+    CHECK(waitExtracted(cache, 3));
+
+    std::vector<u16> big(ArtCache::thumbBytes(0) / 2), small(ArtCache::thumbBytes(1) / 2);
+    CHECK(cache.lookup(ArtCache::trackKey("sdmc:/art_small.mp3"), 0, big.data()) && allColor(big, 0xF, 0, 0));
+    CHECK(cache.lookup(ArtCache::trackKey("sdmc:/art_small.mp3"), 1, small.data()) && allColor(small, 0xF, 0, 0));
+    CHECK(cache.lookup(ArtCache::trackKey("sdmc:/art_narrow.mp3"), 0, big.data()) && allColor(big, 0, 0, 0xF));
+    CHECK(cache.lookup(ArtCache::trackKey("sdmc:/art_narrow.mp3"), 1, small.data()) && allColor(small, 0, 0, 0xF));
+    CHECK(cache.lookup(ArtCache::trackKey("sdmc:/art_short.mp3"), 0, big.data()) && allColor(big, 0, 0xF, 0));
+}
+
+static void testLimits() {
+    remove(PACK);
+    // Too wide, and progressive with a 4MB coefficient buffer, are refused from their headers
+    writeTrack("sdmc:/art_wide.mp3", "Limits", nullptr, "Wide", makeJpeg(5000, 16, RED, false), false);
+    writeTrack("sdmc:/art_prog_big.mp3", "Limits", nullptr, "Progressive big", makeJpeg(1200, 1200, RED, true), false);
+    writeTrack("sdmc:/art_png_big.mp3", "Limits", nullptr, "PNG big", makePng(4200, 8, RED), true);
+    writeTrack("sdmc:/art_prog.mp3", "Limits", nullptr, "Progressive", makeJpeg(300, 300, GREEN, true), false);
+
+    ArtCache cache(PACK);
+    CHECK(R_SUCCEEDED(cache.open()));
+    cache.enqueue("sdmc:/art_wide.mp3");
+    cache.enqueue("sdmc:/art_prog_big.mp3");
+    cache.enqueue("sdmc:/art_png_big.mp3");
+    cache.enqueue("sdmc:/art_prog.mp3");
+    CHECK(waitExtracted(cache, 1));
+    svcSleepThread(20000000);
+    CHECK(cache.getExtracted() == 1 && cache.getEntryCount() == 1);
+
+    std::vector<u16> big(ArtCache::thumbBytes(0) / 2);
+    CHECK(cache.lookup(ArtCache::trackKey("sdmc:/art_prog.mp3"), 0, big.data()) && isColor(big[0], 0, 0xF, 0));
+    CHECK(!cache.lookup(ArtCache::trackKey("sdmc:/art_wide.mp3"), 0, big.data()));
+}
+
+static void writeHeader(u32 entryCount, u64 tableOffset) {
+    FILE* f = fopen(PACK, "r+b");
+    u32 header[6] = {0x4B505841, 1, entryCount, 0, (u32)tableOffset, (u32)(tableOffset >> 32)};
+    fwrite(header, 1, sizeof(header), f);
+    fclose(f);
+}
+
+static void testBadTables() {
+    // Counts and offsets that do not fit the file start a fresh pack instead of allocating for them
+    const u64 tables[][2] = {
+        {0xFFFFFFFF, 24},
+        {1000, 24},
+        {1, 0x7FFFFFFFFFFFULL},
+    };
+    for (const auto& t : tables) {
+        testExtract();
+        writeHeader((u32)t[0], t[1]);
+        ArtCache cache(PACK);
+        CHECK(R_SUCCEEDED(cache.open()));
+        CHECK(cache.getEntryCount() == 0);
+    }
+}
+
+static void testCompaction() {
+    testExtract();
+    long committed = fileSize(PACK);
+
+    // Orphaned blobs from writes that never got committed
+    FILE* f = fopen(PACK, "ab");
+    std::vector<u8> junk(0x180000, 0xAA);
+    fwrite(junk.data(), 1, junk.size(), f);
+    fclose(f);
+
+    writeTrack("sdmc:/art_third.mp3", "Artist", nullptr, "Green", makeJpeg(128, 128, GREEN, false), false);
+    {
+        ArtCache cache(PACK);
+        CHECK(R_SUCCEEDED(cache.open()));
+        CHECK(cache.getDeadBytes() >= junk.size());
+        cache.enqueue("sdmc:/art_third.mp3");
+        CHECK(waitFor(cache, &ArtCache::getCompactions, 1));
+        CHECK(cache.getDeadBytes() == 0 && cache.getEntryCount() == 3);
+
+        std::vector<u16> big(ArtCache::thumbBytes(0) / 2);
+        CHECK(cache.lookup(ArtCache::trackKey("sdmc:/art_jpeg.mp3"), 0, big.data()) && isColor(big[0], 0xF, 0, 0));
+        CHECK(cache.lookup(ArtCache::trackKey("sdmc:/art_third.mp3"), 0, big.data()) && isColor(big[0], 0, 0xF, 0));
+        printf("  compacted %ld bytes to %ld\n", committed + (long)junk.size(), fileSize(PACK));
+    }
+    const long packed = 24 + 3 * (96 * 96 + 48 * 48) * 2 + 3 * 16;
+    CHECK(fileSize(PACK) == packed);
+
+    // Stopped after removing the old pack, before the rename: the copy is picked up
+    rename(PACK, PACK_NEW);
+    ArtCache cache(PACK);
+    CHECK(R_SUCCEEDED(cache.open()));
+    CHECK(cache.getEntryCount() == 3 && fileSize(PACK_NEW) < 0);
+}
+
+static void testThousandAlbums() {
+    const u32 albums = 1000;
+    remove(PACK);
+    std::vector<u8> cover = makeJpeg(300, 300, RED, false);
+    char path[64], album[32];
+    {
+        ArtCache cache(PACK);
+        CHECK(R_SUCCEEDED(cache.open()));
+        for (u32 i = 0; i < albums; i++) {
+            snprintf(path, sizeof(path), "sdmc:/art_many%u.mp3", i);
+            snprintf(album, sizeof(album), "Album %u", i);
+            writeTrack(path, "Many", nullptr, album, cover, false);
+            cache.enqueue(path);
+        }
+        u64 start = armGetSystemTick();
+        while (cache.getExtracted() < albums && msSince(start) < 60000) svcSleepThread(1000000);
+        CHECK(cache.getExtracted() == albums && cache.getEntryCount() == albums);
+    }
+
+    // Pack size once committed and closed, compaction keeps table rewrites from piling up
+    double perAlbum = (double)fileSize(PACK) / albums;
+    const double blob = (96 * 96 + 48 * 48) * 2 + 16;
+
+    // One seek and one read per hit, keys looked up in a scattered order
+    ArtCache cache(PACK);
+    CHECK(R_SUCCEEDED(cache.open()));
+    std::vector<u64> keys(albums);
+    for (u32 i = 0; i < albums; i++) {
+        snprintf(path, sizeof(path), "sdmc:/art_many%u.mp3", i);
+        keys[i] = ArtCache::trackKey(path);
+    }
+    std::vector<u16> big(ArtCache::thumbBytes(0) / 2);
+    u32 hits = 0;
+    u64 start = armGetSystemTick();
+    for (u32 i = 0; i < albums; i++) {
+        if (cache.lookup(keys[(i * 617) % albums], 0, big.data())) hits++;
+    }
+    double usPerHit = armTicksToNs(armGetSystemTick() - start) / 1e3 / albums;
+    printf("  %u albums: %.0f bytes per album (%.0f of thumbnails), %.1fus per hit\n",
+           albums, perAlbum, blob, usPerHit);
+
+    CHECK(hits == albums && isColor(big[0], 0xF, 0, 0));
+    CHECK(perAlbum < blob * 1.3);
+    CHECK(!TIMING_CHECKS || usPerHit < 500.0);  // The SD card is slower, this bounds our own overhead
+    for (u32 i = 0; i < albums; i++) {
+        snprintf(path, sizeof(path), "sdmc:/art_many%u.mp3", i);
+        remove(path);
+    }
+}
+
+int main() {
+    mkdir("sdmc:", 0777);
+    mkdir("sdmc:/config", 0777);
+    mkdir("sdmc:/config/xmusic", 0777);
+
+    testExtract();
+    testAlbumArtist();
+    testSmallCovers();
+    testLimits();
+    testBadTables();
+    testCompaction();
+    testThousandAlbums();
+    return testExit("art_cache_test");
+}
@@ -0,0 +1,274 @@
+#include "test_util.h"
+#include "frame_index.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+/**
+ * FrameIndex: MP3 scans with an ID3 tag, a LAME Info frame and junk between
+ * frames, Ogg page granules, seek points, cache files that do not match
+ * the track they claim to index, and scans in the background.
+ */
+static constexpr u32 MP3_FRAMES = 50;
+static constexpr u32 MP3_FRAME_BYTES = 417;     // 128kbps, 44.1kHz, no padding bit
+static constexpr u32 ID3_BYTES = 10 + 100;
+static constexpr u32 ENCODER_DELAY = 576;
+static constexpr u32 ENCODER_PADDING = 1000;
+static constexpr u32 JUNK_AFTER = 10;           // Junk bytes follow this frame
+static constexpr u32 JUNK_BYTES = 5;
+
+static void putBE32(u8* p, u32 v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+static void putLE32(u8* p, u32 v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+
+static bool writeFile(const char* path, const std::vector<u8>& data) {
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    fclose(f);
+    return ok;
+}
+
+static void appendFrameHeader(std::vector<u8>& v) {
+    size_t at = v.size();
+    v.resize(at + MP3_FRAME_BYTES, 0);
+    v[at] = 0xFF; v[at + 1] = 0xFB; v[at + 2] = 0x90; v[at + 3] = 0x64; // MPEG1 L3 joint stereo
+}
+
+static u32 mp3FrameOffset(u32 frame, bool tagged) {
+    u32 offset = ID3_BYTES + (tagged ? MP3_FRAME_BYTES : 0) + frame * MP3_FRAME_BYTES;
+    return offset + (frame > JUNK_AFTER ? JUNK_BYTES : 0);
+}
+
+static bool writeMp3(const char* path, bool tagged) {
+    std::vector<u8> v = {'I', 'D', '3', 3, 0, 0, 0, 0, 0, 100};
+    v.resize(ID3_BYTES, 0);
+
+    if (tagged) {
+        size_t at = v.size();
+        appendFrameHeader(v);
+        u8* xing = &v[at + 36];                 // Header plus 32 bytes of side info
+        memcpy(xing, "Info", 4);
+        putBE32(xing + 4, 0x0F);                // Frames, bytes, TOC, quality
+        putBE32(xing + 8, MP3_FRAMES);
+        u8* lame = xing + 8 + 4 + 4 + 100 + 4;
+        memcpy(lame, "LAME3.100", 9);
+        lame[21] = ENCODER_DELAY >> 4;
+        lame[22] = ((ENCODER_DELAY & 0xF) << 4) | (ENCODER_PADDING >> 8);
+        lame[23] = ENCODER_PADDING & 0xFF;
+    }
+    for (u32 i = 0; i < MP3_FRAMES; i++) {
+        appendFrameHeader(v);
+        if (i == JUNK_AFTER) v.resize(v.size() + JUNK_BYTES, 0);
+    }
+    return writeFile(path, v);
+}
+
+static void testMp3() {
+    CHECK(writeMp3("tagged.mp3", true));
+    FrameIndex index;
+    CHECK(R_SUCCEEDED(index.build("tagged.mp3")));
+    CHECK(index.getFormat() == FrameIndex::Format_Mp3);
+    CHECK(index.getSampleRate() == 44100);
+    CHECK(index.getEntryCount() == MP3_FRAMES);        // The Info frame is not audio
+    CHECK(index.getDelay() == ENCODER_DELAY + 529);
+    CHECK(index.getTotalSamples() == MP3_FRAMES * 1152 - ENCODER_DELAY - ENCODER_PADDING);
+
+    const FrameIndex::Entry* entries = index.getEntries();
+    CHECK(entries[0].byteOffset == mp3FrameOffset(0, true) && entries[0].firstSample == 0);
+    CHECK(entries[JUNK_AFTER + 1].byteOffset == mp3FrameOffset(JUNK_AFTER + 1, true));
+
+    // Sample 0 of the track is the first sample after the delay
+    FrameIndex::SeekPoint point;
+    CHECK(index.find(0, &point));
+    CHECK(point.byteOffset == mp3FrameOffset(0, true));
+    CHECK(point.skipSamples == ENCODER_DELAY + 529 && point.primingFrames == 0);
+
+    // 10000 + 1105 lands in frame 9, primed with frame 8
+    CHECK(index.find(10000, &point));
+    CHECK(point.frameSample == 9 * 1152 && point.skipSamples == 10000 + 1105 - 9 * 1152);
+    CHECK(point.primingFrames == 1 && point.byteOffset == mp3FrameOffset(8, true));
+
+    // Past the junk
+    CHECK(index.find(20000, &point));
+    CHECK(point.frameSample == 18 * 1152 && point.byteOffset == mp3FrameOffset(17, true));
+
+    // Without a tag nothing is trimmed
+    CHECK(writeMp3("plain.mp3", false));
+    CHECK(R_SUCCEEDED(index.build("plain.mp3")));
+    CHECK(index.getEntryCount() == MP3_FRAMES && index.getDelay() == 0);
+    CHECK(index.getTotalSamples() == MP3_FRAMES * 1152);
+    CHECK(index.find(1152 * 3, &point) && point.skipSamples == 0 && point.frameSample == 1152 * 3);
+}
+
+static void appendPage(std::vector<u8>& v, u64 granule, const std::vector<u8>& body) {
+    size_t at = v.size();
+    v.resize(at + 27 + 1, 0);
+    memcpy(&v[at], "OggS", 4);
+    putLE32(&v[at + 6], (u32)granule);
+    putLE32(&v[at + 10], (u32)(granule >> 32));
+    v[at + 26] = 1;
+    v[at + 27] = (u8)body.size();
+    v.insert(v.end(), body.begin(), body.end());
+}
+
+static void testOgg() {
+    std::vector<u8> ident(30, 0);
+    ident[0] = 1;
+    memcpy(&ident[1], "vorbis", 6);
+    ident[11] = 2;
+    putLE32(&ident[12], 44100);
+    std::vector<u8> body(100, 0x55);
+
+    std::vector<u8> v;
+    std::vector<u32> pages;
+    for (u64 granule : {0ULL, 0ULL, 1024ULL, ~0ULL, 4096ULL, 6000ULL}) {
+        pages.push_back((u32)v.size());
+        appendPage(v, granule, pages.size() == 1 ? ident : body);
+    }
+    CHECK(writeFile("track.ogg", v));
+
+    FrameIndex index;
+    CHECK(R_SUCCEEDED(index.build("track.ogg")));
+    CHECK(index.getFormat() == FrameIndex::Format_Ogg);
+    CHECK(index.getSampleRate() == 44100);
+    CHECK(index.getTotalSamples() == 6000);
+    CHECK(index.getEntryCount() == 3);
+
+    // Each entry starts where the page before it ended
+    const FrameIndex::Entry* entries = index.getEntries();
+    CHECK(entries[0].byteOffset == pages[2] && entries[0].firstSample == 0);
+    CHECK(entries[1].byteOffset == pages[4] && entries[1].firstSample == 1024);
+    CHECK(entries[2].byteOffset == pages[5] && entries[2].firstSample == 4096);
+
+    FrameIndex::SeekPoint point;
+    CHECK(index.find(5000, &point));
+    CHECK(point.frameSample == 4096 && point.skipSamples == 904);
+    CHECK(point.primingFrames == 1 && point.byteOffset == pages[4]);
+}
+
+static std::string onlyCacheFile() {
+    std::string found;
+    DIR* dir = opendir(FrameIndex::CACHE_DIR);
+    if (!dir) return found;
+    while (dirent* e = readdir(dir)) {
+        if (strstr(e->d_name, ".idx")) found = std::string(FrameIndex::CACHE_DIR) + "/" + e->d_name;
+    }
+    closedir(dir);
+    return found;
+}
+
+static void testCache() {
+    mkdir("sdmc:", 0777);
+    mkdir("sdmc:/config", 0777);
+    mkdir("sdmc:/config/xmusic", 0777);
+
+    CHECK(writeMp3("cached.mp3", true));
+    struct stat st;
+    stat("cached.mp3", &st);
+    u64 size = (u64)st.st_size;
+
+    FrameIndex index;
+    CHECK(R_SUCCEEDED(index.open("cached.mp3")));       // Scans and writes the cache
+    std::string cache = onlyCacheFile();
+    CHECK(!cache.empty());
+
+    FrameIndex loaded;
+    CHECK(R_SUCCEEDED(loaded.loadCache("cached.mp3", size)));
+    CHECK(loaded.getEntryCount() == index.getEntryCount());
+    CHECK(loaded.getDelay() == index.getDelay());
+    CHECK(loaded.getTotalSamples() == index.getTotalSamples());
+
+    // A different size is a different track
+    CHECK(R_FAILED(loaded.loadCache("cached.mp3", size + 1)));
+
+    FILE* f = fopen(cache.c_str(), "rb");
+    std::vector<u8> good(4096);
+    good.resize(fread(good.data(), 1, good.size(), f));
+    fclose(f);
+
+    // An entry count the file cannot hold is rejected before anything is allocated
+    std::vector<u8> bad = good;
+    putLE32(&bad[32], 0x20000000);  // CacheHeader::entryCount
+    CHECK(writeFile(cache.c_str(), bad));
+    CHECK(R_FAILED(loaded.loadCache("cached.mp3", size)));
+    CHECK(loaded.getEntryCount() == 0);
+
+    // Truncated entries
+    bad = good;
+    bad.resize(bad.size() - 8);
+    CHECK(writeFile(cache.c_str(), bad));
+    CHECK(R_FAILED(loaded.loadCache("cached.mp3", size)));
+
+    // open() replaces a bad cache with a fresh scan
+    CHECK(R_SUCCEEDED(loaded.open("cached.mp3")));
+    CHECK(loaded.getEntryCount() == MP3_FRAMES);
+    CHECK(R_SUCCEEDED(loaded.loadCache("cached.mp3", size)));
+    remove(cache.c_str());
+}
+
+/**
+ * A long track: start() hands back at once, the scan arrives later through
+ * take() and is cached, and stop() cancels a scan partway
+ */
+static void testBackgroundScan() {
+    static constexpr u32 LONG_FRAMES = 60000;   // About 26 minutes, 25MB
+    std::vector<u8> v;
+    v.reserve((size_t)LONG_FRAMES * MP3_FRAME_BYTES);
+    for (u32 i = 0; i < LONG_FRAMES; i++) appendFrameHeader(v);
+    CHECK(writeFile("long.mp3", v));
+
+    u64 start = armGetSystemTick();
+    FrameIndex built;
+    CHECK(R_SUCCEEDED(built.build("long.mp3")));
+    double scanMs = msSince(start);
+
+    FrameIndexScan scan;
+    FrameIndex index;
+    start = armGetSystemTick();
+    CHECK(!scan.start("long.mp3", &index));
+    double startMs = msSince(start);
+    CHECK(index.getEntryCount() == 0);
+
+    u64 deadline = armGetSystemTick() + armNsToTicks(10000000000ULL);
+    bool taken = false;
+    while (!(taken = scan.take(&index)) && armGetSystemTick() < deadline) svcSleepThread(1000000);
+    double readyMs = msSince(start);
+    CHECK(taken && index.getEntryCount() == LONG_FRAMES);
+    CHECK(index.getTotalSamples() == built.getTotalSamples());
+    CHECK(!scan.take(&index) && index.getEntryCount() == LONG_FRAMES);
+
+    // Played again: the cache, no scan
+    FrameIndex cached;
+    start = armGetSystemTick();
+    CHECK(scan.start("long.mp3", &cached));
+    double cachedMs = msSince(start);
+    CHECK(cached.getEntryCount() == LONG_FRAMES);
+
+    // Cancelled right away: the thread is gone long before a scan would end
+    remove(onlyCacheFile().c_str());
+    CHECK(!scan.start("long.mp3", &index));
+    start = armGetSystemTick();
+    scan.stop();
+    double stopMs = msSince(start);
+    CHECK(!scan.take(&index));
+
+    printf("  %u frames: scan %.1fms, start %.3fms, index ready %.1fms, from cache %.1fms, cancel %.3fms\n",
+           LONG_FRAMES, scanMs, startMs, readyMs, cachedMs, stopMs);
+    CHECK(!TIMING_CHECKS || startMs < scanMs / 4);
+    CHECK(!TIMING_CHECKS || stopMs < scanMs / 2);
+    remove(onlyCacheFile().c_str());
+    remove("long.mp3");
+}
+
+int main() {
+    testMp3();
+    testOgg();
+    testCache();
+    testBackgroundScan();
+    remove("tagged.mp3");
+    remove("plain.mp3");
+    remove("track.ogg");
+    remove("cached.mp3");
+    return testExit("frame_index_test");
+}
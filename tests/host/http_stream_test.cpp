@@ -0,0 +1,437 @@
+#include "test_util.h"
+#include "http_stream.h"
+#include "track_player.h"
+#include <csignal>
+#include <string>
+#include <vector>
+
+/**
+ * HttpStream against a local HTTP server stand-in that can limit its
+ * bandwidth, stall, drop the connection, ignore Range, redirect, or accept
+ * and never answer. Reports time to first sample and rebuffer counts.
+ */
+struct ServerConfig {
+    u32 bytesPerSec = 0;        // 0 for as fast as the socket takes it
+    u64 stallAt = ~0ULL;        // First connection pauses at this body offset
+    u32 stallMs = 0;
+    u64 dropAt = ~0ULL;         // First connection closes at this body offset
+    bool ignoreRange = false;   // Always answer 200 from byte 0
+    std::string location;       // Answer to /dir/redirect
+};
+
+class TestServer {
+private:
+    int m_listen = -1;
+    u16 m_port = 0;
+    std::thread m_acceptThread;
+    std::vector<std::thread> m_handlers;
+    std::atomic<bool> m_stop{false};
+    std::vector<u8> m_body;
+    ServerConfig m_config;
+
+    bool sleepMs(u32 ms) {
+        for (u32 i = 0; i < ms && !m_stop; i += 5) svcSleepThread(5000000);
+        return !m_stop;
+    }
+
+    bool sendText(int fd, const std::string& text) {
+        return send(fd, text.data(), text.size(), MSG_NOSIGNAL) == (ssize_t)text.size();
+    }
+
+    void handle(int fd, bool first) {
+        std::string request;
+        char buf[1024];
+        while (request.find("\r\n\r\n") == std::string::npos) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                ::close(fd);
+                return;
+            }
+            request.append(buf, n);
+        }
+        char path[256] = {};
+        sscanf(request.c_str(), "GET %255s", path);
+        unsigned long long from = 0;
+        const char* range = strstr(request.c_str(), "Range: bytes=");
+        if (range) from = strtoull(range + 13, nullptr, 10);
+        if (from) lastRangeStart = from;
+
+        if (strcmp(path, "/hang") == 0) {
+            // Accept and never answer, until the client gives up
+            pollfd pfd = {fd, POLLIN, 0};
+            while (!m_stop && poll(&pfd, 1, 10) == 0) {}
+        } else if (strcmp(path, "/dir/redirect") == 0) {
+            sendText(fd, "HTTP/1.0 302 Found\r\nLocation: " + m_config.location + "\r\n\r\n");
+        } else if (strcmp(path, "/dir/track.bin") != 0) {
+            sendText(fd, "HTTP/1.0 404 Not Found\r\n\r\n");
+        } else {
+            if (m_config.ignoreRange || from >= m_body.size()) from = 0;
+            char header[256];
+            snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Length: %llu\r\n\r\n",
+                     from ? "206 Partial Content" : "200 OK", (unsigned long long)(m_body.size() - from));
+            sendBody(fd, header, from, first);
+        }
+        ::close(fd);
+    }
+
+    void sendBody(int fd, const char* header, u64 from, bool first) {
+        if (!sendText(fd, header)) return;
+        u64 start = armGetSystemTick();
+        u64 sent = 0;
+        for (u64 pos = from; pos < m_body.size() && !m_stop;) {
+            if (first && pos >= m_config.stallAt && pos < m_config.stallAt + 1024) {
+                if (!sleepMs(m_config.stallMs)) return;
+                start = armGetSystemTick();
+                sent = 0;
+            }
+            if (first && pos >= m_config.dropAt) return;
+
+            size_t n = (size_t)std::min<u64>(1024, m_body.size() - pos);
+            if (send(fd, &m_body[pos], n, MSG_NOSIGNAL) != (ssize_t)n) return;
+            pos += n;
+            sent += n;
+            if (m_config.bytesPerSec) {
+                u64 due = start + armNsToTicks(sent * 1000000000ULL / m_config.bytesPerSec);
+                while (!m_stop && armGetSystemTick() < due) svcSleepThread(1000000);
+            }
+        }
+    }
+
+    void acceptLoop() {
+        bool first = true;
+        while (!m_stop) {
+            pollfd pfd = {m_listen, POLLIN, 0};
+            if (poll(&pfd, 1, 10) <= 0) continue;
+            int fd = accept(m_listen, nullptr, nullptr);
+            if (fd < 0) continue;
+            connections++;
+            m_handlers.emplace_back(&TestServer::handle, this, fd, first);
+            first = false;
+        }
+    }
+
+public:
+    std::atomic<u32> connections{0};
+    std::atomic<u64> lastRangeStart{0};
+
+    bool start(const std::vector<u8>& body, const ServerConfig& config) {
+        m_body = body;
+        m_config = config;
+        m_listen = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(m_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (bind(m_listen, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(m_listen, 8) != 0 ||
+            getsockname(m_listen, (sockaddr*)&addr, &len) != 0) {
+            return false;
+        }
+        m_port = ntohs(addr.sin_port);
+        m_acceptThread = std::thread(&TestServer::acceptLoop, this);
+        return true;
+    }
+
+    void stop() {
+        m_stop = true;
+        if (m_acceptThread.joinable()) m_acceptThread.join();
+        for (std::thread& t : m_handlers) t.join();
+        m_handlers.clear();
+        if (m_listen >= 0) ::close(m_listen);
+        m_listen = -1;
+    }
+
+    ~TestServer() { stop(); }
+
+    std::string url(const char* path) {
+        return "http://127.0.0.1:" + std::to_string(m_port) + path;
+    }
+};
+
+static u8 patternAt(u64 i) {
+    return (u8)(i ^ (i >> 8) ^ (i >> 16));
+}
+
+static std::vector<u8> patternBody(u32 size) {
+    std::vector<u8> body(size);
+    for (u32 i = 0; i < size; i++) body[i] = patternAt(i);
+    return body;
+}
+
+static HttpStream::Config smallConfig(u32 consumptionBps) {
+    HttpStream::Config config;
+    config.lowWatermarkBytes = 0x4000;
+    config.capacityBytes = 0x10000;
+    config.consumptionBps = consumptionBps;
+    return config;
+}
+
+/**
+ * Pull from the stream at bytesPerSec in 10ms ticks, as a decoder would,
+ * until it finishes or fails. Returns the bytes that matched the body.
+ */
+static u64 consume(HttpStream& stream, u32 bytesPerSec, u32 timeoutMs, bool* intact) {
+    std::vector<u8> buf(bytesPerSec / 100);
+    u64 offset = 0;
+    *intact = true;
+    u64 start = armGetSystemTick();
+    while (msSince(start) < timeoutMs) {
+        HttpStream::State state = stream.getState();
+        if (state == HttpStream::State_Finished || state == HttpStream::State_Failed) break;
+        size_t n = stream.read(buf.data(), buf.size());
+        for (size_t i = 0; i < n; i++) {
+            if (buf[i] != patternAt(offset + i)) *intact = false;
+        }
+        offset += n;
+        svcSleepThread(10000000);
+    }
+    return offset;
+}
+
+static void report(const char* name, HttpStream& stream) {
+    HttpStream::Stats stats = stream.getStats();
+    printf("  %-12s first sample %6.1fms, %u rebuffer(s), %u reconnect(s), target %uKB\n", name,
+           stats.timeToFirstSampleNs / 1e6, stats.rebufferCount, stats.reconnectCount, stats.targetBytes >> 10);
+}
+
+static void testSteady() {
+    std::vector<u8> body = patternBody(0x30000);
+    TestServer server;
+    CHECK(server.start(body, ServerConfig()));
+
+    HttpStream stream;
+    CHECK(R_SUCCEEDED(stream.open(server.url("/dir/track.bin").c_str(), smallConfig(0x40000))));
+    bool intact;
+    CHECK(consume(stream, 0x40000, 5000, &intact) == body.size() && intact);
+    CHECK(stream.getState() == HttpStream::State_Finished);
+    CHECK(stream.getContentLength() == body.size());
+
+    HttpStream::Stats stats = stream.getStats();
+    CHECK(stats.rebufferCount == 0 && stats.reconnectCount == 0);
+    CHECK(!TIMING_CHECKS || stats.timeToFirstSampleNs < 500000000ULL);
+    report("steady", stream);
+}
+
+static void testSlowLink() {
+    // The link delivers half of what the decoder consumes
+    std::vector<u8> body = patternBody(0x18000);
+    ServerConfig config;
+    config.bytesPerSec = 0x18000;
+    TestServer server;
+    CHECK(server.start(body, config));
+
+    HttpStream stream;
+    CHECK(R_SUCCEEDED(stream.open(server.url("/dir/track.bin").c_str(), smallConfig(0x30000))));
+    bool intact;
+    CHECK(consume(stream, 0x30000, 5000, &intact) == body.size() && intact);
+    HttpStream::Stats stats = stream.getStats();
+    CHECK(stats.rebufferCount > 0);
+    CHECK(stats.targetBytes > 0x4000);   // Rebuffers refill past the low watermark
+    // The low watermark takes about 170ms at this rate
+    CHECK(!TIMING_CHECKS || (stats.timeToFirstSampleNs > 100000000ULL && stats.timeToFirstSampleNs < 1000000000ULL));
+    report("slow link", stream);
+}
+
+static void testStall() {
+    // A one second stall is longer than the 0.5s the buffer holds
+    std::vector<u8> body = patternBody(0x28000);
+    ServerConfig config;
+    config.stallAt = 0x10000;
+    config.stallMs = 1000;
+    TestServer server;
+    CHECK(server.start(body, config));
+
+    HttpStream stream;
+    CHECK(R_SUCCEEDED(stream.open(server.url("/dir/track.bin").c_str(), smallConfig(0x20000))));
+    bool intact;
+    CHECK(consume(stream, 0x20000, 5000, &intact) == body.size() && intact);
+    HttpStream::Stats stats = stream.getStats();
+    CHECK(stats.rebufferCount >= 1 && stats.reconnectCount == 0);
+    report("stall", stream);
+
+    // A stall past the receive timeout reconnects with a Range request
+    server.stop();
+    TestServer slow;
+    CHECK(slow.start(body, config));
+    HttpStream::Config streamConfig = smallConfig(0x20000);
+    streamConfig.stallTimeoutMs = 300;
+    CHECK(R_SUCCEEDED(stream.open(slow.url("/dir/track.bin").c_str(), streamConfig)));
+    CHECK(consume(stream, 0x20000, 5000, &intact) == body.size() && intact);
+    CHECK(stream.getStats().reconnectCount == 1);
+    CHECK(slow.lastRangeStart >= config.stallAt);
+    report("stall resume", stream);
+}
+
+static void testDrop() {
+    std::vector<u8> body = patternBody(0x20000);
+    ServerConfig config;
+    config.dropAt = 0x9000;
+    TestServer server;
+    CHECK(server.start(body, config));
+
+    HttpStream stream;
+    CHECK(R_SUCCEEDED(stream.open(server.url("/dir/track.bin").c_str(), smallConfig(0x40000))));
+    bool intact;
+    CHECK(consume(stream, 0x40000, 5000, &intact) == body.size() && intact);
+    CHECK(stream.getStats().reconnectCount == 1);
+    CHECK(server.lastRangeStart == config.dropAt);
+    report("drop", stream);
+
+    // A server that ignores Range restarts from byte 0; the stream skips what it has
+    server.stop();
+    config.ignoreRange = true;
+    TestServer noRange;
+    CHECK(noRange.start(body, config));
+    CHECK(R_SUCCEEDED(stream.open(noRange.url("/dir/track.bin").c_str(), smallConfig(0x40000))));
+    CHECK(consume(stream, 0x40000, 5000, &intact) == body.size() && intact);
+    CHECK(stream.getStats().reconnectCount == 1);
+}
+
+static void testRedirects() {
+    std::vector<u8> body = patternBody(0x8000);
+    ServerConfig config;
+    config.location = "track.bin";
+    TestServer server;
+    CHECK(server.start(body, config));
+
+    // Relative to the directory of the request
+    HttpStream stream;
+    CHECK(R_SUCCEEDED(stream.open(server.url("/dir/redirect").c_str(), smallConfig(0x40000))));
+    bool intact;
+    CHECK(consume(stream, 0x40000, 5000, &intact) == body.size() && intact);
+    server.stop();
+
+    // Host-relative
+    config.location = "/dir/track.bin";
+    TestServer absolute;
+    CHECK(absolute.start(body, config));
+    CHECK(R_SUCCEEDED(stream.open(absolute.url("/dir/redirect").c_str(), smallConfig(0x40000))));
+    CHECK(consume(stream, 0x40000, 5000, &intact) == body.size() && intact);
+    absolute.stop();
+
+    // https cannot be followed and is not retried
+    config.location = "https://example.com/track.bin";
+    TestServer https;
+    CHECK(https.start(body, config));
+    u64 start = armGetSystemTick();
+    CHECK(R_SUCCEEDED(stream.open(https.url("/dir/redirect").c_str(), smallConfig(0x40000))));
+    consume(stream, 0x40000, 5000, &intact);
+    CHECK(stream.getState() == HttpStream::State_Failed);
+    CHECK(https.connections == 1);
+    CHECK(!TIMING_CHECKS || msSince(start) < 200.0);
+
+    // Neither is a 404
+    CHECK(R_SUCCEEDED(stream.open(https.url("/dir/missing").c_str(), smallConfig(0x40000))));
+    consume(stream, 0x40000, 5000, &intact);
+    CHECK(stream.getState() == HttpStream::State_Failed);
+    CHECK(https.connections == 2);
+}
+
+static void testClose() {
+    TestServer server;
+    CHECK(server.start(patternBody(0x1000), ServerConfig()));
+
+    // A server that never answers does not hold up close()
+    HttpStream stream;
+    CHECK(R_SUCCEEDED(stream.open(server.url("/hang").c_str(), smallConfig(0x40000))));
+    svcSleepThread(100000000);
+    CHECK(stream.getState() == HttpStream::State_Connecting);
+    u64 start = armGetSystemTick();
+    stream.close();
+    double hangMs = msSince(start);
+    CHECK(!TIMING_CHECKS || hangMs < 100.0);
+
+    // Nor does the back-off between refused connections
+    std::string refused = server.url("/dir/track.bin");
+    server.stop();
+    CHECK(R_SUCCEEDED(stream.open(refused.c_str(), smallConfig(0x40000))));
+    svcSleepThread(100000000);
+    start = armGetSystemTick();
+    stream.close();
+    double backoffMs = msSince(start);
+    CHECK(!TIMING_CHECKS || backoffMs < 100.0);
+    printf("  close while waiting for a response %.1fms, while backing off %.1fms\n", hangMs, backoffMs);
+
+    // Out of retries
+    HttpStream::Config config = smallConfig(0x40000);
+    config.maxRetries = 1;
+    CHECK(R_SUCCEEDED(stream.open(refused.c_str(), config)));
+    bool intact;
+    consume(stream, 0x40000, 2000, &intact);
+    CHECK(stream.getState() == HttpStream::State_Failed);
+
+    CHECK(R_FAILED(stream.open("https://127.0.0.1/track.bin")));
+}
+
+static void put32(std::vector<u8>& v, u32 x) { for (int i = 0; i < 4; i++) v.push_back((u8)(x >> (i * 8))); }
+static void put16(std::vector<u8>& v, u16 x) { v.push_back((u8)x); v.push_back((u8)(x >> 8)); }
+
+static void testTrackPlayer() {
+    // Half a second of 48kHz stereo WAV, decoded straight off the stream
+    static constexpr u32 FRAMES = 24000;
+    std::vector<u8> wav = {'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A', 'V', 'E', 'f', 'm', 't', ' '};
+    put32(wav, 16);
+    put16(wav, 1);
+    put16(wav, 2);
+    put32(wav, 48000);
+    put32(wav, 48000 * 4);
+    put16(wav, 4);
+    put16(wav, 16);
+    wav.insert(wav.end(), {'d', 'a', 't', 'a'});
+    put32(wav, FRAMES * 4);
+    for (u32 i = 0; i < FRAMES * 2; i++) put16(wav, (u16)(i / 2));
+
+    ServerConfig config;
+    config.bytesPerSec = 48000 * 4 * 2;     // Twice real time
+    TestServer server;
+    CHECK(server.start(wav, config));
+
+    HttpStream stream;
+    HttpSource source(&stream);
+    TrackPlayer player;
+    CHECK(R_SUCCEEDED(stream.open(server.url("/dir/track.bin").c_str(), smallConfig(0x40000))));
+    u64 start = armGetSystemTick();
+    CHECK(R_SUCCEEDED(player.openSource(&source)));
+
+    PcmStream* pcm = player.getStream();
+    u64 frames = 0;
+    double firstMs = -1.0;
+    bool ordered = true;
+    while (!pcm->isDrained() && msSince(start) < 5000) {
+        pcm->sync();
+        const s16* span;
+        u32 n = pcm->peek(&span, 1024);
+        if (n == 0) {
+            svcSleepThread(1000000);
+            continue;
+        }
+        if (firstMs < 0) firstMs = msSince(start);
+        for (u32 i = 0; i < n && frames + i < FRAMES - Resampler::FLUSH_FRAMES; i++) {
+            if (span[i * 2] != (s16)(frames + i)) ordered = false;
+        }
+        pcm->consume(n);
+        frames += n;
+    }
+    CHECK(ordered);
+    CHECK(frames >= FRAMES - Resampler::FLUSH_FRAMES);
+    CHECK(player.getState() == TrackPlayer::State_Finished);
+    CHECK(!source.canSeek() && source.getSize() == wav.size());
+    CHECK(!TIMING_CHECKS || firstMs < 500.0);
+    printf("  track player first audio %.1fms, %llu frames\n", firstMs, (unsigned long long)frames);
+
+    player.close();
+    stream.close();
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    testSteady();
+    testSlowLink();
+    testStall();
+    testDrop();
+    testRedirects();
+    testClose();
+    testTrackPlayer();
+    return testExit("http_stream_test");
+}
@@ -0,0 +1,136 @@
+#include "test_util.h"
+#include "audio_mixer.h"
+#include <thread>
+#include <vector>
+
+/**
+ * AudioMixer: summing and saturation, stale voice ids, control threads
+ * racing the audio thread, and the cost of a block for 1 to 16 voices.
+ */
+using Output = RenderConfig<2, SampleFormat_S16, 4096>;
+using Mixer = AudioMixer<Output>;
+
+static constexpr u32 BLOCK = Output::BLOCK_FRAMES;
+
+static void testSumAndSaturation() {
+    static Mixer mixer;
+    static s16 out[BLOCK * 2];
+    std::vector<s16> a(BLOCK * 4, 10000), b(BLOCK * 4, 30000);
+
+    s32 va = mixer.startVoice(a.data(), BLOCK * 2);
+    s32 vb = mixer.startVoice(b.data(), BLOCK * 2);
+    mixer.mix(out, BLOCK, 1.0f);
+    CHECK(out[0] == 32767);                 // 40000 saturates once, at the store
+
+    mixer.setVoiceGain(vb, 0.5f);
+    mixer.seekVoice(va, 0);
+    mixer.seekVoice(vb, 0);
+    mixer.mix(out, BLOCK, 1.0f);
+    CHECK(out[0] >= 24998 && out[0] <= 25000);
+
+    mixer.mix(out, BLOCK, 1.0f);            // Both one-shot voices ended
+    CHECK(!mixer.isVoiceActive(va) && !mixer.isVoiceActive(vb));
+}
+
+static void testStaleIds() {
+    static Mixer mixer;
+    static s16 out[64 * 2];
+    std::vector<s16> a(64 * 2, 1000);
+
+    s32 first = mixer.startVoice(a.data(), 64);
+    mixer.mix(out, 64, 1.0f);               // Plays out and frees its slot
+    s32 second = mixer.startVoice(a.data(), 64, 1.0f, 0.0f, true);
+    CHECK(first != second);
+    CHECK((first & 0xF) == (second & 0xF)); // Same slot, newer generation
+
+    mixer.stopVoice(first, true);           // Must not touch the new voice
+    CHECK(mixer.isVoiceActive(second));
+    CHECK(mixer.getVoicePosition(first) == 0);
+    mixer.stopVoice(second);
+    mixer.collect();
+}
+
+/**
+ * One control thread starting and stopping voices while the audio thread
+ * mixes and reads voice blocks. Meaningful under -fsanitize=thread.
+ */
+static void testConcurrentControl() {
+    static Mixer mixer;
+    static s16 out[256 * 2];
+    std::vector<s16> a(256 * 2, 100);
+    std::atomic<bool> done{false};
+    std::atomic<s32> current{Mixer::INVALID_VOICE};
+
+    std::thread control([&] {
+        for (u32 i = 0; i < 2000; i++) {
+            s32 id = mixer.startVoice(a.data(), 256, 0.5f, 0.0f, true);
+            current.store(id);
+            mixer.setVoicePaused(id, (i & 1) != 0);
+            mixer.stopVoice(id, true);
+        }
+        done.store(true);
+    });
+
+    u32 blocks = 0;
+    while (!done.load()) {
+        mixer.mix(out, 256, 1.0f);
+        u64 start, length;
+        u32 frames;
+        bool loop;
+        mixer.getVoiceBlock(current.load(), &start, &frames, &length, &loop);
+        blocks++;
+    }
+    control.join();
+    CHECK(blocks > 0);
+    CHECK(!mixer.hasAudibleVoices());
+}
+
+/**
+ * Cost of one 4096 frame block against its 85ms real-time budget
+ */
+static void benchmarkVoices() {
+    static s16 out[BLOCK * 2];
+    std::vector<s16> stereo(BLOCK * 2 * 4);
+    std::vector<s16> mono(BLOCK * 4);
+    for (size_t i = 0; i < stereo.size(); i++) stereo[i] = (s16)((i * 37) & 0x3FFF);
+    for (size_t i = 0; i < mono.size(); i++) mono[i] = (s16)((i * 53) & 0x3FFF);
+
+    const double budgetNs = BLOCK * 1e9 / 48000.0;
+    const u32 iterations = 400;
+    printf("  voices  ns/block  %%budget\n");
+
+    for (u32 count = 1; count <= Mixer::MAX_VOICES; count++) {
+        static Mixer mixer;
+        s32 ids[Mixer::MAX_VOICES];
+        for (u32 i = 0; i < count; i++) {
+            // Mostly stereo music-like voices, every fourth one a mono effect
+            ids[i] = (i % 4 == 3) ? mixer.startVoice(mono.data(), BLOCK * 4, 1, SampleFormat_S16,
+                                                     0.2f, 0.0f, true)
+                                  : mixer.startVoice(stereo.data(), BLOCK * 4, 0.2f, 0.0f, true);
+        }
+
+        u64 ticks = 0;
+        for (u32 k = 0; k < iterations; k++) {
+            mixer.mix(out, BLOCK, 1.0f);
+            ticks += mixer.getLastMixTicks();
+        }
+        CHECK(mixer.getLastMixVoices() == count);
+
+        double ns = armTicksToNs(ticks) / (double)iterations;
+        printf("  %6u  %8.0f  %7.3f\n", count, ns, 100.0 * ns / budgetNs);
+        if (count == Mixer::MAX_VOICES) {
+            CHECK(!TIMING_CHECKS || ns < budgetNs * 0.25);    // Generous: the console core is slower than a host
+        }
+
+        for (u32 i = 0; i < count; i++) mixer.stopVoice(ids[i]);
+        mixer.collect();
+    }
+}
+
+int main() {
+    testSumAndSaturation();
+    testStaleIds();
+    testConcurrentControl();
+    benchmarkVoices();
+    return testExit("mixer_test");
+}
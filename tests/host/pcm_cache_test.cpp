@@ -0,0 +1,341 @@
+#include "test_util.h"
+#include "pcm_cache.h"
+#include "track_player.h"
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+/**
+ * PCM cache: entries round trip, damaged blocks are never handed out,
+ * headers that do not describe their file are refused, the track player
+ * counts plays, plays hits and falls back to decoding the file when an
+ * entry turns out damaged mid-track, and a transcode stops without leaving
+ * an entry when playback resumes.
+ */
+static const char* ENTRY = "sdmc:/config/xmusic/pcm_test.pcm";
+static const char* CACHE_DIR = "sdmc:/config/xmusic/pcm_test";
+static const char* TRACK = "sdmc:/config/xmusic/pcm_test.wav";
+static constexpr u64 KEY = 0x1234567890ABCDEFULL;
+static constexpr u32 BLOCK_FRAMES = pcmcache::BLOCK_BYTES / pcmcache::FRAME_BYTES;
+
+static s16 sampleAt(u64 i) {
+    return (s16)((i * 2654435761ULL) >> 16);
+}
+
+static std::vector<s16> makeFrames(u32 frames) {
+    std::vector<s16> v((size_t)frames * 2);
+    for (size_t i = 0; i < v.size(); i++) v[i] = sampleAt(i);
+    return v;
+}
+
+static bool writeEntry(const std::vector<s16>& pcm) {
+    PcmCacheWriter writer;
+    u64 bytes = 0;
+    if (R_FAILED(writer.open(ENTRY, KEY))) return false;
+    // Odd appends, so blocks never line up with them
+    for (size_t done = 0; done < pcm.size() / 2;) {
+        u32 n = (u32)std::min<size_t>(1000, pcm.size() / 2 - done);
+        if (R_FAILED(writer.append(pcm.data() + done * 2, n))) return false;
+        done += n;
+    }
+    return R_SUCCEEDED(writer.commit(&bytes));
+}
+
+/**
+ * Everything read() hands out from the current position, in odd sizes
+ */
+static std::vector<s16> readAll(PcmCacheReader& reader) {
+    std::vector<s16> out;
+    s16 buf[777 * 2];
+    u32 n;
+    while ((n = reader.read(buf, 777)) > 0) out.insert(out.end(), buf, buf + n * 2);
+    return out;
+}
+
+static bool exists(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (f) fclose(f);
+    return f != nullptr;
+}
+
+static void patchFile(const char* path, u64 offset, const void* data, size_t size) {
+    FILE* f = fopen(path, "r+b");
+    fseeko(f, (off_t)offset, SEEK_SET);
+    fwrite(data, 1, size, f);
+    fclose(f);
+}
+
+static void testRoundTrip() {
+    std::vector<s16> pcm = makeFrames(BLOCK_FRAMES * 3 + 1234);
+    CHECK(writeEntry(pcm));
+
+    PcmCacheReader reader;
+    CHECK(R_SUCCEEDED(reader.open(ENTRY, KEY)));
+    CHECK(reader.getFrames() == pcm.size() / 2);
+    CHECK(readAll(reader) == pcm);
+    CHECK(!reader.hasFailed());
+
+    // Into the middle of a block, back to an earlier one, and to the end
+    u64 targets[] = {BLOCK_FRAMES * 2 + 100, 5, pcm.size() / 2};
+    for (u64 target : targets) {
+        reader.seek(target);
+        std::vector<s16> rest = readAll(reader);
+        CHECK(rest.size() == pcm.size() - target * 2 &&
+              std::equal(rest.begin(), rest.end(), pcm.begin() + target * 2));
+    }
+
+    // Wrong source key, a discarded write leaves nothing behind
+    CHECK(R_FAILED(reader.open(ENTRY, KEY + 1)));
+    {
+        PcmCacheWriter writer;
+        CHECK(R_SUCCEEDED(writer.open("sdmc:/config/xmusic/pcm_discard.pcm", KEY)));
+        CHECK(R_SUCCEEDED(writer.append(pcm.data(), 100)));
+        writer.discard();
+    }
+    CHECK(!exists("sdmc:/config/xmusic/pcm_discard.pcm.tmp"));
+    CHECK(!exists("sdmc:/config/xmusic/pcm_discard.pcm"));
+}
+
+static void testDamagedBlock() {
+    std::vector<s16> pcm = makeFrames(BLOCK_FRAMES * 4);
+    CHECK(writeEntry(pcm));
+    u8 junk = 0x5A;
+    patchFile(ENTRY, pcmcache::DATA_OFFSET + 2 * pcmcache::BLOCK_BYTES + 4321, &junk, 1);
+
+    // Exactly the two good blocks come out, none of the damaged one
+    PcmCacheReader reader;
+    CHECK(R_SUCCEEDED(reader.open(ENTRY, KEY)));
+    std::vector<s16> got = readAll(reader);
+    CHECK(got.size() == (size_t)BLOCK_FRAMES * 2 * 2 && std::equal(got.begin(), got.end(), pcm.begin()));
+    CHECK(reader.hasFailed());
+    CHECK(reader.getPosition() == BLOCK_FRAMES * 2);
+
+    // A seek straight into it returns nothing; the block after it is fine
+    CHECK(R_SUCCEEDED(reader.open(ENTRY, KEY)));
+    reader.seek(BLOCK_FRAMES * 2 + 10);
+    s16 buf[64 * 2];
+    CHECK(reader.read(buf, 64) == 0 && reader.hasFailed());
+    CHECK(R_SUCCEEDED(reader.open(ENTRY, KEY)));
+    reader.seek(BLOCK_FRAMES * 3);
+    got = readAll(reader);
+    CHECK(!reader.hasFailed() && got.size() == (size_t)BLOCK_FRAMES * 2 &&
+          std::equal(got.begin(), got.end(), pcm.begin() + BLOCK_FRAMES * 3 * 2));
+}
+
+static void testBadHeaders() {
+    std::vector<s16> pcm = makeFrames(BLOCK_FRAMES * 2 + 50);
+    PcmCacheReader reader;
+
+    // Each header is internally consistent, CRC included, but lies about the file
+    auto tamper = [&](void (*edit)(PcmCacheHeader&)) {
+        CHECK(writeEntry(pcm));
+        PcmCacheHeader h;
+        FILE* f = fopen(ENTRY, "rb");
+        CHECK(fread(&h, sizeof(h), 1, f) == 1);
+        fclose(f);
+        edit(h);
+        h.headerCrc = pcmcache::headerCrc(h);
+        patchFile(ENTRY, 0, &h, sizeof(h));
+        return R_FAILED(reader.open(ENTRY, KEY));
+    };
+    CHECK(tamper([](PcmCacheHeader& h) { h.blockCount = 0x40000000; }));
+    CHECK(tamper([](PcmCacheHeader& h) { h.blockCount--; }));
+    CHECK(tamper([](PcmCacheHeader& h) { h.frames = ~0ULL / 2; }));
+    CHECK(tamper([](PcmCacheHeader& h) { h.frames += BLOCK_FRAMES; h.blockCount++; }));
+    CHECK(tamper([](PcmCacheHeader& h) { h.crcTableOffset -= 4; }));
+    CHECK(tamper([](PcmCacheHeader& h) { h.frames = 0; h.blockCount = 0; }));
+
+    // Cut short: the table no longer fits
+    CHECK(writeEntry(pcm));
+    std::vector<u8> head(pcmcache::DATA_OFFSET + pcm.size() * 2 + 4);
+    FILE* f = fopen(ENTRY, "rb");
+    CHECK(fread(head.data(), 1, head.size(), f) == head.size());
+    fclose(f);
+    f = fopen(ENTRY, "wb");
+    fwrite(head.data(), 1, head.size(), f);
+    fclose(f);
+    CHECK(R_FAILED(reader.open(ENTRY, KEY)));
+}
+
+static void put32(std::vector<u8>& v, u32 x) { for (int i = 0; i < 4; i++) v.push_back((u8)(x >> (i * 8))); }
+static void put16(std::vector<u8>& v, u16 x) { v.push_back((u8)x); v.push_back((u8)(x >> 8)); }
+
+static void writeWav(const char* path, u32 rate, u32 frames) {
+    std::vector<u8> v;
+    v.insert(v.end(), {'R', 'I', 'F', 'F'});
+    put32(v, 36 + frames * 2);
+    v.insert(v.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' '});
+    put32(v, 16);
+    put16(v, 1);
+    put16(v, 1);
+    put32(v, rate);
+    put32(v, rate * 2);
+    put16(v, 2);
+    put16(v, 16);
+    v.insert(v.end(), {'d', 'a', 't', 'a'});
+    put32(v, frames * 2);
+    for (u32 i = 0; i < frames; i++) put16(v, (u16)lrint(12000.0 * sin(2.0 * M_PI * 700.0 * i / rate)));
+    FILE* f = fopen(path, "wb");
+    fwrite(v.data(), 1, v.size(), f);
+    fclose(f);
+}
+
+/**
+ * Play a file to the end the way the mixer reads the stream
+ */
+static std::vector<s16> play(TrackPlayer& player, const char* path) {
+    std::vector<s16> out;
+    CHECK(R_SUCCEEDED(player.openFile(path)));
+    PcmStream* stream = player.getStream();
+    u64 deadline = armGetSystemTick() + armNsToTicks(10000000000ULL);
+    while (!stream->isDrained() && armGetSystemTick() < deadline) {
+        stream->sync();
+        const s16* span;
+        u32 n = stream->peek(&span, 1024);
+        if (n == 0) {
+            svcSleepThread(1000000);
+            continue;
+        }
+        out.insert(out.end(), span, span + n * 2);
+        stream->consume(n);
+    }
+    CHECK(player.getState() == TrackPlayer::State_Finished);
+    player.close();
+    return out;
+}
+
+static bool waitTranscoded(PcmCache& cache, u32 count) {
+    u64 deadline = armGetSystemTick() + armNsToTicks(10000000000ULL);
+    while (cache.getStats().transcoded < count && armGetSystemTick() < deadline) {
+        svcSleepThread(10000000);
+    }
+    return cache.getStats().transcoded == count;
+}
+
+static void testPlayback() {
+    writeWav(TRACK, 44100, 44100 * 2);
+    std::string entry = std::string(CACHE_DIR) + "/index.bin";
+    remove(entry.c_str());
+
+    PcmCache cache(CACHE_DIR);
+    cache.setDecoder(&TrackPlayer::transcode, nullptr);
+    CHECK(R_SUCCEEDED(cache.open()));
+    TrackPlayer player;
+    std::vector<s16> decoded = play(player, TRACK);   // Without a cache: the reference
+    CHECK(decoded.size() / 2 >= 96000);
+
+    // Plays below the threshold are counted, not transcoded
+    player.setPcmCache(&cache);
+    for (u32 i = 0; i < PcmCache::MIN_PLAYS; i++) {
+        CHECK(play(player, TRACK) == decoded);
+    }
+    CHECK(cache.getStats().lookups == PcmCache::MIN_PLAYS && cache.getStats().hits == 0);
+    cache.setIdle(true);
+    CHECK(waitTranscoded(cache, 1));
+    cache.setIdle(false);
+
+    // A hit plays the same audio as decoding
+    CHECK(play(player, TRACK) == decoded);
+    CHECK(cache.getStats().hits == 1);
+
+    // Damage the second block: the first plays from the cache, the rest from the file
+    char name[40];
+    snprintf(name, sizeof(name), "/%016llx.pcm", (unsigned long long)PcmCache::contentKey(TRACK));
+    std::string path = std::string(CACHE_DIR) + name;
+    u8 junk[16] = {};
+    patchFile(path.c_str(), pcmcache::DATA_OFFSET + pcmcache::BLOCK_BYTES + 100, junk, sizeof(junk));
+    std::vector<s16> mixed = play(player, TRACK);
+    CHECK(cache.getStats().hits == 2 && cache.getStats().evicted == 1 && cache.getStats().cachedBytes == 0);
+    CHECK(std::equal(decoded.begin(), decoded.begin() + BLOCK_FRAMES * 2, mixed.begin()));
+    CHECK(mixed.size() + Resampler::FLUSH_FRAMES * 2 >= decoded.size() &&
+          mixed.size() <= decoded.size() + Resampler::FLUSH_FRAMES * 2);
+    u32 worst = 0;
+    for (size_t i = BLOCK_FRAMES * 2; i < std::min(mixed.size(), decoded.size()) - Resampler::FLUSH_FRAMES * 2; i++) {
+        worst = std::max(worst, (u32)abs(mixed[i] - decoded[i]));
+    }
+    printf("  fallback from a damaged block: %zu of %zu frames, worst difference %u\n",
+           mixed.size() / 2, decoded.size() / 2, worst);
+    CHECK(worst < 2000);    // The resampler restarts at the block, the tone carries on
+    CHECK(!exists(path.c_str()));
+
+    // Played as a miss from then on
+    CHECK(play(player, TRACK) == decoded);
+    CHECK(cache.getStats().hits == 2);
+    cache.close();
+}
+
+struct SlowDecode {
+    std::atomic<bool> started{false};
+    std::atomic<bool> resume{false};
+};
+
+/**
+ * One block, then waits for the test before appending eight more
+ */
+static Result slowDecode(const char* sourcePath, PcmCacheWriter* out, void* user) {
+    SlowDecode* slow = (SlowDecode*)user;
+    std::vector<s16> pcm = makeFrames(BLOCK_FRAMES);
+    Result rc = out->append(pcm.data(), BLOCK_FRAMES);
+    slow->started = true;
+    while (!slow->resume) svcSleepThread(1000000);
+    for (u32 i = 0; i < 8 && R_SUCCEEDED(rc); i++) {
+        rc = out->append(pcm.data(), BLOCK_FRAMES);
+    }
+    return rc;
+}
+
+static void testCancel() {
+    writeWav(TRACK, 44100, 44100);
+    std::string index = std::string(CACHE_DIR) + "/index.bin";
+    remove(index.c_str());
+
+    SlowDecode slow;
+    PcmCache cache(CACHE_DIR);
+    cache.setDecoder(&slowDecode, &slow);
+    CHECK(R_SUCCEEDED(cache.open()));
+    u64 key = PcmCache::contentKey(TRACK);
+    char name[40];
+    snprintf(name, sizeof(name), "/%016llx.pcm", (unsigned long long)key);
+    std::string entry = std::string(CACHE_DIR) + name;
+    remove(entry.c_str());
+    for (u32 i = 0; i < PcmCache::MIN_PLAYS; i++) {
+        cache.recordPlay(key, TRACK);
+    }
+    CHECK(!exists(index.c_str()));     // Counted in memory, the job writes the index
+
+    // Playback resumes mid-transcode: the next append refuses and the partial entry goes
+    cache.setIdle(true);
+    u64 deadline = armGetSystemTick() + armNsToTicks(10000000000ULL);
+    while (!slow.started && armGetSystemTick() < deadline) svcSleepThread(1000000);
+    CHECK(slow.started);
+    cache.setIdle(false);
+    slow.resume = true;
+    while (cache.getStats().cancelled == 0 && armGetSystemTick() < deadline) svcSleepThread(1000000);
+
+    PcmCache::Stats stats = cache.getStats();
+    CHECK(stats.cancelled == 1 && stats.transcoded == 0 && stats.cachedBytes == 0);
+    CHECK(!exists(entry.c_str()) && !exists((entry + ".tmp").c_str()));
+
+    // Still a candidate, the next idle spell finishes it
+    cache.setIdle(true);
+    CHECK(waitTranscoded(cache, 1));
+    cache.setIdle(false);
+    PcmCacheReader reader;
+    CHECK(cache.open(key, &reader) && reader.getFrames() == BLOCK_FRAMES * 9);
+    reader.close();
+    cache.close();
+    CHECK(exists(index.c_str()));
+}
+
+int main() {
+    mkdir("sdmc:", 0777);
+    mkdir("sdmc:/config", 0777);
+    mkdir("sdmc:/config/xmusic", 0777);
+
+    testRoundTrip();
+    testDamagedBlock();
+    testBadHeaders();
+    testPlayback();
+    testCancel();
+    return testExit("pcm_cache_test");
+}
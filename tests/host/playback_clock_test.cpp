@@ -0,0 +1,279 @@
+#include "test_util.h"
+#include "playback_clock.h"
+#include "../../common/xmusic_ipc.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * PlaybackClock against a timed sink: a thread that plays submitted blocks
+ * in real time and releases each one when it ends, the way audout does.
+ * The sink logs when every block started, which gives the true audible
+ * position to compare the clock with through seeks, pauses, starvation,
+ * looping and non-looping track ends, and output latency.
+ */
+static constexpr u32 RATE = 48000;
+static constexpr u32 FRAMES = 1024;         // 21ms blocks keep the test short
+static constexpr u32 QUEUE = 2;             // Blocks in flight, as AudioManager
+static constexpr u32 LATENCY = 480;
+
+static u64 framesToTicks(u64 frames) {
+    return frames * armGetSystemTickFreq() / RATE;
+}
+
+class TimedSink {
+private:
+    struct Played {
+        u64 startTick;
+        PlaybackClock::Block block;
+    };
+
+    std::thread m_audio;
+    std::thread m_sink;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<PlaybackClock::Block> m_queue;   // Submitted, not started
+    std::vector<Played> m_log;                  // Started, in order
+    u32 m_released = 0;
+    bool m_stop = false;
+
+    u64 m_length;
+    bool m_looping;
+
+    // Stands in for AudioManager's audio thread: renders while a voice is audible
+    void audioThreadFunc() {
+        u64 media = 0;
+        u32 queued = 0;
+        bool ended = false;
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_stop) break;
+            }
+            s64 seek = seekTo.exchange(-1);
+            if (seek >= 0) {
+                media = (u64)seek;
+                ended = false;
+            }
+
+            if (queued < QUEUE && !paused && !ended) {
+                PlaybackClock::Block block = {media, FRAMES, mediaPerBlock, 1, m_length, m_looping};
+                if (m_length && !m_looping) {
+                    block.mediaFrames = (u32)std::min<u64>(block.mediaFrames, m_length - media);
+                }
+                media += block.mediaFrames;
+                if (m_looping && m_length) media %= m_length;
+                ended = m_length && !m_looping && media >= m_length;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_queue.push_back(block);
+                }
+                m_cond.notify_all();
+                clock.onSubmit(block, armGetSystemTick());
+                queued++;
+            } else if (queued > 0) {
+                u32 count;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_cond.wait(lock, [&] { return m_released > 0 || m_stop; });
+                    count = m_released;
+                    m_released = 0;
+                }
+                clock.onReleased(count, armGetSystemTick());
+                queued -= std::min(count, queued);
+            } else {
+                svcSleepThread(1000000);
+            }
+        }
+    }
+
+    // Plays blocks back to back in real time, idling when starved
+    void sinkThreadFunc() {
+        u64 end = 0;
+        while (true) {
+            PlaybackClock::Block block;
+            u64 start;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cond.wait(lock, [&] { return !m_queue.empty() || m_stop; });
+                if (m_stop) break;
+                block = m_queue.front();
+                m_queue.pop_front();
+                start = std::max(armGetSystemTick(), end);
+                m_log.push_back({start, block});
+            }
+            end = start + framesToTicks(block.frames);
+            while (armGetSystemTick() < end) svcSleepThread(200000);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_released++;
+            }
+            m_cond.notify_all();
+        }
+    }
+
+public:
+    PlaybackClock clock{RATE};
+    std::atomic<bool> paused{false};
+    std::atomic<s64> seekTo{-1};
+    std::atomic<u32> mediaPerBlock{FRAMES};     // Track frames per block, stretched playback
+
+    TimedSink(u64 length, bool looping) : m_length(length), m_looping(looping) {
+        clock.setOutputLatency(LATENCY);
+        m_sink = std::thread(&TimedSink::sinkThreadFunc, this);
+        m_audio = std::thread(&TimedSink::audioThreadFunc, this);
+    }
+
+    ~TimedSink() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_all();
+        m_audio.join();
+        m_sink.join();
+    }
+
+    /**
+     * What the listener hears at tick, false before anything was heard
+     */
+    bool truth(u64 tick, u64* position) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        u64 heard = tick - std::min(tick, framesToTicks(LATENCY));
+        const Played* playing = nullptr;
+        for (const Played& p : m_log) {
+            if (p.startTick > heard) break;
+            playing = &p;
+        }
+        if (!playing) return false;
+
+        const PlaybackClock::Block& b = playing->block;
+        u64 elapsed = std::min<u64>((heard - playing->startTick) * RATE / armGetSystemTickFreq(), b.frames);
+        u64 pos = b.mediaStart + elapsed * b.mediaFrames / b.frames;
+        if (m_length) pos = m_looping ? pos % m_length : std::min(pos, m_length);
+        *position = pos;
+        return true;
+    }
+};
+
+static constexpr u64 TOLERANCE = RATE * 3 / 1000;   // 3ms of scheduling noise
+
+static u64 distance(u64 a, u64 b, u64 loopLength) {
+    u64 d = a > b ? a - b : b - a;
+    return loopLength ? std::min(d, loopLength - d) : d;
+}
+
+/**
+ * Sample the clock for ms and return the worst error against the sink. The
+ * clock learns that a block started when the audio thread wakes for the
+ * release, so a jump may show up to TOLERANCE late; what it reports then is
+ * what was heard that long ago. Errors are measured around the loop point
+ * for looping tracks.
+ */
+static u64 measure(TimedSink& sink, u32 ms, u64 loopLength = 0) {
+    u64 worst = 0;
+    u64 start = armGetSystemTick();
+    while (msSince(start) < ms) {
+        PlaybackClock::Position p = sink.clock.read();
+        u64 now, before;
+        if (sink.truth(p.anchorTick, &now) && sink.truth(p.anchorTick - framesToTicks(TOLERANCE), &before)) {
+            u64 error = std::min(distance(p.mediaFrames, now, loopLength), distance(p.mediaFrames, before, loopLength));
+            worst = std::max(worst, error);
+        }
+        svcSleepThread(2000000);
+    }
+    return worst;
+}
+
+static void testSeekAndPause() {
+    TimedSink sink(0, false);
+    u64 steady = measure(sink, 300);
+    CHECK(!TIMING_CHECKS || steady <= TOLERANCE);
+
+    // The new position only shows once its block is audible
+    sink.seekTo = 480000;
+    u64 seek = measure(sink, 300);
+    CHECK(!TIMING_CHECKS || seek <= TOLERANCE);
+    CHECK(sink.clock.read().mediaFrames >= 480000);
+
+    // Paused, the clock holds where the last block ended
+    sink.paused = true;
+    svcSleepThread(150000000);
+    PlaybackClock::Position held = sink.clock.read();
+    CHECK(!held.advancing);
+    svcSleepThread(50000000);
+    CHECK(sink.clock.read().mediaFrames == held.mediaFrames);
+    u64 pause = measure(sink, 100);
+    CHECK(!TIMING_CHECKS || pause <= TOLERANCE);
+
+    sink.paused = false;
+    u64 resume = measure(sink, 300);
+    CHECK(!TIMING_CHECKS || resume <= TOLERANCE);
+
+    // 1.5x: the track moves faster than the device
+    u64 before = sink.clock.read().mediaFrames;
+    sink.mediaPerBlock = FRAMES * 3 / 2;
+    u64 fast = measure(sink, 300);
+    CHECK(!TIMING_CHECKS || fast <= TOLERANCE);
+    CHECK(sink.clock.read().mediaFrames - before > RATE * 3 / 10 * 5 / 4);
+    printf("  worst error: steady %.2fms, after seek %.2fms, paused %.2fms, resumed %.2fms, 1.5x %.2fms\n",
+           steady * 1000.0 / RATE, seek * 1000.0 / RATE, pause * 1000.0 / RATE, resume * 1000.0 / RATE,
+           fast * 1000.0 / RATE);
+}
+
+static void testTrackEnds() {
+    // Looping: wraps, and right after the loop point latency reaches back into the previous pass
+    const u64 length = 9600 + 100;  // Not a whole number of blocks
+    {
+        TimedSink sink(length, true);
+        u64 worst = measure(sink, 600, length);
+        CHECK(!TIMING_CHECKS || worst <= TOLERANCE);
+        PlaybackClock::Position p = sink.clock.read();
+        CHECK(p.looping && p.trackLength == length && p.mediaFrames < length);
+        printf("  looping: worst error %.2fms\n", worst * 1000.0 / RATE);
+    }
+
+    // Not looping: stops at the end and stays there
+    {
+        TimedSink sink(length, false);
+        u64 worst = measure(sink, 400);
+        CHECK(!TIMING_CHECKS || worst <= TOLERANCE);
+        PlaybackClock::Position p = sink.clock.read();
+        CHECK(!p.looping && !p.advancing && p.mediaFrames == length);
+    }
+}
+
+static void testInterpolation() {
+    XMusicStatus status = {};
+    status.sampleRate = RATE;
+    status.speed = 1.0f;
+    status.advancing = true;
+    status.positionTick = 1000;
+    status.positionSamples = 40000;
+    status.lengthSamples = 48000;
+    u64 later = status.positionTick + armNsToTicks(500000000ULL);   // Half a second on
+
+    // Not looping: stops at the end instead of wrapping to the start
+    CHECK(xmusicInterpolatePosition(&status, later) == 48000);
+    status.looping = true;
+    CHECK(xmusicInterpolatePosition(&status, later) == 40000 + 24000 - 48000);
+
+    // Unknown length, and speed
+    status.lengthSamples = 0;
+    status.speed = 2.0f;
+    CHECK(xmusicInterpolatePosition(&status, later) == 40000 + 48000);
+
+    // A length that is not a whole number of seconds still wraps at the right sample
+    status.speed = 1.0f;
+    status.lengthSamples = 48000 + 123;
+    CHECK(xmusicInterpolatePosition(&status, later) == 40000 + 24000 - 48123);
+}
+
+int main() {
+    testSeekAndPause();
+    testTrackEnds();
+    testInterpolation();
+    return testExit("playback_clock_test");
+}
@@ -0,0 +1,164 @@
+#include "test_util.h"
+#include "read_ahead.h"
+#include <cstdio>
+#include <vector>
+
+/**
+ * ReadAhead: data integrity across chunk edges and seeks, window sizing,
+ * reader stalls against an SD card slowed by injected latency, and how
+ * long a seek waits for the read in flight.
+ */
+static const char* const PATH = "read_ahead_test.bin";
+static constexpr u32 FILE_SIZE = 0x80000;   // 512KB
+
+static u8 patternAt(u64 offset) {
+    return (u8)((offset * 2654435761u) >> 13);
+}
+
+static bool writeFile() {
+    FILE* f = fopen(PATH, "wb");
+    if (!f) return false;
+    std::vector<u8> data(FILE_SIZE);
+    for (u32 i = 0; i < FILE_SIZE; i++) data[i] = patternAt(i);
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    fclose(f);
+    return ok;
+}
+
+static bool matches(const u8* data, size_t size, u64 offset) {
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] != patternAt(offset + i)) return false;
+    }
+    return true;
+}
+
+static void testIntegrity() {
+    ReadAhead reader;
+    CHECK(R_SUCCEEDED(reader.open(PATH)));
+    CHECK(reader.getFileSize() == FILE_SIZE);
+
+    // Odd read sizes so reads straddle chunk edges
+    static u8 buf[7777];
+    u64 offset = 0;
+    bool ok = true;
+    while (true) {
+        size_t n = reader.read(buf, sizeof(buf));
+        if (n == 0) break;
+        ok = ok && matches(buf, n, offset);
+        offset += n;
+    }
+    CHECK(ok);
+    CHECK(offset == FILE_SIZE);
+    CHECK(reader.tell() == FILE_SIZE);
+
+    // Unaligned seek, then across the end
+    reader.seek(0x12345);
+    size_t n = reader.read(buf, sizeof(buf));
+    CHECK(n == sizeof(buf) && matches(buf, n, 0x12345));
+    CHECK(reader.tell() == 0x12345 + sizeof(buf));
+
+    reader.seek(FILE_SIZE - 100);
+    n = reader.read(buf, sizeof(buf));
+    CHECK(n == 100 && matches(buf, n, FILE_SIZE - 100));
+    CHECK(reader.read(buf, sizeof(buf)) == 0);
+    CHECK(!reader.hasError());
+}
+
+static void testWindowSizing() {
+    ReadAhead reader;
+    CHECK(R_SUCCEEDED(reader.open(PATH)));
+    CHECK(reader.getWindowChunks() == 2);   // Unknown bitrate, smallest window
+
+    reader.setBitrate(128);                 // 32KB for two seconds
+    CHECK(reader.getWindowChunks() == 2);
+    reader.setBitrate(1411);                // CD audio, 352KB, capped
+    CHECK(reader.getWindowChunks() == ReadAhead::MAX_CHUNKS);
+
+    // Resizing refills from where the reader is
+    static u8 buf[1000];
+    reader.seek(0x30000);
+    reader.setBitrate(128);
+    CHECK(reader.getWindowChunks() == 2);
+    size_t n = reader.read(buf, sizeof(buf));
+    CHECK(n == sizeof(buf) && matches(buf, n, 0x30000));
+}
+
+/**
+ * A reader paced like a decoder must not stall once the window is full,
+ * even when every slice read takes a few milliseconds
+ */
+static void testInjectedLatency() {
+    static constexpr u64 SLICE_LATENCY_NS = 5000000;    // 5ms per 16KB, about 3MB/s
+    static constexpr u32 READ_SIZE = 0x4000;
+    static constexpr u64 READ_INTERVAL_NS = 40000000;   // 400KB/s of consumption
+
+    ReadAhead reader;
+    reader.setInjectedLatency(SLICE_LATENCY_NS);
+    CHECK(R_SUCCEEDED(reader.open(PATH, 1411)));
+
+    static u8 buf[READ_SIZE];
+    u64 start = armGetSystemTick();
+    CHECK(reader.read(buf, sizeof(buf)) == sizeof(buf));
+    double firstMs = msSince(start);
+
+    double worstMs = 0.0;
+    u64 offset = sizeof(buf);
+    bool ok = true;
+    while (offset < FILE_SIZE) {
+        svcSleepThread(READ_INTERVAL_NS);
+        u64 t = armGetSystemTick();
+        size_t n = reader.read(buf, sizeof(buf));
+        worstMs = std::max(worstMs, msSince(t));
+        ok = ok && n == sizeof(buf) && matches(buf, n, offset);
+        offset += n;
+        if (n == 0) break;
+    }
+    CHECK(ok);
+    CHECK(offset == FILE_SIZE);
+    CHECK(!TIMING_CHECKS || worstMs < 5.0);
+
+    ReadAhead::Stats stats = reader.getStats();
+    printf("  latency: first read %.1f ms, worst stall %.2f ms, card %.1f MB/s, worst chunk %.1f ms\n",
+           firstMs, worstMs, stats.getMBps(), stats.worstReadNs / 1e6);
+}
+
+/**
+ * A seek abandons the chunk being read after the current slice, so it
+ * waits for one slice, not a whole chunk, before the refill starts
+ */
+static void testSeekLatency() {
+    static constexpr u64 SLICE_LATENCY_NS = 40000000;   // 40ms per slice, 160ms per chunk
+    static constexpr u32 SLICES = ReadAhead::CHUNK_SIZE / ReadAhead::READ_SLICE;
+
+    ReadAhead reader;
+    reader.setInjectedLatency(SLICE_LATENCY_NS);
+    CHECK(R_SUCCEEDED(reader.open(PATH)));
+    svcSleepThread(SLICE_LATENCY_NS / 2);   // First chunk is in flight
+
+    static u8 buf[256];
+    u64 start = armGetSystemTick();
+    reader.seek(0x50010);
+    size_t n = reader.read(buf, sizeof(buf));
+    double seekMs = msSince(start);
+    CHECK(n == sizeof(buf) && matches(buf, n, 0x50010));
+
+    // One slice left of the abandoned read, then one chunk from the new offset
+    double bound = (SLICE_LATENCY_NS * (SLICES + 1)) / 1e6;
+    double wholeChunk = (SLICE_LATENCY_NS * SLICES * 2) / 1e6;
+    CHECK(!TIMING_CHECKS || seekMs < bound + 30.0);
+    printf("  seek: %.0f ms to data (one slice + one chunk %.0f ms, whole chunk + one chunk %.0f ms)\n",
+           seekMs, bound, wholeChunk);
+}
+
+int main() {
+    if (!writeFile()) {
+        printf("read_ahead_test: cannot write %s\n", PATH);
+        return 1;
+    }
+    testIntegrity();
+    testWindowSizing();
+    testInjectedLatency();
+    testSeekLatency();
+    remove(PATH);
+    return testExit("read_ahead_test");
+}
@@ -0,0 +1,209 @@
+#include "test_util.h"
+#include "state_journal.h"
+#include <string>
+#include <vector>
+
+/**
+ * StateJournal under power loss: every write is cut at every byte it could
+ * have stopped at, and compactions at every step of their swap. Each cut
+ * must restore the state before the write or the state after it, never a
+ * mix or nothing, and a journal restored from a cut must keep working.
+ */
+static const char* JOURNAL = "sdmc:/config/xmusic/state_test.journal";
+static const char* JOURNAL_NEW = "sdmc:/config/xmusic/state_test.journal.new";
+
+static constexpr u64 LATER = 16000000000ULL;   // Past the write interval
+
+static std::vector<u8> readFile(const char* path, bool* exists) {
+    std::vector<u8> data;
+    FILE* f = fopen(path, "rb");
+    *exists = f != nullptr;
+    if (!f) return data;
+    u8 buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf + n);
+    fclose(f);
+    return data;
+}
+
+static void writeFile(const char* path, const u8* data, size_t size) {
+    FILE* f = fopen(path, "wb");
+    fwrite(data, 1, size, f);
+    fclose(f);
+}
+
+struct Disk {
+    bool haveJournal, haveNew;
+    std::vector<u8> journal, copy;
+
+    static Disk capture() {
+        Disk d;
+        d.journal = readFile(JOURNAL, &d.haveJournal);
+        d.copy = readFile(JOURNAL_NEW, &d.haveNew);
+        return d;
+    }
+
+    /**
+     * Put the card in a state a cut could have left: the journal as its
+     * first journalBytes (or gone) and the copy as its first copyBytes (or gone)
+     */
+    void restore(s64 journalBytes, s64 copyBytes) const {
+        remove(JOURNAL);
+        remove(JOURNAL_NEW);
+        if (journalBytes >= 0) writeFile(JOURNAL, journal.data(), (size_t)journalBytes);
+        if (copyBytes >= 0) writeFile(JOURNAL_NEW, copy.data(), (size_t)copyBytes);
+    }
+};
+
+static PlaybackState makeState(u32 track, u64 position, bool playing) {
+    PlaybackState s;
+    memset(&s, 0, sizeof(s));
+    s.source = PlaybackSource_File;
+    snprintf(s.url, sizeof(s.url), "sdmc:/music/track%u.mp3", track);
+    snprintf(s.title, sizeof(s.title), "Track %u", track);
+    snprintf(s.artist, sizeof(s.artist), "Artist %u", track % 3);
+    s.positionSamples = position;
+    s.volume = 0.1f * (float)(track % 10);
+    s.playing = playing;
+    return s;
+}
+
+static bool sameState(const PlaybackState& a, const PlaybackState& b) {
+    return a.source == b.source && strcmp(a.url, b.url) == 0 && strcmp(a.title, b.title) == 0 &&
+           strcmp(a.artist, b.artist) == 0 && a.positionSamples == b.positionSamples &&
+           a.volume == b.volume && a.playing == b.playing;
+}
+
+/**
+ * Load after a cut; true when it restored expected (nothing if null) or, if
+ * given, alternative
+ */
+static bool restoresTo(const PlaybackState* expected, const PlaybackState* alternative = nullptr) {
+    StateJournal journal(JOURNAL);
+    PlaybackState loaded;
+    bool ok = journal.load(&loaded);
+    if (alternative && ok && sameState(loaded, *alternative)) return true;
+    return expected ? ok && sameState(loaded, *expected) : !ok;
+}
+
+/**
+ * After a cut the journal must take the next write and restore it
+ */
+static bool keepsWorking(const PlaybackState& next) {
+    {
+        StateJournal journal(JOURNAL);
+        PlaybackState loaded;
+        journal.load(&loaded);
+        journal.update(next, LATER);
+        if (R_FAILED(journal.flush())) return false;
+    }
+    return restoresTo(&next);
+}
+
+static void testCutEverywhere() {
+    remove(JOURNAL);
+    remove(JOURNAL_NEW);
+
+    // Position updates, pauses and track changes, enough to compact a few times
+    std::vector<PlaybackState> states;
+    for (u32 i = 0; i < 60; i++) {
+        u32 track = i / 4;
+        states.push_back(makeState(track, (u64)i * 48000 * 7, (i % 5) != 0));
+    }
+
+    u32 appends = 0, compactions = 0, cuts = 0;
+    const PlaybackState* previous = nullptr;
+    u64 tick = 1;
+    for (size_t i = 0; i < states.size(); i++) {
+        Disk before = Disk::capture();
+        {
+            StateJournal journal(JOURNAL);
+            PlaybackState loaded;
+            journal.load(&loaded);
+            tick += LATER;
+            journal.update(states[i], tick);
+            CHECK(journal.getWrites() == 1);
+        }
+        Disk after = Disk::capture();
+        CHECK(after.haveJournal && !after.haveNew);
+        const PlaybackState& current = states[i];
+
+        bool appended = before.haveJournal && after.journal.size() > before.journal.size() &&
+                        memcmp(after.journal.data(), before.journal.data(), before.journal.size()) == 0;
+        bool ok = true;
+        if (appended) {
+            // A record cut anywhere leaves the one before it
+            appends++;
+            for (size_t n = before.journal.size(); n < after.journal.size(); n++) {
+                after.restore((s64)n, -1);
+                ok = ok && restoresTo(previous);
+                cuts++;
+            }
+        } else {
+            // Compaction: the copy written aside at every length, then the
+            // old journal removed before the copy is renamed over it
+            compactions++;
+            Disk aside = after;
+            aside.copy = after.journal;
+            aside.journal = before.journal;
+            for (size_t n = 0; n < aside.copy.size(); n++) {
+                aside.restore(before.haveJournal ? (s64)aside.journal.size() : -1, (s64)n);
+                ok = ok && restoresTo(previous);
+                cuts++;
+            }
+            aside.restore(before.haveJournal ? (s64)aside.journal.size() : -1, (s64)aside.copy.size());
+            ok = ok && restoresTo(previous, &current);
+            aside.restore(-1, (s64)aside.copy.size());
+            ok = ok && restoresTo(&current);
+            cuts += 2;
+        }
+        CHECK(ok);
+
+        // A cut mid-write followed by the next write, then the finished state for the next round
+        if (appended && i + 1 < states.size()) {
+            after.restore((s64)(before.journal.size() + 5), -1);
+            CHECK(keepsWorking(states[i + 1]));
+        }
+        after.restore((s64)after.journal.size(), -1);
+        CHECK(restoresTo(&current));
+        previous = &states[i];
+    }
+
+    CHECK(appends > 0 && compactions > 1);
+    printf("  %u writes (%u appends, %u compactions), %u cuts\n",
+           (u32)states.size(), appends, compactions, cuts);
+}
+
+static void testGarbage() {
+    // Noise after a good journal, and noise instead of one
+    PlaybackState state = makeState(1, 48000, true);
+    remove(JOURNAL);
+    remove(JOURNAL_NEW);
+    {
+        StateJournal journal(JOURNAL);
+        journal.update(state, LATER);
+    }
+    FILE* f = fopen(JOURNAL, "ab");
+    const u8 junk[40] = {0x58, 0x4D, 0x53, 0x4A, 2, 0, 0xFF, 0x7F};
+    fwrite(junk, 1, sizeof(junk), f);
+    fclose(f);
+    CHECK(restoresTo(&state));
+    CHECK(keepsWorking(makeState(2, 96000, false)));
+
+    std::vector<u8> noise(3000);
+    for (size_t i = 0; i < noise.size(); i++) noise[i] = (u8)(i * 131 + 7);
+    remove(JOURNAL);
+    writeFile(JOURNAL, noise.data(), noise.size());
+    CHECK(restoresTo(nullptr));
+    CHECK(keepsWorking(state));
+}
+
+int main() {
+    mkdir("sdmc:", 0777);
+    mkdir("sdmc:/config", 0777);
+    mkdir("sdmc:/config/xmusic", 0777);
+
+    testCutEverywhere();
+    testGarbage();
+    return testExit("state_journal_test");
+}
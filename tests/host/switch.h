@@ -0,0 +1,84 @@
+#pragma once
+/**
+ * Host stand-in for the parts of libnx the sysmodule headers use
+ *
+ * Only what the host tests need: the integer types, Result helpers, thread
+ * sleep, the system tick (at the console's 19.2MHz so tick conversions are
+ * exercised) and CRC32. Anything guarded by __SWITCH__ in the sysmodule is
+ * not provided here.
+ */
+#include <cstdint>
+#include <cstddef>
+#include <ctime>
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t   s8;
+typedef int16_t  s16;
+typedef int32_t  s32;
+typedef int64_t  s64;
+
+typedef u32 Result;
+typedef u32 Handle;
+
+#define INVALID_HANDLE ((Handle)0)
+
+#define R_SUCCEEDED(res) ((res) == 0)
+#define R_FAILED(res)    ((res) != 0)
+#define MAKERESULT(module, description) \
+    ((((module) & 0x1FF)) | ((description) & 0x1FFF) << 9)
+
+enum {
+    Module_Kernel = 1,
+    Module_Libnx = 345,
+};
+
+enum {
+    LibnxError_BadInput = 1,
+    LibnxError_NotInitialized = 2,
+    LibnxError_OutOfMemory = 3,
+    LibnxError_IoError = 4,
+    LibnxError_NotFound = 5,
+};
+
+static inline u64 hostNowNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + (u64)ts.tv_nsec;
+}
+
+static inline void svcSleepThread(s64 nano) {
+    if (nano <= 0) return;
+    timespec ts = {(time_t)(nano / 1000000000LL), (long)(nano % 1000000000LL)};
+    nanosleep(&ts, nullptr);
+}
+
+static inline u64 armGetSystemTickFreq() { return 19200000ULL; }
+
+static inline u64 armNsToTicks(u64 ns) {
+    return (ns * 12) / 625;
+}
+
+static inline u64 armTicksToNs(u64 tick) {
+    return (tick * 625) / 12;
+}
+
+static inline u64 armGetSystemTick() { return armNsToTicks(hostNowNs()); }
+
+static inline u32 crc32CalculateWithSeed(u32 seed, const void* src, size_t size) {
+    const u8* p = (const u8*)src;
+    u32 crc = ~seed;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+static inline u32 crc32Calculate(const void* src, size_t size) {
+    return crc32CalculateWithSeed(0, src, size);
+}
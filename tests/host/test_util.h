@@ -0,0 +1,39 @@
+#pragma once
+#include <switch.h>
+#include <cstdio>
+
+/**
+ * Minimal checking helpers shared by the host tests
+ *
+ * Each test is a standalone program: CHECK() records a failure and keeps
+ * going, testExit() prints the verdict and becomes the exit status.
+ */
+static int g_testFailures = 0;
+
+// Sanitizers slow code down unevenly, timing comparisons only hold without them
+#if defined(__SANITIZE_THREAD__) || defined(__SANITIZE_ADDRESS__)
+static constexpr bool TIMING_CHECKS = false;
+#else
+static constexpr bool TIMING_CHECKS = true;
+#endif
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            g_testFailures++; \
+        } \
+    } while (0)
+
+static inline double msSince(u64 startTick) {
+    return armTicksToNs(armGetSystemTick() - startTick) / 1e6;
+}
+
+static inline int testExit(const char* name) {
+    if (g_testFailures) {
+        printf("%s: %d failure(s)\n", name, g_testFailures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
@@ -0,0 +1,171 @@
+#include "test_util.h"
+#include "audio_mixer.h"
+#include "time_stretch.h"
+#include <cmath>
+#include <vector>
+
+/**
+ * TimeStretch: source/output ratio and pitch at every speed step, the cost
+ * of a second of output, and the timing of a chime started while the music
+ * is stretched, composed the way the audio thread composes a block.
+ */
+using Output = RenderConfig<2, SampleFormat_S16, 4096>;
+using Mixer = AudioMixer<Output>;
+
+static constexpr u32 BLOCK = Output::BLOCK_FRAMES;
+static constexpr u32 RATE = 48000;
+static constexpr u32 TONE_PERIOD = 100;     // 480Hz
+static const float SPEEDS[] = {0.5f, 0.75f, 1.25f, 1.5f, 2.0f};
+
+static s16 tone(u64 frame) {
+    return (s16)(12000.0 * sin(2.0 * M_PI * (double)(frame % TONE_PERIOD) / TONE_PERIOD));
+}
+
+/**
+ * Sign changes on the left channel, a tone's pitch without an FFT
+ */
+static u32 zeroCrossings(const s16* frames, u32 count) {
+    u32 n = 0;
+    for (u32 f = 1; f < count; f++) {
+        if ((frames[(f - 1) * 2] < 0) != (frames[f * 2] < 0)) n++;
+    }
+    return n;
+}
+
+static void testSpeeds() {
+    static TimeStretch stretch;
+    static s16 out[BLOCK * 2];
+    const u32 blocks = 20 * RATE / BLOCK;
+    const u32 warmup = 2;
+    printf("  speed  ratio   pitch   ms/s of output\n");
+
+    for (float speed : SPEEDS) {
+        stretch.requestReset();
+        stretch.setSpeed(speed);
+        CHECK(stretch.update());
+
+        u64 pulled = 0, ticks = 0, crossings = 0, measured = 0;
+        auto pull = [&](s16* dst, u32 n) {
+            for (u32 i = 0; i < n; i++) dst[i * 2] = dst[i * 2 + 1] = tone(pulled + i);
+            pulled += n;
+        };
+        for (u32 b = 0; b < blocks; b++) {
+            u64 start = armGetSystemTick();
+            stretch.render(out, BLOCK, pull);
+            ticks += armGetSystemTick() - start;
+            if (b >= warmup) {
+                crossings += zeroCrossings(out, BLOCK);
+                measured += BLOCK;
+            }
+        }
+
+        // Source heard so far against output played
+        double ratio = (double)(pulled - stretch.getInputLatency()) / ((u64)blocks * BLOCK);
+        double pitch = crossings / 2.0 * RATE / measured;
+        double msPerSecond = armTicksToNs(ticks) / 1e6 / ((double)blocks * BLOCK / RATE);
+        printf("  %5.2f  %6.4f  %6.1f  %6.2f\n", speed, ratio, pitch, msPerSecond);
+
+        CHECK(fabs(ratio - speed) < 0.002);
+        CHECK(fabs(pitch - (double)RATE / TONE_PERIOD) < 5.0);
+        CHECK(!TIMING_CHECKS || msPerSecond < 50.0);    // 5% of a core, the console's is slower
+    }
+}
+
+/**
+ * Frames from the start of the block a chime was started before to its
+ * first audible frame, through either composition
+ */
+static u32 chimeDelay(bool wholeMix) {
+    static Mixer mixer;
+    static TimeStretch stretch;
+    static s16 out[BLOCK * 2];
+    std::vector<s16> music(BLOCK * 2 * 2, 0);   // Silent, so anything heard is the chime
+    std::vector<s16> chime(RATE / 10 * 2, 16000);
+
+    s32 musicVoice = mixer.startVoice(music.data(), BLOCK * 2, 1.0f, 0.0f, true);
+    stretch.requestReset();
+    stretch.setSpeed(1.5f);
+    auto render = [&] {
+        CHECK(stretch.update());
+        if (wholeMix) {
+            stretch.render(out, BLOCK, [&](s16* dst, u32 n) { mixer.mix(dst, n, 1.0f); });
+        } else {
+            stretch.render(out, BLOCK, [&](s16* dst, u32 n) { mixer.mixOnly(musicVoice, dst, n, 1.0f); });
+            mixer.mixOver(out, BLOCK, 1.0f, musicVoice);
+        }
+    };
+
+    for (u32 b = 0; b < 4; b++) render();
+    s32 chimeVoice = mixer.startVoice(chime.data(), chime.size() / 2);
+
+    u32 delay = ~0u;
+    for (u32 b = 0; b < 4 && delay == ~0u; b++) {
+        render();
+        for (u32 f = 0; f < BLOCK; f++) {
+            if (out[f * 2] != 0) {
+                delay = b * BLOCK + f;
+                break;
+            }
+        }
+    }
+    mixer.stopVoice(chimeVoice);
+    mixer.stopVoice(musicVoice);
+    mixer.collect();
+    return delay;
+}
+
+static void testChimeTiming() {
+    u32 split = chimeDelay(false);
+    u32 whole = chimeDelay(true);
+    printf("  chime at 1.5x: %u frames late (whole mix stretched: %u, %.1fms)\n",
+           split, whole, whole * 1000.0 / RATE);
+    CHECK(split == 0);
+    CHECK(whole > 0 && whole != ~0u);
+}
+
+/**
+ * mixOnly() plus mixOver() is the same block as mix()
+ */
+static void testSplitMix() {
+    static Mixer mixer;
+    static s16 joint[BLOCK * 2], split[BLOCK * 2];
+    std::vector<s16> a(BLOCK * 2 * 2), b(BLOCK * 2 * 2);
+    for (size_t i = 0; i < a.size(); i++) {
+        a[i] = (s16)((i * 37) & 0x7FFF);
+        b[i] = (s16)(((i * 53) & 0x3FFF) - 0x2000);
+    }
+
+    s32 va = mixer.startVoice(a.data(), BLOCK * 2, 0.8f, -0.3f);
+    s32 vb = mixer.startVoice(b.data(), BLOCK * 2, 0.6f, 0.5f);
+    mixer.mix(joint, BLOCK, 0.9f);
+    CHECK(mixer.getLastMixVoices() == 2);
+
+    mixer.seekVoice(va, 0);
+    mixer.seekVoice(vb, 0);
+    mixer.mixOnly(va, split, BLOCK, 0.9f);
+    mixer.mixOver(split, BLOCK, 0.9f, va);
+    CHECK(mixer.getLastMixVoices() == 2);
+
+    // The split block saturates once per call instead of once, equal while below full scale
+    u32 differ = 0;
+    for (u32 i = 0; i < BLOCK * 2; i++) {
+        if (joint[i] != split[i] && abs(joint[i]) < 32767) differ++;
+    }
+    CHECK(differ == 0);
+    CHECK(mixer.getVoicePosition(va) == BLOCK && mixer.getVoicePosition(vb) == BLOCK);
+
+    // A stale id renders silence alone and excludes nothing
+    mixer.stopVoice(va);
+    mixer.collect();
+    mixer.mixOnly(va, split, BLOCK, 1.0f);
+    CHECK(split[0] == 0 && split[BLOCK * 2 - 1] == 0);
+    mixer.mixOver(split, BLOCK, 1.0f, va);
+    CHECK(mixer.getLastMixVoices() == 1);
+}
+
+int main() {
+    testSplitMix();
+    testChimeTiming();
+    testSpeeds();
+    return testExit("time_stretch_test");
+}
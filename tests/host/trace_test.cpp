@@ -0,0 +1,227 @@
+#include "test_util.h"
+#include "trace.h"
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Trace rings: released when their thread exits, continued by the next
+ * thread of the same name, handed to other names once none is free, and
+ * never shared by two live threads. Checked through the dump file, as
+ * tools/xmusic_trace.py reads it. Also the cost of a trace scope, the
+ * window a dump keeps, and the converter's JSON.
+ */
+static const char* DUMP = "sdmc:/config/xmusic/trace_test.bin";
+
+struct DumpedThread {
+    std::string name;
+    std::vector<TraceEvent> events;
+};
+
+static std::vector<DumpedThread> readDump(u32 seconds = 0) {
+    std::vector<DumpedThread> threads;
+    CHECK(R_SUCCEEDED(Trace::dump(seconds, DUMP)));
+    FILE* f = fopen(DUMP, "rb");
+    if (!f) return threads;
+
+    u32 header[6];
+    bool ok = fread(header, sizeof(header), 1, f) == 1 && header[0] == 0x52544D58;
+    u32 threadCount = header[4], idCount = header[5];
+    ok = ok && fseek(f, (long)idCount * 24, SEEK_CUR) == 0;
+    for (u32 t = 0; ok && t < threadCount; t++) {
+        char name[16];
+        u32 counts[2];
+        ok = fread(name, sizeof(name), 1, f) == 1 && fread(counts, sizeof(counts), 1, f) == 1;
+        DumpedThread thread;
+        thread.name.assign(name, strnlen(name, sizeof(name)));
+        thread.events.resize(counts[0]);
+        ok = ok && fread(thread.events.data(), sizeof(TraceEvent), counts[0], f) == counts[0];
+        threads.push_back(thread);
+    }
+    CHECK(ok && fgetc(f) == EOF);
+    fclose(f);
+    return threads;
+}
+
+static const DumpedThread* find(const std::vector<DumpedThread>& threads, const char* name) {
+    for (const DumpedThread& t : threads) {
+        if (t.name == name) return &t;
+    }
+    return nullptr;
+}
+
+static u32 countPayload(const DumpedThread* thread, u32 payload) {
+    u32 n = 0;
+    if (!thread) return 0;
+    for (const TraceEvent& e : thread->events) {
+        if (e.payload == payload) n++;
+    }
+    return n;
+}
+
+static void runThread(const char* name, u32 payload, u32 events) {
+    std::thread([=] {
+        Trace::registerThread(name);
+        for (u32 i = 0; i < events; i++) Trace::instant(TraceId_Decode, payload);
+    }).join();
+}
+
+static void testSameName() {
+    // A decode thread per track, far more tracks than rings
+    for (u32 track = 0; track < Trace::MAX_THREADS * 4; track++) {
+        runThread("decode", 1000 + track, 10);
+    }
+    std::vector<DumpedThread> threads = readDump();
+    const DumpedThread* decode = find(threads, "decode");
+    CHECK(decode != nullptr);
+    CHECK(threads.size() == 1);
+
+    // The last track traced, and the earlier ones are still in the one ring
+    CHECK(countPayload(decode, 1000 + Trace::MAX_THREADS * 4 - 1) == 10);
+    CHECK(countPayload(decode, 1000) == 10);
+}
+
+static void testOtherNames() {
+    // More names than rings: the newest take over the rings idle longest
+    const u32 names = Trace::MAX_THREADS + 3;
+    for (u32 i = 0; i < names; i++) {
+        std::string name = "worker" + std::to_string(i);
+        runThread(name.c_str(), 2000 + i, 5);
+        svcSleepThread(100000);     // Distinct last ticks
+    }
+    std::vector<DumpedThread> threads = readDump();
+    CHECK(threads.size() == Trace::MAX_THREADS);
+    for (u32 i = names - (Trace::MAX_THREADS - 1); i < names; i++) {
+        std::string name = "worker" + std::to_string(i);
+        const DumpedThread* t = find(threads, name.c_str());
+        CHECK(t && t->events.size() == 5 && countPayload(t, 2000 + i) == 5);
+    }
+
+    // A ring that changed hands only dumps its new owner's events
+    CHECK(find(threads, "decode") == nullptr && find(threads, "worker0") == nullptr);
+    for (const DumpedThread& t : threads) {
+        for (const TraceEvent& e : t.events) CHECK(e.payload >= 2000);
+    }
+}
+
+static void testAllLive() {
+    // MAX_THREADS live threads hold every ring; one more traces nothing and breaks nothing
+    std::atomic<u32> ready{0};
+    std::atomic<bool> release{false};
+    std::vector<std::thread> live;
+    for (u32 i = 0; i < Trace::MAX_THREADS; i++) {
+        live.emplace_back([&, i] {
+            std::string name = "live" + std::to_string(i);
+            Trace::registerThread(name.c_str());
+            Trace::instant(TraceId_Decode, 3000 + i);
+            ready++;
+            while (!release) svcSleepThread(1000000);
+            Trace::instant(TraceId_Decode, 3000 + i);
+        });
+    }
+    while (ready < Trace::MAX_THREADS) svcSleepThread(1000000);
+    runThread("extra", 4000, 5);
+
+    release = true;
+    for (std::thread& t : live) t.join();
+    std::vector<DumpedThread> threads = readDump();
+    CHECK(find(threads, "extra") == nullptr);
+    for (u32 i = 0; i < Trace::MAX_THREADS; i++) {
+        std::string name = "live" + std::to_string(i);
+        CHECK(countPayload(find(threads, name.c_str()), 3000 + i) == 2);
+    }
+
+    // Once they exit, rings are available again
+    runThread("extra", 4000, 5);
+    CHECK(countPayload(find(readDump(), "extra"), 4000) == 5);
+}
+
+static void testOverhead() {
+    // Two events per scope, against the same loop without it
+    const u32 loops = 1000000;
+    double emptyNs = 0, tracedNs = 0;
+    std::thread([&] {
+        Trace::registerThread("bench");
+        volatile u32 sink = 0;
+        u64 start = armGetSystemTick();
+        for (u32 i = 0; i < loops; i++) {
+            sink = i;
+        }
+        emptyNs = (double)armTicksToNs(armGetSystemTick() - start);
+
+        start = armGetSystemTick();
+        for (u32 i = 0; i < loops; i++) {
+            XMUSIC_TRACE_SCOPE(TraceId_Decode, i);
+            sink = i;
+        }
+        tracedNs = (double)armTicksToNs(armGetSystemTick() - start);
+        (void)sink;
+    }).join();
+
+    double perEvent = (tracedNs - emptyNs) / (2.0 * loops);
+    printf("  XMUSIC_TRACE_SCOPE: %.1fns per event (%u scopes in %.1fms, empty loop %.1fms)\n",
+           perEvent, loops, tracedNs / 1e6, emptyNs / 1e6);
+    CHECK(!TIMING_CHECKS || perEvent < 100.0);
+}
+
+static void testWindow() {
+    // dump(1) keeps only what was traced in the last second
+    runThread("window", 5000, 5);
+    svcSleepThread(1200000000);
+    runThread("window", 5001, 5);
+
+    std::vector<DumpedThread> recent = readDump(1);
+    const DumpedThread* window = find(recent, "window");
+    CHECK(countPayload(window, 5001) == 5 && countPayload(window, 5000) == 0);
+    for (const DumpedThread& t : recent) {
+        CHECK(t.events.size() == (&t == window ? 5u : 0u));
+    }
+
+    std::vector<DumpedThread> all = readDump(0);
+    window = find(all, "window");
+    CHECK(countPayload(window, 5000) == 5 && countPayload(window, 5001) == 5);
+    CHECK(find(all, "bench") != nullptr);
+}
+
+static void testConverter() {
+    if (system("python3 -c '' 2>/dev/null") != 0) {
+        printf("  no python3, converter not checked\n");
+        return;
+    }
+    CHECK(R_SUCCEEDED(Trace::dump(0, DUMP)));
+    CHECK(system("python3 " TRACE_TOOL " sdmc:/config/xmusic/trace_test.bin trace_test.json >/dev/null") == 0);
+
+    // Valid JSON, every event on a named thread, time never going back and no end without its begin
+    const char* validate = "python3 -c '"
+        "import json\n"
+        "t = json.load(open(\"trace_test.json\"))[\"traceEvents\"]\n"
+        "names = {e[\"tid\"]: e[\"args\"][\"name\"] for e in t if e[\"ph\"] == \"M\"}\n"
+        "assert {\"bench\", \"window\"} <= set(names.values())\n"
+        "last, depth = {}, {}\n"
+        "for e in t:\n"
+        "    if e[\"ph\"] == \"M\": continue\n"
+        "    tid = e[\"tid\"]\n"
+        "    assert tid in names and e[\"ph\"] in (\"B\", \"E\", \"i\") and e[\"ts\"] >= last.get(tid, 0)\n"
+        "    last[tid] = e[\"ts\"]\n"
+        "    depth[tid] = depth.get(tid, 0) + {\"B\": 1, \"E\": -1}.get(e[\"ph\"], 0)\n"
+        "    assert depth[tid] >= 0\n"
+        "assert any(e[\"name\"] == \"Decode\" and e[\"ph\"] == \"B\" for e in t)\n"
+        "'";
+    CHECK(system(validate) == 0);
+    remove("trace_test.json");
+}
+
+int main() {
+    mkdir("sdmc:", 0777);
+    mkdir("sdmc:/config", 0777);
+    mkdir("sdmc:/config/xmusic", 0777);
+
+    testSameName();
+    testOtherNames();
+    testAllLive();
+    testOverhead();
+    testWindow();
+    testConverter();
+    return testExit("trace_test");
+}
@@ -0,0 +1,188 @@
+#include "test_util.h"
+#include "track_player.h"
+#include "audio_mixer.h"
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+/**
+ * File playback pipeline: WAV parsing, resampling to 48kHz stereo, seeks
+ * through the decode thread, and a mixer stream voice playing the result.
+ */
+static constexpr u32 OUT_RATE = TrackPlayer::OUTPUT_RATE;
+static constexpr float TONE_HZ = 1000.0f;
+static constexpr float AMPLITUDE = 16000.0f;
+
+static void put32(std::vector<u8>& v, u32 x) { for (int i = 0; i < 4; i++) v.push_back((u8)(x >> (i * 8))); }
+static void put16(std::vector<u8>& v, u16 x) { v.push_back((u8)x); v.push_back((u8)(x >> 8)); }
+
+static s16 toneAt(double seconds) {
+    return (s16)lrint(AMPLITUDE * sin(2.0 * M_PI * TONE_HZ * seconds));
+}
+
+/**
+ * A sine WAV with an extra chunk in front of the data, as many taggers write
+ */
+static bool writeWav(const char* path, u32 rate, u32 channels, u32 frames) {
+    std::vector<u8> v;
+    v.insert(v.end(), {'R', 'I', 'F', 'F'});
+    put32(v, 0);
+    v.insert(v.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' '});
+    put32(v, 16);
+    put16(v, 1);
+    put16(v, (u16)channels);
+    put32(v, rate);
+    put32(v, rate * channels * 2);
+    put16(v, (u16)(channels * 2));
+    put16(v, 16);
+    v.insert(v.end(), {'L', 'I', 'S', 'T'});
+    put32(v, 5);
+    v.insert(v.end(), {'I', 'N', 'F', 'O', 0, 0});  // Odd size, padded
+    v.insert(v.end(), {'d', 'a', 't', 'a'});
+    put32(v, frames * channels * 2);
+    for (u32 i = 0; i < frames; i++) {
+        s16 s = toneAt((double)i / rate);
+        for (u32 c = 0; c < channels; c++) put16(v, (u16)s);
+    }
+
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+    bool ok = fwrite(v.data(), 1, v.size(), f) == v.size();
+    fclose(f);
+    return ok;
+}
+
+/**
+ * Read the stream the way the mixer does until it is drained or the limit
+ * is reached. Returns the largest error against the expected tone before
+ * checkEnd; the last frames fade into the resampler's flush.
+ */
+static float drain(PcmStream* stream, u64 maxFrames, u64* frames, u64 startFrame, u64 checkEnd = ~0ULL) {
+    float worst = 0.0f;
+    *frames = 0;
+    u64 deadline = armGetSystemTick() + armNsToTicks(5000000000ULL);
+    while (*frames < maxFrames && !stream->isDrained() && armGetSystemTick() < deadline) {
+        stream->sync();
+        const s16* span;
+        u32 n = stream->peek(&span, (u32)std::min<u64>(1024, maxFrames - *frames));
+        if (n == 0) {
+            svcSleepThread(1000000);
+            continue;
+        }
+        for (u32 i = 0; i < n; i++) {
+            if (startFrame + *frames + i >= checkEnd) break;
+            double t = (double)(startFrame + *frames + i) / OUT_RATE;
+            float err = fabsf((float)span[i * 2] - (float)toneAt(t));
+            worst = std::max(worst, err);
+            worst = std::max(worst, fabsf((float)span[i * 2] - (float)span[i * 2 + 1]));
+        }
+        stream->consume(n);
+        *frames += n;
+    }
+    return worst;
+}
+
+static void testPassthrough() {
+    CHECK(writeWav("tone48.wav", 48000, 2, 48000));
+    TrackPlayer player;
+    CHECK(R_SUCCEEDED(player.openFile("tone48.wav")));
+
+    u64 frames;
+    float err = drain(player.getStream(), ~0ULL, &frames, 0);
+    CHECK(frames == 48000);
+    CHECK(err == 0.0f);                     // Same rate stereo is copied through
+    CHECK(player.getLength() == 48000);
+    CHECK(player.getState() == TrackPlayer::State_Finished);
+}
+
+static void testResampleAndSeek() {
+    CHECK(writeWav("tone44.wav", 44100, 1, 88200));
+    TrackPlayer player;
+    u64 start = armGetSystemTick();
+    CHECK(R_SUCCEEDED(player.openFile("tone44.wav")));
+
+    // First second, 44.1kHz mono to 48kHz stereo
+    u64 frames;
+    float err = drain(player.getStream(), OUT_RATE, &frames, 0);
+    double firstSecondMs = msSince(start);
+    CHECK(frames == OUT_RATE);
+    CHECK(err < AMPLITUDE * 0.01f);
+    CHECK(player.getLength() == 96000);
+
+    // Back to 0.5s; buffered data from the old position is dropped
+    player.seek(24000);
+    PcmStream* stream = player.getStream();
+    u64 deadline = armGetSystemTick() + armNsToTicks(1000000000ULL);
+    do {
+        svcSleepThread(1000000);
+        stream->sync();
+    } while (stream->getTrackPosition() != 24000 && armGetSystemTick() < deadline);
+    CHECK(stream->getTrackPosition() == 24000);
+
+    err = drain(stream, ~0ULL, &frames, 24000, 96000 - 8);
+    CHECK(err < AMPLITUDE * 0.01f);
+    CHECK(frames >= 72000 && frames <= 72000 + Resampler::FLUSH_FRAMES);
+    CHECK(player.getState() == TrackPlayer::State_Finished);
+    printf("  resample: 1s of 44.1kHz mono in %.1f ms, worst error %.0f of %.0f\n",
+           firstSecondMs, err, AMPLITUDE);
+}
+
+static void testUnsupported() {
+    FILE* f = fopen("garbage.bin", "wb");
+    const char junk[] = "this is not an audio file at all";
+    fwrite(junk, 1, sizeof(junk), f);
+    fclose(f);
+
+    TrackPlayer player;
+    CHECK(R_SUCCEEDED(player.openFile("garbage.bin")));
+    u64 frames;
+    drain(player.getStream(), ~0ULL, &frames, 0);
+    CHECK(frames == 0);
+    CHECK(player.getState() == TrackPlayer::State_Failed);
+
+    CHECK(R_FAILED(player.openFile("missing.wav")));
+}
+
+/**
+ * The mixer plays the stream as a voice and reports track positions for it
+ */
+static void testStreamVoice() {
+    using Output = RenderConfig<2, SampleFormat_S16, 4096>;
+    static AudioMixer<Output> mixer;
+    static s16 out[Output::BLOCK_SAMPLES];
+
+    TrackPlayer player;
+    CHECK(R_SUCCEEDED(player.openFile("tone48.wav")));
+    s32 voice = mixer.startStreamVoice(player.getStream());
+    CHECK(voice != AudioMixer<Output>::INVALID_VOICE);
+
+    u64 played = 0, expected = 0;
+    bool contiguous = true;
+    for (u32 block = 0; block < 200 && mixer.isVoiceActive(voice); block++) {
+        svcSleepThread(2000000);
+        mixer.mix(out, Output::BLOCK_FRAMES, 1.0f);
+        u64 blockStart, length;
+        u32 blockFrames;
+        bool loop;
+        if (mixer.getVoiceBlock(voice, &blockStart, &blockFrames, &length, &loop)) {
+            CHECK(length == 48000 && !loop);
+            contiguous = contiguous && blockStart == expected;
+            expected = blockStart + blockFrames;
+            played += blockFrames;
+        }
+    }
+    CHECK(contiguous);
+    CHECK(played == 48000);
+    CHECK(!mixer.isVoiceActive(voice));     // Ended once the stream drained
+}
+
+int main() {
+    testPassthrough();
+    testResampleAndSeek();
+    testUnsupported();
+    testStreamVoice();
+    remove("tone48.wav");
+    remove("tone44.wav");
+    remove("garbage.bin");
+    return testExit("track_player_test");
+}
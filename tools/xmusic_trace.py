@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Convert an XMusic trace dump (trace.bin) to Chrome trace JSON.
+
+Usage: xmusic_trace.py trace.bin [trace.json]
+
+Get the dump with XMusicCmd_DumpTrace, copy sdmc:/config/xmusic/trace.bin
+off the SD card, and open the JSON in chrome://tracing or ui.perfetto.dev.
+The layout matches Trace::dump in sysmodule/source/trace.h.
+"""
+
+import json
+import struct
+import sys
+
+FILE_MAGIC = 0x52544D58  # "XMTR"
+FILE_VERSION = 1
+
+
+def read_trace(data):
+    magic, version, tick_freq, thread_count, id_count = struct.unpack_from("<IIQII", data, 0)
+    if magic != FILE_MAGIC or version != FILE_VERSION:
+        raise ValueError("not an XMusic trace (magic %08x, version %d)" % (magic, version))
+    pos = 24
+
+    names = []
+    for _ in range(id_count):
+        names.append(data[pos:pos + 24].split(b"\0", 1)[0].decode())
+        pos += 24
+
+    threads = []
+    for _ in range(thread_count):
+        name = data[pos:pos + 16].split(b"\0", 1)[0].decode()
+        (count,) = struct.unpack_from("<I", data, pos + 16)
+        pos += 24
+        events = []
+        for _ in range(count):
+            tick, event_id, phase, _, payload = struct.unpack_from("<QHBBI", data, pos)
+            events.append((tick, event_id, chr(phase), payload))
+            pos += 16
+        threads.append((name, events))
+
+    return tick_freq, names, threads
+
+
+def to_chrome(tick_freq, names, threads):
+    starts = [events[0][0] for _, events in threads if events]
+    base = min(starts) if starts else 0
+
+    out = []
+    for tid, (thread_name, events) in enumerate(threads):
+        out.append({"ph": "M", "name": "thread_name", "pid": 0, "tid": tid,
+                    "args": {"name": thread_name}})
+        depth = 0
+        for tick, event_id, phase, payload in events:
+            if phase == "E" and depth == 0:
+                continue  # Its begin fell out of the ring
+            depth += {"B": 1, "E": -1}.get(phase, 0)
+
+            event = {
+                "name": names[event_id] if event_id < len(names) else "id%d" % event_id,
+                "ph": phase,
+                "ts": (tick - base) * 1e6 / tick_freq,
+                "pid": 0,
+                "tid": tid,
+                "args": {"payload": payload},
+            }
+            if phase == "i":
+                event["s"] = "t"
+            out.append(event)
+
+    return {"traceEvents": out, "displayTimeUnit": "ms"}
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        print(__doc__.strip().splitlines()[2], file=sys.stderr)
+        return 1
+
+    with open(sys.argv[1], "rb") as f:
+        trace = to_chrome(*read_trace(f.read()))
+
+    output = sys.argv[2] if len(sys.argv) == 3 else sys.argv[1].rsplit(".", 1)[0] + ".json"
+    with open(output, "w") as f:
+        json.dump(trace, f)
+    print("%d events -> %s" % (len(trace["traceEvents"]), output))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())